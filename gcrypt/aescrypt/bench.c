@@ -0,0 +1,642 @@
+/**************************************************************************
+ * bench.c                                                                *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-18                                                             *
+ *                                                                        *
+ * throughput benchmarks for the cipher modes and the key functions       *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <gcrypt.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define     BENCH_HAVE_TSC      1
+#endif
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptoinit.h"
+#include "cryptofile.h"
+#include "cryptorand.h"
+#include "keystore.h"
+#include "metakey.h"
+
+/**************************************************************************/
+/*                         note on the benchmarks                         */
+/**************************************************************************/
+/*
+ * every test runs one operation over and over until at least the minimum
+ * run time (-t) has passed, checking the clock after batches of doubling
+ * size so that the timer does not show up in the numbers for small
+ * buffers. cipher tests count one operation as setting the IV (the
+ * counter for CTR, nothing for ECB), encrypting the buffer in place and,
+ * for GCM, computing the tag; i.e. the cost of one message of that size.
+ *
+ * cycles are read from the time stamp counter where there is one, which
+ * on current x86 CPUs ticks at a constant reference rate rather than the
+ * actual core clock; elsewhere cycles_per_byte is reported as 0.
+ *
+ * crypto_unwrapkeys counts one operation as unwrapping a batch of
+ * BENCH_UNWRAP_KEYS 256-bit keys, as loading them from a keyfile would;
+ * crypto_genkeys as generating as many, from the random pool. the pool's
+ * counters are printed to stderr afterwards, since a run that drains it
+ * measures libgcrypt rather than the pool.
+ *
+ * the filler tests fill a BENCH_FILL_SIZE buffer, from the keystream
+ * crypto_wipe_file uses (crypto_randstream_fill) and, for comparison,
+ * from libgcrypt's nonce generator (gcry_create_nonce).
+ *
+ * the library only writes messages to stderr (see cryptotrace.h), so the
+ * results on stdout can be piped; -o writes them to a file instead.
+ */
+
+#define     BENCH_DEFAULT_TIME      0.2
+#define     BENCH_WIPE_SIZE         (4 * 1024 * 1024)
+#define     BENCH_MAX_BATCH         (1UL << 20)
+#define     BENCH_UNWRAP_KEYS       256
+#define     BENCH_FILL_SIZE         (1024 * 1024)
+
+/* buffer sizes for the cipher tests */
+static const size_t bench_sizes[] = {
+    16, 64, 256, 1024, 8192, 65536, 1024 * 1024
+};
+
+static const struct {
+    const char *name;
+    int algo;
+    size_t keysize;
+} bench_algos[] = {
+    { "aes128", GCRY_CIPHER_AES128, 16 },
+    { "aes192", GCRY_CIPHER_AES192, 24 },
+    { "aes256", GCRY_CIPHER_AES256, 32 }
+};
+
+/* keymul: XTS takes two keys of the cipher's size */
+static const struct {
+    const char *name;
+    int mode;
+    size_t keymul;
+} bench_modes[] = {
+    { "ecb", GCRY_CIPHER_MODE_ECB, 1 },
+    { "cbc", GCRY_CIPHER_MODE_CBC, 1 },
+    { "ctr", GCRY_CIPHER_MODE_CTR, 1 },
+    { "gcm", GCRY_CIPHER_MODE_GCM, 1 },
+    { "xts", GCRY_CIPHER_MODE_XTS, 2 }
+};
+
+#define     NELEM(a)    (sizeof (a) / sizeof (a)[0])
+
+/********************************************************************
+ * bench_result:                                                    *
+ *      outcome of one test                                         *
+ *                                                                  *
+ * test: what was measured, "cipher" or the function's name         *
+ * algo / mode: the cipher, "-" where it does not apply             *
+ * size: bytes processed per operation                              *
+ * iterations: number of operations timed                           *
+ * seconds / cycles: time spent in the timed operations             *
+ ********************************************************************/
+struct bench_result {
+    const char *test;
+    const char *algo;
+    const char *mode;
+    size_t size;
+    unsigned long iterations;
+    double seconds;
+    uint64_t cycles;
+};
+
+/* one operation of a test; returns 0 on success */
+typedef int (*bench_op)( void * );
+
+/* state shared by the operations below */
+struct bench_ctx {
+    metakey_t mk;
+    gcry_cipher_hd_t hd;
+    int mode;
+    unsigned char *buf;
+    size_t len;
+    size_t keysize;
+    char keyfile[64];
+    char wipefile[64];
+    metakey_t kek;
+    struct wrapped_key wrapped[BENCH_UNWRAP_KEYS];
+    metakey_t unwrapped[BENCH_UNWRAP_KEYS];
+    randstream_t rs;
+};
+
+enum bench_format {
+    BENCH_CSV = 0,
+    BENCH_JSON
+};
+
+static double bench_min_time = BENCH_DEFAULT_TIME;
+
+static void usage( const char * );
+static double now( void );
+static uint64_t cycles( void );
+static int run( bench_op, bench_op, void *, struct bench_result * );
+static int op_cipher( void * );
+static int op_genkey( void * );
+static int op_loadkey( void * );
+static int op_zerokey( void * );
+static int op_genkeys( void * );
+static int op_unwrapkeys( void * );
+static int prep_unwrapkeys( struct bench_ctx *, unsigned char * );
+static int op_randstream( void * );
+static int op_nonce( void * );
+static int op_wipe( void * );
+static int prep_wipe( void * );
+static void emit( FILE *, enum bench_format, const struct bench_result *,
+                  int );
+
+int main( int argc, char **argv ) {
+    enum bench_format format = BENCH_CSV;
+    struct bench_ctx ctx;
+    struct bench_result res;
+    FILE *out = stdout;
+    const char *outfile = NULL;
+    size_t a = 0, m = 0, s = 0;
+    unsigned char *wrapped = NULL;
+    struct randpool_stats pool;
+    int first = 1;
+    int c = 0;
+    int fd = -1;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, "f:o:t:h")) != -1) {
+        switch (c) {
+            case 'f':
+                if (0 == strcmp(optarg, "json")) {
+                    format = BENCH_JSON;
+                } else if (0 == strcmp(optarg, "csv")) {
+                    format = BENCH_CSV;
+                } else {
+                    fprintf(stderr, "[!] unknown format %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 't':
+                bench_min_time = strtod(optarg, NULL);
+                if (bench_min_time <= 0.0) {
+                    fprintf(stderr, "[!] -t must be positive\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (NULL != outfile) {
+        out = fopen(outfile, "w");
+        if (NULL == out) {
+            perror("[!] fopen");
+            return EXIT_FAILURE;
+        }
+    }
+
+    keystore = crypto_init();
+    if (NULL == keystore) {
+        fprintf(stderr, "[!] could not initalise gcrypt!\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&ctx, 0, sizeof ctx);
+    ctx.mk = crypto_keystore_add(keystore, 0);
+    ctx.buf = gcry_malloc(bench_sizes[NELEM(bench_sizes) - 1]);
+    if ((NULL == ctx.mk) || (NULL == ctx.buf)) {
+        fprintf(stderr, "[!] out of memory\n");
+        return EXIT_FAILURE;
+    }
+    memset(ctx.buf, 0xa5, bench_sizes[NELEM(bench_sizes) - 1]);
+
+    if (BENCH_JSON == format) {
+        fprintf(out, "{\n  \"gcrypt_version\": \"%s\",\n",
+                gcry_check_version(NULL));
+        fprintf(out, "  \"min_time\": %g,\n", bench_min_time);
+        fprintf(out, "  \"results\": [\n");
+    } else {
+        fprintf(out, "test,algo,mode,size,iterations,seconds,");
+        fprintf(out, "mb_per_s,cycles_per_byte,ns_per_op\n");
+    }
+
+    /* cipher throughput */
+    for (a = 0; a < NELEM(bench_algos); ++a) {
+        for (m = 0; m < NELEM(bench_modes); ++m) {
+            ctx.mode = bench_modes[m].mode;
+            ctx.mk->algo = bench_algos[a].algo;
+            if ((KEY_SUCCESS != crypto_genkey(ctx.mk,
+                        bench_algos[a].keysize * bench_modes[m].keymul)) ||
+                    (KEY_SUCCESS != crypto_cipher_open(ctx.mk, ctx.mode,
+                        &ctx.hd))) {
+                fprintf(stderr, "[!] %s-%s not supported, skipped\n",
+                        bench_algos[a].name, bench_modes[m].name);
+                continue;
+            }
+
+            for (s = 0; s < NELEM(bench_sizes); ++s) {
+                ctx.len = bench_sizes[s];
+                res.test = "cipher";
+                res.algo = bench_algos[a].name;
+                res.mode = bench_modes[m].name;
+                res.size = ctx.len;
+                fprintf(stderr, "[+] %s-%s %lu bytes\n", res.algo,
+                        res.mode, (unsigned long) res.size);
+
+                if (0 == run(op_cipher, NULL, &ctx, &res)) {
+                    emit(out, format, &res, first);
+                    first = 0;
+                } else {
+                    fprintf(stderr, "[!] %s-%s failed\n", res.algo,
+                            res.mode);
+                }
+            }
+
+            gcry_cipher_close(ctx.hd);
+            ctx.hd = NULL;
+        }
+    }
+
+    /* key functions, with 256-bit keys */
+    ctx.keysize = 32;
+    ctx.mk->algo = GCRY_CIPHER_AES256;
+    strcpy(ctx.keyfile, "/tmp/aescrypt-bench-key.XXXXXX");
+    strcpy(ctx.wipefile, "/tmp/aescrypt-bench-wipe.XXXXXX");
+    fd = mkstemp(ctx.keyfile);
+    if (-1 != fd) {
+        close(fd);
+    }
+    crypto_unset_autogen();
+
+    res.algo = "aes256";
+    res.mode = "-";
+    res.size = ctx.keysize;
+
+    res.test = "crypto_genkey";
+    fprintf(stderr, "[+] %s\n", res.test);
+    if (0 == run(op_genkey, NULL, &ctx, &res)) {
+        emit(out, format, &res, first);
+        first = 0;
+    }
+
+    res.test = "crypto_loadkey";
+    fprintf(stderr, "[+] %s\n", res.test);
+    if ((-1 != fd) && (KEY_SUCCESS == crypto_dumpkey(ctx.keyfile, ctx.mk)) &&
+            (0 == run(op_loadkey, NULL, &ctx, &res))) {
+        emit(out, format, &res, first);
+        first = 0;
+    } else {
+        fprintf(stderr, "[!] %s failed\n", res.test);
+    }
+    if (-1 != fd) {
+        unlink(ctx.keyfile);
+    }
+
+    res.test = "crypto_zerokey";
+    fprintf(stderr, "[+] %s\n", res.test);
+    if (0 == run(op_zerokey, NULL, &ctx, &res)) {
+        emit(out, format, &res, first);
+        first = 0;
+    }
+
+    res.test = "crypto_genkeys";
+    res.size = BENCH_UNWRAP_KEYS * ctx.keysize;
+    fprintf(stderr, "[+] %s\n", res.test);
+    for (s = 0; s < BENCH_UNWRAP_KEYS; ++s) {
+        ctx.unwrapped[s] = crypto_metakey_new();
+        if (NULL == ctx.unwrapped[s]) {
+            break;
+        }
+    }
+    if ((BENCH_UNWRAP_KEYS == s) &&
+            (0 == run(op_genkeys, NULL, &ctx, &res))) {
+        emit(out, format, &res, first);
+        first = 0;
+    } else {
+        fprintf(stderr, "[!] %s failed\n", res.test);
+    }
+    crypto_randpool_stats(&pool);
+    fprintf(stderr, "[+] random pool: %llu bytes pooled, %llu drawn "
+            "directly, %lu refills\n", pool.served, pool.direct,
+            pool.refills);
+
+    res.test = "crypto_unwrapkeys";
+    res.size = BENCH_UNWRAP_KEYS * ctx.keysize;
+    fprintf(stderr, "[+] %s\n", res.test);
+    wrapped = malloc(BENCH_UNWRAP_KEYS * CRYPTO_WRAPPED_LEN(ctx.keysize));
+    if ((NULL != wrapped) && (0 == prep_unwrapkeys(&ctx, wrapped)) &&
+            (0 == run(op_unwrapkeys, NULL, &ctx, &res))) {
+        emit(out, format, &res, first);
+        first = 0;
+    } else {
+        fprintf(stderr, "[!] %s failed\n", res.test);
+    }
+    for (s = 0; s < BENCH_UNWRAP_KEYS; ++s) {
+        crypto_metakey_free(ctx.unwrapped[s]);
+    }
+    crypto_metakey_free(ctx.kek);
+    free(wrapped);
+
+    /* filler data */
+    res.test = "crypto_randstream_fill";
+    res.algo = "aes256";
+    res.mode = "ctr";
+    res.size = BENCH_FILL_SIZE;
+    fprintf(stderr, "[+] %s\n", res.test);
+    if ((CRYPTO_SUCCESS == crypto_randstream_new(&ctx.rs)) &&
+            (0 == run(op_randstream, NULL, &ctx, &res))) {
+        emit(out, format, &res, first);
+        first = 0;
+    } else {
+        fprintf(stderr, "[!] %s failed\n", res.test);
+    }
+    crypto_randstream_free(ctx.rs);
+
+    res.test = "gcry_create_nonce";
+    res.algo = "-";
+    res.mode = "-";
+    fprintf(stderr, "[+] %s\n", res.test);
+    if (0 == run(op_nonce, NULL, &ctx, &res)) {
+        emit(out, format, &res, first);
+        first = 0;
+    }
+
+    /* single pass wipe of a BENCH_WIPE_SIZE file */
+    res.test = "crypto_wipe_file";
+    res.algo = "-";
+    res.size = BENCH_WIPE_SIZE;
+    fprintf(stderr, "[+] %s\n", res.test);
+    if (0 == run(op_wipe, prep_wipe, &ctx, &res)) {
+        emit(out, format, &res, first);
+        first = 0;
+    } else {
+        fprintf(stderr, "[!] %s failed\n", res.test);
+    }
+    unlink(ctx.wipefile);
+
+    if (BENCH_JSON == format) {
+        fprintf(out, "\n  ]\n}\n");
+    }
+
+    if ((stdout != out) && (0 != fclose(out))) {
+        perror("[!] fclose");
+    }
+
+    memset(ctx.buf, 0, bench_sizes[NELEM(bench_sizes) - 1]);
+    gcry_free(ctx.buf);
+    crypto_zerokeystore(keystore);
+    crypto_shutdown();
+
+    return EXIT_SUCCESS;
+}
+
+/* time op until bench_min_time has passed. prep, if given, is run before
+ * every operation and is not timed. */
+static int run( bench_op op, bench_op prep, void *arg,
+        struct bench_result *res ) {
+    unsigned long batch = 1, i = 0;
+    double start = 0.0, t = 0.0;
+    uint64_t c0 = 0;
+
+    res->iterations = 0;
+    res->seconds    = 0.0;
+    res->cycles     = 0;
+
+    /* warm up caches and lazy initialisation */
+    if (((NULL != prep) && (0 != prep(arg))) || (0 != op(arg))) {
+        return -1;
+    }
+
+    while (res->seconds < bench_min_time) {
+        if (NULL != prep) {
+            /* slow operations: time each one on its own */
+            if (0 != prep(arg)) {
+                return -1;
+            }
+            batch = 1;
+        }
+
+        start = now();
+        c0 = cycles();
+        for (i = 0; i < batch; ++i) {
+            if (0 != op(arg)) {
+                return -1;
+            }
+        }
+        res->cycles  += cycles() - c0;
+        t = now() - start;
+
+        res->seconds    += t;
+        res->iterations += batch;
+        if (batch < BENCH_MAX_BATCH) {
+            batch *= 2;
+        }
+    }
+
+    return 0;
+}
+
+static int op_cipher( void *arg ) {
+    struct bench_ctx *ctx = arg;
+    unsigned char iv[16];
+    unsigned char tag[16];
+    gcry_error_t err = 0;
+
+    memset(iv, 0, sizeof iv);
+    switch (ctx->mode) {
+        case GCRY_CIPHER_MODE_ECB:
+            break;
+        case GCRY_CIPHER_MODE_CTR:
+            err = gcry_cipher_setctr(ctx->hd, iv, sizeof iv);
+            break;
+        case GCRY_CIPHER_MODE_GCM:
+            err = gcry_cipher_setiv(ctx->hd, iv, 12);
+            break;
+        default:
+            err = gcry_cipher_setiv(ctx->hd, iv, sizeof iv);
+            break;
+    }
+
+    if (0 == err) {
+        err = gcry_cipher_encrypt(ctx->hd, ctx->buf, ctx->len, NULL, 0);
+    }
+    if ((0 == err) && (GCRY_CIPHER_MODE_GCM == ctx->mode)) {
+        err = gcry_cipher_gettag(ctx->hd, tag, sizeof tag);
+    }
+
+    return (0 == err) ? 0 : -1;
+}
+
+static int op_genkey( void *arg ) {
+    struct bench_ctx *ctx = arg;
+
+    return (KEY_SUCCESS == crypto_genkey(ctx->mk, ctx->keysize)) ? 0 : -1;
+}
+
+static int op_loadkey( void *arg ) {
+    struct bench_ctx *ctx = arg;
+
+    return (KEY_SUCCESS == crypto_loadkey(ctx->keyfile, ctx->mk,
+                ctx->keysize)) ? 0 : -1;
+}
+
+static int op_zerokey( void *arg ) {
+    struct bench_ctx *ctx = arg;
+
+    return (KEY_SUCCESS == crypto_zerokey(ctx->mk)) ? 0 : -1;
+}
+
+static int op_genkeys( void *arg ) {
+    struct bench_ctx *ctx = arg;
+
+    return (KEY_SUCCESS == crypto_genkeys(ctx->unwrapped, BENCH_UNWRAP_KEYS,
+                ctx->keysize)) ? 0 : -1;
+}
+
+static int op_unwrapkeys( void *arg ) {
+    struct bench_ctx *ctx = arg;
+
+    return (KEY_SUCCESS == crypto_unwrapkeys(ctx->kek, ctx->wrapped,
+                ctx->unwrapped, BENCH_UNWRAP_KEYS)) ? 0 : -1;
+}
+
+/* wrap BENCH_UNWRAP_KEYS fresh keys into buf under a fresh KEK, to be
+ * unwrapped into the keys crypto_genkeys made */
+static int prep_unwrapkeys( struct bench_ctx *ctx, unsigned char *buf ) {
+    size_t i = 0, len = 0;
+
+    ctx->kek = crypto_metakey_new();
+    if ((NULL == ctx->kek) ||
+            (KEY_SUCCESS != crypto_genkey(ctx->kek, ctx->keysize))) {
+        return -1;
+    }
+    ctx->kek->algo = GCRY_CIPHER_AES256;
+
+    for (i = 0; i < BENCH_UNWRAP_KEYS; ++i) {
+        ctx->mk->id = i;
+        if ((KEY_SUCCESS != crypto_genkey(ctx->mk, ctx->keysize)) ||
+                (KEY_SUCCESS != crypto_wrapkey(ctx->kek, ctx->mk, buf,
+                    &len))) {
+            return -1;
+        }
+
+        ctx->wrapped[i].data = buf;
+        ctx->wrapped[i].len  = len;
+        ctx->wrapped[i].id   = i;
+        buf += len;
+
+        if (NULL == ctx->unwrapped[i]) {
+            return -1;
+        }
+    }
+    ctx->mk->id = 0;
+
+    return 0;
+}
+
+static int op_randstream( void *arg ) {
+    struct bench_ctx *ctx = arg;
+
+    return (CRYPTO_SUCCESS == crypto_randstream_fill(ctx->rs, ctx->buf,
+                BENCH_FILL_SIZE)) ? 0 : -1;
+}
+
+static int op_nonce( void *arg ) {
+    struct bench_ctx *ctx = arg;
+
+    gcry_create_nonce(ctx->buf, BENCH_FILL_SIZE);
+    return 0;
+}
+
+static int op_wipe( void *arg ) {
+    struct bench_ctx *ctx = arg;
+
+    return (KEY_SUCCESS == crypto_wipe_file(ctx->wipefile, 1)) ? 0 : -1;
+}
+
+/* crypto_wipe_file removes the file, so make a new one every time */
+static int prep_wipe( void *arg ) {
+    struct bench_ctx *ctx = arg;
+    size_t chunk = bench_sizes[NELEM(bench_sizes) - 1];
+    size_t done = 0;
+    FILE *f = NULL;
+
+    strcpy(ctx->wipefile, "/tmp/aescrypt-bench-wipe.XXXXXX");
+    f = fdopen(mkstemp(ctx->wipefile), "w");
+    if (NULL == f) {
+        return -1;
+    }
+
+    for (done = 0; done < BENCH_WIPE_SIZE; done += chunk) {
+        if (chunk != fwrite(ctx->buf, 1, chunk, f)) {
+            fclose(f);
+            return -1;
+        }
+    }
+
+    return (0 == fclose(f)) ? 0 : -1;
+}
+
+static void emit( FILE *out, enum bench_format format,
+        const struct bench_result *res, int first ) {
+    double bytes = (double) res->size * (double) res->iterations;
+    double mbps  = bytes / res->seconds / (1024.0 * 1024.0);
+    double cpb   = (double) res->cycles / bytes;
+    double nsop  = res->seconds * 1e9 / (double) res->iterations;
+
+    if (BENCH_JSON == format) {
+        fprintf(out, "%s    {\"test\": \"%s\", \"algo\": \"%s\", ",
+                first ? "" : ",\n", res->test, res->algo);
+        fprintf(out, "\"mode\": \"%s\", \"size\": %lu, ", res->mode,
+                (unsigned long) res->size);
+        fprintf(out, "\"iterations\": %lu, \"seconds\": %.6f, ",
+                res->iterations, res->seconds);
+        fprintf(out, "\"mb_per_s\": %.2f, \"cycles_per_byte\": %.2f, ",
+                mbps, cpb);
+        fprintf(out, "\"ns_per_op\": %.1f}", nsop);
+    } else {
+        fprintf(out, "%s,%s,%s,%lu,%lu,%.6f,%.2f,%.2f,%.1f\n", res->test,
+                res->algo, res->mode, (unsigned long) res->size,
+                res->iterations, res->seconds, mbps, cpb, nsop);
+    }
+    fflush(out);
+}
+
+static double now( void ) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static uint64_t cycles( void ) {
+#ifdef BENCH_HAVE_TSC
+    return (uint64_t) __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void usage( const char *progname ) {
+    fprintf(stderr, "usage: %s [-f csv|json] [-o outfile] [-t seconds]\n",
+            progname);
+    fprintf(stderr, "\t-f\toutput format (default csv)\n");
+    fprintf(stderr, "\t-o\twrite results to outfile (default stdout)\n");
+    fprintf(stderr, "\t-t\tminimum run time of each test (default %g)\n",
+            BENCH_DEFAULT_TIME);
+}
@@ -8,13 +8,20 @@
 #ifndef __CRYPTO_CONFIG_H
 #define __CRYPTO_CONFIG_H
 
-/* require at least gnupg 1.4.0 */
-#define         GCRYPT_MIN_VERSION      "1.4.0"
+/* require at least libgcrypt 1.8.0: gcry_get_config, XTS, Poly1305 and
+ * growing secure memory are all used unconditionally */
+#define         GCRYPT_MIN_VERSION      "1.8.0"
 
 /* use secure memory - if defined, should be the size in bytes to allocate
- * for secure memory. define as 0 to disable secure memory. */
+ * for secure memory. define as 0 to disable secure memory. this is only
+ * the default, see crypto_secmem_set_size (cryptosecmem.h). */
 #define 	SECURE_MEM		0
 
+/* bytes by which a full secure memory pool grows; 0 keeps the pool at its initial size. a single allocation
+ * larger than this, such as the table of a big keystore, still fails once
+ * the pool is full. */
+#define         SECMEM_EXPAND           (1024 * 1024)
+
 /* define strength of randomly generated bytes */
 #define         RANDOM_STRENGTH         GCRY_VERY_STRONG_RANDOM
 
@@ -25,16 +32,101 @@
 #define		GCRYPT_NO_MPI_MACROS	1
 #define		GRYPT_NO_DEPRECATED	1
 
-/* for development, pull in debug messages */
+/* for development, pull in debug messages. without DEBUG the TRACE_*
+ * macros of debug.h compile to nothing; with it, they are filtered at
+ * runtime by crypto_trace_set_level, starting at TRACE_LEVEL. */
 #define         DEBUG                   1
+#define         TRACE_LEVEL             TRACE_LEVEL_ERROR
+
+/* time key generation, key loads, wipe passes and chunk encryption into
+ * latency histograms, when turned on with crypto_trace_set_latency (see
+ * cryptotrace.h). undefine to compile the timing out. */
+#define         TRACE_LATENCY           1
 
 /* defines the maximum key length that can be used - this should only
  * be altered if you specifically want to limit key sizes or you choose
  * an algorithm other than AES. */
 #define         MAX_KEY_LENGTH          32
 
-/* define the size of the keystore
- * note that the current version uses a statically-sized keystore */
-#define         KEYSTORE_SIZE           1
+/* initial number of slots in the keystore hash table, rounded up to a
+ * power of two. the table doubles whenever it gets half full. */
+#define         KEYSTORE_SIZE           16
+
+/* size in bytes of each locked region of the key arena. every metakey
+ * takes ARENA_LINE_SIZE + ARENA_KEY_MAX bytes of it (see cryptoarena.h);
+ * ARENA_KEY_MAX covers the double length keys of XTS. the regions count
+ * against RLIMIT_MEMLOCK. */
+#define         ARENA_REGION_SIZE       (64 * 1024)
+#define         ARENA_KEY_MAX           (2 * MAX_KEY_LENGTH)
+
+/* size in bytes of the random pool crypto_genkeys draws keys from, the
+ * fill level below which its thread refills it, and how many bytes the
+ * thread draws at a time (see cryptorand.h). the pool is locked into
+ * memory and counts against RLIMIT_MEMLOCK. */
+#define         RANDPOOL_SIZE           (64 * 1024)
+#define         RANDPOOL_LOW_WATER      (RANDPOOL_SIZE / 2)
+#define         RANDPOOL_REFILL         4096
+
+/* size in bytes of the buffer crypto_wipe_file overwrites a file with at a
+ * time, and the default number of passes. the buffer is reused for the
+ * whole wipe, so this bounds its memory use for any file size. */
+#define         WIPE_BUF_SIZE           (1024 * 1024)
+#define         WIPE_PASSES             3
+
+/* most patterns crypto_wipe_set_patterns takes */
+#define         WIPE_MAX_PATTERNS       8
+
+/* defaults for crypto_wipe_tree: worker threads, the size up to which
+ * files are batched WIPE_BATCH_FILES to a job, and the size of the pieces
+ * larger files are split into. */
+#define         WIPE_THREADS            4
+#define         WIPE_SMALL_FILE         (64 * 1024)
+#define         WIPE_BATCH_FILES        64
+#define         WIPE_EXTENT_SIZE        (64 * 1024 * 1024)
+
+/* largest key that crypto_wrapkey and the keyfile will wrap; like the
+ * arena, this leaves room for XTS keys. */
+#define         WRAP_KEY_MAX            (2 * MAX_KEY_LENGTH)
+
+/* default size in bytes of the chunks the streaming engine reads,
+ * encrypts and writes at a time. this bounds the memory used to encrypt a
+ * file regardless of its size; it should be a multiple of the cipher block
+ * size. can be changed at runtime with crypto_stream_set_chunk_size. */
+#define         STREAM_CHUNK_SIZE       (1024 * 1024)
+
+/* size in bytes of the file windows mapped at a time by the mmap I/O
+ * method. must be a multiple of the cipher block size. */
+#define         STREAM_MMAP_WINDOW      (64 * 1024 * 1024)
+
+/* default and maximum number of chunks the aio I/O method keeps in
+ * flight at once */
+#define         AIO_QUEUE_DEPTH         8
+#define         AIO_MAX_DEPTH           256
+
+/* default sector size, in bytes, of XTS disk image encryption: each
+ * sector is encrypted on its own. the physical sector size of current
+ * disks; larger sectors mean fewer tweak setups per byte. can be changed
+ * at runtime with crypto_xts_set_sector_size. */
+#define         XTS_SECTOR_SIZE         4096
+
+/* how much data, in bytes and in passes over one buffer, the calibration
+ * behind STREAM_AEAD_AUTO runs through each candidate AEAD. kept small:
+ * it runs once per process, before the first file is sealed. */
+#define         AEAD_CALIBRATE_LEN      (64 * 1024)
+#define         AEAD_CALIBRATE_ROUNDS   16
+
+/* upper bound on the number of worker threads aescrypt -j will start */
+#define         STREAM_MAX_THREADS      64
+
+/* most bytes of idle data buffers the buffer pool keeps for reuse, and
+ * the size from which crypto_bufpool_set_hugepages backs a buffer with
+ * huge pages. */
+#define         BUFPOOL_MAX_CACHED      (64 * 1024 * 1024)
+#define         BUFPOOL_HUGE_MIN        (2 * 1024 * 1024)
+
+/* number of keyed cipher handles each key keeps around for reuse. one
+ * handle is in use per worker at a time, so this should be at least
+ * STREAM_MAX_THREADS; handles beyond it are opened and closed per use. */
+#define         CIPHER_CACHE_SIZE       64
 
 #endif
@@ -19,19 +19,15 @@
 #define     AUTOKEYGEN          1
 
 /********************************************************************
- * CRYPTO_MALLOC:                                                   *
+ * CRYPTO_MALLOC / CRYPTO_FREE:                                     *
  *      cryptographic memory allocation                             *
  *                                                                  *
- * allocate a segment of memory, zeroing it first. bases method     *
- * selection on the use of secure memory.                           *
+ * allocate a segment of memory, zeroing it first, from secure      *
+ * memory if it is in use at runtime, and free it again. the        *
+ * allocations are counted, see cryptosecmem.h.                     *
  ********************************************************************/
-#if SECURE_MEM != 0
-#define     CRYPTO_MALLOC               gcry_calloc_secure
-
-#else
-#define     CRYPTO_MALLOC               gcry_calloc
-
-#endif
+#define     CRYPTO_MALLOC               crypto_secmem_calloc
+#define     CRYPTO_FREE                 crypto_secmem_free
 
 /********************************************************************
  * CRYPTO_RANDOM_STRENGTH:                                          *
@@ -40,29 +36,25 @@
  * if secure memory is used, random numbers will be very strong     *
  * otherwise, strong random numbers with be used                    *
  ********************************************************************/
-#if SECURE_MEM != 0
-#define     CRYPTO_RANDOM_STRENGTH      GCRY_VERY_STRONG_RANDOM
-
-#else
-#define     CRYPTO_RANDOM_STRENGTH      GCRY_STRONG_RANDOM
-
-#endif
-
-/********************************************************************
- * RNG_METHOD:                                                      *
- *      define the RNG function                                     *
- *                                                                  *
- * if secure memory is used, the RNG should allocate from secure    *
- *  memory                                                          *
- * otherwise, pull random numbers from PRNG                         *
- ********************************************************************/
-#if SECURE_MEM != 0
-#define     RNG_METHOD                  gcry_random_bytes_secure
-
-#else
-#define     RNG_METHOD                  gcry_random_bytes
-
-#endif
+#define     CRYPTO_RANDOM_STRENGTH      (crypto_secmem_enabled() ?        \
+                                         GCRY_VERY_STRONG_RANDOM :      \
+                                         GCRY_STRONG_RANDOM)
+
+/* crypto_secmem_calloc: CRYPTO_MALLOC. allocate zeroed memory, from the
+ *                  secure pool if there is one. thread safe.
+ *      arguments: the number of elements and the size of each
+ *      returns: the memory, or NULL; free it with crypto_secmem_free
+ */
+extern void *crypto_secmem_calloc( size_t, size_t );
+
+/* crypto_secmem_free: CRYPTO_FREE. free memory from crypto_secmem_calloc;
+ *                  NULL is ignored. thread safe.
+ */
+extern void crypto_secmem_free( void * );
+
+/* crypto_secmem_enabled: 1 if secure memory is in use (see cryptosecmem.h)
+ */
+extern int crypto_secmem_enabled( void );
 
 /**************************************************************************
  *                                structs                                 *
@@ -77,30 +69,45 @@
  * key: the raw key bytes                                           *
  * algo: an int specifying one of the gcrypt ciphers                *
  * securemem: this key uses secure memory                           *
+ * arena: the metakey was carved out of the key arena               *
+ *          (cryptoarena.h)                                         *
+ * lazy: the keystore loaded the key from its keyfile on first use  *
+ *          and may evict it again                                  *
+ * used: the key was used since the keystore last looked for a key  *
+ *          to evict                                                *
+ * refs: references taken with crypto_keystore_get; the key can    *
+ *          not be zeroised while any are held                      *
+ * id: the key's ID in the keystore                                 *
+ * ciphers: cipher handles already keyed with this key, kept for    *
+ *          reuse; created on first use, see crypto_cipher_get      *
  ********************************************************************/
+struct cipher_cache;
+
 struct metakey {
     size_t keysize;
     unsigned char *key;
     int algo;
     unsigned short sm;
     unsigned short initialised;
+    unsigned short arena;
+    unsigned short lazy;
+    unsigned short used;
+    unsigned int refs;
+    unsigned long id;
+    struct cipher_cache *ciphers;
 };
 
 typedef struct metakey * metakey_t;
 
 /********************************************************************
  * keystore_t:                                                      *
- *      global keystore                                             *
- *                                                                  *
- * store: array of metakey_t's                                      *
- * size: number of keys in the array                                *
+ *      global keystore, a hash table of metakeys indexed by key ID *
+ *      that many threads can read at once. opaque, see keystore.h  *
  ********************************************************************/
-static struct keystore_s {
-    metakey_t *store;
-    size_t size;
-} *keystore;
+typedef struct keystore_s * keystore_t;
 
-typedef struct keystore_s * keystore_t; 
+/* the global keystore, set up by crypto_init (cryptoinit.c) */
+extern keystore_t keystore;
 
 /**************************************************************************
  *                                enums                                   *
@@ -141,6 +148,10 @@ typedef enum crypto_op crypto_op_t;
  *          state. the most common cause is that an opened keyfile  *
  *          could not be closed.                                    *
  * KEY_NOT_INIT: attempted to use an uninitialised key              *
+ * KEY_EXISTS: the keystore already holds a key with this ID        *
+ * KEY_NOT_FOUND: the keystore holds no key with this ID            *
+ * KEY_IN_USE: the key is referenced by another user and can not be *
+ *          zeroised yet                                            *
  ********************************************************************/
 enum crypto_key_return {
     KEY_FAILURE          = -1,
@@ -150,7 +161,10 @@ enum crypto_key_return {
     KEYGEN_ERR,
     LIB_NOT_INIT,
     INCONSISTENT_STATE,
-    KEY_NOT_INIT
+    KEY_NOT_INIT,
+    KEY_EXISTS,
+    KEY_NOT_FOUND,
+    KEY_IN_USE
 };
 
 typedef enum crypto_key_return crypto_key_return_t;
@@ -162,12 +176,18 @@ typedef enum crypto_key_return crypto_key_return_t;
  * CRYPTO_FAILURE: cryptographic operation failed                   *
  * CRYPTO_SUCCESS: operation succeeded                              *
  * CRYPTO_NOT_INIT: crypto library has not been initialized         *
+ * CRYPTO_BAD_FORMAT: input is not in a format the library can      *
+ *          decrypt (bad magic, version, or mismatched algorithm)   *
+ * CRYPTO_AUTH_FAILURE: authenticated data failed to verify; the    *
+ *          input has been corrupted or tampered with               *
  ********************************************************************/
 
 enum crypto_return {
     CRYPTO_SUCCESS,
     CRYPTO_FAILURE,
-    CRYPTO_NOT_INIT
+    CRYPTO_NOT_INIT,
+    CRYPTO_BAD_FORMAT,
+    CRYPTO_AUTH_FAILURE
 };
 
 typedef enum crypto_return crypto_return_t;
@@ -0,0 +1,690 @@
+/**************************************************************************
+ * cryptoaead.c                                                           *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-28                                                             *
+ *                                                                        *
+ * framed authenticated streams, see cryptoaead.h                         *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptoaead.h"
+#include "cryptobuf.h"
+#include "cryptocpu.h"
+#include "cryptoparallel.h"
+#include "cryptoprofile.h"
+#include "cryptostream.h"
+#include "cryptoutil.h"
+#include "metakey.h"
+#include "debug.h"
+
+/* largest chunk size a reader will allocate a buffer for */
+#define     AEAD_MAX_CHUNK          (256 * 1024 * 1024)
+
+static const char *aead_names[] = {
+    "none", "gcm", "ocb", "chacha20", "auto"
+};
+
+/* the AEAD calibration picked, and the key algorithm it was for */
+static pthread_mutex_t aead_lock = PTHREAD_MUTEX_INITIALIZER;
+static stream_aead_t aead_best = STREAM_AEAD_NONE;
+static int aead_best_algo = 0;
+
+static crypto_return_t aead_new_header( metakey_t, stream_aead_t, size_t,
+                                        unsigned char *, int * );
+static crypto_return_t aead_check_header( metakey_t,
+                                          const struct stream_header *,
+                                          int * );
+static crypto_return_t aead_check_key( metakey_t, int );
+static int aead_acceptable( stream_aead_t, size_t, unsigned int, int );
+static uint64_t aead_calibrate( stream_aead_t, int, size_t );
+static uint64_t aead_now( void );
+
+int crypto_is_aead( const struct stream_header *hdr ) {
+    return 0 != (hdr->flags & STREAM_FLAG_FRAMED);
+}
+
+int crypto_aead_mode( stream_aead_t aead ) {
+    switch (aead) {
+        case STREAM_AEAD_GCM:
+            return GCRY_CIPHER_MODE_GCM;
+        case STREAM_AEAD_OCB:
+            return GCRY_CIPHER_MODE_OCB;
+        case STREAM_AEAD_CHACHA20:
+            return GCRY_CIPHER_MODE_POLY1305;
+        default:
+            return 0;
+    }
+}
+
+const char *crypto_aead_name( stream_aead_t aead ) {
+    if ((aead < STREAM_AEAD_NONE) || (aead > STREAM_AEAD_AUTO)) {
+        return "unknown";
+    }
+
+    return aead_names[aead];
+}
+
+crypto_return_t crypto_aead_parse( const char *name, stream_aead_t *aead ) {
+    int i = 0;
+
+    for (i = STREAM_AEAD_NONE; i <= STREAM_AEAD_AUTO; ++i) {
+        if (0 == strcmp(name, aead_names[i])) {
+            *aead = (stream_aead_t) i;
+            return CRYPTO_SUCCESS;
+        }
+    }
+
+    return CRYPTO_FAILURE;
+}
+
+stream_aead_t crypto_aead_select( metakey_t mk ) {
+    stream_aead_t best = STREAM_AEAD_NONE;
+    unsigned int features = crypto_cpu_features();
+    uint64_t ns = 0, best_ns = 0;
+    int i = 0, strict = 1, found = 0;
+
+    pthread_mutex_lock(&aead_lock);
+    if ((STREAM_AEAD_NONE != aead_best) && (mk->algo == aead_best_algo)) {
+        best = aead_best;
+        pthread_mutex_unlock(&aead_lock);
+
+        return best;
+    }
+
+    /* AES from tables is slow and leaks through the cache, as is GHASH
+     * without carry-less multiply: only fall back to them if nothing
+     * else suits the key */
+    for (i = STREAM_AEAD_GCM; i <= STREAM_AEAD_CHACHA20; ++i) {
+        found |= aead_acceptable((stream_aead_t) i, mk->keysize, features,
+                                 strict);
+    }
+    strict = found;
+
+    for (i = STREAM_AEAD_GCM; i <= STREAM_AEAD_CHACHA20; ++i) {
+        if (! aead_acceptable((stream_aead_t) i, mk->keysize, features,
+                    strict)) {
+            continue;
+        }
+
+        ns = aead_calibrate((stream_aead_t) i, mk->algo, mk->keysize);
+        TRACE_DEBUG("[+] calibrating %s: %lu ns\n",
+                    crypto_aead_name((stream_aead_t) i), (unsigned long) ns);
+        if ((0 != ns) && ((0 == best_ns) || (ns < best_ns))) {
+            best    = (stream_aead_t) i;
+            best_ns = ns;
+        }
+    }
+
+    /* no clock or no cipher: go by the features alone */
+    if (STREAM_AEAD_NONE == best) {
+        best = ((32 == mk->keysize) && (0 == (features & CPU_AES))) ?
+            STREAM_AEAD_CHACHA20 : STREAM_AEAD_GCM;
+    }
+
+    TRACE_INFO("[+] sealing with %s\n", crypto_aead_name(best));
+    aead_best       = best;
+    aead_best_algo  = mk->algo;
+    pthread_mutex_unlock(&aead_lock);
+
+    return best;
+}
+
+crypto_return_t crypto_aead_encrypt_stream( FILE *in, FILE *out,
+        metakey_t mk, stream_aead_t aead ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    gcry_cipher_hd_t hd = NULL;
+    unsigned char raw_hdr[STREAM_HEADER_LEN];
+    unsigned char frame[AEAD_FRAME_LEN];
+    unsigned char tag[AEAD_TAG_LEN];
+    unsigned char *buf = NULL;
+    size_t chunk = crypto_stream_chunk_size();
+    size_t rd = 0;
+    uint64_t nframes = 0;
+    uint32_t word = 0;
+    int mode = 0, next = 0;
+    gcry_error_t err = 0;
+    uint64_t began = 0, stage = 0;
+
+    result = aead_new_header(mk, aead, chunk, raw_hdr, &mode);
+    if (CRYPTO_SUCCESS != result) {
+        return result;
+    }
+    result = CRYPTO_FAILURE;
+
+    if (KEY_SUCCESS != crypto_cipher_get(mk, mode, &hd)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    buf = crypto_buf_get(chunk);
+    if (NULL == buf) {
+        TRACE_ERROR("[!] could not allocate stream buffer!\n");
+
+        goto out;
+    }
+
+    if (STREAM_HEADER_LEN != fwrite(raw_hdr, 1, STREAM_HEADER_LEN, out)) {
+        TRACE_ERROR("[!] error writing stream header!\n");
+
+        goto out;
+    }
+
+    for (;;) {
+        PROFILE_START(stage);
+        rd = fread(buf, 1, chunk, in);
+        PROFILE_END(PROFILE_READ, stage, rd);
+        if (0 != ferror(in)) {
+            TRACE_ERRNO("[!] fread");
+
+            goto out;
+        }
+
+        /* the last frame is marked, so a full chunk needs a look at the
+         * next byte to tell whether it is the last one */
+        word = (uint32_t) rd;
+        if (rd < chunk) {
+            word |= AEAD_FRAME_FINAL;
+        } else if (EOF == (next = getc(in))) {
+            if (0 != ferror(in)) {
+                TRACE_ERRNO("[!] fread");
+
+                goto out;
+            }
+            word |= AEAD_FRAME_FINAL;
+        } else {
+            ungetc(next, in);
+        }
+
+        if (nframes == AEAD_MAX_FRAMES) {
+            TRACE_ERROR("[!] input too large for the chunk size!\n");
+
+            goto out;
+        }
+        crypto_profile_inflight(1);
+
+        put_be32(frame, word);
+        TRACE_START(began);
+        PROFILE_START(stage);
+        err = crypto_aead_seal_frame(hd, raw_hdr, nframes, frame, buf, rd,
+                tag, encrypt);
+        PROFILE_END(PROFILE_CIPHER, stage, rd);
+        TRACE_END(TRACE_CHUNK, began);
+        if (0 != err) {
+            TRACE_ERROR("[!] cipher error: %s\n", gcry_strerror(err));
+
+            goto out;
+        }
+
+        PROFILE_START(stage);
+        if ((AEAD_FRAME_LEN != fwrite(frame, 1, AEAD_FRAME_LEN, out)) ||
+                (rd != fwrite(buf, 1, rd, out)) ||
+                (AEAD_TAG_LEN != fwrite(tag, 1, AEAD_TAG_LEN, out))) {
+            TRACE_ERRNO("[!] fwrite");
+
+            goto out;
+        }
+        PROFILE_END(PROFILE_WRITE, stage, rd);
+
+        ++nframes;
+        if (word & AEAD_FRAME_FINAL) {
+            break;
+        }
+    }
+
+    TRACE_DEBUG("[+] sealed %lu frames with %s\n", (unsigned long) nframes,
+                crypto_aead_name(aead));
+    result = CRYPTO_SUCCESS;
+
+out:
+    crypto_buf_put(buf, chunk);
+    crypto_cipher_put(mk, hd);
+
+    return result;
+}
+
+crypto_return_t crypto_aead_decrypt_body( FILE *in, FILE *out,
+        metakey_t mk, const struct stream_header *hdr ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    gcry_cipher_hd_t hd = NULL;
+    unsigned char raw_hdr[STREAM_HEADER_LEN];
+    unsigned char frame[AEAD_FRAME_LEN];
+    unsigned char tag[AEAD_TAG_LEN];
+    unsigned char *buf = NULL;
+    size_t chunk = hdr->chunk_size;
+    size_t len = 0;
+    uint64_t nframes = 0;
+    uint32_t word = 0;
+    int mode = 0;
+    gcry_error_t err = 0;
+    uint64_t began = 0, stage = 0;
+
+    result = aead_check_header(mk, hdr, &mode);
+    if (CRYPTO_SUCCESS != result) {
+        return result;
+    }
+    result = CRYPTO_FAILURE;
+
+    if (KEY_SUCCESS != crypto_cipher_get(mk, mode, &hd)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    buf = crypto_buf_get(chunk);
+    if (NULL == buf) {
+        TRACE_ERROR("[!] could not allocate stream buffer!\n");
+
+        goto out;
+    }
+
+    /* every tag covers the header as it was written */
+    stream_header_pack(hdr, raw_hdr);
+
+    for (;;) {
+        PROFILE_START(stage);
+        if (AEAD_FRAME_LEN != fread(frame, 1, AEAD_FRAME_LEN, in)) {
+            result = ferror(in) ? CRYPTO_FAILURE : CRYPTO_AUTH_FAILURE;
+            TRACE_ERROR("[!] stream ends before its last frame!\n");
+
+            goto out;
+        }
+
+        word = get_be32(frame);
+        len  = (size_t) (word & ~AEAD_FRAME_FINAL);
+        if ((len > chunk) || ((len < chunk) &&
+                    (0 == (word & AEAD_FRAME_FINAL)))) {
+            TRACE_ERROR("[!] frame %lu has a bad length!\n",
+                        (unsigned long) nframes);
+            result = CRYPTO_AUTH_FAILURE;
+
+            goto out;
+        }
+
+        if ((len != fread(buf, 1, len, in)) ||
+                (AEAD_TAG_LEN != fread(tag, 1, AEAD_TAG_LEN, in))) {
+            result = ferror(in) ? CRYPTO_FAILURE : CRYPTO_AUTH_FAILURE;
+            TRACE_ERROR("[!] frame %lu is cut short!\n",
+                        (unsigned long) nframes);
+
+            goto out;
+        }
+        PROFILE_END(PROFILE_READ, stage, len);
+        crypto_profile_inflight(1);
+
+        /* decrypt and verify in the same pass; nothing leaves buf unless
+         * the tag matched */
+        TRACE_START(began);
+        PROFILE_START(stage);
+        err = crypto_aead_seal_frame(hd, raw_hdr, nframes, frame, buf, len,
+                tag, decrypt);
+        PROFILE_END(PROFILE_CIPHER, stage, len);
+        TRACE_END(TRACE_CHUNK, began);
+        if (0 != err) {
+            TRACE_ERROR("[!] frame %lu failed to verify!\n",
+                        (unsigned long) nframes);
+            result = CRYPTO_AUTH_FAILURE;
+
+            goto out;
+        }
+
+        PROFILE_START(stage);
+        if (len != fwrite(buf, 1, len, out)) {
+            TRACE_ERRNO("[!] fwrite");
+
+            goto out;
+        }
+        PROFILE_END(PROFILE_WRITE, stage, len);
+
+        ++nframes;
+        if (word & AEAD_FRAME_FINAL) {
+            break;
+        } else if (nframes == AEAD_MAX_FRAMES) {
+            result = CRYPTO_AUTH_FAILURE;
+
+            goto out;
+        }
+    }
+
+    /* nothing may follow the last frame */
+    if (EOF != getc(in)) {
+        TRACE_ERROR("[!] data after the last frame!\n");
+        result = CRYPTO_AUTH_FAILURE;
+    } else if (0 != ferror(in)) {
+        TRACE_ERRNO("[!] fread");
+    } else {
+        result = CRYPTO_SUCCESS;
+    }
+
+out:
+    /* wiped on the way back, it may hold unverified plaintext */
+    crypto_buf_put(buf, chunk);
+    crypto_cipher_put(mk, hd);
+
+    return result;
+}
+
+crypto_return_t crypto_aead_encrypt_parallel( FILE *in, FILE *out,
+        metakey_t mk, stream_aead_t aead ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    unsigned char raw_hdr[STREAM_HEADER_LEN];
+    size_t chunk = crypto_stream_chunk_size();
+    struct stat st;
+    uint64_t nframes = 0;
+    off_t len = 0;
+    int mode = 0;
+
+    result = aead_new_header(mk, aead, chunk, raw_hdr, &mode);
+    if (CRYPTO_SUCCESS != result) {
+        return result;
+    }
+
+    /* the header goes out through stdio, the frames through the fd */
+    if ((STREAM_HEADER_LEN != fwrite(raw_hdr, 1, STREAM_HEADER_LEN, out)) ||
+            (0 != fflush(out)) || (-1 == fstat(fileno(in), &st))) {
+        TRACE_ERROR("[!] error writing stream header!\n");
+
+        return CRYPTO_FAILURE;
+    }
+
+    /* an empty input still gets its one, empty, final frame */
+    len = st.st_size;
+    nframes = (0 == len) ? 1 : ((uint64_t) len + chunk - 1) / chunk;
+    if (nframes > AEAD_MAX_FRAMES) {
+        TRACE_ERROR("[!] input too large for the chunk size!\n");
+
+        return CRYPTO_FAILURE;
+    }
+
+    if (-1 == ftruncate(fileno(out), (off_t) (STREAM_HEADER_LEN +
+                    (uint64_t) len + nframes * AEAD_FRAME_OVERHEAD))) {
+        TRACE_ERRNO("[!] ftruncate");
+
+        return CRYPTO_FAILURE;
+    }
+
+    return stream_aead_parallel(fileno(in), 0, fileno(out),
+            STREAM_HEADER_LEN, len, mk, mode, raw_hdr, encrypt,
+            crypto_stream_threads(), chunk);
+}
+
+crypto_return_t crypto_aead_decrypt_parallel( FILE *in, FILE *out,
+        metakey_t mk, const struct stream_header *hdr ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    unsigned char raw_hdr[STREAM_HEADER_LEN];
+    unsigned char last[AEAD_FRAME_LEN];
+    size_t chunk = hdr->chunk_size;
+    struct stat st;
+    uint64_t body = 0, frame_len = 0, nframes = 0, rem = 0;
+    off_t len = 0;
+    int mode = 0;
+
+    result = aead_check_header(mk, hdr, &mode);
+    if (CRYPTO_SUCCESS != result) {
+        return result;
+    } else if ((-1 == fstat(fileno(in), &st)) ||
+            (st.st_size < STREAM_HEADER_LEN)) {
+        return CRYPTO_FAILURE;
+    }
+
+    /* every frame but the last is full, so the size of the file gives
+     * the number of frames and the length of the last one */
+    body      = (uint64_t) st.st_size - STREAM_HEADER_LEN;
+    frame_len = chunk + AEAD_FRAME_OVERHEAD;
+    nframes   = body / frame_len;
+    rem       = body % frame_len;
+    if (0 != rem) {
+        nframes++;
+    }
+
+    /* a size no stream can have, or a last frame that was not written
+     * as the last one: the stream was cut short or extended, so leave it
+     * to the frame by frame reader, which says where it breaks off */
+    if ((0 == nframes) || (nframes > AEAD_MAX_FRAMES) ||
+            ((0 != rem) && (rem < AEAD_FRAME_OVERHEAD))) {
+        return crypto_aead_decrypt_body(in, out, mk, hdr);
+    }
+
+    len = (off_t) (body - nframes * AEAD_FRAME_OVERHEAD);
+    if ((0 != full_pread(fileno(in), last, AEAD_FRAME_LEN,
+                    (off_t) (STREAM_HEADER_LEN + (nframes - 1) * frame_len))) ||
+            (get_be32(last) != (AEAD_FRAME_FINAL |
+                    (uint32_t) ((uint64_t) len - (nframes - 1) * chunk)))) {
+        return crypto_aead_decrypt_body(in, out, mk, hdr);
+    }
+    if (-1 == ftruncate(fileno(out), len)) {
+        TRACE_ERRNO("[!] ftruncate");
+
+        return CRYPTO_FAILURE;
+    }
+
+    stream_header_pack(hdr, raw_hdr);
+    return stream_aead_parallel(fileno(in), STREAM_HEADER_LEN, fileno(out),
+            0, len, mk, mode, raw_hdr, decrypt, crypto_stream_threads(),
+            chunk);
+}
+
+gcry_error_t crypto_aead_seal_frame( gcry_cipher_hd_t hd,
+        const unsigned char *raw_hdr, uint64_t i,
+        const unsigned char *frame, unsigned char *buf, size_t len,
+        unsigned char *tag, crypto_op_t op ) {
+    unsigned char iv[AEAD_IV_LEN];
+    unsigned char aad[AEAD_AAD_LEN];
+    gcry_error_t err = 0;
+
+    memcpy(iv, raw_hdr + 16, AEAD_NONCE_LEN);
+    put_be32(iv + AEAD_NONCE_LEN, (uint32_t) i);
+
+    memcpy(aad, raw_hdr, STREAM_HEADER_LEN);
+    put_be32(aad + STREAM_HEADER_LEN, (uint32_t) (i >> 32));
+    put_be32(aad + STREAM_HEADER_LEN + 4, (uint32_t) i);
+    memcpy(aad + STREAM_HEADER_LEN + 8, frame, AEAD_FRAME_LEN);
+
+    err = gcry_cipher_setiv(hd, iv, AEAD_IV_LEN);
+    if (0 == err) {
+        err = gcry_cipher_authenticate(hd, aad, AEAD_AAD_LEN);
+    }
+
+    /* OCB wants to be told which call is the last; the rest ignore it */
+    if (0 == err) {
+        err = gcry_cipher_final(hd);
+    }
+
+    if (0 == err) {
+        if (encrypt == op) {
+            err = gcry_cipher_encrypt(hd, buf, len, NULL, 0);
+        } else {
+            err = gcry_cipher_decrypt(hd, buf, len, NULL, 0);
+        }
+    }
+
+    if (0 == err) {
+        if (encrypt == op) {
+            err = gcry_cipher_gettag(hd, tag, AEAD_TAG_LEN);
+        } else {
+            err = gcry_cipher_checktag(hd, tag, AEAD_TAG_LEN);
+        }
+    }
+
+    return err;
+}
+
+
+/**************************************************************************/
+/*                           internal helpers                             */
+/**************************************************************************/
+
+/* resolve the AEAD and fill in the raw header of a new framed stream
+ * sealed under mk; mode is set to the AEAD's gcrypt mode */
+static crypto_return_t aead_new_header( metakey_t mk, stream_aead_t aead,
+        size_t chunk, unsigned char *raw_hdr, int *mode ) {
+    struct stream_header hdr;
+
+    if ((NULL == mk) || (1 != mk->initialised)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    /* the header records the AEAD chosen, so the reader needs no hint */
+    if (STREAM_AEAD_AUTO == aead) {
+        aead = crypto_aead_select(mk);
+    }
+
+    *mode = crypto_aead_mode(aead);
+    if ((0 == *mode) || (CRYPTO_SUCCESS != aead_check_key(mk, *mode))) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    if (chunk > AEAD_MAX_CHUNK) {
+        TRACE_ERROR("[!] chunks of an authenticated stream are limited to ");
+        TRACE_ERROR("%d bytes!\n", AEAD_MAX_CHUNK);
+
+        return CRYPTO_FAILURE;
+    }
+
+    memset(&hdr, 0, sizeof hdr);
+    hdr.version     = STREAM_VERSION;
+    hdr.algo        = (unsigned char) mk->algo;
+    hdr.mode        = (unsigned char) *mode;
+    hdr.flags       = STREAM_FLAG_FRAMED;
+    hdr.chunk_size  = chunk;
+    gcry_create_nonce(hdr.iv, AEAD_NONCE_LEN);
+    stream_header_pack(&hdr, raw_hdr);
+
+    return CRYPTO_SUCCESS;
+}
+
+/* the header must name one of the AEADs, and the key's algorithm; mode is
+ * set to the AEAD's gcrypt mode */
+static crypto_return_t aead_check_header( metakey_t mk,
+        const struct stream_header *hdr, int *mode ) {
+    int i = 0;
+
+    if ((NULL == mk) || (1 != mk->initialised)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    *mode = 0;
+    for (i = STREAM_AEAD_GCM; i <= STREAM_AEAD_CHACHA20; ++i) {
+        if (crypto_aead_mode((stream_aead_t) i) == (int) hdr->mode) {
+            *mode = (int) hdr->mode;
+        }
+    }
+
+    if ((0 == *mode) || (mk->algo != hdr->algo) ||
+            (hdr->flags != STREAM_FLAG_FRAMED) || (0 == hdr->chunk_size) ||
+            (hdr->chunk_size > AEAD_MAX_CHUNK)) {
+        TRACE_ERROR("[!] stream was sealed with algo %u mode %u, ",
+                    (unsigned int) hdr->algo, (unsigned int) hdr->mode);
+        TRACE_ERROR("key is for algo %d!\n", mk->algo);
+
+        return CRYPTO_BAD_FORMAT;
+    } else if (CRYPTO_SUCCESS != aead_check_key(mk, *mode)) {
+        return CRYPTO_BAD_FORMAT;
+    }
+
+    return CRYPTO_SUCCESS;
+}
+
+/* ChaCha20 takes exactly 256 bits of key */
+static crypto_return_t aead_check_key( metakey_t mk, int mode ) {
+    if ((GCRY_CIPHER_MODE_POLY1305 == mode) && (32 != mk->keysize)) {
+        TRACE_ERROR("[!] ChaCha20-Poly1305 needs a 256-bit key!\n");
+
+        return CRYPTO_FAILURE;
+    }
+
+    return CRYPTO_SUCCESS;
+}
+
+/* whether an AEAD suits a key of keysize bytes on a CPU with features; a
+ * non-strict check only asks whether it can work at all */
+static int aead_acceptable( stream_aead_t aead, size_t keysize,
+        unsigned int features, int strict ) {
+    switch (aead) {
+        case STREAM_AEAD_GCM:
+            return (! strict) || ((features & CPU_AES) &&
+                                  (features & CPU_CLMUL));
+        case STREAM_AEAD_OCB:
+            return (! strict) || (0 != (features & CPU_AES));
+        case STREAM_AEAD_CHACHA20:
+            return 32 == keysize;
+        default:
+            return 0;
+    }
+}
+
+/* time AEAD_CALIBRATE_ROUNDS seals of an AEAD_CALIBRATE_LEN buffer under a
+ * throwaway key; returns the ns taken, or 0 if the AEAD is not available */
+static uint64_t aead_calibrate( stream_aead_t aead, int algo,
+        size_t keysize ) {
+    gcry_cipher_hd_t hd = NULL;
+    unsigned char key[32];
+    unsigned char iv[AEAD_IV_LEN];
+    unsigned char aad[AEAD_AAD_LEN];
+    unsigned char tag[AEAD_TAG_LEN];
+    unsigned char *buf = NULL;
+    int mode = crypto_aead_mode(aead);
+    gcry_error_t err = 0;
+    uint64_t start = 0, total = 0;
+    unsigned int i = 0;
+
+    if (GCRY_CIPHER_MODE_POLY1305 == mode) {
+        algo = GCRY_CIPHER_CHACHA20;
+    }
+
+    if ((0 == mode) || (keysize > sizeof key) ||
+            (0 != gcry_cipher_open(&hd, algo, mode, 0))) {
+        return 0;
+    }
+
+    buf = calloc(1, AEAD_CALIBRATE_LEN);
+    memset(iv, 0, sizeof iv);
+    memset(aad, 0, sizeof aad);
+    gcry_create_nonce(key, keysize);
+    if ((NULL == buf) || (0 != gcry_cipher_setkey(hd, key, keysize))) {
+        free(buf);
+        gcry_cipher_close(hd);
+        return 0;
+    }
+
+    /* the first round warms up the caches and is not counted */
+    for (i = 0; (i <= AEAD_CALIBRATE_ROUNDS) && (0 == err); ++i) {
+        start = aead_now();
+        err = gcry_cipher_setiv(hd, iv, AEAD_IV_LEN);
+        if (0 == err) {
+            err = gcry_cipher_authenticate(hd, aad, AEAD_AAD_LEN);
+        }
+        if (0 == err) {
+            err = gcry_cipher_final(hd);
+        }
+        if (0 == err) {
+            err = gcry_cipher_encrypt(hd, buf, AEAD_CALIBRATE_LEN, NULL, 0);
+        }
+        if (0 == err) {
+            err = gcry_cipher_gettag(hd, tag, AEAD_TAG_LEN);
+        }
+        if (i > 0) {
+            total += aead_now() - start;
+        }
+    }
+
+    free(buf);
+    gcry_cipher_close(hd);
+
+    /* 0 too if the clock was too coarse to see the work */
+    return (0 == err) ? total : 0;
+}
+
+static uint64_t aead_now( ) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
@@ -0,0 +1,174 @@
+/**************************************************************************
+ * cryptoaead.h                                                           *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-28                                                             *
+ *                                                                        *
+ * authenticated streaming encryption in framed, per-chunk sealed form    *
+ **************************************************************************/
+
+#ifndef __CRYPTOAEAD_H
+#define __CRYPTOAEAD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptostream.h"
+#include "metakey.h"
+
+/**************************************************************************/
+/*                         framed stream format                           */
+/**************************************************************************/
+/*
+ * a framed stream starts with the usual stream header (see cryptostream.h)
+ * with STREAM_FLAG_FRAMED set. algo is the key's algorithm and mode names
+ * the AEAD: GCRY_CIPHER_MODE_GCM or GCRY_CIPHER_MODE_OCB over the key's
+ * AES, or GCRY_CIPHER_MODE_POLY1305 for ChaCha20-Poly1305 keyed with the
+ * key's 256 bits (gcrypt's ChaCha20 id does not fit the algo byte, and
+ * Poly1305 pairs with nothing else). the first AEAD_NONCE_LEN bytes of
+ * the header's iv field are a random per-stream nonce, the rest is 0.
+ *
+ * the header is followed by frames, each holding one chunk of plaintext
+ * sealed on its own:
+ *
+ *      offset  size    field
+ *      0       4       frame word: plaintext length, big endian, with
+ *                      AEAD_FRAME_FINAL set on the last frame
+ *      4       len     ciphertext
+ *      4+len   16      tag
+ *
+ * every frame but the last holds exactly chunk_size bytes; the last holds
+ * 1 to chunk_size, or 0 if the plaintext is empty. frame i is sealed with
+ * the IV nonce || i (32 bits, big endian) and the additional authenticated
+ * data header || i (64 bits) || frame word, so a frame can be neither
+ * modified, moved, nor moved to another stream, and the stream can be
+ * neither cut short nor extended without a tag failing.
+ *
+ * the reader checks each frame's tag as it decrypts it, in the same pass
+ * over the chunk, and only writes the chunk out once the tag matched. the
+ * first frame that does not verify ends the stream with
+ * CRYPTO_AUTH_FAILURE; nothing of it or after it is written. a stream
+ * read to the end has been verified in full. the plaintext length is
+ * visible without the key, as with CTR streams.
+ *
+ * frame i always holds plaintext bytes i * chunk_size on and starts at
+ * STREAM_HEADER_LEN + i * (chunk_size + AEAD_FRAME_OVERHEAD), so between
+ * regular files the frames are sealed and opened by the workers of
+ * cryptoparallel.h like CTR chunks. the layout read back follows from the
+ * file size; a file whose last frame word does not agree with it is read
+ * frame by frame instead, and any other frame word that disagrees fails
+ * its frame. when a frame fails, the output is cut back to the frames
+ * before it, so it holds what the frame by frame reader would have
+ * written.
+ */
+#define     AEAD_NONCE_LEN          8
+#define     AEAD_IV_LEN             12
+#define     AEAD_TAG_LEN            16
+#define     AEAD_FRAME_LEN          4
+#define     AEAD_AAD_LEN            (STREAM_HEADER_LEN + 12)
+#define     AEAD_FRAME_OVERHEAD     (AEAD_FRAME_LEN + AEAD_TAG_LEN)
+#define     AEAD_FRAME_FINAL        0x80000000UL
+#define     AEAD_MAX_FRAMES         0xffffffffUL
+
+
+/**************************************************************************/
+/*                             aead functions                             */
+/**************************************************************************/
+
+/* crypto_aead_encrypt_stream: encrypt everything readable from one stdio
+ *                  stream into framed form. memory use is one chunk of
+ *                  crypto_stream_chunk_size() bytes.
+ *      arguments: the input FILE *, the output FILE *, the metakey_t and
+ *                 the AEAD to seal the frames with (not STREAM_AEAD_NONE;
+ *                 STREAM_AEAD_AUTO picks one with crypto_aead_select).
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE, or CRYPTO_NOT_INIT if the
+ *                 key is not ready or does not suit the AEAD
+ */
+extern crypto_return_t crypto_aead_encrypt_stream( FILE *, FILE *,
+                                                   metakey_t,
+                                                   stream_aead_t );
+
+/* crypto_aead_decrypt_body: decrypt and verify the frames following an
+ *                  already parsed framed header.
+ *      arguments: the input FILE *, positioned after the header, the
+ *                 output FILE *, the metakey_t, and the parsed header.
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE on I/O errors,
+ *                 CRYPTO_BAD_FORMAT if the header does not describe a
+ *                 framed stream for this key, or CRYPTO_AUTH_FAILURE if a
+ *                 frame does not verify or the stream was cut short.
+ */
+extern crypto_return_t crypto_aead_decrypt_body( FILE *, FILE *,
+                                        metakey_t,
+                                        const struct stream_header * );
+
+/* crypto_aead_encrypt_parallel, crypto_aead_decrypt_parallel: the same
+ *                  for regular files, with the frames spread over
+ *                  crypto_stream_threads() workers (see cryptoparallel.h).
+ *                  memory use is one chunk per worker.
+ *      arguments: as for crypto_aead_encrypt_stream and
+ *                 crypto_aead_decrypt_body; the output is sized with
+ *                 ftruncate and written by offset.
+ *      returns: as for crypto_aead_encrypt_stream and
+ *                 crypto_aead_decrypt_body
+ */
+extern crypto_return_t crypto_aead_encrypt_parallel( FILE *, FILE *,
+                                                     metakey_t,
+                                                     stream_aead_t );
+extern crypto_return_t crypto_aead_decrypt_parallel( FILE *, FILE *,
+                                        metakey_t,
+                                        const struct stream_header * );
+
+/* crypto_aead_seal_frame: encrypt and tag, or decrypt and verify, frame i
+ *                  of a framed stream in one pass over its data.
+ *      arguments: a handle for the stream's AEAD, the raw header, the
+ *                 frame index, its frame word, the data and its length,
+ *                 the tag (written when encrypting, checked when
+ *                 decrypting), and the operation.
+ *      returns: 0, or the gcrypt error; a checksum error when the tag
+ *                 does not match
+ */
+extern gcry_error_t crypto_aead_seal_frame( gcry_cipher_hd_t,
+                                            const unsigned char *, uint64_t,
+                                            const unsigned char *,
+                                            unsigned char *, size_t,
+                                            unsigned char *, crypto_op_t );
+
+/* crypto_aead_select: the AEAD STREAM_AEAD_AUTO stands for with this key:
+ *                  of those that suit the key and have hardware support
+ *                  (see cryptocpu.h), the one that seals fastest in a short
+ *                  calibration. AES modes are only considered without
+ *                  hardware support if nothing else suits the key. the
+ *                  calibration runs once per process and key algorithm.
+ *                  thread safe.
+ *      arguments: the metakey_t to seal with
+ *      returns: STREAM_AEAD_GCM, STREAM_AEAD_OCB or STREAM_AEAD_CHACHA20
+ */
+extern stream_aead_t crypto_aead_select( metakey_t );
+
+/* crypto_aead_mode: the gcrypt cipher mode behind an AEAD, as recorded
+ *                  in the header
+ *      returns: a GCRY_CIPHER_MODE_*, or 0 for STREAM_AEAD_NONE
+ */
+extern int crypto_aead_mode( stream_aead_t );
+
+/* crypto_aead_name: the name of an AEAD, e.g. "gcm", as taken by
+ *                  crypto_aead_parse
+ */
+extern const char *crypto_aead_name( stream_aead_t );
+
+/* crypto_aead_parse: look up an AEAD by name
+ *      arguments: "none", "gcm", "ocb", "chacha20" or "auto", and the
+ *                 stream_aead_t to fill in
+ *      returns: CRYPTO_SUCCESS, or CRYPTO_FAILURE for an unknown name
+ */
+extern crypto_return_t crypto_aead_parse( const char *, stream_aead_t * );
+
+/* crypto_is_aead: check whether a parsed stream header starts a framed
+ *                  stream rather than a plain CTR stream.
+ */
+extern int crypto_is_aead( const struct stream_header * );
+
+#endif
@@ -0,0 +1,705 @@
+/**************************************************************************
+ * cryptoaio.c                                                            *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-16                                                             *
+ *                                                                        *
+ * asynchronous I/O pipeline, see cryptoaio.h                             *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <gcrypt.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptobuf.h"
+#include "cryptoaio.h"
+#include "cryptoprofile.h"
+#include "cryptostream.h"
+#include "metakey.h"
+#include "debug.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING   1
+#endif
+
+/********************************************************************
+ * aio_req:                                                         *
+ *      a queued request; also used as the completion record        *
+ ********************************************************************/
+struct aio_req {
+    aio_opcode_t op;
+    int fd;
+    unsigned char *buf;
+    size_t len;
+    off_t off;
+    unsigned int tag;
+    ssize_t res;
+};
+
+#ifdef HAVE_IO_URING
+/********************************************************************
+ * uring:                                                           *
+ *      the mapped submission and completion rings                  *
+ ********************************************************************/
+struct uring {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz, sqes_sz;
+    unsigned int to_submit;
+    struct iovec *iov;          /* one per tag, must outlive the request */
+};
+#endif
+
+/********************************************************************
+ * aio_threads:                                                     *
+ *      thread based emulation of the ring: a request queue served  *
+ *      by I/O threads and a completion queue they fill             *
+ ********************************************************************/
+struct aio_threads {
+    pthread_mutex_t lock;
+    pthread_cond_t  req_cond;
+    pthread_cond_t  done_cond;
+    pthread_t *tids;
+    unsigned int nthreads;
+    unsigned int size;          /* capacity of both rings, the depth */
+    struct aio_req *reqs;       /* ring of queued requests */
+    unsigned int req_head, req_count;
+    struct aio_req *done;       /* ring of completions */
+    unsigned int done_head, done_count;
+    int shutdown;
+};
+
+struct aio_ctx {
+    unsigned int depth;
+    int use_uring;
+#ifdef HAVE_IO_URING
+    struct uring ring;
+#endif
+    struct aio_threads th;
+};
+
+#ifdef HAVE_IO_URING
+static int uring_setup( struct uring *, unsigned int );
+static void uring_teardown( struct uring * );
+static crypto_return_t uring_queue( struct uring *, struct aio_req * );
+static crypto_return_t uring_wait( struct uring *, struct aio_completion * );
+#endif
+static int threads_setup( struct aio_threads *, unsigned int );
+static void threads_teardown( struct aio_threads *, unsigned int );
+static void *threads_run( void * );
+
+
+/**************************************************************************/
+/*                             aio context                                */
+/**************************************************************************/
+
+aio_ctx_t aio_open( unsigned int depth ) {
+    aio_ctx_t ctx = NULL;
+
+    if ((0 == depth) || (depth > AIO_MAX_DEPTH)) {
+        return NULL;
+    }
+
+    ctx = calloc(1, sizeof *ctx);
+    if (NULL == ctx) {
+        return NULL;
+    }
+    ctx->depth = depth;
+
+#ifdef HAVE_IO_URING
+    if (0 == uring_setup(&ctx->ring, depth)) {
+        ctx->use_uring = 1;
+        return ctx;
+    }
+
+    TRACE_INFO("[+] io_uring not available, using I/O threads\n");
+#endif
+
+    if (0 != threads_setup(&ctx->th, depth)) {
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+crypto_return_t aio_queue( aio_ctx_t ctx, aio_opcode_t op, int fd,
+        unsigned char *buf, size_t len, off_t off, unsigned int tag ) {
+    struct aio_req req;
+    struct aio_threads *th = &ctx->th;
+
+    if (tag >= ctx->depth) {
+        return CRYPTO_FAILURE;
+    }
+
+    req.op  = op;
+    req.fd  = fd;
+    req.buf = buf;
+    req.len = len;
+    req.off = off;
+    req.tag = tag;
+    req.res = 0;
+
+#ifdef HAVE_IO_URING
+    if (ctx->use_uring) {
+        return uring_queue(&ctx->ring, &req);
+    }
+#endif
+
+    pthread_mutex_lock(&th->lock);
+    if (th->req_count == th->size) {
+        pthread_mutex_unlock(&th->lock);
+        return CRYPTO_FAILURE;
+    }
+    th->reqs[(th->req_head + th->req_count) % th->size] = req;
+    th->req_count++;
+    pthread_cond_signal(&th->req_cond);
+    pthread_mutex_unlock(&th->lock);
+
+    return CRYPTO_SUCCESS;
+}
+
+crypto_return_t aio_wait( aio_ctx_t ctx, struct aio_completion *c ) {
+    struct aio_threads *th = &ctx->th;
+    struct aio_req *done = NULL;
+
+#ifdef HAVE_IO_URING
+    if (ctx->use_uring) {
+        return uring_wait(&ctx->ring, c);
+    }
+#endif
+
+    pthread_mutex_lock(&th->lock);
+    while (0 == th->done_count) {
+        pthread_cond_wait(&th->done_cond, &th->lock);
+    }
+    done = &th->done[th->done_head];
+    c->tag = done->tag;
+    c->res = done->res;
+    th->done_head = (th->done_head + 1) % th->size;
+    th->done_count--;
+    pthread_mutex_unlock(&th->lock);
+
+    return CRYPTO_SUCCESS;
+}
+
+const char *aio_backend( aio_ctx_t ctx ) {
+    return ctx->use_uring ? "io_uring" : "threads";
+}
+
+void aio_close( aio_ctx_t ctx ) {
+    if (NULL == ctx) {
+        return;
+    }
+
+#ifdef HAVE_IO_URING
+    if (ctx->use_uring) {
+        uring_teardown(&ctx->ring);
+    } else
+#endif
+    {
+        threads_teardown(&ctx->th, ctx->th.nthreads);
+    }
+
+    free(ctx);
+}
+
+
+/**************************************************************************/
+/*                             the pipeline                               */
+/**************************************************************************/
+
+/* chunk buffer states */
+enum slot_state {
+    SLOT_FREE = 0,
+    SLOT_READING,
+    SLOT_READ,
+    SLOT_WRITING
+};
+
+struct aio_slot {
+    enum slot_state state;
+    unsigned char *buf;
+    uint64_t chunk;             /* index of the chunk in the buffer */
+    size_t len;                 /* bytes in the chunk */
+    size_t done;                /* bytes transferred so far */
+    uint64_t issued;            /* when the read or write was queued */
+};
+
+crypto_return_t stream_crypt_aio( int infd, off_t in_off, int outfd,
+        off_t out_off, off_t len, metakey_t mk, const unsigned char *iv,
+        crypto_op_t op, unsigned int depth, size_t chunk_size ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    aio_ctx_t ctx = NULL;
+    gcry_cipher_hd_t hd = NULL;
+    struct aio_slot *slots = NULL;
+    struct aio_slot *s = NULL;
+    struct aio_completion c;
+    unsigned char ctr[STREAM_IV_LEN];
+    uint64_t nchunks = 0, next_read = 0, written = 0;
+    unsigned int i = 0, inflight = 0;
+    gcry_error_t err = 0;
+    uint64_t began = 0, stage = 0;
+    crypto_return_t queued = CRYPTO_FAILURE;
+    off_t pos = 0;
+
+    nchunks = ((uint64_t) len + chunk_size - 1) / chunk_size;
+    if (0 == nchunks) {
+        return CRYPTO_SUCCESS;
+    }
+    if ((uint64_t) depth > nchunks) {
+        depth = (unsigned int) nchunks;
+    }
+
+    if (KEY_SUCCESS != crypto_cipher_get(mk, GCRY_CIPHER_MODE_CTR, &hd)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    ctx = aio_open(depth);
+    slots = calloc(depth, sizeof *slots);
+    if ((NULL == ctx) || (NULL == slots)) {
+        goto out;
+    }
+
+    for (i = 0; i < depth; ++i) {
+        slots[i].buf = crypto_buf_get(chunk_size);
+        if (NULL == slots[i].buf) {
+            goto out;
+        }
+    }
+
+    TRACE_INFO("[+] aio pipeline: %s, depth %u, %lu byte chunks\n",
+               aio_backend(ctx), depth, (unsigned long) chunk_size);
+
+    while (written < nchunks) {
+        /* keep every free buffer busy reading ahead */
+        for (i = 0; (i < depth) && (next_read < nchunks); ++i) {
+            s = &slots[i];
+            if (SLOT_FREE != s->state) {
+                continue;
+            }
+
+            pos      = (off_t) (next_read * chunk_size);
+            s->chunk = next_read++;
+            s->len   = chunk_size;
+            if ((off_t) s->len > len - pos) {
+                s->len = (size_t) (len - pos);
+            }
+            s->done  = 0;
+            s->state = SLOT_READING;
+            PROFILE_START(s->issued);
+
+            if (CRYPTO_SUCCESS != aio_queue(ctx, AIO_READ, infd, s->buf,
+                        s->len, in_off + pos, i)) {
+                goto drain;
+            }
+            ++inflight;
+        }
+
+        /* encrypt whatever has arrived and send it on its way; every
+         * chunk carries its own counter, so arrival order is irrelevant */
+        for (i = 0; i < depth; ++i) {
+            s = &slots[i];
+            if (SLOT_READ != s->state) {
+                continue;
+            }
+
+            pos = (off_t) (s->chunk * chunk_size);
+            stream_ctr_offset(ctr, iv, (uint64_t) pos / STREAM_BLOCK_LEN);
+            err = gcry_cipher_setctr(hd, ctr, STREAM_IV_LEN);
+            if (0 == err) {
+                TRACE_START(began);
+                PROFILE_START(stage);
+                if (encrypt == op) {
+                    err = gcry_cipher_encrypt(hd, s->buf, s->len, NULL, 0);
+                } else {
+                    err = gcry_cipher_decrypt(hd, s->buf, s->len, NULL, 0);
+                }
+                PROFILE_END(PROFILE_CIPHER, stage, s->len);
+                TRACE_END(TRACE_CHUNK, began);
+            }
+
+            if (0 != err) {
+                TRACE_ERROR("[!] cipher error: %s\n",
+                            gcry_strerror(err));
+
+                goto drain;
+            }
+
+            s->done  = 0;
+            s->state = SLOT_WRITING;
+            PROFILE_START(s->issued);
+            if (CRYPTO_SUCCESS != aio_queue(ctx, AIO_WRITE, outfd, s->buf,
+                        s->len, out_off + pos, i)) {
+                goto drain;
+            }
+            ++inflight;
+        }
+
+        if (0 == inflight) {
+            break;
+        }
+
+        /* the requests outstanding are the pipeline's occupancy */
+        crypto_profile_inflight(inflight);
+        if (CRYPTO_SUCCESS != aio_wait(ctx, &c)) {
+            goto drain;
+        }
+        --inflight;
+
+        s = &slots[c.tag];
+        if (c.res <= 0) {
+            TRACE_ERROR("[!] aio %s failed: %s\n",
+                        (SLOT_READING == s->state) ? "read" : "write",
+                        (0 == c.res) ? "unexpected end of file"
+                                     : strerror((int) -c.res));
+
+            goto drain;
+        }
+
+        /* a short transfer is requeued for the remainder */
+        s->done += (size_t) c.res;
+        pos = (off_t) (s->chunk * chunk_size) + (off_t) s->done;
+        if (s->done < s->len) {
+            if (SLOT_READING == s->state) {
+                queued = aio_queue(ctx, AIO_READ, infd, s->buf + s->done,
+                        s->len - s->done, in_off + pos, c.tag);
+            } else {
+                queued = aio_queue(ctx, AIO_WRITE, outfd, s->buf + s->done,
+                        s->len - s->done, out_off + pos, c.tag);
+            }
+
+            if (CRYPTO_SUCCESS != queued) {
+                goto drain;
+            }
+            ++inflight;
+        } else if (SLOT_READING == s->state) {
+            PROFILE_END(PROFILE_READ, s->issued, s->len);
+            s->state = SLOT_READ;
+        } else {
+            PROFILE_END(PROFILE_WRITE, s->issued, s->len);
+            s->state = SLOT_FREE;
+            ++written;
+        }
+    }
+
+    result = (written == nchunks) ? CRYPTO_SUCCESS : CRYPTO_FAILURE;
+
+drain:
+    /* buffers may not be released while the kernel still owns them */
+    while (inflight > 0) {
+        if (CRYPTO_SUCCESS != aio_wait(ctx, &c)) {
+            break;
+        }
+        --inflight;
+    }
+
+out:
+    /* a request the kernel never completed may still write into its
+     * buffer, so with any left, no buffer goes back to the pool: wiping
+     * or reusing one could race with the kernel */
+    if ((NULL != slots) && (inflight > 0)) {
+        TRACE_ERROR("[!] %u aio requests lost, leaking their buffers!\n",
+                    inflight);
+    } else if (NULL != slots) {
+        for (i = 0; i < depth; ++i) {
+            crypto_buf_put(slots[i].buf, chunk_size);
+        }
+    }
+    free(slots);
+    aio_close(ctx);
+    crypto_cipher_put(mk, hd);
+
+    return result;
+}
+
+
+/**************************************************************************/
+/*                              io_uring                                  */
+/**************************************************************************/
+
+#ifdef HAVE_IO_URING
+static int uring_setup( struct uring *r, unsigned int depth ) {
+    struct io_uring_params p;
+    unsigned char *sq = NULL, *cq = NULL;
+    long fd = 0;
+
+    memset(&p, 0, sizeof p);
+    memset(r, 0, sizeof *r);
+    r->fd = -1;
+
+    fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (fd < 0) {
+        return -1;
+    }
+    r->fd = (int) fd;
+
+    r->sq_sz   = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_sz   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* newer kernels map both rings with a single mmap */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_sz > r->sq_sz) {
+            r->sq_sz = r->cq_sz;
+        }
+        r->cq_sz = r->sq_sz;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == r->sq_ptr) {
+        r->sq_ptr = NULL;
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == r->cq_ptr) {
+            r->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == r->sqes) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    r->iov = calloc(depth, sizeof *r->iov);
+    if (NULL == r->iov) {
+        goto fail;
+    }
+
+    sq = r->sq_ptr;
+    cq = r->cq_ptr;
+    r->sq_head    = (unsigned int *) (void *) (sq + p.sq_off.head);
+    r->sq_tail    = (unsigned int *) (void *) (sq + p.sq_off.tail);
+    r->sq_mask    = (unsigned int *) (void *) (sq + p.sq_off.ring_mask);
+    r->sq_entries = (unsigned int *) (void *) (sq + p.sq_off.ring_entries);
+    r->sq_array   = (unsigned int *) (void *) (sq + p.sq_off.array);
+    r->cq_head    = (unsigned int *) (void *) (cq + p.cq_off.head);
+    r->cq_tail    = (unsigned int *) (void *) (cq + p.cq_off.tail);
+    r->cq_mask    = (unsigned int *) (void *) (cq + p.cq_off.ring_mask);
+    r->cqes       = (struct io_uring_cqe *) (void *) (cq + p.cq_off.cqes);
+
+    return 0;
+
+fail:
+    uring_teardown(r);
+    return -1;
+}
+
+static void uring_teardown( struct uring *r ) {
+    if (NULL != r->sqes) {
+        munmap(r->sqes, r->sqes_sz);
+    }
+    if ((NULL != r->cq_ptr) && (r->cq_ptr != r->sq_ptr)) {
+        munmap(r->cq_ptr, r->cq_sz);
+    }
+    if (NULL != r->sq_ptr) {
+        munmap(r->sq_ptr, r->sq_sz);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    free(r->iov);
+    memset(r, 0, sizeof *r);
+    r->fd = -1;
+}
+
+static crypto_return_t uring_queue( struct uring *r, struct aio_req *req ) {
+    struct io_uring_sqe *sqe = NULL;
+    unsigned int tail = *r->sq_tail;
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int idx = 0;
+
+    if (tail - head >= *r->sq_entries) {
+        return CRYPTO_FAILURE;
+    }
+
+    r->iov[req->tag].iov_base = req->buf;
+    r->iov[req->tag].iov_len  = req->len;
+
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode    = (AIO_READ == req->op) ? IORING_OP_READV
+                                           : IORING_OP_WRITEV;
+    sqe->fd        = req->fd;
+    sqe->addr      = (uint64_t) (uintptr_t) &r->iov[req->tag];
+    sqe->len       = 1;
+    sqe->off       = (uint64_t) req->off;
+    sqe->user_data = req->tag;
+
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+
+    return CRYPTO_SUCCESS;
+}
+
+static crypto_return_t uring_wait( struct uring *r,
+        struct aio_completion *c ) {
+    struct io_uring_cqe *cqe = NULL;
+    unsigned int head = 0, tail = 0;
+    long ret = 0;
+
+    for (;;) {
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if ((head != tail) && (0 == r->to_submit)) {
+            break;
+        }
+
+        ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit,
+                (head != tail) ? 0 : 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            TRACE_ERRNO("[!] io_uring_enter");
+
+            return CRYPTO_FAILURE;
+        }
+        r->to_submit -= (unsigned int) ret;
+    }
+
+    cqe    = &r->cqes[head & *r->cq_mask];
+    c->tag = (unsigned int) cqe->user_data;
+    c->res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return CRYPTO_SUCCESS;
+}
+#endif /* HAVE_IO_URING */
+
+
+/**************************************************************************/
+/*                         thread emulation                               */
+/**************************************************************************/
+
+static int threads_setup( struct aio_threads *th, unsigned int depth ) {
+    unsigned int i = 0;
+
+    memset(th, 0, sizeof *th);
+    th->size = depth;
+    th->reqs = calloc(depth, sizeof *th->reqs);
+    th->done = calloc(depth, sizeof *th->done);
+    th->tids = calloc(depth, sizeof *th->tids);
+    if ((NULL == th->reqs) || (NULL == th->done) || (NULL == th->tids)) {
+        threads_teardown(th, 0);
+        return -1;
+    }
+
+    pthread_mutex_init(&th->lock, NULL);
+    pthread_cond_init(&th->req_cond, NULL);
+    pthread_cond_init(&th->done_cond, NULL);
+
+    /* one thread per slot: every request in flight can be blocked in the
+     * kernel at the same time, just like on a ring */
+    for (i = 0; i < depth; ++i) {
+        if (0 != pthread_create(&th->tids[i], NULL, threads_run, th)) {
+            break;
+        }
+    }
+    th->nthreads = i;
+
+    if (0 == th->nthreads) {
+        threads_teardown(th, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void threads_teardown( struct aio_threads *th, unsigned int n ) {
+    unsigned int i = 0;
+
+    if (n > 0) {
+        pthread_mutex_lock(&th->lock);
+        th->shutdown = 1;
+        pthread_cond_broadcast(&th->req_cond);
+        pthread_mutex_unlock(&th->lock);
+
+        for (i = 0; i < n; ++i) {
+            pthread_join(th->tids[i], NULL);
+        }
+    }
+
+    if (NULL != th->tids) {
+        pthread_cond_destroy(&th->done_cond);
+        pthread_cond_destroy(&th->req_cond);
+        pthread_mutex_destroy(&th->lock);
+    }
+
+    free(th->tids);
+    free(th->done);
+    free(th->reqs);
+    th->tids = NULL;
+    th->done = th->reqs = NULL;
+}
+
+static void *threads_run( void *arg ) {
+    struct aio_threads *th = arg;
+    struct aio_req req;
+
+    for (;;) {
+        pthread_mutex_lock(&th->lock);
+        while ((0 == th->req_count) && (0 == th->shutdown)) {
+            pthread_cond_wait(&th->req_cond, &th->lock);
+        }
+        if (th->shutdown) {
+            pthread_mutex_unlock(&th->lock);
+            break;
+        }
+
+        req = th->reqs[th->req_head];
+        th->req_head = (th->req_head + 1) % th->size;
+        th->req_count--;
+        pthread_mutex_unlock(&th->lock);
+
+        do {
+            if (AIO_READ == req.op) {
+                req.res = pread(req.fd, req.buf, req.len, req.off);
+            } else {
+                req.res = pwrite(req.fd, req.buf, req.len, req.off);
+            }
+        } while ((req.res < 0) && (EINTR == errno));
+
+        if (req.res < 0) {
+            req.res = -errno;
+        }
+
+        pthread_mutex_lock(&th->lock);
+        th->done[(th->done_head + th->done_count) % th->size] = req;
+        th->done_count++;
+        pthread_cond_signal(&th->done_cond);
+        pthread_mutex_unlock(&th->lock);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,111 @@
+/**************************************************************************
+ * cryptoaio.h                                                            *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-16                                                             *
+ *                                                                        *
+ * asynchronous read -> encrypt -> write pipeline                         *
+ **************************************************************************/
+
+#ifndef __CRYPTOAIO_H
+#define __CRYPTOAIO_H
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "metakey.h"
+
+/**************************************************************************/
+/*                         note on the aio pipeline                       */
+/**************************************************************************/
+/*
+ * the pipeline keeps up to depth chunks in flight. each chunk buffer goes
+ * through the states free -> reading -> read -> writing -> free; while the
+ * cipher works on one chunk the reads for the following chunks and the
+ * writes of the preceding ones are still outstanding, so the disk and the
+ * cipher are busy at the same time.
+ *
+ * requests are queued on an io_uring when the kernel provides one, and
+ * otherwise on a pool of I/O threads doing pread / pwrite, which emulates
+ * the same submit / complete interface.
+ */
+
+/********************************************************************
+ * aio_opcode_t:                                                    *
+ *      the operations that can be queued                           *
+ ********************************************************************/
+enum aio_opcode {
+    AIO_READ = 0,
+    AIO_WRITE
+};
+
+typedef enum aio_opcode aio_opcode_t;
+
+/********************************************************************
+ * aio_completion:                                                  *
+ *      result of a finished request                                *
+ *                                                                  *
+ * tag: the tag the request was queued with                         *
+ * res: bytes transferred, or -errno on failure                     *
+ ********************************************************************/
+struct aio_completion {
+    unsigned int tag;
+    ssize_t res;
+};
+
+typedef struct aio_ctx * aio_ctx_t;
+
+
+/**************************************************************************/
+/*                            aio functions                               */
+/**************************************************************************/
+
+/* aio_open: set up an asynchronous I/O context able to hold depth
+ *                  requests. an io_uring is tried first; if the kernel
+ *                  does not support it (or forbids it), a thread based
+ *                  emulation is used instead.
+ *      arguments: the queue depth, 1 to AIO_MAX_DEPTH
+ *      returns: the new context, or NULL on failure
+ */
+extern aio_ctx_t aio_open( unsigned int );
+
+/* aio_queue: queue a read or write. the request is not necessarily
+ *                  started until the next aio_wait. tags must be unique
+ *                  among the requests in flight and less than the depth.
+ *      arguments: the context, the opcode, fd, buffer, length, file
+ *                 offset, and the tag to report the completion with.
+ *      returns: CRYPTO_SUCCESS or CRYPTO_FAILURE
+ */
+extern crypto_return_t aio_queue( aio_ctx_t, aio_opcode_t, int,
+                                  unsigned char *, size_t, off_t,
+                                  unsigned int );
+
+/* aio_wait: start everything queued and wait for one request to finish
+ *      arguments: the context and the completion to fill in
+ *      returns: CRYPTO_SUCCESS or CRYPTO_FAILURE
+ */
+extern crypto_return_t aio_wait( aio_ctx_t, struct aio_completion * );
+
+/* aio_backend: name of the backend in use, "io_uring" or "threads" */
+extern const char *aio_backend( aio_ctx_t );
+
+/* aio_close: tear down a context; no requests may be in flight */
+extern void aio_close( aio_ctx_t );
+
+/* stream_crypt_aio: run len bytes of infd starting at in_off through
+ *                  AES-CTR and write them to outfd starting at out_off,
+ *                  keeping up to depth chunks of chunk_size bytes in
+ *                  flight.
+ *      arguments: input fd and offset, output fd and offset, number of
+ *                 bytes, the metakey_t, the initial counter block, the
+ *                 operation, the queue depth, and the chunk size (a
+ *                 multiple of the cipher block size).
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE, or CRYPTO_NOT_INIT if
+ *                 the cipher handle could not be set up
+ */
+extern crypto_return_t stream_crypt_aio( int, off_t, int, off_t, off_t,
+                                         metakey_t, const unsigned char *,
+                                         crypto_op_t, unsigned int, size_t );
+
+#endif
@@ -0,0 +1,195 @@
+/**************************************************************************
+ * cryptoarena.c                                                          *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-20                                                             *
+ *                                                                        *
+ * locked slab allocator, see cryptoarena.h for documentation             *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptoarena.h"
+#include "cryptosecmem.h"
+#include "debug.h"
+
+/* the metakey has to fit in the slot's first cache line */
+typedef char arena_metakey_fits[(sizeof(struct metakey) <= ARENA_LINE_SIZE)
+                                ? 1 : -1];
+
+/********************************************************************
+ * arena_slot:                                                      *
+ *      one metakey and its key bytes                               *
+ *                                                                  *
+ * head: the metakey while the slot is in use, the free list link   *
+ *       while it is not                                            *
+ * key: the key bytes                                               *
+ ********************************************************************/
+union arena_head {
+    struct metakey mk;
+    union arena_head *next;
+    unsigned char line[ARENA_LINE_SIZE];
+};
+
+struct arena_slot {
+    union arena_head head;
+    unsigned char key[ARENA_KEY_MAX];
+};
+
+/********************************************************************
+ * arena_region:                                                    *
+ *      one mapping                                                 *
+ *                                                                  *
+ * base / len: the mapping                                          *
+ * used: slots handed out from the region so far (bump pointer)     *
+ * locked: mlock succeeded                                          *
+ ********************************************************************/
+struct arena_region {
+    unsigned char *base;
+    size_t len;
+    size_t used;
+    int locked;
+    struct arena_region *next;
+};
+
+static struct arena_region *arena_regions = NULL;
+static union arena_head *arena_free = NULL;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct arena_region *arena_map( void );
+
+metakey_t crypto_arena_alloc( ) {
+    struct arena_region *r = NULL;
+    struct arena_slot *slot = NULL;
+
+    pthread_mutex_lock(&arena_lock);
+    if (NULL != arena_free) {
+        slot = (struct arena_slot *) arena_free;
+        arena_free = arena_free->next;
+    } else {
+        r = arena_regions;
+        if ((NULL == r) || (r->used + ARENA_SLOT_SIZE > r->len)) {
+            r = arena_map();
+        }
+
+        if (NULL != r) {
+            slot = (struct arena_slot *) (r->base + r->used);
+            r->used += ARENA_SLOT_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&arena_lock);
+
+    if (NULL == slot) {
+        return NULL;
+    }
+
+    memset(slot, 0, sizeof *slot);
+    slot->head.mk.key = slot->key;
+    return &slot->head.mk;
+}
+
+void crypto_arena_release( metakey_t mk ) {
+    union arena_head *head = (union arena_head *) mk;
+
+    crypto_wipe(head, sizeof(struct arena_slot));
+
+    pthread_mutex_lock(&arena_lock);
+    head->next = arena_free;
+    arena_free = head;
+    pthread_mutex_unlock(&arena_lock);
+}
+
+unsigned char *crypto_arena_keybuf( metakey_t mk ) {
+    return ((struct arena_slot *) mk)->key;
+}
+
+int crypto_arena_owns( metakey_t mk ) {
+    struct arena_region *r = NULL;
+    unsigned char *p = (unsigned char *) mk;
+    int owned = 0;
+
+    pthread_mutex_lock(&arena_lock);
+    for (r = arena_regions; (NULL != r) && (0 == owned); r = r->next) {
+        owned = (p >= r->base) && (p < r->base + r->len);
+    }
+    pthread_mutex_unlock(&arena_lock);
+
+    return owned;
+}
+
+int crypto_arena_locked( ) {
+    struct arena_region *r = NULL;
+    int locked = 1;
+
+    pthread_mutex_lock(&arena_lock);
+    for (r = arena_regions; NULL != r; r = r->next) {
+        locked = locked && r->locked;
+    }
+    pthread_mutex_unlock(&arena_lock);
+
+    return locked;
+}
+
+void crypto_arena_destroy( ) {
+    struct arena_region *r = NULL;
+
+    pthread_mutex_lock(&arena_lock);
+    while (NULL != arena_regions) {
+        r = arena_regions;
+        arena_regions = r->next;
+
+        /* one pass over the whole region, used or not */
+        crypto_wipe(r->base, r->len);
+        if (r->locked) {
+            munlock(r->base, r->len);
+        }
+        munmap(r->base, r->len);
+        free(r);
+    }
+    arena_free = NULL;
+    pthread_mutex_unlock(&arena_lock);
+}
+
+
+/**************************************************************************/
+/*                           internal helpers                             */
+/**************************************************************************/
+
+/* map, lock and link in a new region; called with arena_lock held */
+static struct arena_region *arena_map( ) {
+    struct arena_region *r = malloc(sizeof *r);
+
+    if (NULL == r) {
+        return NULL;
+    }
+
+    r->len  = ARENA_REGION_SIZE;
+    r->used = 0;
+    r->base = mmap(NULL, r->len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == r->base) {
+        TRACE_ERRNO("[!] arena mmap");
+
+        free(r);
+        return NULL;
+    }
+
+    r->locked = (0 == mlock(r->base, r->len));
+    if (!r->locked) {
+        TRACE_ERRNO("[!] arena mlock");
+    }
+
+#ifdef MADV_DONTDUMP
+    madvise(r->base, r->len, MADV_DONTDUMP);
+#endif
+
+    r->next = arena_regions;
+    arena_regions = r;
+
+    return r;
+}
@@ -0,0 +1,80 @@
+/**************************************************************************
+ * cryptoarena.h                                                          *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-20                                                             *
+ *                                                                        *
+ * locked slab allocator for metakeys and their key bytes                 *
+ **************************************************************************/
+
+#ifndef __CRYPTOARENA_H
+#define __CRYPTOARENA_H
+
+#include <stdlib.h>
+
+#include "config.h"
+#include "crypto.h"
+
+/**************************************************************************/
+/*                          note on the arena                             */
+/**************************************************************************/
+/*
+ * every metakey created with crypto_metakey_new is carved out of the
+ * arena: a list of ARENA_REGION_SIZE regions mapped straight from the
+ * kernel, locked into memory (mlock) and kept out of core dumps. a region
+ * is cut into ARENA_SLOT_SIZE slots; the first cache line of a slot holds
+ * the struct metakey and the rest holds up to ARENA_KEY_MAX key bytes, so
+ * each key sits on its own cache lines right next to its metakey.
+ *
+ * generating or loading a key reuses the slot's key bytes instead of
+ * allocating a new buffer, so keys never touch libgcrypt's secure memory
+ * pool and a busy keystore cannot fragment it. only keys longer than
+ * ARENA_KEY_MAX fall back to CRYPTO_MALLOC.
+ *
+ * freed slots are wiped and go on a free list. crypto_arena_destroy, run
+ * by crypto_shutdown, wipes each whole region with a single memset before
+ * unmapping it.
+ *
+ * if the arena cannot be set up, or a region cannot be locked (see
+ * RLIMIT_MEMLOCK), the allocator still works; crypto_arena_locked says
+ * whether all of it is locked.
+ */
+
+#define     ARENA_LINE_SIZE     64
+#define     ARENA_SLOT_SIZE     (ARENA_LINE_SIZE + ARENA_KEY_MAX)
+
+
+/**************************************************************************/
+/*                           arena functions                              */
+/**************************************************************************/
+
+/* crypto_arena_alloc: take a zeroed slot from the arena, mapping a new
+ *                  region if all are in use. thread safe.
+ *      arguments: none
+ *      returns: the slot's metakey_t, with mk->key pointing at the slot's
+ *                 key bytes, or NULL if no memory could be mapped
+ */
+extern metakey_t crypto_arena_alloc( void );
+
+/* crypto_arena_release: wipe a slot and put it back on the free list
+ *      arguments: a metakey_t from crypto_arena_alloc
+ */
+extern void crypto_arena_release( metakey_t );
+
+/* crypto_arena_keybuf: the key bytes belonging to an arena metakey
+ *      arguments: a metakey_t from crypto_arena_alloc
+ *      returns: a buffer of ARENA_KEY_MAX bytes
+ */
+extern unsigned char *crypto_arena_keybuf( metakey_t );
+
+/* crypto_arena_owns: check whether a metakey lives in the arena */
+extern int crypto_arena_owns( metakey_t );
+
+/* crypto_arena_locked: 1 if every region is locked into memory */
+extern int crypto_arena_locked( void );
+
+/* crypto_arena_destroy: wipe and unmap every region. all metakeys from the
+ *                  arena become invalid.
+ */
+extern void crypto_arena_destroy( void );
+
+#endif
@@ -0,0 +1,170 @@
+/**************************************************************************
+ * cryptobuf.c                                                            *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-25                                                             *
+ *                                                                        *
+ * buffer pool, see cryptobuf.h for documentation                         *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptobuf.h"
+#include "cryptosecmem.h"
+#include "debug.h"
+
+/********************************************************************
+ * bufpool_idle:                                                    *
+ *      the start of an idle buffer, linking it into the pool       *
+ ********************************************************************/
+struct bufpool_idle {
+    size_t size;
+    struct bufpool_idle *next;
+};
+
+static struct bufpool_idle *bufpool = NULL;
+static struct bufpool_stats bufpool_counters;
+static int bufpool_huge = 0;
+static pthread_mutex_t bufpool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t bufpool_round( size_t );
+static unsigned char *bufpool_map( size_t );
+
+unsigned char *crypto_buf_get( size_t size ) {
+    struct bufpool_idle **pp = NULL, *b = NULL;
+
+    size = bufpool_round(size);
+    if (0 == size) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&bufpool_lock);
+    bufpool_counters.gets++;
+    for (pp = &bufpool; NULL != *pp; pp = &(*pp)->next) {
+        if (size == (*pp)->size) {
+            b = *pp;
+            *pp = b->next;
+            bufpool_counters.reused++;
+            bufpool_counters.cached -= size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bufpool_lock);
+
+    /* an idle buffer is all zeros but for its link */
+    if (NULL != b) {
+        memset(b, 0, sizeof *b);
+        return (unsigned char *) b;
+    }
+
+    return bufpool_map(size);
+}
+
+void crypto_buf_put( unsigned char *buf, size_t size ) {
+    struct bufpool_idle *b = (struct bufpool_idle *) (void *) buf;
+
+    if (NULL == buf) {
+        return;
+    }
+
+    size = bufpool_round(size);
+    crypto_wipe(buf, size);
+
+    pthread_mutex_lock(&bufpool_lock);
+    if (bufpool_counters.cached + size <= BUFPOOL_MAX_CACHED) {
+        b->size = size;
+        b->next = bufpool;
+        bufpool = b;
+        bufpool_counters.cached += size;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&bufpool_lock);
+
+    /* the pool is full: give the buffer back to the kernel */
+    if (NULL != b) {
+        munmap(buf, size);
+    }
+}
+
+void crypto_bufpool_set_hugepages( int on ) {
+    pthread_mutex_lock(&bufpool_lock);
+    bufpool_huge = (0 != on);
+    pthread_mutex_unlock(&bufpool_lock);
+}
+
+void crypto_bufpool_stats( struct bufpool_stats *st ) {
+    pthread_mutex_lock(&bufpool_lock);
+    *st = bufpool_counters;
+    pthread_mutex_unlock(&bufpool_lock);
+}
+
+void crypto_bufpool_drain( ) {
+    struct bufpool_idle *b = NULL, *next = NULL;
+
+    pthread_mutex_lock(&bufpool_lock);
+    b = bufpool;
+    bufpool = NULL;
+    bufpool_counters.cached = 0;
+    pthread_mutex_unlock(&bufpool_lock);
+
+    for (; NULL != b; b = next) {
+        next = b->next;
+        munmap(b, b->size);
+    }
+}
+
+
+/**************************************************************************/
+/*                          internal helpers                              */
+/**************************************************************************/
+
+/* buffers come in whole pages */
+static size_t bufpool_round( size_t size ) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    if (size < sizeof(struct bufpool_idle)) {
+        size = sizeof(struct bufpool_idle);
+    }
+
+    return (size + page - 1) & ~(page - 1);
+}
+
+static unsigned char *bufpool_map( size_t size ) {
+    unsigned char *buf = NULL;
+    int locked = 0;
+
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == buf) {
+        TRACE_ERRNO("[!] buffer mmap");
+
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (bufpool_huge && (size >= BUFPOOL_HUGE_MIN)) {
+        madvise(buf, size, MADV_HUGEPAGE);
+    }
+#endif
+
+#ifdef MADV_DONTDUMP
+    madvise(buf, size, MADV_DONTDUMP);
+#endif
+
+    locked = (0 == mlock(buf, size));
+
+    pthread_mutex_lock(&bufpool_lock);
+    bufpool_counters.mapped++;
+    if (! locked) {
+        bufpool_counters.unlocked++;
+    }
+    pthread_mutex_unlock(&bufpool_lock);
+
+    return buf;
+}
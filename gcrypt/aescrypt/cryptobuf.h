@@ -0,0 +1,89 @@
+/**************************************************************************
+ * cryptobuf.h                                                            *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-25                                                             *
+ *                                                                        *
+ * pool of locked, page-aligned data buffers                              *
+ **************************************************************************/
+
+#ifndef __CRYPTOBUF_H
+#define __CRYPTOBUF_H
+
+#include <stdlib.h>
+
+#include "config.h"
+#include "crypto.h"
+
+/**************************************************************************/
+/*                        note on the buffer pool                         */
+/**************************************************************************/
+/*
+ * the chunks the streaming engine, the containers and the wipe code work
+ * on come from a pool of buffers instead of the allocator. a buffer is
+ * mapped straight from the kernel, so it is page-aligned, locked into
+ * memory (mlock) so the plaintext in it never reaches swap, and kept out
+ * of core dumps. with crypto_bufpool_set_hugepages, buffers of at least
+ * BUFPOOL_HUGE_MIN bytes are also backed by transparent huge pages.
+ *
+ * crypto_buf_put wipes a buffer and keeps it for the next crypto_buf_get
+ * of the same size, up to BUFPOOL_MAX_CACHED bytes of idle buffers; a
+ * file, or a whole run of files, therefore maps its buffers once and
+ * reuses them. idle buffers are unmapped by crypto_bufpool_drain, which
+ * crypto_shutdown calls.
+ *
+ * a buffer that can not be locked (see RLIMIT_MEMLOCK) is still handed
+ * out; crypto_bufpool_stats counts those.
+ */
+
+
+/********************************************************************
+ * bufpool_stats:                                                   *
+ *      counters of the buffer pool                                 *
+ *                                                                  *
+ * gets: buffers handed out                                         *
+ * reused: of those, buffers that were taken from the pool          *
+ * mapped: buffers mapped from the kernel                           *
+ * unlocked: mapped buffers that could not be locked                *
+ * cached: bytes of idle buffers kept in the pool                   *
+ ********************************************************************/
+struct bufpool_stats {
+    unsigned long gets;
+    unsigned long reused;
+    unsigned long mapped;
+    unsigned long unlocked;
+    size_t cached;
+};
+
+
+/**************************************************************************/
+/*                          buffer pool functions                         */
+/**************************************************************************/
+
+/* crypto_buf_get: take a zeroed buffer of at least size bytes from the
+ *                  pool, mapping a new one if none is idle. thread safe.
+ *      arguments: the size in bytes
+ *      returns: the page-aligned buffer, or NULL if none could be mapped
+ */
+extern unsigned char *crypto_buf_get( size_t );
+
+/* crypto_buf_put: wipe a buffer and give it back to the pool. thread
+ *                  safe.
+ *      arguments: a buffer from crypto_buf_get, or NULL, and the size it
+ *                 was taken with
+ */
+extern void crypto_buf_put( unsigned char *, size_t );
+
+/* crypto_bufpool_set_hugepages: back buffers of at least BUFPOOL_HUGE_MIN
+ *                  bytes mapped from now on with transparent huge pages;
+ *                  off by default.
+ *      arguments: 1 to use huge pages, 0 not to
+ */
+extern void crypto_bufpool_set_hugepages( int );
+
+/* crypto_bufpool_stats: fill in the pool's counters */
+extern void crypto_bufpool_stats( struct bufpool_stats * );
+
+/* crypto_bufpool_drain: unmap every idle buffer */
+extern void crypto_bufpool_drain( void );
+
+#endif
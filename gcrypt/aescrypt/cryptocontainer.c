@@ -0,0 +1,658 @@
+/**************************************************************************
+ * cryptocontainer.c                                                      *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-17                                                             *
+ *                                                                        *
+ * seekable encrypted container, see cryptocontainer.h                    *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptobuf.h"
+#include "cryptocontainer.h"
+#include "cryptofile.h"
+#include "cryptoprofile.h"
+#include "cryptostream.h"
+#include "cryptoutil.h"
+#include "metakey.h"
+#include "debug.h"
+
+/********************************************************************
+ * container:                                                       *
+ *      state of an open container                                  *
+ *                                                                  *
+ * fd: the container file                                           *
+ * mk: the container's key                                          *
+ * hd: GCM handle taken from mk                                     *
+ * hdr: the parsed header                                           *
+ * nchunks: number of index entries                                 *
+ * size: total plaintext size                                       *
+ * index: the verified raw index                                    *
+ * buf: one chunk of plaintext                                      *
+ ********************************************************************/
+struct container {
+    int fd;
+    metakey_t mk;
+    gcry_cipher_hd_t hd;
+    struct stream_header hdr;
+    uint64_t nchunks;
+    uint64_t size;
+    unsigned char *index;
+    unsigned char *buf;
+};
+
+/* decoded index entry */
+struct container_entry {
+    uint64_t data_off;
+    uint64_t plain_off;
+    uint32_t len;
+    uint32_t flags;
+    unsigned char iv[CONTAINER_IV_LEN];
+    unsigned char tag[CONTAINER_TAG_LEN];
+};
+
+static void entry_pack( const struct container_entry *, unsigned char * );
+static void entry_unpack( const unsigned char *, struct container_entry * );
+static void chunk_aad( unsigned char *, uint64_t, uint32_t );
+static void index_iv( const struct stream_header *, unsigned char * );
+static int chunk_is_hole( container_t, uint64_t );
+
+int crypto_is_container( const struct stream_header *hdr ) {
+    return 0 != (hdr->flags & STREAM_FLAG_INDEXED);
+}
+
+
+/**************************************************************************/
+/*                                writer                                  */
+/**************************************************************************/
+
+crypto_return_t crypto_container_encrypt_file( const char *infile,
+        const char *outfile, metakey_t mk ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    struct stream_header hdr;
+    struct container_entry ent;
+    gcry_cipher_hd_t hd = NULL;
+    FILE *in = NULL, *out = NULL;
+    unsigned char raw_hdr[STREAM_HEADER_LEN];
+    unsigned char trailer[CONTAINER_TRAILER_LEN];
+    unsigned char aad[12];
+    unsigned char *buf = NULL, *index = NULL, *tmp = NULL;
+    size_t chunk = crypto_stream_chunk_size();
+    size_t index_cap = 0, rd = 0;
+    uint64_t nchunks = 0, plain_off = 0;
+    uint64_t data_off = STREAM_HEADER_LEN;
+    struct stat st;
+    off_t size = 0, data = 0, hole = 0;
+    int fd = -1, in_hole = 0;
+    gcry_error_t err = 0;
+    uint64_t began = 0, stage = 0;
+
+    if ((NULL == mk) || (1 != mk->initialised)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    /* the reader would refuse the container, and the data with it */
+    if (chunk > CONTAINER_MAX_CHUNK) {
+        TRACE_ERROR("[!] chunks of a container are limited to ");
+        TRACE_ERROR("%d bytes!\n", CONTAINER_MAX_CHUNK);
+
+        return CRYPTO_FAILURE;
+    }
+
+    if (KEY_SUCCESS != crypto_cipher_get(mk, GCRY_CIPHER_MODE_GCM, &hd)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    memset(&hdr, 0, sizeof hdr);
+    hdr.version     = STREAM_VERSION;
+    hdr.algo        = (unsigned char) mk->algo;
+    hdr.mode        = GCRY_CIPHER_MODE_GCM;
+    hdr.flags       = STREAM_FLAG_INDEXED;
+    hdr.chunk_size  = chunk;
+    gcry_create_nonce(hdr.iv, CONTAINER_NONCE_LEN);
+    stream_header_pack(&hdr, raw_hdr);
+
+    buf = crypto_buf_get(chunk);
+    in  = stream_fopen(infile, "rb");
+    if ((NULL == buf) || (NULL == in) ||
+            (CRYPTO_SUCCESS != stream_check_output(fileno(in), outfile))) {
+        goto out;
+    }
+
+    out = stream_fopen(outfile, "w+b");
+    if (NULL == out) {
+        goto out;
+    }
+
+    if (STREAM_HEADER_LEN != fwrite(raw_hdr, 1, STREAM_HEADER_LEN, out)) {
+        goto out;
+    }
+
+    /* a regular file is read by offset, so that chunks falling entirely
+     * into holes can be skipped without reading their zeros */
+    if ((0 == fstat(fileno(in), &st)) && S_ISREG(st.st_mode)) {
+        fd   = fileno(in);
+        size = st.st_size;
+    }
+
+    for (;;) {
+        PROFILE_START(stage);
+        if (-1 == fd) {
+            rd = fread(buf, 1, chunk, in);
+        } else {
+            rd = ((uint64_t) size - plain_off < chunk) ?
+                (size_t) ((uint64_t) size - plain_off) : chunk;
+            if ((rd > 0) && ((off_t) plain_off >= hole) &&
+                    (! crypto_file_extent(fd, (off_t) plain_off, size, &data,
+                                          &hole))) {
+                data = hole = size;
+            }
+
+            in_hole = (data >= (off_t) (plain_off + rd));
+            if ((rd > 0) && (! in_hole) && (0 != full_pread(fd, buf, rd,
+                            (off_t) plain_off))) {
+                TRACE_ERRNO("[!] pread");
+
+                goto out;
+            }
+        }
+        PROFILE_END(PROFILE_READ, stage, in_hole ? 0 : rd);
+
+        if (0 == rd) {
+            break;
+        }
+        crypto_profile_inflight(1);
+
+        if (nchunks == CONTAINER_MAX_CHUNKS) {
+            TRACE_ERROR("[!] input too large for the chunk size!\n");
+
+            goto out;
+        }
+
+        /* grow the in-memory index geometrically */
+        if ((nchunks + 1) * CONTAINER_ENTRY_LEN > index_cap) {
+            index_cap = (0 == index_cap) ? 64 * CONTAINER_ENTRY_LEN
+                                         : 2 * index_cap;
+            tmp = realloc(index, index_cap);
+            if (NULL == tmp) {
+                goto out;
+            }
+            index = tmp;
+        }
+
+        memset(&ent, 0, sizeof ent);
+        ent.data_off  = data_off;
+        ent.plain_off = plain_off;
+        ent.len       = (uint32_t) rd;
+        ent.flags     = in_hole ? CONTAINER_CHUNK_HOLE : 0;
+        memcpy(ent.iv, hdr.iv, CONTAINER_NONCE_LEN);
+        put_be32(ent.iv + CONTAINER_NONCE_LEN, (uint32_t) nchunks);
+        chunk_aad(aad, ent.plain_off, ent.len);
+
+        TRACE_START(began);
+        PROFILE_START(stage);
+        err = gcry_cipher_setiv(hd, ent.iv, CONTAINER_IV_LEN);
+        if (0 == err) {
+            err = gcry_cipher_authenticate(hd, aad, sizeof aad);
+        }
+        if ((0 == err) && (! in_hole)) {
+            err = gcry_cipher_encrypt(hd, buf, rd, NULL, 0);
+        }
+        if (0 == err) {
+            err = gcry_cipher_gettag(hd, ent.tag, CONTAINER_TAG_LEN);
+        }
+        PROFILE_END(PROFILE_CIPHER, stage, rd);
+        TRACE_END(TRACE_CHUNK, began);
+        if (0 != err) {
+            TRACE_ERROR("[!] cipher error: %s\n", gcry_strerror(err));
+
+            goto out;
+        }
+
+        PROFILE_START(stage);
+        if ((! in_hole) && (rd != fwrite(buf, 1, rd, out))) {
+            goto out;
+        }
+        PROFILE_END(PROFILE_WRITE, stage, in_hole ? 0 : rd);
+
+        entry_pack(&ent, index + nchunks * CONTAINER_ENTRY_LEN);
+        ++nchunks;
+        plain_off += rd;
+        if (! in_hole) {
+            data_off += rd;
+        }
+
+        if (rd < chunk) {
+            break;
+        }
+    }
+
+    if (0 != ferror(in)) {
+        TRACE_ERRNO("[!] fread");
+
+        goto out;
+    }
+
+    /* index, then the trailer with the tag binding everything together */
+    memset(trailer, 0, sizeof trailer);
+    memcpy(trailer, CONTAINER_TRAILER_MAGIC, 4);
+    put_be64(trailer + 8, nchunks);
+    put_be64(trailer + 16, plain_off);
+    put_be64(trailer + 24, data_off);
+
+    {
+        unsigned char iv[CONTAINER_IV_LEN];
+
+        index_iv(&hdr, iv);
+        err = gcry_cipher_setiv(hd, iv, CONTAINER_IV_LEN);
+        if (0 == err) {
+            err = gcry_cipher_authenticate(hd, raw_hdr, STREAM_HEADER_LEN);
+        }
+        if ((0 == err) && (nchunks > 0)) {
+            err = gcry_cipher_authenticate(hd, index,
+                    nchunks * CONTAINER_ENTRY_LEN);
+        }
+        if (0 == err) {
+            err = gcry_cipher_authenticate(hd, trailer, 32);
+        }
+        if (0 == err) {
+            err = gcry_cipher_gettag(hd, trailer + 32, CONTAINER_TAG_LEN);
+        }
+        if (0 != err) {
+            goto out;
+        }
+    }
+
+    if ((nchunks > 0) && (nchunks != fwrite(index, CONTAINER_ENTRY_LEN,
+                    nchunks, out))) {
+        goto out;
+    }
+
+    if (CONTAINER_TRAILER_LEN != fwrite(trailer, 1, CONTAINER_TRAILER_LEN,
+                out)) {
+        goto out;
+    }
+
+    result = CRYPTO_SUCCESS;
+
+out:
+    if (NULL != out) {
+        if (CRYPTO_SUCCESS != stream_fclose_out(out)) {
+            result = CRYPTO_FAILURE;
+        }
+    }
+    if (NULL != in) {
+        stream_fclose(in);
+    }
+    crypto_buf_put(buf, chunk);
+    free(index);
+    crypto_cipher_put(mk, hd);
+
+    return result;
+}
+
+
+/**************************************************************************/
+/*                                reader                                  */
+/**************************************************************************/
+
+crypto_return_t crypto_container_open( const char *filename, metakey_t mk,
+        container_t *cp ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    container_t c = NULL;
+    unsigned char raw_hdr[STREAM_HEADER_LEN];
+    unsigned char trailer[CONTAINER_TRAILER_LEN];
+    unsigned char iv[CONTAINER_IV_LEN];
+    struct stat st;
+    uint64_t index_off = 0, index_len = 0;
+    gcry_error_t err = 0;
+
+    *cp = NULL;
+    if ((NULL == mk) || (1 != mk->initialised)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    c = calloc(1, sizeof *c);
+    if (NULL == c) {
+        return result;
+    }
+
+    c->fd = open(filename, O_RDONLY);
+    if (-1 == c->fd) {
+        TRACE_ERROR("[!] error opening %s!\n", filename);
+        TRACE_ERRNO("open");
+
+        free(c);
+        return result;
+    }
+
+    if ((-1 == fstat(c->fd, &st)) || (0 != full_pread(c->fd, raw_hdr,
+                    STREAM_HEADER_LEN, 0))) {
+        goto fail;
+    }
+
+    result = stream_header_unpack(raw_hdr, &c->hdr);
+    if (CRYPTO_SUCCESS != result) {
+        goto fail;
+    }
+
+    result = CRYPTO_BAD_FORMAT;
+    if (!crypto_is_container(&c->hdr) ||
+            (GCRY_CIPHER_MODE_GCM != c->hdr.mode) ||
+            (mk->algo != c->hdr.algo) || (0 == c->hdr.chunk_size) ||
+            (c->hdr.chunk_size > CONTAINER_MAX_CHUNK) ||
+            (st.st_size < STREAM_HEADER_LEN + CONTAINER_TRAILER_LEN)) {
+        TRACE_ERROR("[!] %s is not a container for this key!\n",
+                    filename);
+
+        goto fail;
+    }
+
+    if (0 != full_pread(c->fd, trailer, CONTAINER_TRAILER_LEN,
+                st.st_size - CONTAINER_TRAILER_LEN)) {
+        result = CRYPTO_FAILURE;
+        goto fail;
+    }
+
+    c->nchunks = get_be64(trailer + 8);
+    c->size    = get_be64(trailer + 16);
+    index_off  = get_be64(trailer + 24);
+    index_len  = c->nchunks * CONTAINER_ENTRY_LEN;
+
+    /* the index has to end exactly where the trailer starts */
+    if ((0 != memcmp(trailer, CONTAINER_TRAILER_MAGIC, 4)) ||
+            (c->nchunks > CONTAINER_MAX_CHUNKS) ||
+            (index_off < STREAM_HEADER_LEN) ||
+            (index_off + index_len + CONTAINER_TRAILER_LEN !=
+             (uint64_t) st.st_size)) {
+        TRACE_ERROR("[!] %s: damaged container trailer!\n", filename);
+
+        goto fail;
+    }
+
+    c->index = malloc(index_len + 1);
+    c->buf   = crypto_buf_get(c->hdr.chunk_size);
+    if ((NULL == c->index) || (NULL == c->buf)) {
+        result = CRYPTO_FAILURE;
+        goto fail;
+    }
+
+    if (0 != full_pread(c->fd, c->index, index_len, (off_t) index_off)) {
+        result = CRYPTO_FAILURE;
+        goto fail;
+    }
+
+    c->mk = mk;
+    if (KEY_SUCCESS != crypto_cipher_get(mk, GCRY_CIPHER_MODE_GCM,
+                &c->hd)) {
+        result = CRYPTO_NOT_INIT;
+        goto fail;
+    }
+
+    /* verify the index before trusting a single offset in it */
+    index_iv(&c->hdr, iv);
+    err = gcry_cipher_setiv(c->hd, iv, CONTAINER_IV_LEN);
+    if (0 == err) {
+        err = gcry_cipher_authenticate(c->hd, raw_hdr, STREAM_HEADER_LEN);
+    }
+    if ((0 == err) && (index_len > 0)) {
+        err = gcry_cipher_authenticate(c->hd, c->index, index_len);
+    }
+    if (0 == err) {
+        err = gcry_cipher_authenticate(c->hd, trailer, 32);
+    }
+    if (0 == err) {
+        err = gcry_cipher_checktag(c->hd, trailer + 32, CONTAINER_TAG_LEN);
+    }
+    if (0 != err) {
+        TRACE_ERROR("[!] %s: container index does not verify!\n",
+                    filename);
+
+        result = CRYPTO_AUTH_FAILURE;
+        goto fail;
+    }
+
+    *cp = c;
+    return CRYPTO_SUCCESS;
+
+fail:
+    crypto_container_close(c);
+    return result;
+}
+
+crypto_return_t crypto_container_read( container_t c, unsigned char *out,
+        size_t len, uint64_t offset, size_t *nread ) {
+    struct container_entry ent;
+    unsigned char aad[12];
+    uint64_t end = 0, i = 0, last = 0;
+    uint64_t from = 0, to = 0;
+    gcry_error_t err = 0;
+    uint64_t began = 0, stage = 0;
+
+    *nread = 0;
+    if ((offset >= c->size) || (0 == len)) {
+        return CRYPTO_SUCCESS;
+    }
+
+    end = offset + len;
+    if ((end < offset) || (end > c->size)) {
+        end = c->size;
+    }
+
+    last = (end - 1) / c->hdr.chunk_size;
+    for (i = offset / c->hdr.chunk_size; i <= last; ++i) {
+        entry_unpack(c->index + i * CONTAINER_ENTRY_LEN, &ent);
+
+        if ((ent.plain_off != i * c->hdr.chunk_size) ||
+                (ent.len > c->hdr.chunk_size) ||
+                (0 != (ent.flags & ~(uint32_t) CONTAINER_CHUNK_HOLE))) {
+            return CRYPTO_BAD_FORMAT;
+        }
+
+        /* a hole has no ciphertext, only its tag */
+        crypto_profile_inflight(1);
+        PROFILE_START(stage);
+        if (ent.flags & CONTAINER_CHUNK_HOLE) {
+            memset(c->buf, 0, ent.len);
+        } else if (0 != full_pread(c->fd, c->buf, ent.len,
+                    (off_t) ent.data_off)) {
+            return CRYPTO_FAILURE;
+        }
+        PROFILE_END(PROFILE_READ, stage,
+                (ent.flags & CONTAINER_CHUNK_HOLE) ? 0 : ent.len);
+
+        /* decrypt and verify in the same pass; nothing leaves c->buf
+         * unless the tag matched */
+        chunk_aad(aad, ent.plain_off, ent.len);
+        TRACE_START(began);
+        PROFILE_START(stage);
+        err = gcry_cipher_setiv(c->hd, ent.iv, CONTAINER_IV_LEN);
+        if (0 == err) {
+            err = gcry_cipher_authenticate(c->hd, aad, sizeof aad);
+        }
+        if ((0 == err) && (! (ent.flags & CONTAINER_CHUNK_HOLE))) {
+            err = gcry_cipher_decrypt(c->hd, c->buf, ent.len, NULL, 0);
+        }
+        if (0 == err) {
+            err = gcry_cipher_checktag(c->hd, ent.tag, CONTAINER_TAG_LEN);
+        }
+        PROFILE_END(PROFILE_CIPHER, stage, ent.len);
+        TRACE_END(TRACE_CHUNK, began);
+        if (0 != err) {
+            TRACE_ERROR("[!] chunk %lu failed to verify!\n",
+                        (unsigned long) i);
+
+            memset(c->buf, 0, c->hdr.chunk_size);
+            return CRYPTO_AUTH_FAILURE;
+        }
+
+        from = (offset > ent.plain_off) ? offset - ent.plain_off : 0;
+        to   = ent.len;
+        if (ent.plain_off + to > end) {
+            to = end - ent.plain_off;
+        }
+
+        memcpy(out + *nread, c->buf + from, (size_t) (to - from));
+        *nread += (size_t) (to - from);
+    }
+
+    return CRYPTO_SUCCESS;
+}
+
+uint64_t crypto_container_size( container_t c ) {
+    return c->size;
+}
+
+void crypto_container_close( container_t c ) {
+    if (NULL == c) {
+        return;
+    }
+
+    crypto_buf_put(c->buf, c->hdr.chunk_size);
+    crypto_cipher_put(c->mk, c->hd);
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    free(c->index);
+    free(c);
+}
+
+crypto_return_t crypto_container_decrypt_file( const char *infile,
+        const char *outfile, metakey_t mk, uint64_t offset,
+        uint64_t length ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    container_t c = NULL;
+    FILE *out = NULL;
+    unsigned char *buf = NULL;
+    size_t chunk = 0, n = 0, want = 0;
+    uint64_t pos = offset, end = 0, stage = 0;
+    struct stat st;
+    int sparse = 0, skipped = 0;
+
+    result = crypto_container_open(infile, mk, &c);
+    if (CRYPTO_SUCCESS != result) {
+        return result;
+    }
+
+    end = c->size;
+    if ((length < end) && (offset + length >= offset) &&
+            (offset + length < end)) {
+        end = offset + length;
+    }
+
+    chunk = c->hdr.chunk_size;
+    buf = crypto_buf_get(chunk);
+    if ((NULL == buf) || (CRYPTO_SUCCESS != stream_check_output(c->fd,
+                    outfile))) {
+        result = CRYPTO_FAILURE;
+        goto out;
+    }
+
+    out = stream_fopen(outfile, "w+b");
+    if (NULL == out) {
+        result = CRYPTO_FAILURE;
+        goto out;
+    }
+
+    /* holes are recreated by seeking over them in a regular file */
+    sparse = (0 == fstat(fileno(out), &st)) && S_ISREG(st.st_mode);
+
+    /* one chunk at a time, so each piece is all hole or all data */
+    while (pos < end) {
+        want = chunk - (size_t) (pos % chunk);
+        if ((uint64_t) want > end - pos) {
+            want = (size_t) (end - pos);
+        }
+
+        result = crypto_container_read(c, buf, want, pos, &n);
+        if ((CRYPTO_SUCCESS != result) || (0 == n)) {
+            break;
+        }
+
+        PROFILE_START(stage);
+        if (sparse && chunk_is_hole(c, pos / chunk)) {
+            if (0 != fseeko(out, (off_t) n, SEEK_CUR)) {
+                result = CRYPTO_FAILURE;
+                break;
+            }
+            skipped = 1;
+        } else if (n != fwrite(buf, 1, n, out)) {
+            result = CRYPTO_FAILURE;
+            break;
+        } else {
+            PROFILE_END(PROFILE_WRITE, stage, n);
+        }
+        pos += n;
+    }
+
+    /* a trailing hole only exists once the file has its full length */
+    if ((CRYPTO_SUCCESS == result) && skipped && ((0 != fflush(out)) ||
+                (0 != ftruncate(fileno(out), (off_t) (pos - offset))))) {
+        result = CRYPTO_FAILURE;
+    }
+
+out:
+    if (NULL != out) {
+        if (CRYPTO_SUCCESS != stream_fclose_out(out)) {
+            result = CRYPTO_FAILURE;
+        }
+    }
+    crypto_buf_put(buf, chunk);
+    crypto_container_close(c);
+
+    return result;
+}
+
+
+/**************************************************************************/
+/*                           internal helpers                             */
+/**************************************************************************/
+
+static void entry_pack( const struct container_entry *ent,
+        unsigned char *p ) {
+    memset(p, 0, CONTAINER_ENTRY_LEN);
+    put_be64(p, ent->data_off);
+    put_be64(p + 8, ent->plain_off);
+    put_be32(p + 16, ent->len);
+    put_be32(p + 20, ent->flags);
+    memcpy(p + 24, ent->iv, CONTAINER_IV_LEN);
+    memcpy(p + 40, ent->tag, CONTAINER_TAG_LEN);
+}
+
+static void entry_unpack( const unsigned char *p,
+        struct container_entry *ent ) {
+    ent->data_off  = get_be64(p);
+    ent->plain_off = get_be64(p + 8);
+    ent->len       = get_be32(p + 16);
+    ent->flags     = get_be32(p + 20);
+    memcpy(ent->iv, p + 24, CONTAINER_IV_LEN);
+    memcpy(ent->tag, p + 40, CONTAINER_TAG_LEN);
+}
+
+/* a chunk's additional authenticated data: where it belongs */
+static void chunk_aad( unsigned char *aad, uint64_t plain_off,
+        uint32_t len ) {
+    put_be64(aad, plain_off);
+    put_be32(aad + 8, len);
+}
+
+static void index_iv( const struct stream_header *hdr, unsigned char *iv ) {
+    memcpy(iv, hdr->iv, CONTAINER_NONCE_LEN);
+    put_be32(iv + CONTAINER_NONCE_LEN, 0xffffffffUL);
+}
+
+static int chunk_is_hole( container_t c, uint64_t i ) {
+    return 0 != (get_be32(c->index + i * CONTAINER_ENTRY_LEN + 20) &
+                 CONTAINER_CHUNK_HOLE);
+}
@@ -0,0 +1,154 @@
+/**************************************************************************
+ * cryptocontainer.h                                                      *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-17                                                             *
+ *                                                                        *
+ * seekable, chunk-indexed encrypted container format                     *
+ **************************************************************************/
+
+#ifndef __CRYPTOCONTAINER_H
+#define __CRYPTOCONTAINER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptostream.h"
+#include "metakey.h"
+
+/**************************************************************************/
+/*                        container file format                           */
+/**************************************************************************/
+/*
+ * a container starts with the usual stream header (see cryptostream.h)
+ * with mode GCM and STREAM_FLAG_INDEXED set. the first CONTAINER_NONCE_LEN
+ * bytes of the header's iv field are a random per-file nonce.
+ *
+ * the header is followed by the chunks, each encrypted on its own with
+ * AES-GCM, then by the chunk index and a fixed size trailer:
+ *
+ *      header | chunk 0 | chunk 1 | ... | chunk n-1 | index | trailer
+ *
+ * chunk i holds plaintext bytes [i * chunk_size, (i + 1) * chunk_size);
+ * only the last chunk may be shorter. its IV is the file nonce followed by
+ * i as a 32-bit big endian integer, and its additional authenticated data
+ * is its plaintext offset (64 bits) and length (32 bits), so chunks can be
+ * neither modified nor moved.
+ *
+ * a chunk that lies entirely in a hole of a sparse input file (see
+ * crypto_file_extent) has CONTAINER_CHUNK_HOLE set and no ciphertext: its
+ * tag covers only the additional authenticated data, and it reads back as
+ * zeros. the writer skips reading it and the decrypter seeks over it, so a
+ * sparse file stays sparse. like the plaintext size, which chunks are
+ * holes is visible without the key.
+ *
+ * index entry, CONTAINER_ENTRY_LEN bytes (big endian):
+ *      offset  size    field
+ *      0       8       file offset of the chunk's ciphertext
+ *      8       8       plaintext offset of the chunk
+ *      16      4       plaintext (and ciphertext) length
+ *      20      4       chunk flags, 0 or CONTAINER_CHUNK_HOLE
+ *      24      12      GCM IV
+ *      36      4       reserved, must be 0
+ *      40      16      GCM tag
+ *      56      8       reserved, must be 0
+ *
+ * trailer, CONTAINER_TRAILER_LEN bytes, at the very end of the file:
+ *      0       4       magic, "AESI"
+ *      4       4       reserved, must be 0
+ *      8       8       number of index entries
+ *      16      8       total plaintext size
+ *      24      8       file offset of the index
+ *      32      16      GCM tag over header, index, and trailer bytes 0-31
+ *
+ * the index tag uses the IV nonce || 0xffffffff, which no chunk can use,
+ * and authenticates the whole layout: a reader that has verified it can
+ * trust the index to find any chunk without reading the others.
+ *
+ * the writer keeps the index in memory until the end of the data, i.e.
+ * CONTAINER_ENTRY_LEN bytes per chunk. chunks are at most
+ * CONTAINER_MAX_CHUNK bytes, the largest buffer a reader will allocate.
+ */
+#define     CONTAINER_NONCE_LEN     8
+#define     CONTAINER_IV_LEN        12
+#define     CONTAINER_TAG_LEN       16
+#define     CONTAINER_ENTRY_LEN     64
+#define     CONTAINER_TRAILER_LEN   48
+#define     CONTAINER_TRAILER_MAGIC "AESI"
+#define     CONTAINER_MAX_CHUNKS    0xffffffffUL
+#define     CONTAINER_MAX_CHUNK     (256 * 1024 * 1024)
+#define     CONTAINER_CHUNK_HOLE    0x01
+
+/********************************************************************
+ * container_t:                                                     *
+ *      an open container, ready for random access reads. opaque.   *
+ ********************************************************************/
+typedef struct container * container_t;
+
+
+/**************************************************************************/
+/*                          container functions                           */
+/**************************************************************************/
+
+/* crypto_container_encrypt_file: encrypt a file into the container format.
+ *                  the input is read sequentially, so it may be a pipe; a
+ *                  NULL or "-" filename selects stdin / stdout.
+ *      arguments: the input filename, the output filename, the metakey_t.
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE (also if the chunk size is
+ *                 above CONTAINER_MAX_CHUNK), or CRYPTO_NOT_INIT
+ */
+extern crypto_return_t crypto_container_encrypt_file( const char *,
+                                                      const char *,
+                                                      metakey_t );
+
+/* crypto_container_open: open a container and verify its index. only the
+ *                  header, index, and trailer are read.
+ *      arguments: the container filename (must be seekable), the
+ *                 metakey_t, and the container_t to fill in.
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE on I/O errors,
+ *                 CRYPTO_BAD_FORMAT if the file is not a container for
+ *                 this key, or CRYPTO_AUTH_FAILURE if the index does not
+ *                 verify.
+ */
+extern crypto_return_t crypto_container_open( const char *, metakey_t,
+                                              container_t * );
+
+/* crypto_container_read: decrypt the plaintext range [offset, offset +
+ *                  length) into buf. only the chunks that overlap the
+ *                  range are read, and each is verified before any of it
+ *                  is copied out. reads past the end are truncated.
+ *      arguments: the container_t, the output buffer, the length, the
+ *                 plaintext offset, and a size_t * set to the number of
+ *                 bytes stored in buf.
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE, or CRYPTO_AUTH_FAILURE if
+ *                 a chunk has been tampered with.
+ */
+extern crypto_return_t crypto_container_read( container_t, unsigned char *,
+                                              size_t, uint64_t, size_t * );
+
+/* crypto_container_size: plaintext size of an open container */
+extern uint64_t crypto_container_size( container_t );
+
+/* crypto_container_close: release a container and wipe its buffers */
+extern void crypto_container_close( container_t );
+
+/* crypto_container_decrypt_file: decrypt a container, or the range
+ *                  [offset, offset + length) of it, into a file.
+ *      arguments: the container filename, the output filename (NULL or
+ *                 "-" for stdout), the metakey_t, the plaintext offset,
+ *                 and the length (UINT64_MAX for "to the end").
+ *      returns: see crypto_container_open and crypto_container_read.
+ */
+extern crypto_return_t crypto_container_decrypt_file( const char *,
+                                                      const char *,
+                                                      metakey_t, uint64_t,
+                                                      uint64_t );
+
+/* crypto_is_container: check whether a parsed stream header describes a
+ *                  container rather than a plain CTR stream.
+ */
+extern int crypto_is_container( const struct stream_header * );
+
+#endif
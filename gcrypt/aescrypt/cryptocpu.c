@@ -0,0 +1,99 @@
+/**************************************************************************
+ * cryptocpu.c                                                            *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-29                                                             *
+ *                                                                        *
+ * CPU feature detection, see cryptocpu.h                                 *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptocpu.h"
+#include "debug.h"
+
+/********************************************************************
+ * cpu_flag:                                                        *
+ *      a libgcrypt hardware flag and the feature it provides       *
+ ********************************************************************/
+struct cpu_flag {
+    const char *hwf;
+    unsigned int feature;
+};
+
+static const struct cpu_flag cpu_flags[] = {
+    { "intel-aesni",            CPU_AES },
+    { "intel-pclmul",           CPU_CLMUL },
+    { "intel-vaes-vpclmul",     CPU_VAES },
+    { "intel-avx2",             CPU_SIMD },
+    { "arm-aes",                CPU_AES },
+    { "arm-pmull",              CPU_CLMUL },
+    { "arm-neon",               CPU_SIMD },
+    { "ppc-vcrypto",            CPU_AES | CPU_CLMUL | CPU_SIMD },
+    { NULL,                     0 }
+};
+
+static const char *cpu_names[] = { "aes", "clmul", "vaes", "simd" };
+
+static unsigned int cpu_features = 0;
+
+unsigned int crypto_cpu_detect( ) {
+    char *list = NULL, *flag = NULL, *save = NULL;
+    char desc[64];
+    size_t i = 0;
+
+    cpu_features = 0;
+
+    /* "hwflist:flag:flag:...:" */
+    list = gcry_get_config(0, "hwflist");
+    if (NULL == list) {
+        TRACE_INFO("[+] no hardware acceleration found\n");
+
+        return cpu_features;
+    }
+
+    for (flag = strtok_r(list, ":\n", &save); NULL != flag;
+            flag = strtok_r(NULL, ":\n", &save)) {
+        for (i = 0; NULL != cpu_flags[i].hwf; ++i) {
+            if (0 == strcmp(flag, cpu_flags[i].hwf)) {
+                cpu_features |= cpu_flags[i].feature;
+            }
+        }
+    }
+    gcry_free(list);
+
+    TRACE_INFO("[+] CPU features: %s\n",
+               crypto_cpu_describe(cpu_features, desc, sizeof desc));
+
+    return cpu_features;
+}
+
+unsigned int crypto_cpu_features( ) {
+    return cpu_features;
+}
+
+char *crypto_cpu_describe( unsigned int features, char *buf, size_t len ) {
+    size_t i = 0, used = 0;
+
+    if (0 == len) {
+        return buf;
+    }
+
+    buf[0] = '\0';
+    for (i = 0; i < sizeof cpu_names / sizeof *cpu_names; ++i) {
+        if ((features & (1U << i)) && (used < len)) {
+            used += (size_t) snprintf(buf + used, len - used, "%s%s",
+                                      (0 == used) ? "" : " ", cpu_names[i]);
+        }
+    }
+
+    if (0 == used) {
+        snprintf(buf, len, "none");
+    }
+
+    return buf;
+}
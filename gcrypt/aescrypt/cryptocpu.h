@@ -0,0 +1,61 @@
+/**************************************************************************
+ * cryptocpu.h                                                            *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-29                                                             *
+ *                                                                        *
+ * CPU features the cipher implementations can use                        *
+ **************************************************************************/
+
+#ifndef __CRYPTOCPU_H
+#define __CRYPTOCPU_H
+
+#include <stdlib.h>
+
+#include "config.h"
+#include "crypto.h"
+
+/**************************************************************************/
+/*                       note on feature detection                        */
+/**************************************************************************/
+/*
+ * the features are not read with cpuid directly but taken from the
+ * hardware flags libgcrypt detected for itself (its "hwflist"), so they
+ * are what the cipher code will actually use: they cover x86, ARM and
+ * POWER alike, and honour flags disabled in /etc/gcrypt/hwf.deny.
+ *
+ * CPU_AES: AES rounds in hardware (AES-NI, ARMv8 AES, POWER vcrypto).
+ *          without it AES runs from tables and is slower, and not
+ *          constant time.
+ * CPU_CLMUL: carry-less multiply (PCLMULQDQ, PMULL), which GHASH and so
+ *          GCM need to be fast and constant time.
+ * CPU_VAES: AES and carry-less multiply on wide vectors (VAES with
+ *          VPCLMULQDQ), for several blocks per instruction.
+ * CPU_SIMD: wide integer vectors (AVX2, NEON), which ChaCha20 and
+ *          Poly1305 run on.
+ */
+#define     CPU_AES                 0x01
+#define     CPU_CLMUL               0x02
+#define     CPU_VAES                0x04
+#define     CPU_SIMD                0x08
+
+
+/**************************************************************************/
+/*                             cpu functions                              */
+/**************************************************************************/
+
+/* crypto_cpu_detect: look up the CPU features. called by crypto_init, and
+ *                  only meaningful once libgcrypt is initialised.
+ *      returns: the CPU_* flags found
+ */
+extern unsigned int crypto_cpu_detect( void );
+
+/* crypto_cpu_features: the CPU_* flags found by crypto_cpu_detect */
+extern unsigned int crypto_cpu_features( void );
+
+/* crypto_cpu_describe: list the CPU_* flags as text, e.g. "aes clmul"
+ *      arguments: the flags, a buffer and its size
+ *      returns: the buffer
+ */
+extern char *crypto_cpu_describe( unsigned int, char *, size_t );
+
+#endif
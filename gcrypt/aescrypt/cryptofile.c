@@ -6,8 +6,13 @@
  * cryptographic file functions                                           *
  **************************************************************************/
 
+#define _GNU_SOURCE             /* SEEK_DATA, SEEK_HOLE */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,125 +20,228 @@
 
 #include "config.h"
 #include "crypto.h"
+#include "cryptobuf.h"
 #include "cryptofile.h"
+#include "cryptorand.h"
+#include "cryptoutil.h"
 #include "debug.h"
 
+const wipe_pattern_t wipe_dod[3] = { WIPE_ZEROS, WIPE_ONES, WIPE_RANDOM };
+
+static size_t wipe_passes = WIPE_PASSES;
+static wipe_pattern_t wipe_patterns[WIPE_MAX_PATTERNS] = { WIPE_RANDOM };
+static size_t wipe_npatterns = 1;
+
 crypto_key_return_t crypto_wipe_file(const char *filename, size_t passes) {
     crypto_key_return_t result = KEY_FAILURE;
-    FILE *kf = NULL;
     struct stat kf_stat;
-    unsigned char *rdata = NULL;    /* random data buffer */
-    size_t file_size = 0;
-    size_t wipe_buf_size = 0;   /* amount of random chars to gen each round */
-    size_t rounds    = 1;       /* needed to handle secure mem */
-    size_t i = 0, j = 0;        /* loop counters */
-
-    /* use stat to get file size */
-    TRACEOUT_1("[+] stat'ing %s...\n", filename);
-    if (-1 == stat(filename, &kf_stat)) {
-#ifdef DEBUG
-        perror("[!] stat");
-#endif
+    randstream_t rs = NULL;
+    unsigned char *rdata = NULL;    /* wipe data buffer */
+    int fd = -1;
+
+    if (0 == passes) {
+        passes = wipe_passes;
+    }
+
+    /* no O_TRUNC: the point is to overwrite the blocks the file has */
+    TRACE_DEBUG("[+] opening %s...\n", filename);
+    fd = open(filename, O_WRONLY);
+    if (-1 == fd) {
+        TRACE_ERROR("[!] could not open %s!\n", filename);
+        TRACE_ERRNO("open");
         return result;
     }
 
-    LOG("[+] stat complete!\n");
+    if (-1 == fstat(fd, &kf_stat)) {
+        TRACE_ERRNO("[!] fstat");
+        close(fd);
+        return result;
+    }
 
-    /* compute number of rounds and the size of the random data buffer
-     * that will be written to the file */
-    file_size = (size_t) kf_stat.st_size;
-#if SECURE_MEM != 0
-    rounds = (file_size / (SECURE_MEM / 5)) + 1;
-    wipe_buf_size = (SECURE_MEM / 5);
-#else
-    wipe_buf_size = file_size;
-#endif
+    /* one buffer for the whole wipe, whatever the size of the file, and
+     * one keystream seeded from the RNG for all its random passes */
+    if (NULL == (rdata = crypto_buf_get(WIPE_BUF_SIZE))) {
+        TRACE_ERROR("[!] could not allocate the wipe buffer!\n");
+        close(fd);
+        return result;
+    } else if (CRYPTO_SUCCESS != crypto_randstream_new(&rs)) {
+        crypto_buf_put(rdata, WIPE_BUF_SIZE);
+        close(fd);
+        return result;
+    }
 
     /* for debugging purposes, print out some wipe data */
-#ifdef DEBUG
-    printf("[+] wipe data:\n");
-    printf("    wipe size: %u\n    passes: %u\n    rounds: %u\n", 
-            (unsigned int) wipe_buf_size, (unsigned int) passes,
-            (unsigned int) rounds);
-#endif
+    TRACE_DEBUG("[+] wipe data:\n");
+    TRACE_DEBUG("    file size: %llu\n    passes: %u\n    buffer: %u\n",
+                 (unsigned long long) kf_stat.st_size, (unsigned int) passes,
+                 (unsigned int) WIPE_BUF_SIZE);
 
-    /* top-level loop to write to the file passes number of times */
-    for (i = 0; i < passes; ++i) {
-#ifdef DEBUG
-        printf("[+] wipe pass number %u\n", (unsigned int) i);
-#endif
+    result = crypto_wipe_range(fd, 0, kf_stat.st_size, passes, rdata, rs,
+            NULL);
 
-        kf = fopen(filename, "w");
+    crypto_randstream_free(rs);
+    crypto_buf_put(rdata, WIPE_BUF_SIZE);
 
-        /* error checking */
-        if (NULL == kf) {
-#ifdef DEBUG
-            fprintf(stderr, "[!] %s does not exist!\n", filename);
-#endif
+    if (0 != close(fd)) {
+        TRACE_ERROR("[!] error encountered closing %s!\n", filename);
+        TRACE_ERRNO("close");
+        result = KEY_FAILURE;
+    }
 
-            return result;
-        } else if (0 != ferror(kf)) {
-#ifdef DEBUG
-            fprintf(stderr, "[!] encountered an error opening %s!\n", 
-                    filename);
-            perror("fopen");
-#endif
+    /* finally remove the file from the file system */
+    if ((KEY_SUCCESS == result) && (0 != unlink(filename))) {
+        TRACE_ERROR("error unlinking file!\n");
+        result = KEY_FAILURE;
+    }
+
+    return result;
+}
+
+crypto_key_return_t crypto_wipe_range( int fd, off_t start, off_t size,
+        size_t passes, unsigned char *rdata, randstream_t rs,
+        unsigned long long *written ) {
+    crypto_key_return_t result = KEY_SUCCESS;
+    wipe_pattern_t pattern = WIPE_RANDOM;
+    off_t end = start + size;
+    off_t off = 0, data = 0, hole = 0;
+    uint64_t pass_start = 0;
+    size_t len = 0;
+    size_t i = 0;               /* loop counter */
+
+    if (0 == passes) {
+        passes = wipe_passes;
+    }
 
-            return result;
+    /* top-level loop to write to the range passes number of times */
+    for (i = 0; (i < passes) && (KEY_SUCCESS == result); ++i) {
+        pattern = wipe_patterns[i % wipe_npatterns];
+        TRACE_START(pass_start);
+        TRACE_DEBUG("[+] wipe pass number %u, pattern %d\n", (unsigned int) i,
+                    (int) pattern);
+
+        /* a fixed pattern is the same for every chunk */
+        switch (pattern) {
+            case WIPE_ZEROS:
+                memset(rdata, 0x00, WIPE_BUF_SIZE);
+                break;
+            case WIPE_ONES:
+                memset(rdata, 0xff, WIPE_BUF_SIZE);
+                break;
+            case WIPE_ALT55:
+                memset(rdata, 0x55, WIPE_BUF_SIZE);
+                break;
+            case WIPE_ALTAA:
+                memset(rdata, 0xaa, WIPE_BUF_SIZE);
+                break;
+            default:
+                break;
         }
 
-        /* inner loop to write the buffer to the file */
-        for (j = 0; j < rounds; ++j) {
-            size_t written = 0;
-#ifdef DEBUG
-            printf("\twipe round %u\n", (unsigned int) j);
-#endif
+        /* holes have no blocks to overwrite; writing them would only
+         * allocate some */
+        hole = start;
+        for (off = start; off < end; off += (off_t) len) {
+            if ((off >= hole) &&
+                    (! crypto_file_extent(fd, off, end, &data, &hole))) {
+                break;
+            } else if (off < data) {
+                off = data;
+            }
 
-            rdata = CRYPTO_MALLOC( wipe_buf_size, sizeof rdata );
-            gcry_create_nonce(rdata, wipe_buf_size);
+            len = WIPE_BUF_SIZE;
+            if ((off_t) len > hole - off) {
+                len = (size_t) (hole - off);
+            }
 
-            /* write and check for errors */
-            written = fwrite(rdata, sizeof *rdata, wipe_buf_size, kf);
+            if ((WIPE_RANDOM == pattern) &&
+                    (CRYPTO_SUCCESS != crypto_randstream_fill(rs, rdata,
+                        len))) {
+                result = KEY_FAILURE;
+                break;
+            }
 
-            /* sanity check to make sure we wrote as many bytes as we 
-             * wanted to */
-            if (written != wipe_buf_size) {
-#ifdef DEBUG
-                fprintf(stderr, "[!] did not write expected number of ");
-                fprintf(stderr, "bytes (expected %u bytes, wrote %u bytes",
-                        (unsigned int) wipe_buf_size, (unsigned int) written);
-                fprintf(stderr, "\nto file: %s\n", filename);
-#endif
+            if (0 != full_pwrite(fd, rdata, len, off)) {
+                TRACE_ERROR("[!] could not overwrite offset %llu!\n",
+                            (unsigned long long) off);
+                TRACE_ERRNO("pwrite");
                 result = INCONSISTENT_STATE;
+                break;
+            }
 
-                return result;
+            if (NULL != written) {
+                *written += len;
             }
+        }
 
-            gcry_free(rdata);
-        } /* end of wiping round */
+        /* the pass is on the disk before the next one starts */
+        if ((KEY_SUCCESS == result) && (0 != fdatasync(fd))) {
+            TRACE_ERRNO("[!] fdatasync");
+            result = KEY_FAILURE;
+        }
 
-        /* close and check for errors */
-        if (0 != fclose(kf)) {
-#ifdef DEBUG
-            fprintf(stderr, "[!] error encountered closing %s!\n", filename);
-            perror("fclose");
-#endif
+        /* and a large wipe does not push everything else out of cache */
+        posix_fadvise(fd, start, size, POSIX_FADV_DONTNEED);
+        TRACE_END(TRACE_WIPE_PASS, pass_start);
+    } /* end of write pass */
+
+    return result;
+}
 
-            return result;
+crypto_return_t crypto_wipe_set_patterns( const wipe_pattern_t *patterns,
+        size_t n ) {
+    size_t i = 0;
+
+    if ((0 == n) || (n > WIPE_MAX_PATTERNS)) {
+        return CRYPTO_FAILURE;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if ((patterns[i] < WIPE_RANDOM) || (patterns[i] > WIPE_ALTAA)) {
+            return CRYPTO_FAILURE;
         }
+    }
 
-    } /* end of write pass */
+    memcpy(wipe_patterns, patterns, n * sizeof *patterns);
+    wipe_npatterns = n;
+    return CRYPTO_SUCCESS;
+}
 
-    /* finally remove the file from the file system */
-    if (0 != unlink(filename)) {
-#ifdef DEBUG
-        fprintf(stderr, "error unlinking file!\n");
-#endif
-    } else {
-        result = KEY_SUCCESS;   /* making it this far means wiping 
-                                 * was successful */
+crypto_return_t crypto_wipe_set_passes( size_t passes ) {
+    if (0 == passes) {
+        return CRYPTO_FAILURE;
     }
 
-    return result;
+    wipe_passes = passes;
+    return CRYPTO_SUCCESS;
 }
 
+size_t crypto_wipe_passes( ) {
+    return wipe_passes;
+}
+
+int crypto_file_extent( int fd, off_t start, off_t end, off_t *data,
+        off_t *hole ) {
+    *data = start;
+    *hole = end;
+    if (start >= end) {
+        return 0;
+    }
+
+#ifdef SEEK_DATA
+    *data = lseek(fd, start, SEEK_DATA);
+    if (-1 == *data) {
+        /* ENXIO: nothing but hole up to the end of the file */
+        *data = start;
+        return (ENXIO == errno) ? 0 : 1;
+    } else if (*data >= end) {
+        return 0;
+    }
+
+    *hole = lseek(fd, *data, SEEK_HOLE);
+    if ((-1 == *hole) || (*hole > end)) {
+        *hole = end;
+    }
+#endif
+
+    return 1;
+}
@@ -10,16 +10,110 @@
 #define __CRYPTOFILE_H
 
 #include <stdlib.h>
+#include <sys/types.h>
 
 #include "config.h"
 #include "crypto.h"
 #include "metakey.h"
+#include "cryptorand.h"
 
-/* crypto_wipe_file
+/**************************************************************************/
+/*                          note on file wiping                           */
+/**************************************************************************/
+/*
+ * crypto_wipe_file overwrites a file in place: it is opened without
+ * truncation and every pass rewrites the file's existing blocks with
+ * pwrite, WIPE_BUF_SIZE bytes at a time, from a single page-aligned buffer
+ * reused for the whole wipe. memory use is therefore the same for any file
+ * size. each pass ends with fdatasync, so it has reached the disk before
+ * the next one starts, and drops the file's pages from the page cache.
+ *
+ * what each pass writes is set with crypto_wipe_set_patterns: pass i uses
+ * the pattern at i modulo the number of patterns. random passes come from
+ * an AES-CTR keystream seeded once per wipe (see cryptorand.h), so they
+ * are limited by the disk rather than by the RNG; fixed patterns fill the
+ * buffer once per pass. the default is a single WIPE_RANDOM pattern, and
+ * wipe_dod is the DoD 5220.22-M style zeros, ones, random sequence.
+ *
+ * only the data extents of the file are written: holes of a sparse file
+ * are found with SEEK_DATA / SEEK_HOLE and skipped, since they have no
+ * blocks to wipe and writing them would allocate the whole file. where
+ * the filesystem can not report holes the whole file counts as data.
+ *
+ * on filesystems that write new data elsewhere (copy on write, log
+ * structured, or SSDs remapping blocks underneath) overwriting in place
+ * can not guarantee the old blocks are gone.
  */
-crypto_key_return_t crypto_wipe_file( const char *, size_t );
 
+/********************************************************************
+ * wipe_pattern_t:                                                  *
+ *      what a wipe pass writes                                     *
+ *                                                                  *
+ * WIPE_RANDOM: keystream bytes                                     *
+ * WIPE_ZEROS / WIPE_ONES: 0x00 / 0xff bytes                        *
+ * WIPE_ALT55 / WIPE_ALTAA: alternating bits, 0x55 / 0xaa bytes     *
+ ********************************************************************/
+typedef enum wipe_pattern {
+    WIPE_RANDOM = 0,
+    WIPE_ZEROS,
+    WIPE_ONES,
+    WIPE_ALT55,
+    WIPE_ALTAA
+} wipe_pattern_t;
 
+/* zeros, ones, random; use with 3 passes */
+extern const wipe_pattern_t wipe_dod[3];
 
+/* crypto_wipe_file: overwrite a file and unlink it
+ *      arguments: the filename and the number of passes, 0 for the
+ *                 default (see crypto_wipe_set_passes)
+ *      returns: KEY_SUCCESS, INCONSISTENT_STATE if a pass could not be
+ *                 completed, or KEY_FAILURE if the file could not be
+ *                 opened, synced or unlinked
+ */
+extern crypto_key_return_t crypto_wipe_file( const char *, size_t );
+
+/* crypto_wipe_set_patterns: set the patterns crypto_wipe_file cycles
+ *                  through, one per pass. the array is copied.
+ *      arguments: an array of wipe_pattern_t and its length, at most
+ *                 WIPE_MAX_PATTERNS
+ *      returns: CRYPTO_FAILURE if there are no patterns, too many, or an
+ *                 unknown one, CRYPTO_SUCCESS otherwise.
+ */
+extern crypto_return_t crypto_wipe_set_patterns( const wipe_pattern_t *,
+                                                 size_t );
+
+/* crypto_wipe_set_passes, crypto_wipe_passes: set and return the number
+ *                  of passes crypto_wipe_file makes when asked for 0;
+ *                  WIPE_PASSES by default.
+ *      returns: CRYPTO_FAILURE if the number is 0, CRYPTO_SUCCESS
+ *                 otherwise.
+ */
+extern crypto_return_t crypto_wipe_set_passes( size_t );
+extern size_t crypto_wipe_passes( void );
+
+/* crypto_wipe_range: the passes of crypto_wipe_file over one byte range
+ *                  of an open file, for the bulk wipe (see cryptowipe.h)
+ *      arguments: the fd, the range's offset and length, the number of
+ *                 passes (0 for the default), a WIPE_BUF_SIZE buffer
+ *                 from crypto_buf_get, a randstream_t, and a count
+ *                 of bytes written to add to, or NULL
+ *      returns: KEY_SUCCESS, INCONSISTENT_STATE if a write failed, or
+ *                 KEY_FAILURE if the keystream or fdatasync failed
+ */
+extern crypto_key_return_t crypto_wipe_range( int, off_t, off_t,
+                                              size_t, unsigned char *,
+                                              randstream_t,
+                                              unsigned long long * );
+
+/* crypto_file_extent: find the first data extent of an open file in a
+ *                  range, skipping holes
+ *      arguments: the fd, the start and end of the range, and off_t *s
+ *                 set to the start and end of the extent, clipped to the
+ *                 range
+ *      returns: 1 if there is data in the range, 0 if it is all hole.
+ *                 files whose holes can not be found are all data.
+ */
+extern int crypto_file_extent( int, off_t, off_t, off_t *, off_t * );
 
 #endif
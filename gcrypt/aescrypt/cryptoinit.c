@@ -11,22 +11,33 @@
 #include <stdlib.h>
 #include <gcrypt.h>
 
+#include "cryptoarena.h"
+#include "cryptobuf.h"
+#include "cryptocpu.h"
+#include "cryptorand.h"
+#include "cryptosecmem.h"
+#include "keystore.h"
+#include "metakey.h"
+#include "debug.h"
+
+#if GCRYPT_VERSION_NUMBER < 0x010800
+#error "aescrypt needs libgcrypt 1.8.0 or later"
+#endif
+
+/* the global keystore, set up by crypto_init */
+keystore_t keystore = NULL;
+
 /*************************/
 /* crypto initialisation */
 /*************************/
 keystore_t crypto_init( ) {
-    size_t i = 0;           /* loop index */
     keystore = NULL;
 
-#ifdef DBEUG
-    printf("[+] initialising gcrypt...\n");
-#endif
+    TRACE_INFO("[+] initialising gcrypt...\n");
 
     if (! gcry_check_version(GCRYPT_MIN_VERSION)) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] version mismatch. the minimum version is %s\n", 
-                GCRYPT_MIN_VERSION);
-#endif
+        TRACE_ERROR("[!] version mismatch. the minimum version is %s\n", 
+                    GCRYPT_MIN_VERSION);
         return NULL;
     }
 
@@ -38,51 +49,23 @@ keystore_t crypto_init( ) {
     /************************
      * set up secure memory *
      ************************/
-#if SECURE_MEM != 0
-
-#ifdef DEBUG
-    printf("[+] setting up secure memory...\n");
-#endif
-
-    /* place the random pool in secure memory */
-    gcry_control(GCRYCTL_USE_SECURE_RNDPOOL);
-
-    /* allocate secure memory */
-    gcry_control(GCRYCTL_INIT_SECMEM, SECURE_MEM);
-
-    /* resume secure memory warnings */
-    gcry_control(GCRYCTL_RESUME_SECMEM_WARN);
-
-#endif
+    crypto_secmem_init();
 
     /* signal initialization complete  - library ready for use */
     gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
 
-#ifdef DEBUG
-    printf("[+] finished library initialisation...\n");
-    printf("[+] setting up keystore...\n");
-#endif
-
-    /* allocate memory to keystore */
-    keystore    = CRYPTO_MALLOC( 1, sizeof *keystore);
-    keystore->store = CRYPTO_MALLOC( KEYSTORE_SIZE,
-            sizeof(metakey_t));
-    keystore->size  = 0;
+    /* what the cipher code can use here, for picking an AEAD */
+    crypto_cpu_detect();
 
-    for (i = 0; i < KEYSTORE_SIZE; ++i) {
-        size_t keysize = 32;
+    TRACE_INFO("[+] finished library initialisation...\n");
+    TRACE_INFO("[+] setting up keystore...\n");
 
-#ifdef DEBUG
-        printf("allocating space for key #%u with size %u bytes...\n", 
-                i, keysize);
-#endif
-
-        keystore->store[i] = CRYPTO_MALLOC(1, sizeof(struct metakey));
-        keystore->store[i]->key = CRYPTO_MALLOC( keysize, 
-                                  sizeof keystore->store[i]->key);
-        keystore->store[i]->initialised = 1;
+    /* keys are added to the keystore as they are needed */
+    keystore = crypto_keystore_new(KEYSTORE_SIZE);
+    if (NULL == keystore) {
+        TRACE_ERROR("[!] error allocating the keystore!\n");
 
-        keystore->store[i]->sm = SECURE_MEM != 0;
+        return NULL;
     }
 
     return keystore;
@@ -93,50 +76,32 @@ keystore_t crypto_init( ) {
 /* close down crypto library and destroy any secure memory */
 /***********************************************************/
 crypto_return_t crypto_shutdown( ) {
-    size_t i = 0;
-
     if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] crypto library not initialised!\n");
-#endif
+        TRACE_ERROR("[!] crypto library not initialised!\n");
 
         return EXIT_FAILURE;
     }
 
-#ifdef DEBUG
-    printf("[+] shutting down crypto system...\n");
-#endif
-
-    /* destroy keys */
-    for (i = 0; i < KEYSTORE_SIZE; ++i) {
-#ifdef DEBUG
-        printf("[+] wiping key %d...\n", i);
-#endif
+    TRACE_INFO("[+] shutting down crypto system...\n");
 
-        if (! keystore->store[i]->initialised) {
-#ifdef DEBUG
-            printf("[+] key not initalised, skipping...\n");
-#endif
+    /* latency histograms, if a file was asked for */
+    crypto_trace_shutdown();
 
-            continue;
-        }
+    /* destroy keys */
+    crypto_keystore_free(keystore);
+    keystore = NULL;
 
-        gcry_create_nonce(keystore->store[i]->key, 
-                keystore->store[i]->keysize);
+    /* the random pool may hold bytes of keys yet to be generated */
+    crypto_randpool_stop();
 
-        gcry_free(keystore->store[i]);
-        keystore->store[i] = NULL;
-    }
+    /* and whatever is left of them in the arena, in one pass */
+    crypto_arena_destroy();
 
-    gcry_free( keystore->store );
-    keystore->store = NULL;
-    gcry_free( keystore );
+    /* idle data buffers are already wiped; give them back */
+    crypto_bufpool_drain();
 
     /* if secure memory is used, zeroise and shutdown secure memory */
-#if SECURE_MEM != 0
-    gcry_control(GCRYCTL_TERM_SECMEM);
-    gcry_control(GCRYCTL_DISABLE_SECMEM);
-#endif
+    crypto_secmem_term();
 
     return EXIT_SUCCESS;
 }
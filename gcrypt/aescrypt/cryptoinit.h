@@ -13,9 +13,6 @@
 #include "crypto.h"
 
 
-/* global variables */
-extern keystore_t keystore;
-
 /**************************************************************************/
 /*                    initialisation and shutdown                         */
 /**************************************************************************/
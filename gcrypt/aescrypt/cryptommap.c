@@ -0,0 +1,103 @@
+/**************************************************************************
+ * cryptommap.c                                                           *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-15                                                             *
+ *                                                                        *
+ * memory-mapped zero-copy encryption, see cryptommap.h                   *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptommap.h"
+#include "cryptoprofile.h"
+#include "debug.h"
+
+static unsigned char *map_range( int, off_t, size_t, int, size_t * );
+
+crypto_return_t mmap_crypt_window( int infd, off_t in_pos, int outfd,
+        off_t out_pos, size_t n, gcry_cipher_hd_t hd, crypto_op_t op ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    unsigned char *src = NULL, *dst = NULL;
+    size_t src_slack = 0, dst_slack = 0;
+    gcry_error_t err = 0;
+    uint64_t began = 0, stage = 0;
+
+    if (0 == n) {
+        return CRYPTO_SUCCESS;
+    }
+
+    src = map_range(infd, in_pos, n, PROT_READ, &src_slack);
+    if (NULL == src) {
+        return result;
+    }
+
+    dst = map_range(outfd, out_pos, n, PROT_READ | PROT_WRITE, &dst_slack);
+    if (NULL == dst) {
+        munmap(src, n + src_slack);
+        return result;
+    }
+
+    /* one pass over the data: the input pages are read straight from the
+     * page cache and the ciphertext lands straight in it */
+    TRACE_START(began);
+    PROFILE_START(stage);
+    if (encrypt == op) {
+        err = gcry_cipher_encrypt(hd, dst + dst_slack, n, src + src_slack, n);
+    } else {
+        err = gcry_cipher_decrypt(hd, dst + dst_slack, n, src + src_slack, n);
+    }
+    PROFILE_END(PROFILE_CIPHER, stage, n);
+    TRACE_END(TRACE_CHUNK, began);
+
+    if (0 != err) {
+        TRACE_ERROR("[!] cipher error: %s\n", gcry_strerror(err));
+    } else {
+        result = CRYPTO_SUCCESS;
+    }
+
+    /* the window has been consumed; let the kernel drop the input pages
+     * early rather than evicting something more useful */
+    madvise(src, n + src_slack, MADV_DONTNEED);
+
+    munmap(dst, n + dst_slack);
+    munmap(src, n + src_slack);
+
+    return result;
+}
+
+/* map len bytes of fd at off. mmap offsets have to be page aligned, so the
+ * mapping starts at the page holding off and *slack is set to the number
+ * of bytes between the start of the mapping and off. */
+static unsigned char *map_range( int fd, off_t off, size_t len, int prot,
+        size_t *slack ) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t base = 0;
+    void *p = NULL;
+
+    if (pagesize <= 0) {
+        pagesize = 4096;
+    }
+
+    base   = off - (off % (off_t) pagesize);
+    *slack = (size_t) (off - base);
+
+    p = mmap(NULL, len + *slack, prot, MAP_SHARED, fd, base);
+    if (MAP_FAILED == p) {
+        TRACE_ERRNO("[!] mmap");
+
+        return NULL;
+    }
+
+    if (PROT_READ == prot) {
+        madvise(p, len + *slack, MADV_SEQUENTIAL);
+    }
+
+    return p;
+}
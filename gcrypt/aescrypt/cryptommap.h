@@ -0,0 +1,34 @@
+/**************************************************************************
+ * cryptommap.h                                                           *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-15                                                             *
+ *                                                                        *
+ * memory-mapped zero-copy encryption of file ranges                      *
+ **************************************************************************/
+
+#ifndef __CRYPTOMMAP_H
+#define __CRYPTOMMAP_H
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+
+/* mmap_crypt_window: map n bytes of infd at in_pos read-only and n bytes
+ *                  of outfd at out_pos read-write, and run the cipher from
+ *                  the input mapping directly into the output mapping.
+ *                  nothing is copied through a user space buffer. the
+ *                  offsets do not need to be page aligned. the output file
+ *                  must already be large enough to hold the range.
+ *      arguments: input fd and offset, output fd and offset, the number
+ *                 of bytes, a cipher handle with the IV / counter already
+ *                 set, and the operation.
+ *      returns: CRYPTO_SUCCESS, or CRYPTO_FAILURE if a mapping could not
+ *                 be made or the cipher failed.
+ */
+extern crypto_return_t mmap_crypt_window( int, off_t, int, off_t, size_t,
+                                          gcry_cipher_hd_t, crypto_op_t );
+
+#endif
@@ -0,0 +1,469 @@
+/**************************************************************************
+ * cryptoparallel.c                                                       *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-14                                                             *
+ *                                                                        *
+ * multi-threaded CTR, XTS and framed AEAD encryption, see               *
+ * cryptoparallel.h                                                       *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptoaead.h"
+#include "cryptobuf.h"
+#include "cryptoparallel.h"
+#include "cryptostream.h"
+#include "cryptommap.h"
+#include "cryptoprofile.h"
+#include "cryptoutil.h"
+#include "metakey.h"
+#include "debug.h"
+
+/********************************************************************
+ * par_job:                                                         *
+ *      work description shared by all workers of one run           *
+ ********************************************************************/
+struct par_job {
+    int infd;
+    int outfd;
+    off_t in_off;
+    off_t out_off;
+    off_t len;
+    metakey_t mk;
+    int mode;                   /* CTR, XTS, or the AEAD's mode */
+    int framed;                 /* chunks are framed AEAD frames */
+    const unsigned char *iv;
+    const unsigned char *raw_hdr;   /* the framed stream's header */
+    size_t sector;              /* XTS data unit */
+    crypto_op_t op;
+    stream_io_t io;
+    size_t unit;
+    size_t bufsize;             /* unit, plus a frame's word and tag */
+    uint64_t nchunks;
+    uint64_t bad;               /* first frame that failed to verify */
+    unsigned int nworkers;
+    unsigned int busy;          /* workers still taking chunks */
+};
+
+/********************************************************************
+ * par_worker:                                                      *
+ *      per-thread state: the worker's index and its result         *
+ ********************************************************************/
+struct par_worker {
+    pthread_t tid;
+    struct par_job *job;
+    unsigned int id;
+    crypto_return_t result;
+};
+
+static crypto_return_t par_run( struct par_job *, unsigned int );
+static void *par_worker_run( void * );
+static gcry_error_t par_xts_sectors( gcry_cipher_hd_t, unsigned char *,
+                                     size_t, off_t, size_t, crypto_op_t );
+static crypto_return_t par_aead_frame( struct par_job *, gcry_cipher_hd_t,
+                                       unsigned char *, uint64_t, size_t );
+
+crypto_return_t stream_crypt_parallel( int infd, off_t in_off, int outfd,
+        off_t out_off, off_t len, metakey_t mk, const unsigned char *iv,
+        crypto_op_t op, stream_io_t io, unsigned int nworkers,
+        size_t chunk_size ) {
+    struct par_job job;
+
+    /* mapped windows are much larger than read chunks: the point is to
+     * touch the page tables rarely, not to bound a copy buffer */
+    job.unit = (STREAM_IO_MMAP == io) ? STREAM_MMAP_WINDOW : chunk_size;
+
+    job.infd        = infd;
+    job.outfd       = outfd;
+    job.in_off      = in_off;
+    job.out_off     = out_off;
+    job.len         = len;
+    job.mk          = mk;
+    job.mode        = GCRY_CIPHER_MODE_CTR;
+    job.framed      = 0;
+    job.iv          = iv;
+    job.raw_hdr     = NULL;
+    job.sector      = 0;
+    job.op          = op;
+    job.io          = io;
+    job.bufsize     = job.unit;
+
+    return par_run(&job, nworkers);
+}
+
+crypto_return_t stream_xts_parallel( int infd, int outfd, off_t off,
+        off_t len, metakey_t mk, crypto_op_t op, unsigned int nworkers,
+        size_t chunk_size, size_t sector ) {
+    struct par_job job;
+
+    if ((0 == sector) || (0 != off % (off_t) sector) ||
+            (0 != len % (off_t) sector)) {
+        return CRYPTO_FAILURE;
+    }
+
+    /* a chunk is a whole number of sectors */
+    job.unit = chunk_size - chunk_size % sector;
+    if (0 == job.unit) {
+        job.unit = sector;
+    }
+
+    job.infd        = infd;
+    job.outfd       = outfd;
+    job.in_off      = off;
+    job.out_off     = off;
+    job.len         = len;
+    job.mk          = mk;
+    job.mode        = GCRY_CIPHER_MODE_XTS;
+    job.framed      = 0;
+    job.iv          = NULL;
+    job.raw_hdr     = NULL;
+    job.sector      = sector;
+    job.op          = op;
+    job.io          = STREAM_IO_BUFFERED;
+    job.bufsize     = job.unit;
+
+    return par_run(&job, nworkers);
+}
+
+crypto_return_t stream_aead_parallel( int infd, off_t in_off, int outfd,
+        off_t out_off, off_t len, metakey_t mk, int mode,
+        const unsigned char *raw_hdr, crypto_op_t op, unsigned int nworkers,
+        size_t chunk_size ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    struct par_job job;
+
+    job.infd        = infd;
+    job.outfd       = outfd;
+    job.in_off      = in_off;
+    job.out_off     = out_off;
+    job.len         = len;
+    job.mk          = mk;
+    job.mode        = mode;
+    job.framed      = 1;
+    job.iv          = NULL;
+    job.raw_hdr     = raw_hdr;
+    job.sector      = 0;
+    job.op          = op;
+    job.io          = STREAM_IO_BUFFERED;
+    job.unit        = chunk_size;
+    job.bufsize     = chunk_size + AEAD_FRAME_OVERHEAD;
+
+    result = par_run(&job, nworkers);
+
+    /* frames past the first bad one may have been written already; drop
+     * them, so the output is what a reader stopping there would leave */
+    if ((CRYPTO_AUTH_FAILURE == result) && (-1 == ftruncate(outfd,
+                    out_off + (off_t) (job.bad * chunk_size)))) {
+        TRACE_ERRNO("[!] ftruncate");
+    }
+
+    return result;
+}
+
+
+/**************************************************************************/
+/*                           internal helpers                             */
+/**************************************************************************/
+
+/* start the workers for a filled in job and wait for them */
+static crypto_return_t par_run( struct par_job *job,
+        unsigned int nworkers ) {
+    crypto_return_t result = CRYPTO_SUCCESS;
+    struct par_worker *workers = NULL;
+    uint64_t nchunks = 0;
+    unsigned int i = 0, started = 0;
+
+    /* no point in starting more workers than there are chunks; a framed
+     * stream has a frame even for no data at all */
+    nchunks = ((uint64_t) job->len + job->unit - 1) / job->unit;
+    if (job->framed && (0 == nchunks)) {
+        nchunks = 1;
+    }
+    if ((uint64_t) nworkers > nchunks) {
+        nworkers = (unsigned int) nchunks;
+    }
+    if (0 == nworkers) {
+        return CRYPTO_SUCCESS;      /* empty input */
+    }
+
+    job->nworkers   = nworkers;
+    job->nchunks    = nchunks;
+    job->bad        = UINT64_MAX;
+    job->busy       = 0;
+
+    workers = calloc(nworkers, sizeof *workers);
+    if (NULL == workers) {
+        return CRYPTO_FAILURE;
+    }
+
+    TRACE_INFO("[+] encrypting %lu %s with %u workers...\n",
+               (unsigned long) nchunks,
+               (STREAM_IO_MMAP == job->io) ? "mapped windows" : "chunks",
+               nworkers);
+
+    for (i = 0; i < nworkers; ++i) {
+        workers[i].job      = job;
+        workers[i].id       = i;
+        workers[i].result   = CRYPTO_FAILURE;
+
+        if (0 != pthread_create(&workers[i].tid, NULL, par_worker_run,
+                    &workers[i])) {
+            TRACE_ERROR("[!] could not start worker %u!\n", i);
+
+            result = CRYPTO_FAILURE;
+            break;
+        }
+        ++started;
+    }
+
+    for (i = 0; i < started; ++i) {
+        pthread_join(workers[i].tid, NULL);
+        if (CRYPTO_SUCCESS != workers[i].result) {
+            result = workers[i].result;
+        }
+    }
+
+    free(workers);
+    return result;
+}
+
+/* worker w handles chunks w, w + n, w + 2n, ... */
+static void *par_worker_run( void *arg ) {
+    struct par_worker *self = arg;
+    struct par_job *job = self->job;
+    gcry_cipher_hd_t hd = NULL;
+    unsigned char ctr[STREAM_IV_LEN];
+    unsigned char *buf = NULL;
+    uint64_t chunk = 0;
+    off_t pos = 0;
+    size_t n = 0;
+    gcry_error_t err = 0;
+    uint64_t began = 0, stage = 0;
+
+    if (KEY_SUCCESS != crypto_cipher_get(job->mk, job->mode, &hd)) {
+        self->result = CRYPTO_NOT_INIT;
+        return NULL;
+    }
+
+    /* the mapped path works directly on the page cache */
+    if (STREAM_IO_BUFFERED == job->io) {
+        buf = crypto_buf_get(job->bufsize);
+        if (NULL == buf) {
+            crypto_cipher_put(job->mk, hd);
+            return NULL;
+        }
+    }
+
+    /* each worker holds one chunk at a time until it runs out */
+    __atomic_add_fetch(&job->busy, 1, __ATOMIC_RELAXED);
+    for (chunk = self->id; ; chunk += job->nworkers) {
+        /* past a frame that failed, nothing more will be kept */
+        if ((chunk >= job->nchunks) ||
+                (chunk > __atomic_load_n(&job->bad, __ATOMIC_RELAXED))) {
+            self->result = CRYPTO_SUCCESS;
+            break;
+        }
+        crypto_profile_inflight(__atomic_load_n(&job->busy,
+                    __ATOMIC_RELAXED));
+
+        pos = (off_t) (chunk * job->unit);
+        n = job->unit;
+        if ((off_t) n > job->len - pos) {
+            n = (size_t) (job->len - pos);
+        }
+
+        if (job->framed) {
+            self->result = par_aead_frame(job, hd, buf, chunk, n);
+            if (CRYPTO_SUCCESS != self->result) {
+                break;
+            }
+
+            continue;
+        }
+
+        /* XTS sets its tweak per sector, below */
+        if (GCRY_CIPHER_MODE_CTR == job->mode) {
+            stream_ctr_offset(ctr, job->iv,
+                    (uint64_t) pos / STREAM_BLOCK_LEN);
+            err = gcry_cipher_setctr(hd, ctr, STREAM_IV_LEN);
+        }
+        if (0 != err) {
+            TRACE_ERROR("[!] worker %u: %s\n", self->id,
+                        gcry_strerror(err));
+
+            break;
+        }
+
+        if (STREAM_IO_MMAP == job->io) {
+            if (CRYPTO_SUCCESS != mmap_crypt_window(job->infd,
+                        job->in_off + pos, job->outfd, job->out_off + pos,
+                        n, hd, job->op)) {
+                break;
+            }
+
+            continue;
+        }
+
+        PROFILE_START(stage);
+        if (0 != full_pread(job->infd, buf, n, job->in_off + pos)) {
+            TRACE_ERRNO("[!] pread");
+
+            break;
+        }
+        PROFILE_END(PROFILE_READ, stage, n);
+
+        TRACE_START(began);
+        PROFILE_START(stage);
+        if (GCRY_CIPHER_MODE_XTS == job->mode) {
+            err = par_xts_sectors(hd, buf, n, job->in_off + pos,
+                    job->sector, job->op);
+        } else if (encrypt == job->op) {
+            err = gcry_cipher_encrypt(hd, buf, n, NULL, 0);
+        } else {
+            err = gcry_cipher_decrypt(hd, buf, n, NULL, 0);
+        }
+        PROFILE_END(PROFILE_CIPHER, stage, n);
+        TRACE_END(TRACE_CHUNK, began);
+
+        if (0 != err) {
+            TRACE_ERROR("[!] worker %u: %s\n", self->id,
+                        gcry_strerror(err));
+
+            break;
+        }
+
+        PROFILE_START(stage);
+        if (0 != full_pwrite(job->outfd, buf, n, job->out_off + pos)) {
+            TRACE_ERRNO("[!] pwrite");
+
+            break;
+        }
+        PROFILE_END(PROFILE_WRITE, stage, n);
+    }
+    __atomic_sub_fetch(&job->busy, 1, __ATOMIC_RELAXED);
+
+    crypto_buf_put(buf, job->bufsize);
+    crypto_cipher_put(job->mk, hd);
+
+    return NULL;
+}
+
+/* run the sectors in buf, which starts at byte off of the device, through
+ * XTS one data unit at a time; sector n has the tweak n, little endian */
+static gcry_error_t par_xts_sectors( gcry_cipher_hd_t hd,
+        unsigned char *buf, size_t len, off_t off, size_t sector,
+        crypto_op_t op ) {
+    unsigned char tweak[STREAM_BLOCK_LEN];
+    uint64_t n = (uint64_t) off / sector;
+    gcry_error_t err = 0;
+    size_t done = 0;
+    unsigned int i = 0;
+
+    memset(tweak, 0, sizeof tweak);
+    for (done = 0; (done < len) && (0 == err); done += sector, ++n) {
+        for (i = 0; i < 8; ++i) {
+            tweak[i] = (unsigned char) (n >> (8 * i));
+        }
+
+        err = gcry_cipher_setiv(hd, tweak, sizeof tweak);
+        if (0 != err) {
+            break;
+        } else if (encrypt == op) {
+            err = gcry_cipher_encrypt(hd, buf + done, sector, NULL, 0);
+        } else {
+            err = gcry_cipher_decrypt(hd, buf + done, sector, NULL, 0);
+        }
+    }
+
+    return err;
+}
+
+/* seal or open frame i, holding n bytes of plaintext. buf takes the whole
+ * frame, word, data and tag, so each side is one pread and one pwrite */
+static crypto_return_t par_aead_frame( struct par_job *job,
+        gcry_cipher_hd_t hd, unsigned char *buf, uint64_t i, size_t n ) {
+    off_t plain  = (off_t) (i * job->unit);
+    off_t framed = (off_t) (i * (job->unit + AEAD_FRAME_OVERHEAD));
+    unsigned char *data = buf + AEAD_FRAME_LEN;
+    uint32_t word = (uint32_t) n;
+    uint64_t bad = 0;
+    gcry_error_t err = 0;
+    uint64_t began = 0, stage = 0;
+    int rc = 0;
+
+    if (i + 1 == job->nchunks) {
+        word |= AEAD_FRAME_FINAL;
+    }
+
+    PROFILE_START(stage);
+    if (encrypt == job->op) {
+        rc = full_pread(job->infd, data, n, job->in_off + plain);
+    } else {
+        rc = full_pread(job->infd, buf, n + AEAD_FRAME_OVERHEAD,
+                job->in_off + framed);
+    }
+    if (0 != rc) {
+        TRACE_ERRNO("[!] pread");
+
+        return CRYPTO_FAILURE;
+    }
+    PROFILE_END(PROFILE_READ, stage, n);
+
+    /* a frame word that disagrees with the layout means frames were cut
+     * off, added or moved; the tag would fail too */
+    if (encrypt == job->op) {
+        put_be32(buf, word);
+    } else if (word != get_be32(buf)) {
+        err = GPG_ERR_CHECKSUM;
+    }
+
+    TRACE_START(began);
+    PROFILE_START(stage);
+    if (0 == err) {
+        err = crypto_aead_seal_frame(hd, job->raw_hdr, i, buf, data, n,
+                data + n, job->op);
+    }
+    PROFILE_END(PROFILE_CIPHER, stage, n);
+    TRACE_END(TRACE_CHUNK, began);
+
+    if ((0 != err) && (decrypt == job->op)) {
+        TRACE_ERROR("[!] frame %lu failed to verify!\n", (unsigned long) i);
+
+        bad = __atomic_load_n(&job->bad, __ATOMIC_RELAXED);
+        while ((i < bad) && (! __atomic_compare_exchange_n(&job->bad, &bad,
+                        i, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {
+            ;
+        }
+
+        return CRYPTO_AUTH_FAILURE;
+    } else if (0 != err) {
+        TRACE_ERROR("[!] cipher error: %s\n", gcry_strerror(err));
+
+        return CRYPTO_FAILURE;
+    }
+
+    PROFILE_START(stage);
+    if (encrypt == job->op) {
+        rc = full_pwrite(job->outfd, buf, n + AEAD_FRAME_OVERHEAD,
+                job->out_off + framed);
+    } else {
+        rc = full_pwrite(job->outfd, data, n, job->out_off + plain);
+    }
+    if (0 != rc) {
+        TRACE_ERRNO("[!] pwrite");
+
+        return CRYPTO_FAILURE;
+    }
+    PROFILE_END(PROFILE_WRITE, stage, n);
+
+    return CRYPTO_SUCCESS;
+}
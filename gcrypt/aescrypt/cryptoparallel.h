@@ -0,0 +1,101 @@
+/**************************************************************************
+ * cryptoparallel.h                                                       *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-14                                                             *
+ *                                                                        *
+ * multi-threaded CTR, XTS and framed AEAD encryption of a single file    *
+ **************************************************************************/
+
+#ifndef __CRYPTOPARALLEL_H
+#define __CRYPTOPARALLEL_H
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "metakey.h"
+#include "cryptostream.h"
+
+/**************************************************************************/
+/*                      note on parallel encryption                       */
+/**************************************************************************/
+/*
+ * in CTR mode the keystream for byte n of the stream only depends on the
+ * IV and n / 16, so the file can be cut into fixed size chunks that
+ * are encrypted independently. chunk i uses the counter block IV + i *
+ * (chunk size / 16); the result is byte for byte identical to the
+ * single-threaded stream.
+ *
+ * worker w of n handles chunks w, w + n, w + 2n, ... using pread / pwrite
+ * at the chunk's offset, so every worker owns a disjoint part of the
+ * output and the chunks land in order without any reordering buffer.
+ * memory use is one chunk per worker.
+ *
+ * with STREAM_IO_MMAP the unit of work is a STREAM_MMAP_WINDOW sized
+ * window instead: the worker maps the input and output ranges and runs
+ * the cipher from one mapping straight into the other (see cryptommap.h).
+ *
+ * XTS (see cryptoxts.h) goes through the same workers: chunks are a whole
+ * number of sectors and each sector is a data unit of its own, with its
+ * sector number as the tweak, so no chunk depends on another there
+ * either. input and output may be the same file descriptor, as each
+ * worker reads a chunk and writes it back before it moves on.
+ *
+ * a framed AEAD stream (see cryptoaead.h) has its frames at fixed offsets
+ * too, and each frame is sealed with its own IV, so chunk i there is
+ * frame i: the worker reads its plaintext, seals it, and writes word, data
+ * and tag in one go. when decrypting, the lowest frame that failed to
+ * verify is recorded, workers take no chunks past it, and the output is
+ * cut back to the frames before it once the workers are done.
+ */
+
+/* stream_crypt_parallel: run len bytes of infd starting at in_off through
+ *                  AES-CTR and write them to outfd starting at out_off.
+ *      arguments: input fd, input offset, output fd, output offset, number
+ *                 of bytes, the metakey_t, the initial counter block,
+ *                 the operation, the I/O method, the number of worker
+ *                 threads, and the chunk size. the output must already be
+ *                 len + out_off bytes long.
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE on an I/O or cipher error,
+ *                 or CRYPTO_NOT_INIT if a cipher handle could not be set up
+ */
+extern crypto_return_t stream_crypt_parallel( int, off_t, int, off_t, off_t,
+                                              metakey_t,
+                                              const unsigned char *,
+                                              crypto_op_t, stream_io_t,
+                                              unsigned int, size_t );
+
+/* stream_xts_parallel: run the sectors in [off, off + len) of infd through
+ *                  AES-XTS and write them to the same range of outfd.
+ *      arguments: input fd, output fd (which may be the input fd), the
+ *                 offset and length (both multiples of the sector size),
+ *                 the metakey_t holding the double length XTS key, the
+ *                 operation, the number of worker threads, the chunk size
+ *                 (rounded down to whole sectors), and the sector size.
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE on an I/O or cipher error
+ *                 or a range that is not whole sectors, or CRYPTO_NOT_INIT
+ *                 if a cipher handle could not be set up
+ */
+extern crypto_return_t stream_xts_parallel( int, int, off_t, off_t,
+                                            metakey_t, crypto_op_t,
+                                            unsigned int, size_t, size_t );
+
+/* stream_aead_parallel: seal len bytes of plaintext into frames, or open
+ *                  the frames holding len bytes of plaintext.
+ *      arguments: input fd, input offset, output fd, output offset, the
+ *                 plaintext length, the metakey_t, the AEAD's gcrypt mode,
+ *                 the raw stream header, the operation, the number of
+ *                 worker threads, and the chunk size, which is the frame
+ *                 size. the output must already have its final length.
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE on an I/O or cipher error,
+ *                 CRYPTO_AUTH_FAILURE if a frame does not verify, or
+ *                 CRYPTO_NOT_INIT if a cipher handle could not be set up
+ */
+extern crypto_return_t stream_aead_parallel( int, off_t, int, off_t, off_t,
+                                             metakey_t, int,
+                                             const unsigned char *,
+                                             crypto_op_t, unsigned int,
+                                             size_t );
+
+#endif
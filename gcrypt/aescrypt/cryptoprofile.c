@@ -0,0 +1,126 @@
+/**************************************************************************
+ * cryptoprofile.c                                                        *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-27                                                             *
+ *                                                                        *
+ * pipeline profiler, see cryptoprofile.h for documentation               *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptoprofile.h"
+
+static const char *profile_names[PROFILE_STAGES] = {
+    "read", "cipher", "write", "sync"
+};
+
+static struct profile_report profile;
+static uint64_t profile_began = 0;
+static int profile_on = 0;
+
+static uint64_t profile_now( void );
+
+void crypto_profile_start( ) {
+    __atomic_store_n(&profile_on, 0, __ATOMIC_RELAXED);
+    memset(&profile, 0, sizeof profile);
+    profile_began = profile_now();
+    __atomic_store_n(&profile_on, 1, __ATOMIC_RELEASE);
+}
+
+void crypto_profile_stop( struct profile_report *rep ) {
+    unsigned int i = 0;
+
+    __atomic_store_n(&profile_on, 0, __ATOMIC_RELAXED);
+
+    rep->wall_ns = profile_now() - profile_began;
+    for (i = 0; i < PROFILE_STAGES; ++i) {
+        rep->busy_ns[i] = __atomic_load_n(&profile.busy_ns[i],
+                __ATOMIC_RELAXED);
+        rep->bytes[i]   = __atomic_load_n(&profile.bytes[i],
+                __ATOMIC_RELAXED);
+        rep->calls[i]   = __atomic_load_n(&profile.calls[i],
+                __ATOMIC_RELAXED);
+    }
+    rep->samples      = __atomic_load_n(&profile.samples, __ATOMIC_RELAXED);
+    rep->inflight     = __atomic_load_n(&profile.inflight, __ATOMIC_RELAXED);
+    rep->inflight_max = __atomic_load_n(&profile.inflight_max,
+            __ATOMIC_RELAXED);
+}
+
+uint64_t crypto_profile_clock( ) {
+    if (! __atomic_load_n(&profile_on, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    return profile_now();
+}
+
+void crypto_profile_add( profile_stage_t stage, uint64_t start,
+        uint64_t bytes ) {
+    uint64_t now = 0;
+
+    if ((0 == start) || (stage >= PROFILE_STAGES)) {
+        return;
+    }
+
+    now = profile_now();
+    __atomic_add_fetch(&profile.busy_ns[stage],
+            (now > start) ? now - start : 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&profile.bytes[stage], bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&profile.calls[stage], 1, __ATOMIC_RELAXED);
+}
+
+void crypto_profile_inflight( unsigned int n ) {
+    uint64_t max = 0;
+
+    if (! __atomic_load_n(&profile_on, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    __atomic_add_fetch(&profile.samples, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&profile.inflight, n, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&profile.inflight_max, __ATOMIC_RELAXED);
+    while ((n > max) && ! __atomic_compare_exchange_n(&profile.inflight_max,
+                &max, n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+profile_stage_t crypto_profile_limit( const struct profile_report *rep ) {
+    profile_stage_t limit = PROFILE_READ;
+    unsigned int i = 0;
+
+    for (i = 1; i < PROFILE_STAGES; ++i) {
+        if (rep->busy_ns[i] > rep->busy_ns[limit]) {
+            limit = (profile_stage_t) i;
+        }
+    }
+
+    return limit;
+}
+
+const char *crypto_profile_name( profile_stage_t stage ) {
+    return (stage < PROFILE_STAGES) ? profile_names[stage] : "unknown";
+}
+
+
+/**************************************************************************/
+/*                          internal helpers                              */
+/**************************************************************************/
+
+static uint64_t profile_now( ) {
+    struct timespec ts;
+    uint64_t now = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+
+    /* 0 means not profiled */
+    return (0 == now) ? 1 : now;
+}
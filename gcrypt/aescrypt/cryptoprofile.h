@@ -0,0 +1,115 @@
+/**************************************************************************
+ * cryptoprofile.h                                                        *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-27                                                             *
+ *                                                                        *
+ * per-stage profile of the streaming pipeline                            *
+ **************************************************************************/
+
+#ifndef __CRYPTOPROFILE_H
+#define __CRYPTOPROFILE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "crypto.h"
+
+/**************************************************************************/
+/*                        note on the profiler                            */
+/**************************************************************************/
+/*
+ * every chunk the streaming engine and containers move goes through four
+ * stages: it is read, run through the cipher, written, and at the end the
+ * output is flushed and closed (sync). between crypto_profile_start and
+ * crypto_profile_stop each stage adds up the time spent in it, the bytes
+ * it moved and how often it ran, and the pipeline samples how many chunks
+ * it has in flight whenever it takes on a new one.
+ *
+ * times are summed over threads: with -j N workers, or the reads and
+ * writes of the aio pipeline that are outstanding at once, a stage can be
+ * busy for longer than the run took. the stage with the most busy time is
+ * the one the others wait on, crypto_profile_limit. with the mmap I/O
+ * method reads and writes are page faults taken inside the cipher stage.
+ * the engine never calls fsync, so sync covers writing out stdio buffers
+ * and closing the output, not the page cache reaching the disk.
+ *
+ * a stage costs two clock reads and a few atomic adds per chunk; with
+ * chunks of STREAM_CHUNK_SIZE that is far below 1% of the work, so
+ * profiling can stay on. while it is off it costs a flag test.
+ */
+
+/* pipeline stages */
+typedef enum {
+    PROFILE_READ,
+    PROFILE_CIPHER,
+    PROFILE_WRITE,
+    PROFILE_SYNC,
+    PROFILE_STAGES
+} profile_stage_t;
+
+/********************************************************************
+ * profile_report:                                                  *
+ *      what a profiled run spent its time on                       *
+ *                                                                  *
+ * wall_ns: time from crypto_profile_start to crypto_profile_stop   *
+ * busy_ns, bytes, calls: per stage, summed over threads            *
+ * samples, inflight, inflight_max: number of occupancy samples,   *
+ *      their sum and the largest                                   *
+ ********************************************************************/
+struct profile_report {
+    uint64_t wall_ns;
+    uint64_t busy_ns[PROFILE_STAGES];
+    uint64_t bytes[PROFILE_STAGES];
+    uint64_t calls[PROFILE_STAGES];
+    uint64_t samples;
+    uint64_t inflight;
+    uint64_t inflight_max;
+};
+
+
+/**************************************************************************/
+/*                           profiler functions                           */
+/**************************************************************************/
+
+/* crypto_profile_start: clear the counters and start profiling */
+extern void crypto_profile_start( void );
+
+/* crypto_profile_stop: stop profiling and fill in the report */
+extern void crypto_profile_stop( struct profile_report * );
+
+/* crypto_profile_clock: the start of a stage
+ *      returns: a timestamp in ns, or 0 if not profiling
+ */
+extern uint64_t crypto_profile_clock( void );
+
+/* crypto_profile_add: account for a stage. thread safe.
+ *      arguments: the stage, its start from crypto_profile_clock (0 is
+ *                 ignored) and the bytes it moved
+ */
+extern void crypto_profile_add( profile_stage_t, uint64_t, uint64_t );
+
+/* crypto_profile_inflight: sample the chunks in flight. thread safe.
+ *      arguments: the number of chunks the pipeline holds
+ */
+extern void crypto_profile_inflight( unsigned int );
+
+/* crypto_profile_limit: the stage the pipeline was waiting on
+ *      arguments: a report from crypto_profile_stop
+ *      returns: the stage with the most busy time
+ */
+extern profile_stage_t crypto_profile_limit( const struct profile_report * );
+
+/* crypto_profile_name: the name of a stage, e.g. "cipher" */
+extern const char *crypto_profile_name( profile_stage_t );
+
+/* a stage: PROFILE_START(t) before, with a uint64_t t, and
+ * PROFILE_END(stage, t, bytes) after */
+#define PROFILE_START(t)            ((t) = crypto_profile_clock())
+#define PROFILE_END(stage, t, n)    do {                                \
+        if (0 != (t)) {                                                 \
+            crypto_profile_add((stage), (t), (uint64_t) (n));           \
+        }                                                               \
+    } while (0)
+
+#endif
@@ -0,0 +1,280 @@
+/**************************************************************************
+ * cryptorand.c                                                           *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-22                                                             *
+ *                                                                        *
+ * random pool, see cryptorand.h for documentation                        *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptosecmem.h"
+#include "cryptorand.h"
+#include "debug.h"
+
+/********************************************************************
+ * randpool:                                                        *
+ *      the pool's state, guarded by randpool_lock                  *
+ *                                                                  *
+ * base / size: the mapping holding the ring buffer                 *
+ * head: offset of the first ready byte                             *
+ * fill: number of ready bytes from head on, wrapping around        *
+ * filling: the refill thread is topping the pool up                *
+ * running / stop: the refill thread exists / has to exit           *
+ * locked: mlock succeeded                                          *
+ ********************************************************************/
+struct randpool {
+    unsigned char *base;
+    size_t size;
+    size_t head;
+    size_t fill;
+    int filling;
+    int running;
+    int stop;
+    int locked;
+    unsigned long refills;
+    unsigned long long served;
+    unsigned long long direct;
+    pthread_t thread;
+};
+
+/********************************************************************
+ * randstream:                                                      *
+ *      a keystream: an AES-256-CTR handle with a random key and    *
+ *      counter                                                     *
+ ********************************************************************/
+struct randstream {
+    gcry_cipher_hd_t hd;
+};
+
+static struct randpool pool;
+static pthread_mutex_t randpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t randpool_wake = PTHREAD_COND_INITIALIZER;
+
+static void *randpool_refill( void * );
+
+crypto_return_t crypto_randpool_start( ) {
+    crypto_return_t result = CRYPTO_SUCCESS;
+    unsigned char *base = NULL;
+
+    if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    pthread_mutex_lock(&randpool_lock);
+    if (pool.running) {
+        pthread_mutex_unlock(&randpool_lock);
+        return CRYPTO_SUCCESS;
+    }
+
+    base = mmap(NULL, RANDPOOL_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == base) {
+        TRACE_ERRNO("[!] random pool mmap");
+
+        pthread_mutex_unlock(&randpool_lock);
+        return CRYPTO_FAILURE;
+    }
+
+    memset(&pool, 0, sizeof pool);
+    pool.base   = base;
+    pool.size   = RANDPOOL_SIZE;
+    pool.locked = (0 == mlock(base, RANDPOOL_SIZE));
+    if (! pool.locked) {
+        TRACE_ERRNO("[!] random pool mlock");
+    }
+
+#ifdef MADV_DONTDUMP
+    madvise(base, RANDPOOL_SIZE, MADV_DONTDUMP);
+#endif
+
+    /* start out empty, with the thread filling it up */
+    pool.filling = 1;
+    if (0 != pthread_create(&pool.thread, NULL, randpool_refill, NULL)) {
+        TRACE_ERROR("[!] could not start the random pool thread!\n");
+
+        munmap(base, RANDPOOL_SIZE);
+        memset(&pool, 0, sizeof pool);
+        result = CRYPTO_FAILURE;
+    } else {
+        pool.running = 1;
+    }
+    pthread_mutex_unlock(&randpool_lock);
+
+    return result;
+}
+
+void crypto_randpool_read( unsigned char *buf, size_t len ) {
+    size_t take = 0, first = 0;
+
+    pthread_mutex_lock(&randpool_lock);
+    if (pool.running) {
+        take  = (len < pool.fill) ? len : pool.fill;
+        first = (take < pool.size - pool.head) ? take :
+            pool.size - pool.head;
+
+        /* the ready bytes may wrap around the end of the ring */
+        memcpy(buf, pool.base + pool.head, first);
+        crypto_wipe(pool.base + pool.head, first);
+        memcpy(buf + first, pool.base, take - first);
+        crypto_wipe(pool.base, take - first);
+
+        pool.head    = (pool.head + take) % pool.size;
+        pool.fill   -= take;
+        pool.served += take;
+
+        if ((! pool.filling) && (pool.fill < RANDPOOL_LOW_WATER)) {
+            pool.filling = 1;
+            pthread_cond_signal(&randpool_wake);
+        }
+    }
+    pool.direct += len - take;
+    pthread_mutex_unlock(&randpool_lock);
+
+    /* ran dry: the caller waits for entropy after all */
+    if (take < len) {
+        gcry_randomize(buf + take, len - take, CRYPTO_RANDOM_STRENGTH);
+    }
+}
+
+void crypto_randpool_stats( struct randpool_stats *st ) {
+    pthread_mutex_lock(&randpool_lock);
+    st->size      = pool.size;
+    st->fill      = pool.fill;
+    st->low_water = pool.running ? RANDPOOL_LOW_WATER : 0;
+    st->refills   = pool.refills;
+    st->served    = pool.served;
+    st->direct    = pool.direct;
+    st->locked    = pool.locked;
+    pthread_mutex_unlock(&randpool_lock);
+}
+
+void crypto_randpool_stop( ) {
+    pthread_mutex_lock(&randpool_lock);
+    if (! pool.running) {
+        pthread_mutex_unlock(&randpool_lock);
+        return;
+    }
+
+    pool.stop = 1;
+    pthread_cond_signal(&randpool_wake);
+    pthread_mutex_unlock(&randpool_lock);
+
+    pthread_join(pool.thread, NULL);
+
+    pthread_mutex_lock(&randpool_lock);
+    crypto_wipe(pool.base, pool.size);
+    munmap(pool.base, pool.size);
+    memset(&pool, 0, sizeof pool);
+    pthread_mutex_unlock(&randpool_lock);
+}
+
+crypto_return_t crypto_randstream_new( randstream_t *rsp ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    randstream_t rs = NULL;
+    unsigned char seed[32 + 16];    /* key and initial counter */
+
+    *rsp = NULL;
+    if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    rs = malloc(sizeof *rs);
+    if (NULL == rs) {
+        return CRYPTO_FAILURE;
+    }
+
+    gcry_randomize(seed, sizeof seed, GCRY_STRONG_RANDOM);
+    if ((0 == gcry_cipher_open(&rs->hd, GCRY_CIPHER_AES256,
+                    GCRY_CIPHER_MODE_CTR, 0))) {
+        if ((0 == gcry_cipher_setkey(rs->hd, seed, 32)) &&
+                (0 == gcry_cipher_setctr(rs->hd, seed + 32, 16))) {
+            result = CRYPTO_SUCCESS;
+        } else {
+            gcry_cipher_close(rs->hd);
+        }
+    }
+    crypto_wipe(seed, sizeof seed);
+
+    if (CRYPTO_SUCCESS != result) {
+        TRACE_ERROR("[!] could not set up a keystream!\n");
+
+        free(rs);
+        return result;
+    }
+
+    *rsp = rs;
+    return CRYPTO_SUCCESS;
+}
+
+crypto_return_t crypto_randstream_fill( randstream_t rs, unsigned char *buf,
+        size_t len ) {
+    /* the keystream is the encryption of zeros */
+    memset(buf, 0, len);
+    if (0 != gcry_cipher_encrypt(rs->hd, buf, len, NULL, 0)) {
+        return CRYPTO_FAILURE;
+    }
+
+    return CRYPTO_SUCCESS;
+}
+
+void crypto_randstream_free( randstream_t rs ) {
+    if (NULL == rs) {
+        return;
+    }
+
+    gcry_cipher_close(rs->hd);
+    free(rs);
+}
+
+
+/**************************************************************************/
+/*                          internal helpers                              */
+/**************************************************************************/
+
+/* the refill thread. it writes only the free part of the ring, which
+ * readers never touch, so it can draw random bytes without the lock. */
+static void *randpool_refill( void *arg ) {
+    size_t at = 0, len = 0;
+
+    (void) arg;
+
+    pthread_mutex_lock(&randpool_lock);
+    while (! pool.stop) {
+        if (! pool.filling) {
+            pthread_cond_wait(&randpool_wake, &randpool_lock);
+            continue;
+        }
+
+        if (pool.fill == pool.size) {
+            pool.filling = 0;
+            continue;
+        }
+
+        at  = (pool.head + pool.fill) % pool.size;
+        len = pool.size - pool.fill;
+        if (len > pool.size - at) {
+            len = pool.size - at;
+        }
+        if (len > RANDPOOL_REFILL) {
+            len = RANDPOOL_REFILL;
+        }
+
+        pthread_mutex_unlock(&randpool_lock);
+        gcry_randomize(pool.base + at, len, CRYPTO_RANDOM_STRENGTH);
+        pthread_mutex_lock(&randpool_lock);
+
+        pool.fill += len;
+        pool.refills++;
+    }
+    pthread_mutex_unlock(&randpool_lock);
+
+    return NULL;
+}
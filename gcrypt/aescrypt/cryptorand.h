@@ -0,0 +1,122 @@
+/**************************************************************************
+ * cryptorand.h                                                           *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-22                                                             *
+ *                                                                        *
+ * random pool for bulk key generation, keystream for filler data        *
+ **************************************************************************/
+
+#ifndef __CRYPTORAND_H
+#define __CRYPTORAND_H
+
+#include <stdlib.h>
+
+#include "config.h"
+#include "crypto.h"
+
+/**************************************************************************/
+/*                        note on the random pool                         */
+/**************************************************************************/
+/*
+ * gcry_randomize at CRYPTO_RANDOM_STRENGTH may block waiting for entropy,
+ * which is harmless for one key but stalls provisioning thousands of them.
+ * the random pool moves that wait off the caller: a RANDPOOL_SIZE ring
+ * buffer, mapped and locked like the key arena (see cryptoarena.h), is
+ * kept topped up by a background thread drawing RANDPOOL_REFILL bytes at a
+ * time at CRYPTO_RANDOM_STRENGTH. the thread wakes once the pool drops
+ * below RANDPOOL_LOW_WATER and refills it completely.
+ *
+ * readers copy bytes straight out of the pool into their destination and
+ * wipe what they took; bytes are never handed out twice. if the pool runs
+ * dry the rest is drawn from libgcrypt directly, in the caller, so a read
+ * always completes; crypto_randpool_stats tells how often that happened.
+ *
+ * the pool is started by the first crypto_genkeys and stopped by
+ * crypto_shutdown.
+ *
+ * bulk filler data that only has to look random, such as the passes of
+ * crypto_wipe_file, comes from a randstream instead: an AES-256-CTR
+ * keystream whose key and counter are drawn once from the strong RNG.
+ * producing it costs one AES block per 16 bytes, i.e. it runs at AES-NI
+ * speed where the CPU has it, far faster than the CSPRNG. it must not be
+ * used for keys.
+ */
+
+
+/********************************************************************
+ * randpool_stats:                                                  *
+ *      fill level and counters of the random pool                  *
+ *                                                                  *
+ * size: capacity of the pool in bytes, 0 if it is not running      *
+ * fill: bytes ready in the pool right now                          *
+ * low_water: fill level below which the pool is refilled           *
+ * refills: chunks of RANDPOOL_REFILL bytes drawn into the pool     *
+ * served: bytes handed out from the pool                           *
+ * direct: bytes drawn directly because the pool ran dry            *
+ * locked: the pool is locked into memory                           *
+ ********************************************************************/
+struct randpool_stats {
+    size_t size;
+    size_t fill;
+    size_t low_water;
+    unsigned long refills;
+    unsigned long long served;
+    unsigned long long direct;
+    int locked;
+};
+
+
+/**************************************************************************/
+/*                         random pool functions                          */
+/**************************************************************************/
+
+/* crypto_randpool_start: map the pool and start its refill thread; does
+ *                  nothing if it is already running. thread safe.
+ *      arguments: none
+ *      returns: CRYPTO_SUCCESS, CRYPTO_NOT_INIT if libgcrypt is not
+ *                 initialised, or CRYPTO_FAILURE if the pool could not be
+ *                 mapped or the thread not started
+ */
+extern crypto_return_t crypto_randpool_start( void );
+
+/* crypto_randpool_read: fill a buffer with random bytes from the pool,
+ *                  drawing whatever the pool is short of directly. works,
+ *                  unpooled, if the pool is not running. thread safe.
+ *      arguments: the buffer and its length
+ */
+extern void crypto_randpool_read( unsigned char *, size_t );
+
+/* crypto_randpool_stats: fill in the pool's fill level and counters */
+extern void crypto_randpool_stats( struct randpool_stats * );
+
+/* crypto_randpool_stop: stop the refill thread, then wipe and unmap the
+ *                  pool. no reads may be in progress.
+ */
+extern void crypto_randpool_stop( void );
+
+/********************************************************************
+ * randstream_t:                                                    *
+ *      a seeded AES-CTR keystream for filler data. opaque; one     *
+ *      thread at a time.                                           *
+ ********************************************************************/
+typedef struct randstream * randstream_t;
+
+/* crypto_randstream_new: seed a new keystream from the strong RNG
+ *      arguments: the randstream_t to fill in
+ *      returns: CRYPTO_SUCCESS, CRYPTO_NOT_INIT if libgcrypt is not
+ *                 initialised, or CRYPTO_FAILURE
+ */
+extern crypto_return_t crypto_randstream_new( randstream_t * );
+
+/* crypto_randstream_fill: fill a buffer with the next bytes of the
+ *                  keystream
+ *      arguments: the randstream_t, the buffer and its length
+ *      returns: CRYPTO_SUCCESS or CRYPTO_FAILURE
+ */
+extern crypto_return_t crypto_randstream_fill( randstream_t, unsigned char *,
+                                               size_t );
+
+/* crypto_randstream_free: close and free a keystream; NULL is ignored */
+extern void crypto_randstream_free( randstream_t );
+
+#endif
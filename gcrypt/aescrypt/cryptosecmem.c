@@ -0,0 +1,167 @@
+/**************************************************************************
+ * cryptosecmem.c                                                         *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-24                                                             *
+ *                                                                        *
+ * secure memory, see cryptosecmem.h for documentation                    *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptosecmem.h"
+#include "debug.h"
+
+/* every allocation starts with its size, in a header that keeps the
+ * memory after it as aligned as the allocator's */
+#define     SECMEM_HEADER       16
+
+static size_t secmem_size = SECURE_MEM;
+static size_t secmem_expand = SECMEM_EXPAND;
+static int secmem_on = 0;
+
+static struct secmem_stats secmem_counters;
+static pthread_mutex_t secmem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+crypto_return_t crypto_secmem_set_size( size_t size ) {
+    if (gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+        return CRYPTO_FAILURE;
+    }
+
+    secmem_size = size;
+    return CRYPTO_SUCCESS;
+}
+
+size_t crypto_secmem_size( ) {
+    return secmem_size;
+}
+
+crypto_return_t crypto_secmem_set_expand( size_t expand ) {
+    if (gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+        return CRYPTO_FAILURE;
+    }
+
+    secmem_expand = expand;
+    return CRYPTO_SUCCESS;
+}
+
+void crypto_secmem_init( ) {
+    if (0 == secmem_size) {
+        return;
+    }
+
+    TRACE_INFO("[+] setting up %lu bytes of secure memory...\n",
+               (unsigned long) secmem_size);
+
+    /* place the random pool in secure memory */
+    gcry_control(GCRYCTL_USE_SECURE_RNDPOOL);
+
+    /* allocate secure memory */
+    gcry_control(GCRYCTL_INIT_SECMEM, (unsigned int) secmem_size);
+
+    /* grow instead of failing allocations once it is full */
+    if (0 != secmem_expand) {
+        gcry_control(GCRYCTL_AUTO_EXPAND_SECMEM,
+                     (unsigned int) secmem_expand);
+    }
+
+    /* resume secure memory warnings */
+    gcry_control(GCRYCTL_RESUME_SECMEM_WARN);
+
+    secmem_on = 1;
+}
+
+void crypto_secmem_term( ) {
+    if (! secmem_on) {
+        return;
+    }
+
+    /* zeroise and shut down secure memory */
+    gcry_control(GCRYCTL_TERM_SECMEM);
+    gcry_control(GCRYCTL_DISABLE_SECMEM);
+    secmem_on = 0;
+}
+
+int crypto_secmem_enabled( ) {
+    return secmem_on;
+}
+
+void *crypto_secmem_calloc( size_t n, size_t size ) {
+    unsigned char *p = NULL;
+    size_t total = 0;
+
+    if ((0 != size) && (n > (SIZE_MAX - SECMEM_HEADER) / size)) {
+        return NULL;
+    }
+    total = n * size + SECMEM_HEADER;
+
+    p = secmem_on ? gcry_calloc_secure(1, total) : gcry_calloc(1, total);
+
+    pthread_mutex_lock(&secmem_lock);
+    secmem_counters.allocs++;
+    if (NULL == p) {
+        secmem_counters.failures++;
+    } else {
+        secmem_counters.in_use += total;
+        if (secmem_counters.in_use > secmem_counters.high_water) {
+            secmem_counters.high_water = secmem_counters.in_use;
+        }
+    }
+    pthread_mutex_unlock(&secmem_lock);
+
+    if (NULL == p) {
+        TRACE_ERROR("[!] could not allocate %lu bytes of %s memory!\n",
+                    (unsigned long) total, secmem_on ? "secure" : "crypto");
+
+        return NULL;
+    }
+
+    memcpy(p, &total, sizeof total);
+    return p + SECMEM_HEADER;
+}
+
+void crypto_secmem_free( void *ptr ) {
+    unsigned char *p = ptr;
+    size_t total = 0;
+
+    if (NULL == p) {
+        return;
+    }
+
+    p -= SECMEM_HEADER;
+    memcpy(&total, p, sizeof total);
+
+    pthread_mutex_lock(&secmem_lock);
+    secmem_counters.in_use -= total;
+    pthread_mutex_unlock(&secmem_lock);
+
+    gcry_free(p);
+}
+
+void crypto_secmem_stats( struct secmem_stats *st ) {
+    pthread_mutex_lock(&secmem_lock);
+    *st = secmem_counters;
+    pthread_mutex_unlock(&secmem_lock);
+
+    st->size   = secmem_on ? secmem_size : 0;
+    st->expand = secmem_on ? secmem_expand : 0;
+}
+
+void crypto_secmem_dump( ) {
+    if (secmem_on) {
+        gcry_control(GCRYCTL_DUMP_SECMEM_STATS);
+    }
+}
+
+/* memset through a volatile pointer so the wipe is not optimised away */
+void crypto_wipe( void *p, size_t len ) {
+    void *(*volatile wipe)(void *, int, size_t) = memset;
+
+    wipe(p, 0, len);
+}
@@ -0,0 +1,114 @@
+/**************************************************************************
+ * cryptosecmem.h                                                         *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-24                                                             *
+ *                                                                        *
+ * runtime sizing and accounting of libgcrypt's secure memory             *
+ **************************************************************************/
+
+#ifndef __CRYPTOSECMEM_H
+#define __CRYPTOSECMEM_H
+
+#include <stdlib.h>
+
+#include "config.h"
+#include "crypto.h"
+
+/**************************************************************************/
+/*                        note on secure memory                           */
+/**************************************************************************/
+/*
+ * libgcrypt's secure memory is a locked pool set up once, by crypto_init.
+ * its size is a runtime setting: SECURE_MEM bytes unless
+ * crypto_secmem_set_size is called before crypto_init, 0 meaning no
+ * secure memory at all. the pool grows by SECMEM_EXPAND bytes at a time
+ * instead of failing when it is full, see crypto_secmem_set_expand; the
+ * initial size then only has to cover the usual load. an allocation
+ * larger than the step still fails once the pool is full.
+ *
+ * with secure memory, CRYPTO_MALLOC allocates from the pool, keys get
+ * cipher handles in secure memory, libgcrypt's random pool moves there
+ * too, and keys are generated at GCRY_VERY_STRONG_RANDOM. without it,
+ * CRYPTO_MALLOC falls back to gcry_calloc.
+ *
+ * every CRYPTO_MALLOC allocation is counted: crypto_secmem_stats reports
+ * the bytes in use, the most ever in use at once and the allocations that
+ * failed, which is what the pool should be sized by. libgcrypt's own use
+ * of the pool, for cipher contexts and its random pool, is not in these
+ * counters; crypto_secmem_dump has libgcrypt log its view of the pool.
+ * keys in the key arena (cryptoarena.h) are not in secure memory.
+ */
+
+
+/********************************************************************
+ * secmem_stats:                                                    *
+ *      size of and CRYPTO_MALLOC use of secure memory              *
+ *                                                                  *
+ * size: initial size of the pool, 0 without secure memory          *
+ * expand: bytes the pool grows by when full, 0 if it can not       *
+ * in_use: bytes allocated with CRYPTO_MALLOC and not freed         *
+ * high_water: the most bytes ever in use at once                   *
+ * allocs: allocations made                                         *
+ * failures: allocations that failed                                *
+ ********************************************************************/
+struct secmem_stats {
+    size_t size;
+    size_t expand;
+    size_t in_use;
+    size_t high_water;
+    unsigned long allocs;
+    unsigned long failures;
+};
+
+
+/**************************************************************************/
+/*                         secure memory functions                        */
+/**************************************************************************/
+
+/* crypto_secmem_set_size, crypto_secmem_size: set and return the size of
+ *                  the secure memory pool. setting it only works before
+ *                  crypto_init.
+ *      arguments: the size in bytes, 0 for no secure memory
+ *      returns: CRYPTO_FAILURE if libgcrypt is already initialised,
+ *                 CRYPTO_SUCCESS otherwise.
+ */
+extern crypto_return_t crypto_secmem_set_size( size_t );
+extern size_t crypto_secmem_size( void );
+
+/* crypto_secmem_set_expand: set by how many bytes a full pool grows;
+ *                  SECMEM_EXPAND by default, 0 for a fixed pool. only
+ *                  works before crypto_init.
+ *      returns: CRYPTO_FAILURE if libgcrypt is already initialised,
+ *                 CRYPTO_SUCCESS otherwise.
+ */
+extern crypto_return_t crypto_secmem_set_expand( size_t );
+
+/* crypto_secmem_init: set up secure memory as configured; part of
+ *                  crypto_init, before libgcrypt's initialisation is
+ *                  finished.
+ */
+extern void crypto_secmem_init( void );
+
+/* crypto_secmem_term: wipe and release secure memory; part of
+ *                  crypto_shutdown. nothing allocated from it may be used
+ *                  afterwards.
+ */
+extern void crypto_secmem_term( void );
+
+/* crypto_secmem_enabled, crypto_secmem_calloc and crypto_secmem_free are
+ * declared in crypto.h, next to the macros built on them */
+
+/* crypto_secmem_stats: fill in the size and counters of secure memory */
+extern void crypto_secmem_stats( struct secmem_stats * );
+
+/* crypto_secmem_dump: have libgcrypt log the use of its secure pool */
+extern void crypto_secmem_dump( void );
+
+/* crypto_wipe: zero memory holding keys or plaintext in a way the
+ *                  compiler can not drop as a dead store, as it may a
+ *                  memset right before the memory is freed or reused.
+ *      arguments: the memory and its length in bytes
+ */
+extern void crypto_wipe( void *, size_t );
+
+#endif
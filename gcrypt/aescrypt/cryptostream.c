@@ -0,0 +1,591 @@
+/**************************************************************************
+ * cryptostream.c                                                         *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-12                                                             *
+ *                                                                        *
+ * streaming chunked encryption / decryption, see cryptostream.h          *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptoaead.h"
+#include "cryptobuf.h"
+#include "cryptostream.h"
+#include "cryptoparallel.h"
+#include "cryptoaio.h"
+#include "cryptocontainer.h"
+#include "cryptoprofile.h"
+#include "metakey.h"
+#include "debug.h"
+
+/* number of worker threads for the file functions */
+static unsigned int stream_threads = 1;
+
+/* I/O method for the file functions */
+static stream_io_t stream_io = STREAM_IO_BUFFERED;
+
+/* bytes per chunk, and chunks in flight for the aio method */
+static size_t stream_chunk = STREAM_CHUNK_SIZE;
+static unsigned int stream_depth = AIO_QUEUE_DEPTH;
+
+/* authentication of new streams */
+static stream_aead_t stream_aead = STREAM_AEAD_NONE;
+
+static crypto_return_t stream_crypt( FILE *, FILE *, gcry_cipher_hd_t,
+                                     crypto_op_t );
+static crypto_key_return_t stream_new_header( metakey_t,
+                                              struct stream_header * );
+static crypto_return_t stream_check_header_fields( metakey_t,
+                                        const struct stream_header * );
+static crypto_return_t stream_decrypt_body( FILE *, FILE *, metakey_t,
+                                        const struct stream_header * );
+static crypto_return_t stream_crypt_file( FILE *, FILE *, metakey_t,
+                                          const unsigned char *,
+                                          crypto_op_t );
+static int stream_is_regular( FILE * );
+
+void crypto_stream_set_threads( unsigned int n ) {
+    if (0 == n) {
+        n = 1;
+    } else if (n > STREAM_MAX_THREADS) {
+        n = STREAM_MAX_THREADS;
+    }
+
+    stream_threads = n;
+}
+
+unsigned int crypto_stream_threads( ) {
+    return stream_threads;
+}
+
+void crypto_stream_set_io( stream_io_t io ) {
+    stream_io = io;
+}
+
+stream_io_t crypto_stream_io( ) {
+    return stream_io;
+}
+
+crypto_return_t crypto_stream_set_chunk_size( size_t n ) {
+    if ((0 == n) || (0 != n % STREAM_BLOCK_LEN)) {
+        return CRYPTO_FAILURE;
+    }
+
+    stream_chunk = n;
+    return CRYPTO_SUCCESS;
+}
+
+size_t crypto_stream_chunk_size( ) {
+    return stream_chunk;
+}
+
+crypto_return_t crypto_stream_set_depth( unsigned int depth ) {
+    if ((0 == depth) || (depth > AIO_MAX_DEPTH)) {
+        return CRYPTO_FAILURE;
+    }
+
+    stream_depth = depth;
+    return CRYPTO_SUCCESS;
+}
+
+unsigned int crypto_stream_depth( ) {
+    return stream_depth;
+}
+
+void crypto_stream_set_aead( stream_aead_t aead ) {
+    stream_aead = aead;
+}
+
+stream_aead_t crypto_stream_aead( ) {
+    return stream_aead;
+}
+
+void stream_ctr_offset( unsigned char *ctr, const unsigned char *iv,
+        uint64_t blocks ) {
+    unsigned int carry = 0;
+    int i = 0;
+
+    for (i = STREAM_IV_LEN - 1; i >= 0; --i) {
+        carry += (unsigned int) iv[i] + (unsigned int) (blocks & 0xff);
+        ctr[i] = (unsigned char) carry;
+        carry >>= 8;
+        blocks >>= 8;
+    }
+}
+
+void stream_header_pack( const struct stream_header *hdr,
+        unsigned char *raw ) {
+    memset(raw, 0, STREAM_HEADER_LEN);
+    memcpy(raw, STREAM_MAGIC, STREAM_MAGIC_LEN);
+    raw[4]  = hdr->version;
+    raw[5]  = hdr->algo;
+    raw[6]  = hdr->mode;
+    raw[7]  = hdr->flags;
+    raw[8]  = (unsigned char) (hdr->chunk_size >> 24);
+    raw[9]  = (unsigned char) (hdr->chunk_size >> 16);
+    raw[10] = (unsigned char) (hdr->chunk_size >> 8);
+    raw[11] = (unsigned char) hdr->chunk_size;
+    memcpy(raw + 16, hdr->iv, STREAM_IV_LEN);
+}
+
+crypto_return_t stream_header_unpack( const unsigned char *raw,
+        struct stream_header *hdr ) {
+    if (0 != memcmp(raw, STREAM_MAGIC, STREAM_MAGIC_LEN)) {
+        TRACE_ERROR("[!] input is not an encrypted stream!\n");
+
+        return CRYPTO_BAD_FORMAT;
+    }
+
+    hdr->version    = raw[4];
+    hdr->algo       = raw[5];
+    hdr->mode       = raw[6];
+    hdr->flags      = raw[7];
+    hdr->chunk_size = ((unsigned long) raw[8] << 24) |
+                      ((unsigned long) raw[9] << 16) |
+                      ((unsigned long) raw[10] << 8) |
+                      (unsigned long) raw[11];
+    memcpy(hdr->iv, raw + 16, STREAM_IV_LEN);
+
+    if (STREAM_VERSION != hdr->version) {
+        TRACE_ERROR("[!] unsupported stream version %u!\n",
+                    (unsigned int) hdr->version);
+
+        return CRYPTO_BAD_FORMAT;
+    }
+
+    return CRYPTO_SUCCESS;
+}
+
+crypto_return_t stream_header_write( FILE *out,
+        const struct stream_header *hdr ) {
+    unsigned char raw[STREAM_HEADER_LEN];
+
+    stream_header_pack(hdr, raw);
+    if (STREAM_HEADER_LEN != fwrite(raw, sizeof *raw, STREAM_HEADER_LEN,
+                out)) {
+        TRACE_ERROR("[!] error writing stream header!\n");
+
+        return CRYPTO_FAILURE;
+    }
+
+    return CRYPTO_SUCCESS;
+}
+
+crypto_return_t stream_header_read( FILE *in, struct stream_header *hdr ) {
+    unsigned char raw[STREAM_HEADER_LEN];
+
+    if (STREAM_HEADER_LEN != fread(raw, sizeof *raw, STREAM_HEADER_LEN,
+                in)) {
+        TRACE_ERROR("[!] input too short to hold a stream header!\n");
+
+        return ferror(in) ? CRYPTO_FAILURE : CRYPTO_BAD_FORMAT;
+    }
+
+    return stream_header_unpack(raw, hdr);
+}
+
+crypto_return_t crypto_encrypt_stream( FILE *in, FILE *out, metakey_t mk ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    gcry_cipher_hd_t hd = NULL;
+    struct stream_header hdr;
+
+    if (STREAM_AEAD_NONE != stream_aead) {
+        return crypto_aead_encrypt_stream(in, out, mk, stream_aead);
+    }
+
+    if (KEY_SUCCESS != stream_new_header(mk, &hdr)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    if (KEY_SUCCESS != crypto_cipher_get(mk, GCRY_CIPHER_MODE_CTR, &hd)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    if (0 != gcry_cipher_setctr(hd, hdr.iv, STREAM_IV_LEN)) {
+        TRACE_ERROR("[!] error setting the initial counter!\n");
+    } else if (CRYPTO_SUCCESS == stream_header_write(out, &hdr)) {
+        result = stream_crypt(in, out, hd, encrypt);
+    }
+
+    crypto_cipher_put(mk, hd);
+    return result;
+}
+
+crypto_return_t crypto_decrypt_stream( FILE *in, FILE *out, metakey_t mk ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    struct stream_header hdr;
+
+    result = stream_header_read(in, &hdr);
+    if ((CRYPTO_SUCCESS == result) && crypto_is_aead(&hdr)) {
+        return crypto_aead_decrypt_body(in, out, mk, &hdr);
+    } else if (CRYPTO_SUCCESS == result) {
+        result = stream_check_header_fields(mk, &hdr);
+    }
+
+    if (CRYPTO_SUCCESS != result) {
+        return result;
+    }
+
+    return stream_decrypt_body(in, out, mk, &hdr);
+}
+
+crypto_return_t crypto_encrypt_file( const char *infile, const char *outfile,
+        metakey_t mk ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    FILE *in = NULL, *out = NULL;
+
+    if (NULL == (in = stream_fopen(infile, "rb"))) {
+        return result;
+    }
+
+    if ((CRYPTO_SUCCESS != stream_check_output(fileno(in), outfile)) ||
+            (NULL == (out = stream_fopen(outfile, "w+b")))) {
+        stream_fclose(in);
+        return result;
+    }
+
+    /* frames go through the workers too, but always buffered: the mmap
+     * and aio paths only know CTR */
+    if ((STREAM_AEAD_NONE != stream_aead) && (stream_threads > 1) &&
+            stream_is_regular(in) && stream_is_regular(out)) {
+        result = crypto_aead_encrypt_parallel(in, out, mk, stream_aead);
+    } else if (((stream_threads > 1) || (STREAM_IO_BUFFERED != stream_io)) &&
+            (STREAM_AEAD_NONE == stream_aead) &&
+            stream_is_regular(in) && stream_is_regular(out)) {
+        struct stream_header hdr;
+
+        if (KEY_SUCCESS != stream_new_header(mk, &hdr)) {
+            result = CRYPTO_NOT_INIT;
+        } else if (CRYPTO_SUCCESS == stream_header_write(out, &hdr)) {
+            result = stream_crypt_file(in, out, mk, hdr.iv, encrypt);
+        }
+    } else {
+        result = crypto_encrypt_stream(in, out, mk);
+    }
+
+    if (CRYPTO_SUCCESS != stream_fclose_out(out)) {
+        result = CRYPTO_FAILURE;
+    }
+    stream_fclose(in);
+
+    return result;
+}
+
+crypto_return_t crypto_decrypt_file( const char *infile, const char *outfile,
+        metakey_t mk ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    struct stream_header hdr;
+    FILE *in = NULL, *out = NULL;
+
+    if (NULL == (in = stream_fopen(infile, "rb"))) {
+        return result;
+    }
+
+    /* look at the header before creating the output: containers are
+     * read through their own, seekable, code path */
+    result = stream_header_read(in, &hdr);
+    if ((CRYPTO_SUCCESS == result) && crypto_is_container(&hdr)) {
+        if (stdin == in) {
+            TRACE_ERROR("[!] containers can not be read from a pipe!\n");
+
+            return CRYPTO_BAD_FORMAT;
+        }
+
+        stream_fclose(in);
+        return crypto_container_decrypt_file(infile, outfile, mk, 0,
+                UINT64_MAX);
+    } else if ((CRYPTO_SUCCESS == result) && (! crypto_is_aead(&hdr))) {
+        result = stream_check_header_fields(mk, &hdr);
+    }
+
+    if (CRYPTO_SUCCESS != result) {
+        stream_fclose(in);
+        return result;
+    }
+
+    if ((CRYPTO_SUCCESS != stream_check_output(fileno(in), outfile)) ||
+            (NULL == (out = stream_fopen(outfile, "w+b")))) {
+        stream_fclose(in);
+        return CRYPTO_FAILURE;
+    }
+
+    if (crypto_is_aead(&hdr) && (STREAM_IO_BUFFERED != stream_io)) {
+        TRACE_INFO("[+] framed stream, using buffered I/O\n");
+    }
+
+    if (crypto_is_aead(&hdr) && (stream_threads > 1) &&
+            stream_is_regular(in) && stream_is_regular(out)) {
+        result = crypto_aead_decrypt_parallel(in, out, mk, &hdr);
+    } else if (crypto_is_aead(&hdr)) {
+        result = crypto_aead_decrypt_body(in, out, mk, &hdr);
+    } else if (((stream_threads > 1) || (STREAM_IO_BUFFERED != stream_io)) &&
+            stream_is_regular(in) && stream_is_regular(out)) {
+        result = stream_crypt_file(in, out, mk, hdr.iv, decrypt);
+    } else {
+        result = stream_decrypt_body(in, out, mk, &hdr);
+    }
+
+    if (CRYPTO_SUCCESS != stream_fclose_out(out)) {
+        result = CRYPTO_FAILURE;
+    }
+    stream_fclose(in);
+
+    return result;
+}
+
+
+/**************************************************************************/
+/*                           internal helpers                             */
+/**************************************************************************/
+
+/* fill in a header for a new stream encrypted under mk */
+static crypto_key_return_t stream_new_header( metakey_t mk,
+        struct stream_header *hdr ) {
+    if ((NULL == mk) || (1 != mk->initialised)) {
+        return KEY_NOT_INIT;
+    }
+
+    memset(hdr, 0, sizeof *hdr);
+    hdr->version    = STREAM_VERSION;
+    hdr->algo       = (unsigned char) mk->algo;
+    hdr->mode       = GCRY_CIPHER_MODE_CTR;
+    hdr->chunk_size = stream_chunk;
+
+    /* the counter block only has to be unique per key, not secret */
+    gcry_create_nonce(hdr->iv, STREAM_IV_LEN);
+
+    return KEY_SUCCESS;
+}
+
+/* make sure a parsed header describes a CTR stream mk can decrypt */
+static crypto_return_t stream_check_header_fields( metakey_t mk,
+        const struct stream_header *hdr ) {
+    if ((GCRY_CIPHER_MODE_CTR != hdr->mode) || (0 != hdr->flags) ||
+            (mk->algo != hdr->algo)) {
+        TRACE_ERROR("[!] stream was encrypted with algo %u mode %u, ",
+                    (unsigned int) hdr->algo, (unsigned int) hdr->mode);
+        TRACE_ERROR("key is for algo %d!\n", mk->algo);
+
+        return CRYPTO_BAD_FORMAT;
+    }
+
+    return CRYPTO_SUCCESS;
+}
+
+/* decrypt the CTR data following an already parsed header */
+static crypto_return_t stream_decrypt_body( FILE *in, FILE *out,
+        metakey_t mk, const struct stream_header *hdr ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    gcry_cipher_hd_t hd = NULL;
+
+    if (KEY_SUCCESS != crypto_cipher_get(mk, GCRY_CIPHER_MODE_CTR, &hd)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    if (0 != gcry_cipher_setctr(hd, hdr->iv, STREAM_IV_LEN)) {
+        TRACE_ERROR("[!] error setting the initial counter!\n");
+    } else {
+        result = stream_crypt(in, out, hd, decrypt);
+    }
+
+    crypto_cipher_put(mk, hd);
+    return result;
+}
+
+/* hand the rest of a regular file to the aio pipeline or the worker pool
+ * (which may be a single worker when only the mmap I/O method was asked
+ * for). the header has
+ * already been read from / written to the FILEs, so the data starts at
+ * STREAM_HEADER_LEN in the encrypted file and at 0 in the plain one. */
+static crypto_return_t stream_crypt_file( FILE *in, FILE *out, metakey_t mk,
+        const unsigned char *iv, crypto_op_t op ) {
+    struct stat st;
+    off_t in_off  = (encrypt == op) ? 0 : STREAM_HEADER_LEN;
+    off_t out_off = (encrypt == op) ? STREAM_HEADER_LEN : 0;
+    off_t len = 0;
+
+    /* the header goes out through stdio, the data through the fd */
+    if ((0 != fflush(out)) || (-1 == fstat(fileno(in), &st))) {
+        return CRYPTO_FAILURE;
+    }
+
+    len = st.st_size - in_off;
+    if (len < 0) {
+        return CRYPTO_BAD_FORMAT;
+    }
+
+    /* size the output up front so the workers never race to extend it,
+     * and so there is something to map for the mmap I/O method */
+    if (-1 == ftruncate(fileno(out), out_off + len)) {
+        TRACE_ERRNO("[!] ftruncate");
+
+        return CRYPTO_FAILURE;
+    }
+
+    if (STREAM_IO_AIO == stream_io) {
+        return stream_crypt_aio(fileno(in), in_off, fileno(out), out_off,
+                len, mk, iv, op, stream_depth, stream_chunk);
+    }
+
+    return stream_crypt_parallel(fileno(in), in_off, fileno(out), out_off,
+            len, mk, iv, op, stream_io, stream_threads, stream_chunk);
+}
+
+static int stream_is_regular( FILE *fp ) {
+    struct stat st;
+
+    if (-1 == fstat(fileno(fp), &st)) {
+        return 0;
+    }
+
+    return S_ISREG(st.st_mode);
+}
+
+/* run every remaining byte of in through the cipher and write it to out.
+ * only one chunk is ever held in memory. CTR mode keeps the unused part of
+ * the keystream between calls, so a short final chunk is handled too. */
+static crypto_return_t stream_crypt( FILE *in, FILE *out,
+        gcry_cipher_hd_t hd, crypto_op_t op ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    unsigned char *buf = NULL;
+    size_t rd = 0;
+    gcry_error_t err = 0;
+    uint64_t began = 0, stage = 0;
+
+    /* bulk data comes from the buffer pool: a chunk is far larger than a
+     * typical secure memory pool */
+    buf = crypto_buf_get(stream_chunk);
+    if (NULL == buf) {
+        TRACE_ERROR("[!] could not allocate stream buffer!\n");
+
+        return result;
+    }
+
+    do {
+        PROFILE_START(stage);
+        rd = fread(buf, sizeof *buf, stream_chunk, in);
+        PROFILE_END(PROFILE_READ, stage, rd);
+        if (0 == rd) {
+            break;
+        }
+
+        /* one chunk at a time */
+        crypto_profile_inflight(1);
+
+        TRACE_START(began);
+        PROFILE_START(stage);
+        if (encrypt == op) {
+            err = gcry_cipher_encrypt(hd, buf, rd, NULL, 0);
+        } else {
+            err = gcry_cipher_decrypt(hd, buf, rd, NULL, 0);
+        }
+        PROFILE_END(PROFILE_CIPHER, stage, rd);
+        TRACE_END(TRACE_CHUNK, began);
+
+        if (0 != err) {
+            TRACE_ERROR("[!] cipher error: %s\n", gcry_strerror(err));
+
+            goto out;
+        }
+
+        PROFILE_START(stage);
+        if (rd != fwrite(buf, sizeof *buf, rd, out)) {
+            TRACE_ERRNO("[!] fwrite");
+
+            goto out;
+        }
+        PROFILE_END(PROFILE_WRITE, stage, rd);
+    } while (stream_chunk == rd);
+
+    if (0 != ferror(in)) {
+        TRACE_ERRNO("[!] fread");
+    } else {
+        result = CRYPTO_SUCCESS;
+    }
+
+out:
+    /* wiped on the way back, it may still hold plaintext */
+    crypto_buf_put(buf, stream_chunk);
+
+    return result;
+}
+
+/* output files are opened read-write: a shared writable mapping needs it */
+FILE *stream_fopen( const char *filename, const char *mode ) {
+    FILE *fp = NULL;
+
+    if ((NULL == filename) || (0 == strcmp(filename, "-"))) {
+        return ('r' == mode[0]) ? stdin : stdout;
+    }
+
+    fp = fopen(filename, mode);
+    if (NULL == fp) {
+        TRACE_ERROR("[!] error opening %s!\n", filename);
+        TRACE_ERRNO("fopen");
+    }
+
+    return fp;
+}
+
+crypto_return_t stream_check_output( int infd, const char *outfile ) {
+    struct stat in_st, out_st;
+    int rc = 0;
+
+    /* a terminal may well be both stdin and stdout */
+    if ((-1 == fstat(infd, &in_st)) || (! S_ISREG(in_st.st_mode))) {
+        return CRYPTO_SUCCESS;
+    }
+
+    if ((NULL == outfile) || (0 == strcmp(outfile, "-"))) {
+        rc = fstat(fileno(stdout), &out_st);
+    } else {
+        rc = stat(outfile, &out_st);
+    }
+
+    /* an output that does not exist yet can not be the input */
+    if ((0 == rc) && (in_st.st_dev == out_st.st_dev) &&
+            (in_st.st_ino == out_st.st_ino)) {
+        TRACE_ERROR("[!] the output is the input file!\n");
+
+        return CRYPTO_FAILURE;
+    }
+
+    return CRYPTO_SUCCESS;
+}
+
+crypto_return_t stream_fclose( FILE *fp ) {
+    if (stdin == fp) {
+        return CRYPTO_SUCCESS;
+    }
+
+    if (stdout == fp) {
+        return (0 == fflush(fp)) ? CRYPTO_SUCCESS : CRYPTO_FAILURE;
+    }
+
+    if (0 != fclose(fp)) {
+        TRACE_ERRNO("[!] fclose");
+
+        return CRYPTO_FAILURE;
+    }
+
+    return CRYPTO_SUCCESS;
+}
+
+crypto_return_t stream_fclose_out( FILE *fp ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    uint64_t stage = 0;
+
+    PROFILE_START(stage);
+    result = stream_fclose(fp);
+    PROFILE_END(PROFILE_SYNC, stage, 0);
+
+    return result;
+}
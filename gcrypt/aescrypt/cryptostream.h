@@ -0,0 +1,266 @@
+/**************************************************************************
+ * cryptostream.h                                                         *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-12                                                             *
+ *                                                                        *
+ * streaming chunked encryption / decryption of files                     *
+ **************************************************************************/
+
+#ifndef __CRYPTOSTREAM_H
+#define __CRYPTOSTREAM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "metakey.h"
+
+/**************************************************************************/
+/*                          stream file format                            */
+/**************************************************************************/
+/*
+ * an encrypted stream is a fixed size header followed by the ciphertext.
+ * the ciphertext is the same length as the plaintext; the whole stream is
+ * encrypted in CTR mode with the counter starting at the header's IV, so
+ * the data can be processed in chunks of any size without padding.
+ *
+ * header layout (all multi-byte integers are big endian):
+ *      offset  size    field
+ *      0       4       magic, "AESC"
+ *      4       1       format version
+ *      5       1       gcrypt cipher algorithm id
+ *      6       1       gcrypt cipher mode id
+ *      7       1       flags, 0, STREAM_FLAG_INDEXED or
+ *                      STREAM_FLAG_FRAMED
+ *      8       4       chunk size used by the writer
+ *      12      4       reserved, must be 0
+ *      16      16      initial counter block
+ *
+ * a header with STREAM_FLAG_INDEXED set starts a seekable container
+ * instead of a CTR stream; see cryptocontainer.h. one with
+ * STREAM_FLAG_FRAMED set starts a stream of authenticated frames; see
+ * cryptoaead.h.
+ */
+#define     STREAM_MAGIC            "AESC"
+#define     STREAM_MAGIC_LEN        4
+#define     STREAM_VERSION          1
+#define     STREAM_IV_LEN           16
+#define     STREAM_HEADER_LEN       32
+#define     STREAM_BLOCK_LEN        16
+
+#define     STREAM_FLAG_INDEXED     0x01
+#define     STREAM_FLAG_FRAMED      0x02
+
+/********************************************************************
+ * stream_header:                                                   *
+ *      decoded form of the on-disk stream header                   *
+ *                                                                  *
+ * version: format version, STREAM_VERSION for new streams          *
+ * algo: gcrypt cipher id the stream was encrypted with             *
+ * mode: gcrypt cipher mode the stream was encrypted with           *
+ * flags: format flags                                              *
+ * chunk_size: size of the chunks the writer used                   *
+ * iv: initial counter block                                        *
+ ********************************************************************/
+struct stream_header {
+    unsigned char version;
+    unsigned char algo;
+    unsigned char mode;
+    unsigned char flags;
+    unsigned long chunk_size;
+    unsigned char iv[STREAM_IV_LEN];
+};
+
+
+/********************************************************************
+ * stream_io_t:                                                     *
+ *      how the file functions move data between disk and cipher    *
+ *                                                                  *
+ * STREAM_IO_BUFFERED: read / pread into a chunk buffer, encrypt    *
+ *          in place, write / pwrite it out                         *
+ * STREAM_IO_MMAP: map the input read-only and the pre-sized output *
+ *          read-write and encrypt from one mapping into the other. *
+ *          only used when both files are regular files; anything   *
+ *          else (pipes, ttys, devices) falls back to buffered I/O. *
+ * STREAM_IO_AIO: keep several reads and writes in flight while the *
+ *          cipher runs, on io_uring or I/O threads (see cryptoaio.h)*
+ *          also limited to regular files.                          *
+ ********************************************************************/
+enum stream_io {
+    STREAM_IO_BUFFERED = 0,
+    STREAM_IO_MMAP,
+    STREAM_IO_AIO
+};
+
+typedef enum stream_io stream_io_t;
+
+
+/********************************************************************
+ * stream_aead_t:                                                   *
+ *      whether, and how, the stream functions authenticate         *
+ *                                                                  *
+ * STREAM_AEAD_NONE: plain CTR stream, no integrity protection      *
+ * STREAM_AEAD_GCM: frames sealed with the key's AES in GCM mode    *
+ * STREAM_AEAD_OCB: frames sealed with the key's AES in OCB mode    *
+ * STREAM_AEAD_CHACHA20: frames sealed with ChaCha20-Poly1305 keyed *
+ *          with the key's bytes; needs a 256-bit key               *
+ * STREAM_AEAD_AUTO: whichever of the above is fastest on this CPU  *
+ *          for the key, see crypto_aead_select. the header records *
+ *          the one used.                                           *
+ ********************************************************************/
+enum stream_aead {
+    STREAM_AEAD_NONE = 0,
+    STREAM_AEAD_GCM,
+    STREAM_AEAD_OCB,
+    STREAM_AEAD_CHACHA20,
+    STREAM_AEAD_AUTO
+};
+
+typedef enum stream_aead stream_aead_t;
+
+
+/**************************************************************************/
+/*                           stream functions                             */
+/**************************************************************************/
+
+/* crypto_encrypt_stream: encrypt everything readable from one stdio stream
+ *                  into another, STREAM_CHUNK_SIZE bytes at a time. memory
+ *                  use is bounded by the chunk size, not the input size.
+ *                  with an AEAD set by crypto_stream_set_aead, the output
+ *                  is a framed stream instead (see cryptoaead.h).
+ *      arguments: the input FILE *, the output FILE *, and the metakey_t
+ *                 to encrypt with. the key's algo must be set.
+ *      returns: a crypto_return_t: CRYPTO_SUCCESS, CRYPTO_FAILURE, or
+ *                 CRYPTO_NOT_INIT if the key or library is not ready.
+ */
+extern crypto_return_t crypto_encrypt_stream( FILE *, FILE *, metakey_t );
+
+/* crypto_decrypt_stream: decrypt a stream written by crypto_encrypt_stream
+ *      arguments: the input FILE *, the output FILE *, and the metakey_t
+ *                 to decrypt with.
+ *      returns: a crypto_return_t: CRYPTO_SUCCESS, CRYPTO_FAILURE,
+ *                 CRYPTO_NOT_INIT, CRYPTO_BAD_FORMAT if the header is
+ *                 invalid or does not match the key's algorithm, or
+ *                 CRYPTO_AUTH_FAILURE if a frame of a framed stream does
+ *                 not verify; the output then ends before that frame.
+ */
+extern crypto_return_t crypto_decrypt_stream( FILE *, FILE *, metakey_t );
+
+/* crypto_encrypt_file, crypto_decrypt_file: wrappers around the stream
+ *                  functions that open and close the named files. a NULL
+ *                  or "-" filename selects stdin / stdout. an existing
+ *                  output file is overwritten. if more than one thread has
+ *                  been requested with crypto_stream_set_threads and both
+ *                  files are regular files, the data is processed in 
+ *                  parallel (see cryptoparallel.h); the output is the same
+ *                  either way.
+ *      arguments: the input filename, the output filename, and the
+ *                 metakey_t to use.
+ *      returns: see crypto_encrypt_stream and crypto_decrypt_stream.
+ */
+extern crypto_return_t crypto_encrypt_file( const char *, const char *,
+                                            metakey_t );
+extern crypto_return_t crypto_decrypt_file( const char *, const char *,
+                                            metakey_t );
+
+/* crypto_stream_set_threads, crypto_stream_threads: set and return the
+ *                  number of worker threads used by the file functions.
+ *                  0 is treated as 1; values above STREAM_MAX_THREADS are
+ *                  clamped.
+ */
+extern void crypto_stream_set_threads( unsigned int );
+extern unsigned int crypto_stream_threads( void );
+
+/* crypto_stream_set_io, crypto_stream_io: set and return the I/O method
+ *                  used by the file functions; STREAM_IO_BUFFERED by 
+ *                  default.
+ */
+extern void crypto_stream_set_io( stream_io_t );
+extern stream_io_t crypto_stream_io( void );
+
+/* crypto_stream_set_chunk_size, crypto_stream_chunk_size: set and return
+ *                  the number of bytes read, encrypted, and written at a
+ *                  time; STREAM_CHUNK_SIZE by default.
+ *      returns: CRYPTO_FAILURE if the size is 0 or not a multiple of
+ *                 STREAM_BLOCK_LEN, CRYPTO_SUCCESS otherwise.
+ */
+extern crypto_return_t crypto_stream_set_chunk_size( size_t );
+extern size_t crypto_stream_chunk_size( void );
+
+/* crypto_stream_set_depth, crypto_stream_depth: set and return the number
+ *                  of chunks the aio I/O method keeps in flight;
+ *                  AIO_QUEUE_DEPTH by default.
+ *      returns: CRYPTO_FAILURE if the depth is 0 or above AIO_MAX_DEPTH,
+ *                 CRYPTO_SUCCESS otherwise.
+ */
+extern crypto_return_t crypto_stream_set_depth( unsigned int );
+extern unsigned int crypto_stream_depth( void );
+
+/* crypto_stream_set_aead, crypto_stream_aead: set and return how the
+ *                  encrypting stream and file functions authenticate;
+ *                  STREAM_AEAD_NONE by default. between regular files,
+ *                  authenticated streams are spread over the worker
+ *                  threads like CTR streams, but always with buffered
+ *                  I/O: the mmap and aio methods only apply to
+ *                  STREAM_AEAD_NONE. decryption follows the stream header.
+ */
+extern void crypto_stream_set_aead( stream_aead_t );
+extern stream_aead_t crypto_stream_aead( void );
+
+/* stream_ctr_offset: compute the counter block for a position in the
+ *                  stream, i.e. iv + blocks as a 128-bit big endian
+ *                  integer, the same way gcrypt increments it in CTR mode.
+ *      arguments: the STREAM_IV_LEN byte output buffer, the initial
+ *                 counter block, and the number of cipher blocks to skip.
+ */
+extern void stream_ctr_offset( unsigned char *, const unsigned char *,
+                               uint64_t );
+
+/* stream_header_pack, stream_header_unpack: convert between a struct
+ *                  stream_header and its STREAM_HEADER_LEN byte on-disk form
+ *      returns: (unpack) CRYPTO_SUCCESS, or CRYPTO_BAD_FORMAT if the magic
+ *                 or version do not match.
+ */
+extern void stream_header_pack( const struct stream_header *,
+                                unsigned char * );
+extern crypto_return_t stream_header_unpack( const unsigned char *,
+                                             struct stream_header * );
+
+/* stream_fopen, stream_fclose: open and close a file for the stream
+ *                  functions. a NULL or "-" filename maps to stdin or
+ *                  stdout depending on the mode, and closing those only
+ *                  flushes them. 
+ *      returns: (fopen) the FILE *, or NULL on error
+ *               (fclose) CRYPTO_SUCCESS or CRYPTO_FAILURE
+ */
+extern FILE *stream_fopen( const char *, const char * );
+extern crypto_return_t stream_fclose( FILE * );
+
+/* stream_check_output: make sure an output path does not name the file
+ *                  already open as the input, which opening the output
+ *                  would truncate before a byte of it was read.
+ *      arguments: the input file descriptor, and the output path (NULL or
+ *                 "-" for stdout)
+ *      returns: CRYPTO_SUCCESS, or CRYPTO_FAILURE if both are the same file
+ */
+extern crypto_return_t stream_check_output( int, const char * );
+
+/* stream_fclose_out: stream_fclose for an output, accounted as the sync
+ *                  stage of the profiler (see cryptoprofile.h)
+ */
+extern crypto_return_t stream_fclose_out( FILE * );
+
+/* stream_header_write, stream_header_read: serialise and parse the
+ *                  STREAM_HEADER_LEN byte on-disk header.
+ *      arguments: a FILE * and the struct stream_header to fill or write
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE on I/O errors, or
+ *                 CRYPTO_BAD_FORMAT (read only) if the magic or version
+ *                 do not match.
+ */
+extern crypto_return_t stream_header_write( FILE *,
+                                            const struct stream_header * );
+extern crypto_return_t stream_header_read( FILE *, struct stream_header * );
+
+#endif
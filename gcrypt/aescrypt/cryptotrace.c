@@ -0,0 +1,294 @@
+/**************************************************************************
+ * cryptotrace.c                                                          *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-26                                                             *
+ *                                                                        *
+ * tracing, see cryptotrace.h for documentation                           *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptotrace.h"
+#include "debug.h"
+
+/* bucket i holds latencies below 2^i ns, down to the previous bucket's
+ * bound; the last one takes everything longer */
+#define     TRACE_BUCKETS       48
+
+/********************************************************************
+ * trace_hist:                                                      *
+ *      latency histogram of one operation, in nanoseconds          *
+ ********************************************************************/
+struct trace_hist {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t bucket[TRACE_BUCKETS];
+};
+
+/********************************************************************
+ * trace_out:                                                       *
+ *      buffered writer for the JSON dump                           *
+ ********************************************************************/
+struct trace_out {
+    int fd;
+    int failed;
+    size_t len;
+    char buf[512];
+};
+
+int crypto_trace_level = TRACE_LEVEL;
+
+static const char *trace_names[TRACE_OPS] = {
+    "keygen", "keyload", "wipe_pass", "chunk"
+};
+
+static struct trace_hist trace_hists[TRACE_OPS];
+static int trace_latency = 0;
+static char trace_path[PATH_MAX];
+
+static void trace_signal( int );
+static void trace_dump_path( void );
+static void out_str( struct trace_out *, const char * );
+static void out_u64( struct trace_out *, uint64_t );
+static void out_flush( struct trace_out * );
+
+void crypto_trace_set_level( int level ) {
+    crypto_trace_level = level;
+}
+
+void crypto_trace( int level, const char *fmt, ... ) {
+    char line[1024];
+    va_list ap;
+
+    if (level > crypto_trace_level) {
+        return;
+    }
+
+    /* one write per message: stderr is unbuffered */
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof line, fmt, ap);
+    va_end(ap);
+
+    fputs(line, stderr);
+}
+
+void crypto_trace_errno( const char *what ) {
+    int err = errno;
+
+    crypto_trace(TRACE_LEVEL_ERROR, "%s: %s\n", what, strerror(err));
+    errno = err;
+}
+
+void crypto_trace_set_latency( int on ) {
+    __atomic_store_n(&trace_latency, (0 != on), __ATOMIC_RELAXED);
+}
+
+uint64_t crypto_trace_clock( ) {
+    struct timespec ts;
+    uint64_t now = 0;
+
+    if (! __atomic_load_n(&trace_latency, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+
+    /* 0 means not timed */
+    return (0 == now) ? 1 : now;
+}
+
+void crypto_trace_record( trace_op_t op, uint64_t start ) {
+    struct trace_hist *h = NULL;
+    uint64_t ns = 0, max = 0;
+    unsigned int b = 0;
+
+    if ((0 == start) || (op >= TRACE_OPS)) {
+        return;
+    }
+
+    ns = crypto_trace_clock();
+    ns = (ns > start) ? ns - start : 0;
+
+    /* the bucket is the bit length of the latency */
+    b = (0 == ns) ? 0 : 64 - (unsigned int) __builtin_clzll(ns);
+    if (b >= TRACE_BUCKETS) {
+        b = TRACE_BUCKETS - 1;
+    }
+
+    h = &trace_hists[op];
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->total, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->bucket[b], 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while ((ns > max) && ! __atomic_compare_exchange_n(&h->max, &max, ns,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+crypto_return_t crypto_trace_dump( int fd ) {
+    struct trace_out out;
+    struct trace_hist *h = NULL;
+    unsigned int op = 0, b = 0;
+    int first = 0;
+
+    out.fd = fd;
+    out.failed = 0;
+    out.len = 0;
+
+    out_str(&out, "{");
+    for (op = 0; op < TRACE_OPS; ++op) {
+        h = &trace_hists[op];
+
+        out_str(&out, (0 == op) ? "\"" : ",\n \"");
+        out_str(&out, trace_names[op]);
+        out_str(&out, "\": {\"count\": ");
+        out_u64(&out, __atomic_load_n(&h->count, __ATOMIC_RELAXED));
+        out_str(&out, ", \"total_ns\": ");
+        out_u64(&out, __atomic_load_n(&h->total, __ATOMIC_RELAXED));
+        out_str(&out, ", \"max_ns\": ");
+        out_u64(&out, __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+        out_str(&out, ", \"buckets\": [");
+
+        first = 1;
+        for (b = 0; b < TRACE_BUCKETS; ++b) {
+            uint64_t n = __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+
+            if (0 == n) {
+                continue;
+            }
+
+            out_str(&out, first ? "[" : ", [");
+            out_u64(&out, (uint64_t) 1 << b);
+            out_str(&out, ", ");
+            out_u64(&out, n);
+            out_str(&out, "]");
+            first = 0;
+        }
+        out_str(&out, "]}");
+    }
+    out_str(&out, "}\n");
+    out_flush(&out);
+
+    return out.failed ? CRYPTO_FAILURE : CRYPTO_SUCCESS;
+}
+
+crypto_return_t crypto_trace_dump_to( const char *path, int signo ) {
+    struct sigaction sa;
+
+    if (strlen(path) >= sizeof trace_path) {
+        return CRYPTO_FAILURE;
+    }
+
+    strcpy(trace_path, path);
+    crypto_trace_set_latency(1);
+
+    if (0 == signo) {
+        return CRYPTO_SUCCESS;
+    }
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = trace_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (0 != sigaction(signo, &sa, NULL)) {
+        TRACE_ERRNO("[!] sigaction");
+        return CRYPTO_FAILURE;
+    }
+
+    return CRYPTO_SUCCESS;
+}
+
+void crypto_trace_shutdown( ) {
+    trace_dump_path();
+}
+
+
+/**************************************************************************/
+/*                          internal helpers                              */
+/**************************************************************************/
+
+static void trace_signal( int signo ) {
+    int err = errno;
+
+    (void) signo;
+    trace_dump_path();
+    errno = err;
+}
+
+/* open, write and close only: this runs in the signal handler too */
+static void trace_dump_path( ) {
+    int fd = -1;
+
+    if ('\0' == trace_path[0]) {
+        return;
+    } else if (0 == strcmp(trace_path, "-")) {
+        crypto_trace_dump(STDERR_FILENO);
+        return;
+    }
+
+    fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (-1 == fd) {
+        return;
+    }
+
+    crypto_trace_dump(fd);
+    close(fd);
+}
+
+static void out_str( struct trace_out *out, const char *s ) {
+    size_t n = strlen(s);
+
+    if (out->len + n > sizeof out->buf) {
+        out_flush(out);
+    }
+
+    memcpy(out->buf + out->len, s, n);
+    out->len += n;
+}
+
+/* snprintf is not async-signal-safe */
+static void out_u64( struct trace_out *out, uint64_t v ) {
+    char digits[21];
+    size_t i = sizeof digits - 1;
+
+    digits[i] = '\0';
+    do {
+        digits[--i] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (0 != v);
+
+    out_str(out, digits + i);
+}
+
+static void out_flush( struct trace_out *out ) {
+    size_t off = 0;
+    ssize_t wr = 0;
+
+    while (off < out->len) {
+        wr = write(out->fd, out->buf + off, out->len - off);
+        if ((-1 == wr) && (EINTR == errno)) {
+            continue;
+        } else if (wr <= 0) {
+            out->failed = 1;
+            break;
+        }
+        off += (size_t) wr;
+    }
+
+    out->len = 0;
+}
@@ -0,0 +1,120 @@
+/**************************************************************************
+ * cryptotrace.h                                                          *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-26                                                             *
+ *                                                                        *
+ * leveled trace messages and latency histograms                          *
+ **************************************************************************/
+
+#ifndef __CRYPTOTRACE_H
+#define __CRYPTOTRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "crypto.h"
+
+/**************************************************************************/
+/*                          note on tracing                               */
+/**************************************************************************/
+/*
+ * the library's messages go through the TRACE_* macros of debug.h. without
+ * DEBUG they compile to nothing. with it, a message is written to stderr,
+ * in one piece so lines from different threads do not mix, only if its
+ * level is at or below the runtime level: TRACE_LEVEL_ERROR by default
+ * (TRACE_LEVEL in config.h), so only failures are reported unless
+ * crypto_trace_set_level asks for more. nothing is ever written to stdout,
+ * which may be carrying ciphertext.
+ *
+ * with TRACE_LATENCY, key generation, key loads, wipe passes and chunk
+ * encryption can be timed into per-operation histograms once
+ * crypto_trace_set_latency turns them on; until then timing costs one
+ * branch. a histogram has a bucket for every power of two nanoseconds and
+ * is updated with atomic adds, so any thread may record into it.
+ * crypto_trace_dump writes them out as JSON:
+ *
+ *      {"keygen": {"count": 2, "total_ns": 5120, "max_ns": 3001,
+ *                  "buckets": [[2048, 1], [4096, 1]]}, ...}
+ *
+ * where each bucket is [upper bound in ns, count] and empty buckets are
+ * left out. crypto_trace_dump_to names a file the histograms are written
+ * to by crypto_shutdown and, if a signal is given, whenever it arrives.
+ */
+
+#define TRACE_LEVEL_NONE        0
+#define TRACE_LEVEL_ERROR       1
+#define TRACE_LEVEL_INFO        2
+#define TRACE_LEVEL_DEBUG       3
+
+/* operations with a latency histogram */
+typedef enum {
+    TRACE_KEYGEN,
+    TRACE_KEYLOAD,
+    TRACE_WIPE_PASS,
+    TRACE_CHUNK,
+    TRACE_OPS
+} trace_op_t;
+
+/* the runtime level; read by the TRACE_* macros */
+extern int crypto_trace_level;
+
+
+/**************************************************************************/
+/*                            trace functions                             */
+/**************************************************************************/
+
+/* crypto_trace_set_level: set which messages are written
+ *      arguments: TRACE_LEVEL_NONE up to TRACE_LEVEL_DEBUG
+ */
+extern void crypto_trace_set_level( int );
+
+/* crypto_trace: write a message to stderr; use the TRACE_* macros, which
+ *                  check the level first
+ *      arguments: the message's level, a printf format and its arguments
+ */
+extern void crypto_trace( int, const char *, ... )
+    __attribute__((format(printf, 2, 3)));
+
+/* crypto_trace_errno: like perror, at TRACE_LEVEL_ERROR */
+extern void crypto_trace_errno( const char * );
+
+/* crypto_trace_set_latency: turn the latency histograms on or off
+ *      arguments: 1 to time operations, 0 not to
+ */
+extern void crypto_trace_set_latency( int );
+
+/* crypto_trace_clock: the start of an operation to time
+ *      returns: a timestamp in ns, or 0 if the histograms are off
+ */
+extern uint64_t crypto_trace_clock( void );
+
+/* crypto_trace_record: record an operation in its histogram. thread safe.
+ *      arguments: the operation and its start from crypto_trace_clock; a
+ *                 start of 0 is ignored
+ */
+extern void crypto_trace_record( trace_op_t, uint64_t );
+
+/* crypto_trace_dump: write the histograms as JSON. only uses
+ *                  async-signal-safe calls, so it may run in a handler.
+ *      arguments: a file descriptor
+ *      returns: CRYPTO_SUCCESS, or CRYPTO_FAILURE if a write failed
+ */
+extern crypto_return_t crypto_trace_dump( int );
+
+/* crypto_trace_dump_to: have crypto_shutdown, and optionally a signal,
+ *                  write the histograms to a file; turns them on
+ *      arguments: the file's path, "-" for stderr, and a signal number
+ *                 or 0 for none
+ *      returns: CRYPTO_SUCCESS, or CRYPTO_FAILURE if the path is too long
+ *                 or the handler could not be installed
+ */
+extern crypto_return_t crypto_trace_dump_to( const char *, int );
+
+/* crypto_trace_shutdown: write the histograms to the file from
+ *                  crypto_trace_dump_to, if any; part of crypto_shutdown
+ */
+extern void crypto_trace_shutdown( void );
+
+#endif
@@ -0,0 +1,81 @@
+/**************************************************************************
+ * cryptoutil.c                                                           *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-31                                                             *
+ *                                                                        *
+ * shared byte order and I/O helpers, see cryptoutil.h                    *
+ **************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "cryptoutil.h"
+
+void put_be16( unsigned char *p, uint16_t v ) {
+    p[0] = (unsigned char) (v >> 8);
+    p[1] = (unsigned char) v;
+}
+
+void put_be32( unsigned char *p, uint32_t v ) {
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+void put_be64( unsigned char *p, uint64_t v ) {
+    put_be32(p, (uint32_t) (v >> 32));
+    put_be32(p + 4, (uint32_t) v);
+}
+
+uint32_t get_be32( const unsigned char *p ) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+uint64_t get_be64( const unsigned char *p ) {
+    return ((uint64_t) get_be32(p) << 32) | get_be32(p + 4);
+}
+
+int full_pread( int fd, unsigned char *buf, size_t len, off_t off ) {
+    ssize_t rd = 0;
+
+    while (len > 0) {
+        rd = pread(fd, buf, len, off);
+        if ((rd < 0) && (EINTR == errno)) {
+            continue;
+        } else if (0 == rd) {
+            errno = 0;
+            return -1;
+        } else if (rd < 0) {
+            return -1;
+        }
+
+        buf += rd;
+        len -= (size_t) rd;
+        off += rd;
+    }
+
+    return 0;
+}
+
+int full_pwrite( int fd, const unsigned char *buf, size_t len, off_t off ) {
+    ssize_t wr = 0;
+
+    while (len > 0) {
+        wr = pwrite(fd, buf, len, off);
+        if ((wr < 0) && (EINTR == errno)) {
+            continue;
+        } else if (wr <= 0) {
+            return -1;
+        }
+
+        buf += wr;
+        len -= (size_t) wr;
+        off += wr;
+    }
+
+    return 0;
+}
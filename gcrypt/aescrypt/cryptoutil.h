@@ -0,0 +1,45 @@
+/**************************************************************************
+ * cryptoutil.h                                                           *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-31                                                             *
+ *                                                                        *
+ * byte order and positioned I/O helpers shared inside the library        *
+ **************************************************************************/
+
+#ifndef __CRYPTOUTIL_H
+#define __CRYPTOUTIL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * these are internal to the library and not part of its interface: the
+ * on-disk formats (containers, framed streams, keyfiles, wrapped keys) are
+ * all big endian, and every file that is read or written by offset goes
+ * through the same retry loops.
+ */
+
+/* put_be16, put_be32, put_be64: store v big endian at p */
+extern void put_be16( unsigned char *, uint16_t );
+extern void put_be32( unsigned char *, uint32_t );
+extern void put_be64( unsigned char *, uint64_t );
+
+/* get_be32, get_be64: load a big endian value from p */
+extern uint32_t get_be32( const unsigned char * );
+extern uint64_t get_be64( const unsigned char * );
+
+/* full_pread: pread exactly len bytes at off, through short reads and
+ *                  signals. running into the end of the file is an error:
+ *                  callers know how much there is to read.
+ *      returns: 0, or -1 with errno set (0 at the end of the file)
+ */
+extern int full_pread( int, unsigned char *, size_t, off_t );
+
+/* full_pwrite: pwrite all of len bytes at off, through short writes and
+ *                  signals.
+ *      returns: 0, or -1 with errno set
+ */
+extern int full_pwrite( int, const unsigned char *, size_t, off_t );
+
+#endif
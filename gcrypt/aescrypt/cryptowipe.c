@@ -0,0 +1,604 @@
+/**************************************************************************
+ * cryptowipe.c                                                           *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-23                                                             *
+ *                                                                        *
+ * parallel tree wipe, see cryptowipe.h for documentation                 *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptobuf.h"
+#include "cryptofile.h"
+#include "cryptorand.h"
+#include "cryptowipe.h"
+#include "debug.h"
+
+/********************************************************************
+ * wipe_file:                                                       *
+ *      a regular file to be wiped                                  *
+ *                                                                  *
+ * path / size: the file                                            *
+ * dev / ino: the file the walk found at path, which is all that    *
+ *            is ever opened or unlinked under that name            *
+ * pending: pieces of the file not wiped yet, plus one while the    *
+ *          walk is still cutting it up                             *
+ * failed: some piece of the file could not be wiped                *
+ ********************************************************************/
+struct wipe_file {
+    char *path;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    unsigned int pending;
+    int failed;
+};
+
+/********************************************************************
+ * wipe_job:                                                        *
+ *      one unit of work for a worker                               *
+ *                                                                  *
+ * files / nfiles: whole files to wipe, or the file a piece is of   *
+ * off / len: the piece, with piece set                             *
+ ********************************************************************/
+struct wipe_job {
+    struct wipe_file *files[WIPE_BATCH_FILES];
+    size_t nfiles;
+    int piece;
+    off_t off;
+    off_t len;
+};
+
+/********************************************************************
+ * wipe_tree:                                                       *
+ *      state of one crypto_wipe_tree run                           *
+ *                                                                  *
+ * lock guards the queue, done and the report                       *
+ * queue / depth / head / count: ring of jobs waiting for a worker  *
+ * done: the walk is over, workers exit once the queue is empty     *
+ * batch: small files collected by the walk, not queued yet         *
+ * dirs / ndirs: directories to remove, deepest first               *
+ ********************************************************************/
+struct wipe_tree {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct wipe_job **queue;
+    unsigned int depth;
+    unsigned int head;
+    unsigned int count;
+    int done;
+    size_t passes;
+    struct wipe_report *report;
+    struct wipe_job *batch;
+    char **dirs;
+    size_t ndirs;
+    size_t dirs_cap;
+};
+
+/********************************************************************
+ * wipe_worker:                                                     *
+ *      a worker thread and the buffer and keystream it wipes with  *
+ ********************************************************************/
+struct wipe_worker {
+    pthread_t tid;
+    struct wipe_tree *tree;
+    unsigned char *buf;
+    randstream_t rs;
+};
+
+static void wipe_walk( struct wipe_tree *, int, const char *,
+                       const char * );
+static void wipe_schedule( struct wipe_tree *, const char *,
+                           const struct stat * );
+static int wipe_split( struct wipe_tree *, struct wipe_file * );
+static int wipe_piece( struct wipe_tree *, struct wipe_file *, off_t, off_t );
+static void wipe_push( struct wipe_tree *, struct wipe_job * );
+static struct wipe_job *wipe_pop( struct wipe_tree * );
+static void *wipe_worker_run( void * );
+static void wipe_job_run( struct wipe_worker *, struct wipe_job * );
+static int wipe_one( struct wipe_worker *, struct wipe_file *, off_t,
+                     off_t );
+static int wipe_open( struct wipe_tree *, struct wipe_file * );
+static int wipe_same( const struct stat *, dev_t, ino_t );
+static void wipe_file_done( struct wipe_tree *, struct wipe_file *, int );
+static void wipe_error( struct wipe_tree *, const char *, const char * );
+static double wipe_now( void );
+
+crypto_key_return_t crypto_wipe_tree( const char *path, size_t passes,
+        unsigned int nworkers, unsigned int depth,
+        struct wipe_report *report ) {
+    struct wipe_tree tree;
+    struct wipe_worker *workers = NULL;
+    double start = wipe_now();
+    unsigned int i = 0, started = 0;
+    size_t d = 0;
+
+    memset(report, 0, sizeof *report);
+    if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+        return LIB_NOT_INIT;
+    }
+
+    if (0 == nworkers) {
+        nworkers = 1;
+    }
+    if (0 == depth) {
+        depth = 1;
+    }
+
+    memset(&tree, 0, sizeof tree);
+    pthread_mutex_init(&tree.lock, NULL);
+    pthread_cond_init(&tree.not_empty, NULL);
+    pthread_cond_init(&tree.not_full, NULL);
+    tree.depth  = depth;
+    tree.passes = (0 == passes) ? crypto_wipe_passes() : passes;
+    tree.report = report;
+    tree.queue  = calloc(depth, sizeof *tree.queue);
+    workers     = calloc(nworkers, sizeof *workers);
+    if ((NULL == tree.queue) || (NULL == workers)) {
+        report->errors++;
+        goto out;
+    }
+
+    /* every worker has its own buffer and keystream for the whole run */
+    for (i = 0; i < nworkers; ++i) {
+        workers[i].tree = &tree;
+        if ((NULL == (workers[i].buf = crypto_buf_get(WIPE_BUF_SIZE))) ||
+                (CRYPTO_SUCCESS != crypto_randstream_new(&workers[i].rs)) ||
+                (0 != pthread_create(&workers[i].tid, NULL, wipe_worker_run,
+                        &workers[i]))) {
+            TRACE_ERROR("[!] could not start wipe worker %u!\n", i);
+
+            crypto_randstream_free(workers[i].rs);
+            crypto_buf_put(workers[i].buf, WIPE_BUF_SIZE);
+            break;
+        }
+        ++started;
+    }
+
+    if (0 == started) {
+        report->errors++;
+        goto out;
+    }
+
+    TRACE_INFO("[+] wiping %s with %u workers, %u jobs queued...\n",
+               path, started, depth);
+
+    wipe_walk(&tree, AT_FDCWD, path, path);
+    if (NULL != tree.batch) {
+        wipe_push(&tree, tree.batch);
+        tree.batch = NULL;
+    }
+
+    pthread_mutex_lock(&tree.lock);
+    tree.done = 1;
+    pthread_cond_broadcast(&tree.not_empty);
+    pthread_mutex_unlock(&tree.lock);
+
+    for (i = 0; i < started; ++i) {
+        pthread_join(workers[i].tid, NULL);
+        crypto_randstream_free(workers[i].rs);
+        crypto_buf_put(workers[i].buf, WIPE_BUF_SIZE);
+    }
+
+    /* children were recorded before their parents */
+    for (d = 0; d < tree.ndirs; ++d) {
+        if (0 == rmdir(tree.dirs[d])) {
+            report->dirs++;
+        } else if ((ENOTEMPTY != errno) && (EEXIST != errno)) {
+            wipe_error(&tree, "rmdir", tree.dirs[d]);
+        }
+    }
+
+out:
+    for (d = 0; d < tree.ndirs; ++d) {
+        free(tree.dirs[d]);
+    }
+    free(tree.dirs);
+    free(tree.queue);
+    free(workers);
+    pthread_cond_destroy(&tree.not_full);
+    pthread_cond_destroy(&tree.not_empty);
+    pthread_mutex_destroy(&tree.lock);
+
+    report->seconds = wipe_now() - start;
+    return (0 == report->errors) ? KEY_SUCCESS : KEY_FAILURE;
+}
+
+
+/**************************************************************************/
+/*                          internal helpers                              */
+/**************************************************************************/
+
+/* depth first walk; directories go on the list after their contents.
+ * entries are looked up relative to the directory being read, so a
+ * directory swapped for a link halfway through leads nowhere else */
+static void wipe_walk( struct wipe_tree *t, int at, const char *name,
+        const char *path ) {
+    struct stat st, dst;
+    struct dirent *de = NULL;
+    DIR *dir = NULL;
+    char *child = NULL;
+    char **dirs = NULL;
+    size_t len = 0;
+    int fd = -1;
+
+    if (-1 == fstatat(at, name, &st, AT_SYMLINK_NOFOLLOW)) {
+        wipe_error(t, "lstat", path);
+        return;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        wipe_schedule(t, path, &st);
+        return;
+    } else if (! S_ISDIR(st.st_mode)) {
+        /* links are not followed, special files have nothing to wipe */
+        if (0 == unlinkat(at, name, 0)) {
+            pthread_mutex_lock(&t->lock);
+            t->report->others++;
+            pthread_mutex_unlock(&t->lock);
+        } else {
+            wipe_error(t, "unlink", path);
+        }
+        return;
+    }
+
+    fd = openat(at, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOCTTY);
+    if ((-1 != fd) && ((-1 == fstat(fd, &dst)) ||
+                (! wipe_same(&dst, st.st_dev, st.st_ino)))) {
+        close(fd);
+        fd = -1;
+        errno = ESTALE;
+    }
+
+    dir = (-1 == fd) ? NULL : fdopendir(fd);
+    if (NULL == dir) {
+        wipe_error(t, "opendir", path);
+        if (-1 != fd) {
+            close(fd);
+        }
+        return;
+    }
+
+    while (NULL != (de = readdir(dir))) {
+        if ((0 == strcmp(de->d_name, ".")) ||
+                (0 == strcmp(de->d_name, ".."))) {
+            continue;
+        }
+
+        len = strlen(path) + strlen(de->d_name) + 2;
+        child = malloc(len);
+        if (NULL == child) {
+            wipe_error(t, "malloc", path);
+            break;
+        }
+
+        snprintf(child, len, "%s/%s", path, de->d_name);
+        wipe_walk(t, dirfd(dir), de->d_name, child);
+        free(child);
+    }
+    closedir(dir);
+
+    if (t->ndirs == t->dirs_cap) {
+        dirs = realloc(t->dirs, (2 * t->dirs_cap + 16) * sizeof *dirs);
+        if (NULL == dirs) {
+            wipe_error(t, "realloc", path);
+            return;
+        }
+        t->dirs = dirs;
+        t->dirs_cap = 2 * t->dirs_cap + 16;
+    }
+
+    t->dirs[t->ndirs] = strdup(path);
+    if (NULL != t->dirs[t->ndirs]) {
+        t->ndirs++;
+    }
+}
+
+/* queue a file: into the open batch, on its own, or in pieces. a sparse
+ * file is placed by the bytes it has allocated, not its length. */
+static void wipe_schedule( struct wipe_tree *t, const char *path,
+        const struct stat *st ) {
+    struct wipe_file *f = calloc(1, sizeof *f);
+    struct wipe_job *job = NULL;
+    off_t allocated = (off_t) st->st_blocks * 512;
+
+    if ((NULL == f) || (NULL == (f->path = strdup(path)))) {
+        free(f);
+        wipe_error(t, "malloc", path);
+        return;
+    }
+    f->size = st->st_size;
+    f->dev  = st->st_dev;
+    f->ino  = st->st_ino;
+    if (allocated > f->size) {
+        allocated = f->size;
+    }
+
+    if (allocated <= WIPE_SMALL_FILE) {
+        if (NULL == t->batch) {
+            t->batch = calloc(1, sizeof *t->batch);
+            if (NULL == t->batch) {
+                wipe_error(t, "malloc", path);
+                wipe_file_done(t, f, -1);
+                return;
+            }
+        }
+
+        t->batch->files[t->batch->nfiles++] = f;
+        if (WIPE_BATCH_FILES == t->batch->nfiles) {
+            wipe_push(t, t->batch);
+            t->batch = NULL;
+        }
+        return;
+    }
+
+    if (allocated <= WIPE_EXTENT_SIZE) {
+        job = calloc(1, sizeof *job);
+        if (NULL == job) {
+            wipe_error(t, "malloc", path);
+            wipe_file_done(t, f, -1);
+            return;
+        }
+
+        job->files[0] = f;
+        job->nfiles = 1;
+        wipe_push(t, job);
+        return;
+    }
+
+    /* the walk holds a reference of its own until every piece is queued,
+     * so the file can not be unlinked under it */
+    f->pending = 1;
+    wipe_file_done(t, f, wipe_split(t, f));
+}
+
+/* cut a large file into pieces holding up to WIPE_EXTENT_SIZE bytes of
+ * data each, following its data extents so holes make no jobs */
+static int wipe_split( struct wipe_tree *t, struct wipe_file *f ) {
+    off_t off = 0, data = 0, hole = 0, n = 0;
+    off_t first = 0, filled = 0;
+    int fd = wipe_open(t, f);
+
+    if (-1 == fd) {
+        return -1;
+    }
+
+    while ((off < f->size) &&
+            crypto_file_extent(fd, off, f->size, &data, &hole)) {
+        while (data < hole) {
+            n = WIPE_EXTENT_SIZE - filled;
+            if (n > hole - data) {
+                n = hole - data;
+            }
+
+            if (0 == filled) {
+                first = data;
+            }
+            filled += n;
+            data   += n;
+
+            if (WIPE_EXTENT_SIZE == filled) {
+                if (0 != wipe_piece(t, f, first, data - first)) {
+                    close(fd);
+                    return -1;
+                }
+                filled = 0;
+            }
+        }
+        off = hole;
+    }
+    close(fd);
+
+    if ((filled > 0) && (0 != wipe_piece(t, f, first, data - first))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int wipe_piece( struct wipe_tree *t, struct wipe_file *f, off_t off,
+        off_t len ) {
+    struct wipe_job *job = calloc(1, sizeof *job);
+
+    if (NULL == job) {
+        wipe_error(t, "malloc", f->path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    f->pending++;
+    pthread_mutex_unlock(&t->lock);
+
+    job->files[0] = f;
+    job->nfiles = 1;
+    job->piece  = 1;
+    job->off    = off;
+    job->len    = len;
+    wipe_push(t, job);
+
+    return 0;
+}
+
+/* hand a job to the workers, waiting while the queue is full */
+static void wipe_push( struct wipe_tree *t, struct wipe_job *job ) {
+    pthread_mutex_lock(&t->lock);
+    while (t->count == t->depth) {
+        pthread_cond_wait(&t->not_full, &t->lock);
+    }
+
+    t->queue[(t->head + t->count) % t->depth] = job;
+    t->count++;
+    t->report->jobs++;
+    pthread_cond_signal(&t->not_empty);
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* the next job, or NULL once the walk is over and the queue empty */
+static struct wipe_job *wipe_pop( struct wipe_tree *t ) {
+    struct wipe_job *job = NULL;
+
+    pthread_mutex_lock(&t->lock);
+    while ((0 == t->count) && (! t->done)) {
+        pthread_cond_wait(&t->not_empty, &t->lock);
+    }
+
+    if (t->count > 0) {
+        job = t->queue[t->head];
+        t->head = (t->head + 1) % t->depth;
+        t->count--;
+        pthread_cond_signal(&t->not_full);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return job;
+}
+
+static void *wipe_worker_run( void *arg ) {
+    struct wipe_worker *self = arg;
+    struct wipe_job *job = NULL;
+
+    while (NULL != (job = wipe_pop(self->tree))) {
+        wipe_job_run(self, job);
+        free(job);
+    }
+
+    return NULL;
+}
+
+static void wipe_job_run( struct wipe_worker *w, struct wipe_job *job ) {
+    size_t i = 0;
+
+    if (job->piece) {
+        wipe_file_done(w->tree, job->files[0],
+                wipe_one(w, job->files[0], job->off, job->len));
+        return;
+    }
+
+    for (i = 0; i < job->nfiles; ++i) {
+        wipe_file_done(w->tree, job->files[i],
+                wipe_one(w, job->files[i], 0, job->files[i]->size));
+    }
+}
+
+/* wipe len bytes of a file from off; 0 on success, -1 on failure */
+static int wipe_one( struct wipe_worker *w, struct wipe_file *f, off_t off,
+        off_t len ) {
+    crypto_key_return_t result = KEY_FAILURE;
+    unsigned long long written = 0;
+    int fd = wipe_open(w->tree, f);
+
+    if (-1 == fd) {
+        return -1;
+    }
+
+    result = crypto_wipe_range(fd, off, len, w->tree->passes, w->buf,
+            w->rs, &written);
+    if (0 != close(fd)) {
+        result = KEY_FAILURE;
+    }
+
+    pthread_mutex_lock(&w->tree->lock);
+    w->tree->report->bytes += written;
+    pthread_mutex_unlock(&w->tree->lock);
+
+    if (KEY_SUCCESS != result) {
+        wipe_error(w->tree, "wipe", f->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* open a file the walk found for writing, provided the name still leads
+ * to that same regular file and not to whatever a link put in its place;
+ * the descriptor, or -1 with the error counted */
+static int wipe_open( struct wipe_tree *t, struct wipe_file *f ) {
+    struct stat st;
+    int fd = open(f->path, O_WRONLY | O_NOFOLLOW | O_NOCTTY);
+
+    if (-1 == fd) {
+        wipe_error(t, "open", f->path);
+        return -1;
+    }
+
+    if ((-1 == fstat(fd, &st)) || (! S_ISREG(st.st_mode)) ||
+            (! wipe_same(&st, f->dev, f->ino))) {
+        close(fd);
+        errno = ESTALE;
+        wipe_error(t, "open", f->path);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int wipe_same( const struct stat *st, dev_t dev, ino_t ino ) {
+    return (st->st_dev == dev) && (st->st_ino == ino);
+}
+
+/* one piece of a file is done; the last one unlinks or gives up on it */
+static void wipe_file_done( struct wipe_tree *t, struct wipe_file *f,
+        int status ) {
+    struct stat st;
+    int last = 1;
+
+    pthread_mutex_lock(&t->lock);
+    if (0 != status) {
+        f->failed = 1;
+    }
+    if (f->pending > 0) {
+        last = (0 == --f->pending);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if (! last) {
+        return;
+    }
+
+    /* only what was wiped is unlinked, not a file moved in since */
+    if ((! f->failed) && (-1 == lstat(f->path, &st))) {
+        wipe_error(t, "lstat", f->path);
+    } else if ((! f->failed) && (! wipe_same(&st, f->dev, f->ino))) {
+        errno = ESTALE;
+        wipe_error(t, "unlink", f->path);
+    } else if ((! f->failed) && (0 == unlink(f->path))) {
+        pthread_mutex_lock(&t->lock);
+        t->report->files++;
+        pthread_mutex_unlock(&t->lock);
+    } else if (! f->failed) {
+        wipe_error(t, "unlink", f->path);
+    }
+
+    free(f->path);
+    free(f);
+}
+
+static void wipe_error( struct wipe_tree *t, const char *what,
+        const char *path ) {
+    TRACE_ERROR("[!] %s %s: %s\n", what, path, strerror(errno));
+
+    pthread_mutex_lock(&t->lock);
+    t->report->errors++;
+    pthread_mutex_unlock(&t->lock);
+}
+
+static double wipe_now( ) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
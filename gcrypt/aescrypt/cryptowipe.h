@@ -0,0 +1,97 @@
+/**************************************************************************
+ * cryptowipe.h                                                           *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-23                                                             *
+ *                                                                        *
+ * parallel wipe of whole directory trees                                 *
+ **************************************************************************/
+
+#ifndef __CRYPTOWIPE_H
+#define __CRYPTOWIPE_H
+
+#include <stdlib.h>
+
+#include "config.h"
+#include "crypto.h"
+
+/**************************************************************************/
+/*                          note on bulk wiping                           */
+/**************************************************************************/
+/*
+ * crypto_wipe_tree walks a directory tree and hands its files to a pool
+ * of worker threads, each of which overwrites them in place with the
+ * passes and patterns of crypto_wipe_file (see cryptofile.h), using one
+ * buffer and one keystream of its own for everything it wipes. with n
+ * workers up to n files or pieces of files are being written at once,
+ * which is what keeps a device with parallel queues busy.
+ *
+ * the walk stays ahead of the workers through a queue of at most depth
+ * jobs; when the queue is full the walk waits, so memory use does not
+ * grow with the size of the tree. a job is one of:
+ *      - a batch of up to WIPE_BATCH_FILES files of at most
+ *        WIPE_SMALL_FILE bytes, so that small files do not cost a trip
+ *        through the queue each
+ *      - one file of up to WIPE_EXTENT_SIZE bytes
+ *      - one piece of a larger file, holding WIPE_EXTENT_SIZE bytes of its
+ *        data; the pieces of a file are wiped in parallel and the last one
+ *        to finish unlinks it
+ *
+ * sizes are the bytes a file has allocated, not its length, and pieces
+ * follow the file's data extents (see crypto_file_extent), so the holes
+ * of a sparse file cost neither jobs nor writes.
+ *
+ * files are unlinked once wiped, symbolic links and special files are
+ * unlinked without being followed or written, and directories are removed
+ * after the workers are done, deepest first. anything that can not be
+ * wiped or removed is counted as an error and left in place, along with
+ * the directories above it.
+ *
+ * the walk looks entries up relative to the directory it is reading and
+ * records each file's device and inode. a worker opens the file again by
+ * name without following a final link, and only writes to and unlinks it
+ * if it is still that regular file; a file replaced or reached through a
+ * directory swapped for a link in the meantime is skipped as an error.
+ */
+
+
+/********************************************************************
+ * wipe_report:                                                     *
+ *      summary of a crypto_wipe_tree run                           *
+ *                                                                  *
+ * files: regular files wiped and unlinked                          *
+ * others: symbolic links and special files unlinked                *
+ * dirs: directories removed                                        *
+ * errors: entries that could not be wiped or removed               *
+ * jobs: batches, files and pieces handed to the workers            *
+ * bytes: bytes written, counting every pass                        *
+ * seconds: wall clock time of the whole run                        *
+ ********************************************************************/
+struct wipe_report {
+    unsigned long files;
+    unsigned long others;
+    unsigned long dirs;
+    unsigned long errors;
+    unsigned long jobs;
+    unsigned long long bytes;
+    double seconds;
+};
+
+
+/**************************************************************************/
+/*                          bulk wipe functions                           */
+/**************************************************************************/
+
+/* crypto_wipe_tree: wipe and remove a directory tree, or a single file
+ *      arguments: the path, the number of passes (0 for the default, see
+ *                 crypto_wipe_set_passes), the number of worker threads,
+ *                 the depth of the job queue, and the wipe_report to fill
+ *                 in
+ *      returns: KEY_SUCCESS if everything was wiped and removed,
+ *                 LIB_NOT_INIT if libgcrypt is not initialised, or
+ *                 KEY_FAILURE if anything was left (see report->errors)
+ */
+extern crypto_key_return_t crypto_wipe_tree( const char *, size_t,
+                                             unsigned int, unsigned int,
+                                             struct wipe_report * );
+
+#endif
@@ -0,0 +1,199 @@
+/**************************************************************************
+ * cryptoxts.c                                                            *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-30                                                             *
+ *                                                                        *
+ * XTS disk image encryption, see cryptoxts.h                             *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptoparallel.h"
+#include "cryptoprofile.h"
+#include "cryptostream.h"
+#include "cryptoxts.h"
+#include "metakey.h"
+#include "debug.h"
+
+/* bytes per data unit */
+static size_t xts_sector = XTS_SECTOR_SIZE;
+
+static int xts_open( const char *, int, struct stat * );
+static off_t xts_size( int, const struct stat * );
+
+crypto_return_t crypto_xts_set_sector_size( size_t n ) {
+    if ((n < XTS_MIN_SECTOR) || (n > XTS_MAX_SECTOR) ||
+            (0 != (n & (n - 1)))) {
+        return CRYPTO_FAILURE;
+    }
+
+    xts_sector = n;
+    return CRYPTO_SUCCESS;
+}
+
+size_t crypto_xts_sector_size( ) {
+    return xts_sector;
+}
+
+crypto_return_t crypto_xts_crypt_file( const char *infile,
+        const char *outfile, metakey_t mk, crypto_op_t op ) {
+    crypto_return_t result = CRYPTO_FAILURE;
+    struct stat in_st, out_st;
+    int infd = -1, outfd = -1;
+    off_t len = 0;
+    uint64_t stage = 0;
+
+    if ((NULL == mk) || (1 != mk->initialised)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    /* one key for the data, one for the tweak */
+    if (mk->keysize != 2 * gcry_cipher_get_algo_keylen(mk->algo)) {
+        TRACE_ERROR("[!] XTS needs a key of twice the cipher's size!\n");
+
+        return CRYPTO_NOT_INIT;
+    }
+
+    if ((NULL == outfile) || ((NULL != infile) &&
+                (0 == strcmp(infile, outfile)))) {
+        outfile = NULL;
+    }
+
+    /* in place, the one descriptor is read and written */
+    infd = xts_open(infile, (NULL == outfile) ? O_RDWR : O_RDONLY, &in_st);
+    if (-1 == infd) {
+        return CRYPTO_FAILURE;
+    }
+
+    len = xts_size(infd, &in_st);
+    if (-1 == len) {
+        goto out;
+    } else if (0 != len % (off_t) xts_sector) {
+        TRACE_ERROR("[!] %s is not a whole number of %lu byte sectors!\n",
+                    infile, (unsigned long) xts_sector);
+        result = CRYPTO_BAD_FORMAT;
+
+        goto out;
+    }
+
+    outfd = infd;
+    if (NULL != outfile) {
+        outfd = xts_open(outfile, O_WRONLY | O_CREAT, &out_st);
+        if (-1 == outfd) {
+            goto out;
+        }
+
+        /* the same file under another name is still in place */
+        if ((in_st.st_dev == out_st.st_dev) &&
+                (in_st.st_ino == out_st.st_ino)) {
+            close(outfd);
+            close(infd);
+            infd = outfd = xts_open(infile, O_RDWR, &in_st);
+            if (-1 == infd) {
+                return CRYPTO_FAILURE;
+            }
+        } else if (S_ISREG(out_st.st_mode) &&
+                (-1 == ftruncate(outfd, len))) {
+            TRACE_ERRNO("[!] ftruncate");
+
+            goto out;
+        } else if (S_ISBLK(out_st.st_mode) &&
+                (xts_size(outfd, &out_st) < len)) {
+            TRACE_ERROR("[!] %s is smaller than %s!\n", outfile, infile);
+
+            goto out;
+        }
+    }
+
+    TRACE_INFO("[+] %scrypting %llu sectors of %lu bytes%s...\n",
+               (encrypt == op) ? "en" : "de",
+               (unsigned long long) (len / (off_t) xts_sector),
+               (unsigned long) xts_sector, (infd == outfd) ? " in place" : "");
+
+    result = stream_xts_parallel(infd, outfd, 0, len, mk, op,
+            crypto_stream_threads(), crypto_stream_chunk_size(),
+            xts_sector);
+
+    /* a device has no page cache flush on close; get the sectors out */
+    PROFILE_START(stage);
+    if ((CRYPTO_SUCCESS == result) && (0 != fsync(outfd))) {
+        TRACE_ERRNO("[!] fsync");
+        result = CRYPTO_FAILURE;
+    }
+    PROFILE_END(PROFILE_SYNC, stage, 0);
+
+out:
+    if ((-1 != outfd) && (outfd != infd) && (0 != close(outfd))) {
+        TRACE_ERRNO("[!] close");
+        result = CRYPTO_FAILURE;
+    }
+    if ((-1 != infd) && (0 != close(infd))) {
+        TRACE_ERRNO("[!] close");
+        result = CRYPTO_FAILURE;
+    }
+
+    return result;
+}
+
+
+/**************************************************************************/
+/*                           internal helpers                             */
+/**************************************************************************/
+
+/* open an image file or block device; anything else can not be addressed
+ * by sector */
+static int xts_open( const char *filename, int flags, struct stat *st ) {
+    int fd = -1;
+
+    if ((NULL == filename) || (0 == strcmp(filename, "-"))) {
+        TRACE_ERROR("[!] XTS needs a file or device, not a pipe!\n");
+
+        return -1;
+    }
+
+    fd = open(filename, flags, 0666);
+    if (-1 == fd) {
+        TRACE_ERROR("[!] error opening %s!\n", filename);
+        TRACE_ERRNO("open");
+
+        return -1;
+    }
+
+    if ((-1 == fstat(fd, st)) ||
+            ((! S_ISREG(st->st_mode)) && (! S_ISBLK(st->st_mode)))) {
+        TRACE_ERROR("[!] %s is neither a file nor a block device!\n",
+                    filename);
+        close(fd);
+
+        return -1;
+    }
+
+    return fd;
+}
+
+/* st_size is 0 for a block device; seeking to its end finds its size */
+static off_t xts_size( int fd, const struct stat *st ) {
+    off_t len = 0;
+
+    if (S_ISREG(st->st_mode)) {
+        return st->st_size;
+    }
+
+    len = lseek(fd, 0, SEEK_END);
+    if (-1 == len) {
+        TRACE_ERRNO("[!] lseek");
+    }
+
+    return len;
+}
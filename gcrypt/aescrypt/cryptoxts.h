@@ -0,0 +1,74 @@
+/**************************************************************************
+ * cryptoxts.h                                                            *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-30                                                             *
+ *                                                                        *
+ * sector-wise, in-place AES-XTS encryption of disk images and devices    *
+ **************************************************************************/
+
+#ifndef __CRYPTOXTS_H
+#define __CRYPTOXTS_H
+
+#include <stdlib.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "metakey.h"
+
+/**************************************************************************/
+/*                             note on XTS                                */
+/**************************************************************************/
+/*
+ * a disk image encrypted with XTS has no header and is exactly as large as
+ * the plain image: sector n of the encrypted image is sector n of the
+ * plain one, encrypted with AES-XTS as a data unit of its own under the
+ * tweak n (64 bits, little endian, zero padded to 16 bytes, counted in
+ * sectors of the chosen size). this is dm-crypt's aes-xts-plain64 with
+ * iv_large_sectors, so any sector can be read or rewritten by itself, and
+ * an image or device can be encrypted or decrypted where it lies.
+ *
+ * XTS takes two AES keys, one for the data and one for the tweak, so the
+ * key is twice the size given with -b: 32 bytes for AES-128-XTS, 64 for
+ * AES-256-XTS. nothing records the key, the sector size, or whether an
+ * image is encrypted at all; that is up to the caller. XTS does not
+ * authenticate: a changed sector decrypts to garbage rather than failing.
+ *
+ * chunks of whole sectors are spread over crypto_stream_threads() workers
+ * (see cryptoparallel.h). working in place, an interrupted run leaves the
+ * image part encrypted and part not, with nothing to tell where the
+ * boundary is; and on flash or copy-on-write storage the old plaintext
+ * may survive in blocks the file system or device no longer maps.
+ */
+#define     XTS_MIN_SECTOR          512
+#define     XTS_MAX_SECTOR          (64 * 1024)
+
+
+/**************************************************************************/
+/*                             xts functions                              */
+/**************************************************************************/
+
+/* crypto_xts_crypt_file: encrypt or decrypt every sector of an image file
+ *                  or block device with AES-XTS.
+ *      arguments: the input filename, the output filename, or NULL or the
+ *                 same file to work in place, the metakey_t holding the
+ *                 double length key, and the operation. neither may be
+ *                 a pipe or stdin / stdout; a regular output file is sized
+ *                 to the input, a device must be at least as large.
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE on I/O errors,
+ *                 CRYPTO_NOT_INIT if the key is not an XTS key for its
+ *                 algorithm, or CRYPTO_BAD_FORMAT if the input is not a
+ *                 whole number of sectors.
+ */
+extern crypto_return_t crypto_xts_crypt_file( const char *, const char *,
+                                              metakey_t, crypto_op_t );
+
+/* crypto_xts_set_sector_size, crypto_xts_sector_size: set and return the
+ *                  size of the data units; XTS_SECTOR_SIZE by default.
+ *      returns: CRYPTO_FAILURE if the size is not a power of two between
+ *                 XTS_MIN_SECTOR and XTS_MAX_SECTOR, CRYPTO_SUCCESS
+ *                 otherwise.
+ */
+extern crypto_return_t crypto_xts_set_sector_size( size_t );
+extern size_t crypto_xts_sector_size( void );
+
+#endif
@@ -10,16 +10,50 @@
 #define __DEBUG_H
 
 #include "config.h"
+#include "cryptotrace.h"
 
+/* messages, see cryptotrace.h. without DEBUG the call is still type
+ * checked but never made, and the compiler drops it. */
 #ifdef DEBUG
-#define LOG(a)                    printf((a))
-#define TRACEOUT(a)               fprintf(stderr, (a))
-#define TRACEOUT_1(a, b)          fprintf(stderr, (a), (b))
+#define TRACE(level, ...)           do {                                \
+        if ((level) <= crypto_trace_level) {                            \
+            crypto_trace((level), __VA_ARGS__);                         \
+        }                                                               \
+    } while (0)
+#define TRACE_ERRNO(what)           do {                                \
+        if (TRACE_LEVEL_ERROR <= crypto_trace_level) {                  \
+            crypto_trace_errno((what));                                 \
+        }                                                               \
+    } while (0)
 
 #else
-#define TRACEOUT(a)                {} 
-#define TRACEOUT_1(a, b)           {}
+#define TRACE(level, ...)           do {                                \
+        if (0) {                                                        \
+            crypto_trace((level), __VA_ARGS__);                         \
+        }                                                               \
+    } while (0)
+#define TRACE_ERRNO(what)           do {                                \
+        if (0) {                                                        \
+            crypto_trace_errno((what));                                 \
+        }                                                               \
+    } while (0)
 
 #endif /* end debug macros */
 
+#define TRACE_ERROR(...)            TRACE(TRACE_LEVEL_ERROR, __VA_ARGS__)
+#define TRACE_INFO(...)             TRACE(TRACE_LEVEL_INFO, __VA_ARGS__)
+#define TRACE_DEBUG(...)            TRACE(TRACE_LEVEL_DEBUG, __VA_ARGS__)
+
+/* latency of an operation: TRACE_START(t) before, with a uint64_t t, and
+ * TRACE_END(op, t) after */
+#ifdef TRACE_LATENCY
+#define TRACE_START(t)              ((t) = crypto_trace_clock())
+#define TRACE_END(op, t)            crypto_trace_record((op), (t))
+
+#else
+#define TRACE_START(t)              ((t) = 0)
+#define TRACE_END(op, t)            ((void) (op), (void) (t))
+
+#endif /* end latency macros */
+
 #endif  /* end header guard */
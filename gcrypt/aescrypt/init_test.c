@@ -13,10 +13,10 @@
 #include "cryptoinit.h"
 #include "metakey.h"
 #include "cryptofile.h"
+#include "keystore.h"
 
 #define KEYFILE             "aes.key"
 
-extern keystore_t keystore;
 
 void pause_for_input( void ) {
     char s[2];
@@ -31,6 +31,7 @@ int main(int argc, char **argv ) {
     crypto_key_return_t key_result  = KEY_FAILURE;
     size_t keysize                  = 16;   /* AES128 */
     int loadkey                     = 0;
+    metakey_t mk                    = NULL;
 
     #ifdef AUTOKEYGEN
     crypto_set_autogen( );
@@ -57,9 +58,15 @@ int main(int argc, char **argv ) {
     }
     printf("[+] %s: cryptographic libraries initialised...\n", argv[0]);
 
+    mk = crypto_keystore_add(keystore, 0);
+    if (NULL == mk) {
+        fprintf(stderr, "[!] %s: could not add a key!\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
     if (0 == loadkey) {
         printf("[+] generating a key...\n");
-        key_result = crypto_genkey( keystore->store[0], keysize );
+        key_result = crypto_genkey( mk, keysize );
         if (KEY_FAILURE == key_result) {
             fprintf(stderr, "[!] %s: key generation failed!\n", argv[0]);
             return EXIT_FAILURE;
@@ -72,9 +79,8 @@ int main(int argc, char **argv ) {
         }
 
         printf("[!] %s: key successfully generated!\n", argv[0]);
-        keystore->size++;
 
-        key_result = crypto_dumpkey(KEYFILE, keystore->store[0]);
+        key_result = crypto_dumpkey(KEYFILE, mk);
         if (KEY_SUCCESS == key_result) {
             printf("[!] %s: key dumped to %s!\n", argv[0], KEYFILE);
         }
@@ -89,7 +95,7 @@ int main(int argc, char **argv ) {
     } /* end key dump handling */
 
     else {
-        key_result = crypto_loadkey(argv[1], keystore->store[0], keysize);
+        key_result = crypto_loadkey(argv[1], mk, keysize);
 
         switch (key_result) {
             case KEY_FAILURE:
@@ -98,13 +104,11 @@ int main(int argc, char **argv ) {
             case KEY_SUCCESS:
                 fprintf(stderr, "[+] %s: key successfully loaded!\n",
                         argv[0]);
-                keystore->size++;
                 break;
             case KEYGEN:
                 fprintf(stderr, "[!] %s: error reading %s, key was ",
                         argv[0], argv[1]);
                 fprintf(stderr, "generated.\n");
-                keystore->size++;
             case SIZE_MISMATCH:
                 fprintf(stderr, "[!] %s: the key read was the wrong length!\n",
                         argv[0]);
@@ -133,7 +137,7 @@ int main(int argc, char **argv ) {
     } /* end key loading */
 
     printf("[+] %s: keystore size: %u\n", argv[0], 
-            (unsigned int) keystore->size);
+            (unsigned int) crypto_keystore_size(keystore));
 
     key_result = crypto_zerokeystore( keystore );
     if (KEY_SUCCESS != key_result) {
@@ -0,0 +1,346 @@
+/**************************************************************************
+ * keyfile.c                                                              *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-21                                                             *
+ *                                                                        *
+ * multi-key keyfile, see keyfile.h for the format and documentation      *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptoutil.h"
+#include "keyfile.h"
+#include "metakey.h"
+#include "debug.h"
+
+/* the wrap method crypto_wrapkey uses (see crypto_cipher_open) */
+#if GCRYPT_VERSION_NUMBER >= 0x010900
+#define     KEYFILE_WRAP            KEYFILE_WRAP_KWP
+#else
+#define     KEYFILE_WRAP            KEYFILE_WRAP_AESWRAP
+#endif
+
+/********************************************************************
+ * keyfile:                                                         *
+ *      an open keyfile                                             *
+ *                                                                  *
+ * base / len: the mapping of the whole file                        *
+ * kek: the key-encrypting key, borrowed from the caller            *
+ * count: number of index entries                                   *
+ * index: the first index entry, inside the mapping                 *
+ ********************************************************************/
+struct keyfile {
+    unsigned char *base;
+    size_t len;
+    metakey_t kek;
+    uint64_t count;
+    const unsigned char *index;
+};
+
+static const unsigned char *keyfile_search( keyfile_t, unsigned long );
+static int keyfile_cmp( const void *, const void * );
+
+crypto_key_return_t crypto_keyfile_write( const char *filename,
+        metakey_t kek, metakey_t *keys, size_t nkeys ) {
+    crypto_key_return_t result = KEY_FAILURE;
+    metakey_t *sorted = NULL;
+    FILE *kf = NULL;
+    char *tmpname = NULL;
+    unsigned char hdr[KEYFILE_HEADER_LEN];
+    unsigned char ent[KEYFILE_ENTRY_LEN];
+    unsigned char wrapped[CRYPTO_WRAPPED_LEN(WRAP_KEY_MAX)];
+    uint64_t data_off = 0;
+    size_t i = 0, len = 0;
+
+    if ((NULL == kek) || (1 != kek->initialised)) {
+        return KEY_NOT_INIT;
+    }
+
+    sorted = malloc((nkeys + 1) * sizeof *sorted);
+    if (NULL == sorted) {
+        return KEY_FAILURE;
+    }
+    if (nkeys > 0) {
+        memcpy(sorted, keys, nkeys * sizeof *sorted);
+    }
+    qsort(sorted, nkeys, sizeof *sorted, keyfile_cmp);
+
+    for (i = 0; i < nkeys; ++i) {
+        if ((NULL == sorted[i]) || (1 != sorted[i]->initialised)) {
+            free(sorted);
+            return KEY_NOT_INIT;
+        } else if ((i > 0) && (sorted[i - 1]->id == sorted[i]->id)) {
+            free(sorted);
+            return KEY_EXISTS;
+        } else if (sorted[i]->keysize > WRAP_KEY_MAX) {
+            TRACE_ERROR("[!] key %lu can not be wrapped!\n",
+                        sorted[i]->id);
+
+            free(sorted);
+            return KEY_FAILURE;
+        }
+    }
+
+    tmpname = malloc(strlen(filename) + 5);
+    if (NULL == tmpname) {
+        goto out;
+    }
+
+    sprintf(tmpname, "%s.tmp", filename);
+    kf = fopen(tmpname, "wb");
+    if (NULL == kf) {
+        TRACE_ERROR("[!] error opening %s for write!\n", tmpname);
+        TRACE_ERRNO("fopen");
+
+        goto out;
+    }
+
+    memset(hdr, 0, sizeof hdr);
+    memcpy(hdr, KEYFILE_MAGIC, 4);
+    hdr[4] = KEYFILE_VERSION;
+    hdr[5] = KEYFILE_WRAP;
+    put_be64(hdr + 8, (uint64_t) nkeys);
+    put_be64(hdr + 16, KEYFILE_HEADER_LEN);
+    if (1 != fwrite(hdr, sizeof hdr, 1, kf)) {
+        goto out;
+    }
+
+    /* the index first: every wrapped key's length is known up front */
+    data_off = KEYFILE_HEADER_LEN + (uint64_t) nkeys * KEYFILE_ENTRY_LEN;
+    for (i = 0; i < nkeys; ++i) {
+        len = CRYPTO_WRAPPED_LEN(sorted[i]->keysize);
+
+        put_be64(ent, (uint64_t) sorted[i]->id);
+        put_be64(ent + 8, data_off);
+        put_be32(ent + 16, (uint32_t) len);
+        put_be16(ent + 20, (uint16_t) sorted[i]->keysize);
+        put_be16(ent + 22, (uint16_t) sorted[i]->algo);
+        if (1 != fwrite(ent, sizeof ent, 1, kf)) {
+            goto out;
+        }
+
+        data_off += len;
+    }
+
+    for (i = 0; i < nkeys; ++i) {
+        if ((KEY_SUCCESS != crypto_wrapkey(kek, sorted[i], wrapped, &len)) ||
+                (1 != fwrite(wrapped, len, 1, kf))) {
+            goto out;
+        }
+    }
+
+    /* the new file has to be on disk before it replaces the old one */
+    if ((0 == fflush(kf)) && (0 == fsync(fileno(kf)))) {
+        result = KEY_SUCCESS;
+    }
+
+out:
+    if ((NULL != kf) && (0 != fclose(kf))) {
+        result = KEY_FAILURE;
+    }
+
+    if ((KEY_SUCCESS == result) && (0 != rename(tmpname, filename))) {
+        TRACE_ERRNO("[!] rename");
+
+        result = KEY_FAILURE;
+    }
+
+    if ((KEY_SUCCESS != result) && (NULL != kf)) {
+        unlink(tmpname);
+    }
+
+    free(tmpname);
+    free(sorted);
+
+    return result;
+}
+
+crypto_return_t crypto_keyfile_open( const char *filename, metakey_t kek,
+        keyfile_t *kfp ) {
+    keyfile_t kf = NULL;
+    struct stat st;
+    uint64_t index_off = 0;
+    int fd = -1;
+
+    *kfp = NULL;
+    if ((NULL == kek) || (1 != kek->initialised)) {
+        return CRYPTO_NOT_INIT;
+    }
+
+    fd = open(filename, O_RDONLY);
+    if (-1 == fd) {
+        TRACE_ERROR("[!] error opening keyfile %s...\n", filename);
+        TRACE_ERRNO("open");
+
+        return CRYPTO_FAILURE;
+    }
+
+    if ((-1 == fstat(fd, &st)) || (st.st_size < KEYFILE_HEADER_LEN)) {
+        close(fd);
+        return CRYPTO_BAD_FORMAT;
+    }
+
+    kf = calloc(1, sizeof *kf);
+    if (NULL == kf) {
+        close(fd);
+        return CRYPTO_FAILURE;
+    }
+
+    kf->kek  = kek;
+    kf->len  = (size_t) st.st_size;
+    kf->base = mmap(NULL, kf->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == kf->base) {
+        TRACE_ERRNO("[!] keyfile mmap");
+
+        free(kf);
+        return CRYPTO_FAILURE;
+    }
+
+    /* lookups touch a handful of index pages, not the file in order */
+    madvise(kf->base, kf->len, MADV_RANDOM);
+
+    kf->count = get_be64(kf->base + 8);
+    index_off = get_be64(kf->base + 16);
+    if ((0 != memcmp(kf->base, KEYFILE_MAGIC, 4)) ||
+            (KEYFILE_VERSION != kf->base[4]) ||
+            ((KEYFILE_WRAP_AESWRAP != kf->base[5]) &&
+             (KEYFILE_WRAP_KWP != kf->base[5])) ||
+            (index_off < KEYFILE_HEADER_LEN) || (index_off > kf->len) ||
+            (kf->count > (kf->len - index_off) / KEYFILE_ENTRY_LEN)) {
+        TRACE_ERROR("[!] %s is not a keyfile!\n", filename);
+
+        crypto_keyfile_close(kf);
+        return CRYPTO_BAD_FORMAT;
+    }
+
+    kf->index = kf->base + index_off;
+    *kfp = kf;
+
+    return CRYPTO_SUCCESS;
+}
+
+crypto_key_return_t crypto_keyfile_load( keyfile_t kf, unsigned long id,
+        metakey_t mk ) {
+    return crypto_keyfile_load_keys(kf, &id, &mk, 1);
+}
+
+crypto_key_return_t crypto_keyfile_load_keys( keyfile_t kf,
+        const unsigned long *ids, metakey_t *mks, size_t n ) {
+    crypto_key_return_t result = KEY_SUCCESS;
+    crypto_key_return_t unwrap = KEY_SUCCESS;
+    struct wrapped_key *wk = NULL;
+    metakey_t *out = NULL;
+    const unsigned char *ent = NULL;
+    uint64_t off = 0;
+    uint32_t len = 0;
+    uint64_t start = 0;
+    size_t i = 0, found = 0;
+
+    TRACE_START(start);
+    wk  = malloc((n + 1) * sizeof *wk);
+    out = malloc((n + 1) * sizeof *out);
+    if ((NULL == wk) || (NULL == out)) {
+        free(wk);
+        free(out);
+        return KEY_FAILURE;
+    }
+
+    /* find every key first, then unwrap the lot in one go */
+    for (i = 0; i < n; ++i) {
+        ent = keyfile_search(kf, ids[i]);
+        if (NULL == ent) {
+            result = KEY_NOT_FOUND;
+            continue;
+        }
+
+        off = get_be64(ent + 8);
+        len = get_be32(ent + 16);
+        if ((off > kf->len) || (len > kf->len - off)) {
+            TRACE_ERROR("[!] damaged keyfile entry for key %lu!\n",
+                        ids[i]);
+
+            result = KEY_FAILURE;
+            continue;
+        }
+
+        wk[found].data = kf->base + off;
+        wk[found].len  = len;
+        wk[found].id   = ids[i];
+        out[found]     = mks[i];
+        found++;
+    }
+
+    unwrap = crypto_unwrapkeys(kf->kek, wk, out, found);
+    if (KEY_SUCCESS != unwrap) {
+        result = unwrap;
+    }
+
+    free(wk);
+    free(out);
+
+    TRACE_END(TRACE_KEYLOAD, start);
+    return result;
+}
+
+uint64_t crypto_keyfile_count( keyfile_t kf ) {
+    return kf->count;
+}
+
+void crypto_keyfile_close( keyfile_t kf ) {
+    if (NULL == kf) {
+        return;
+    }
+
+    if ((NULL != kf->base) && (MAP_FAILED != kf->base)) {
+        munmap(kf->base, kf->len);
+    }
+    free(kf);
+}
+
+
+/**************************************************************************/
+/*                           internal helpers                             */
+/**************************************************************************/
+
+/* binary search of the index, straight out of the mapping */
+static const unsigned char *keyfile_search( keyfile_t kf,
+        unsigned long id ) {
+    uint64_t lo = 0, hi = kf->count, mid = 0, ent_id = 0;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        ent_id = get_be64(kf->index + mid * KEYFILE_ENTRY_LEN);
+
+        if (ent_id == (uint64_t) id) {
+            return kf->index + mid * KEYFILE_ENTRY_LEN;
+        } else if (ent_id < (uint64_t) id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+/* qsort comparison of metakeys by ID */
+static int keyfile_cmp( const void *a, const void *b ) {
+    const metakey_t *ka = a, *kb = b;
+
+    if ((NULL == *ka) || (NULL == *kb)) {
+        return (NULL == *ka) - (NULL == *kb);
+    }
+
+    return ((*ka)->id > (*kb)->id) - ((*ka)->id < (*kb)->id);
+}
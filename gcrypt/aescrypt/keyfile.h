@@ -0,0 +1,129 @@
+/**************************************************************************
+ * keyfile.h                                                              *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-21                                                             *
+ *                                                                        *
+ * single-file store of many wrapped keys with a memory-mapped index      *
+ **************************************************************************/
+
+#ifndef __KEYFILE_H
+#define __KEYFILE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "metakey.h"
+
+/**************************************************************************/
+/*                          keyfile file format                           */
+/**************************************************************************/
+/*
+ * a keyfile holds any number of keys, each wrapped under a key-encrypting
+ * key (KEK) with AES key wrap (see crypto_wrapkey in metakey.h), behind an
+ * index sorted by key ID:
+ *
+ *      header | index | wrapped key 0 | wrapped key 1 | ...
+ *
+ * header, KEYFILE_HEADER_LEN bytes (all integers big endian):
+ *      offset  size    field
+ *      0       4       magic, "AESK"
+ *      4       1       version, KEYFILE_VERSION
+ *      5       1       wrap method, KEYFILE_WRAP_AESWRAP (RFC 3394) or
+ *                      KEYFILE_WRAP_KWP (RFC 5649)
+ *      6       2       reserved, must be 0
+ *      8       8       number of keys
+ *      16      8       file offset of the index
+ *      24      8       reserved, must be 0
+ *
+ * index entry, KEYFILE_ENTRY_LEN bytes, in ascending key ID order:
+ *      0       8       key ID
+ *      8       8       file offset of the wrapped key
+ *      16      4       length of the wrapped key
+ *      20      2       key size in bytes
+ *      22      2       cipher algorithm (GCRY_CIPHER_*)
+ *
+ * each wrapped key is the key block of crypto_wrapkey, CRYPTO_WRAPPED_LEN
+ * bytes long. the index itself is not authenticated, but the key block
+ * repeats the key's ID, so a damaged or rearranged index makes the unwrap
+ * fail instead of handing out the wrong key.
+ *
+ * the file is mapped, not read: opening it looks at the header only, and
+ * loading a key is a binary search of the index plus one unwrap, so the
+ * cost of either does not depend on how many keys the file holds. many
+ * keys are best loaded with one crypto_keyfile_load_keys call, which
+ * unwraps all of them in a single batch (crypto_unwrapkeys).
+ */
+#define     KEYFILE_MAGIC           "AESK"
+#define     KEYFILE_VERSION         1
+#define     KEYFILE_WRAP_AESWRAP    1
+#define     KEYFILE_WRAP_KWP        2
+#define     KEYFILE_HEADER_LEN      32
+#define     KEYFILE_ENTRY_LEN       24
+
+/********************************************************************
+ * keyfile_t:                                                       *
+ *      an open, mapped keyfile. opaque.                            *
+ ********************************************************************/
+typedef struct keyfile * keyfile_t;
+
+
+/**************************************************************************/
+/*                           keyfile functions                            */
+/**************************************************************************/
+
+/* crypto_keyfile_write: write keys into a new keyfile, wrapped under a
+ *                  KEK. each key is stored under its metakey's id. the
+ *                  file is written under a temporary name and renamed into
+ *                  place, so an existing keyfile is replaced atomically.
+ *      arguments: the filename, the KEK metakey_t, an array of metakey_t
+ *                 and its length
+ *      returns: KEY_SUCCESS, KEY_NOT_INIT if the KEK or a key is not
+ *                 initialised, KEY_EXISTS if two keys share an ID, or
+ *                 KEY_FAILURE on I/O errors or keys over WRAP_KEY_MAX
+ */
+extern crypto_key_return_t crypto_keyfile_write( const char *, metakey_t,
+                                                 metakey_t *, size_t );
+
+/* crypto_keyfile_open: map a keyfile. only the header is checked, so this
+ *                  takes the same time for any number of keys. the KEK is
+ *                  borrowed and must outlive the keyfile_t.
+ *      arguments: the filename, the KEK metakey_t, and the keyfile_t to
+ *                 fill in
+ *      returns: CRYPTO_SUCCESS, CRYPTO_FAILURE on I/O errors,
+ *                 CRYPTO_NOT_INIT if the KEK is not initialised, or
+ *                 CRYPTO_BAD_FORMAT if the file is not a keyfile
+ */
+extern crypto_return_t crypto_keyfile_open( const char *, metakey_t,
+                                            keyfile_t * );
+
+/* crypto_keyfile_load: find a key by ID and unwrap it into a metakey,
+ *                  setting its algorithm too. safe to call from several
+ *                  threads at once.
+ *      arguments: the keyfile_t, the key ID, and the metakey_t to load
+ *      returns: KEY_SUCCESS, KEY_NOT_FOUND, or KEY_FAILURE if the key does
+ *                 not unwrap (wrong KEK or a damaged file)
+ */
+extern crypto_key_return_t crypto_keyfile_load( keyfile_t, unsigned long,
+                                                metakey_t );
+
+/* crypto_keyfile_load_keys: load several keys by ID with a single batch
+ *                  unwrap. safe to call from several threads at once.
+ *      arguments: the keyfile_t, an array of key IDs, an array of as many
+ *                 metakey_t's to load them into, and the number of keys
+ *      returns: KEY_SUCCESS, KEY_NOT_FOUND if some ID is not in the file,
+ *                 or KEY_FAILURE if some key does not unwrap. the keys
+ *                 that were found and unwrapped are loaded either way.
+ */
+extern crypto_key_return_t crypto_keyfile_load_keys( keyfile_t,
+                                                     const unsigned long *,
+                                                     metakey_t *, size_t );
+
+/* crypto_keyfile_count: the number of keys in the keyfile */
+extern uint64_t crypto_keyfile_count( keyfile_t );
+
+/* crypto_keyfile_close: unmap a keyfile; NULL is ignored */
+extern void crypto_keyfile_close( keyfile_t );
+
+#endif
@@ -0,0 +1,199 @@
+/**************************************************************************
+ * keygen.c                                                               *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-21                                                             *
+ *                                                                        *
+ * aeskeygen: generate a multi-key keyfile (see keyfile.h)                *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptoinit.h"
+#include "cryptorand.h"
+#include "cryptosecmem.h"
+#include "cryptotrace.h"
+#include "keyfile.h"
+#include "keystore.h"
+#include "metakey.h"
+
+static void usage( const char * );
+static int bits_to_algo( unsigned long );
+
+int main( int argc, char **argv ) {
+    crypto_key_return_t key_result = KEY_FAILURE;
+    struct randpool_stats pool;
+    struct secmem_stats sm;
+    metakey_t kek = NULL;
+    metakey_t *keys = NULL;
+    const char *kekfile = DEFAULT_KEYFILE;
+    const char *outfile = NULL;
+    unsigned long kekbits = 256, keybits = 256;
+    unsigned long count = 1, first = 0, i = 0;
+    int kek_algo = 0, key_algo = 0;
+    int c = 0;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, "k:b:n:s:f:o:m:vT:h")) != -1) {
+        switch (c) {
+            case 'k':
+                kekfile = optarg;
+                break;
+            case 'b':
+                kekbits = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                keybits = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                first = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 'm':
+                crypto_secmem_set_size((size_t) strtoul(optarg, NULL, 0));
+                break;
+            case 'v':
+                crypto_trace_set_level(crypto_trace_level + 1);
+                break;
+            case 'T':
+                if (CRYPTO_SUCCESS != crypto_trace_dump_to(optarg, SIGUSR1)) {
+                    fprintf(stderr, "[!] can not write latencies to %s\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    kek_algo = bits_to_algo(kekbits);
+    key_algo = bits_to_algo(keybits);
+    if ((NULL == outfile) || (0 == kek_algo) || (0 == key_algo)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    keystore = crypto_init();
+    if (NULL == keystore) {
+        fprintf(stderr, "[!] could not initalise gcrypt!\n");
+        return EXIT_FAILURE;
+    }
+
+    /* a missing key-encrypting key is generated, as aescrypt -e does */
+    kek = crypto_metakey_new();
+    keys = calloc(count + 1, sizeof *keys);
+    if ((NULL == kek) || (NULL == keys)) {
+        fprintf(stderr, "[!] out of memory!\n");
+        goto out;
+    }
+
+    crypto_set_autogen();
+    key_result = crypto_loadkey(kekfile, kek, kekbits / 8);
+    if (KEYGEN == key_result) {
+        key_result = crypto_dumpkey(kekfile, kek);
+        if (KEY_SUCCESS == key_result) {
+            fprintf(stderr, "[+] generated new key in %s\n", kekfile);
+        }
+    }
+    if (KEY_SUCCESS != key_result) {
+        fprintf(stderr, "[!] error loading key-encrypting key from %s!\n",
+                kekfile);
+        goto out;
+    }
+    kek->algo = kek_algo;
+
+    for (i = 0; i < count; ++i) {
+        keys[i] = crypto_keystore_add(keystore, first + i);
+        if (NULL == keys[i]) {
+            fprintf(stderr, "[!] could not add key %lu!\n", first + i);
+            key_result = KEY_FAILURE;
+            goto out;
+        }
+        keys[i]->algo = key_algo;
+    }
+
+    /* all in one batch, from the random pool */
+    key_result = crypto_genkeys(keys, (size_t) count, keybits / 8);
+    if (KEY_SUCCESS != key_result) {
+        fprintf(stderr, "[!] could not generate the keys!\n");
+        goto out;
+    }
+
+    crypto_randpool_stats(&pool);
+    fprintf(stderr, "[+] random pool: %llu bytes pooled, %llu drawn directly\n",
+            pool.served, pool.direct);
+
+    key_result = crypto_keyfile_write(outfile, kek, keys, (size_t) count);
+    if (KEY_SUCCESS == key_result) {
+        fprintf(stderr, "[+] wrote %lu %lu-bit keys to %s\n", count, keybits,
+                outfile);
+    } else {
+        fprintf(stderr, "[!] could not write %s!\n", outfile);
+    }
+
+out:
+    crypto_metakey_free(kek);
+    free(keys);
+    crypto_zerokeystore(keystore);
+
+    /* what a keystore of this size needs, to size -m by */
+    crypto_secmem_stats(&sm);
+    fprintf(stderr, "[+] secure memory: %lu bytes, %lu at most in use, ",
+            (unsigned long) sm.size, (unsigned long) sm.high_water);
+    fprintf(stderr, "%lu failed allocations\n", sm.failures);
+    crypto_shutdown();
+
+    return (KEY_SUCCESS == key_result) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void usage( const char *progname ) {
+    fprintf(stderr, "usage: %s -o keystore [-k keyfile] [-b bits] ",
+            progname);
+    fprintf(stderr, "[-n count] [-s bits] [-f first] [-m bytes]\n");
+    fprintf(stderr, "\t[-v] [-T file]\n");
+    fprintf(stderr, "\t-o\tkeyfile to write\n");
+    fprintf(stderr, "\t-k\tkey-encrypting key (default %s, generated if ",
+            DEFAULT_KEYFILE);
+    fprintf(stderr, "missing)\n");
+    fprintf(stderr, "\t-b\tsize of the key-encrypting key in bits ");
+    fprintf(stderr, "(default 256)\n");
+    fprintf(stderr, "\t-n\tnumber of keys to generate (default 1)\n");
+    fprintf(stderr, "\t-s\tsize of the generated keys in bits ");
+    fprintf(stderr, "(default 256)\n");
+    fprintf(stderr, "\t-f\tID of the first key (default 0)\n");
+    fprintf(stderr, "\t-m\tsecure memory in bytes, 0 for none ");
+    fprintf(stderr, "(default %d)\n", SECURE_MEM);
+    fprintf(stderr, "\t-v\tmore messages; repeat for more still\n");
+    fprintf(stderr, "\t-T\twrite latency histograms as JSON to file ");
+    fprintf(stderr, "(- for stderr)\n\t\tat exit and on SIGUSR1\n");
+}
+
+static int bits_to_algo( unsigned long bits ) {
+    switch (bits) {
+        case 128:
+            return GCRY_CIPHER_AES128;
+        case 192:
+            return GCRY_CIPHER_AES192;
+        case 256:
+            return GCRY_CIPHER_AES256;
+        default:
+            return 0;
+    }
+}
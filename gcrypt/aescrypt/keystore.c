@@ -0,0 +1,861 @@
+/**************************************************************************
+ * keystore.c                                                             *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-19                                                             *
+ *                                                                        *
+ * keystore implementation, see keystore.h for documentation              *
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <gcrypt.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "cryptosecmem.h"
+#include "keyfile.h"
+#include "keystore.h"
+#include "metakey.h"
+#include "debug.h"
+
+/********************************************************************
+ * keystore_table:                                                  *
+ *      one generation of the hash table                            *
+ *                                                                  *
+ * capacity: number of slots, always a power of two                 *
+ * used: slots that are not NULL, i.e. keys plus tombstones         *
+ * slot: the metakeys; NULL ends a probe, KS_TOMBSTONE does not     *
+ ********************************************************************/
+struct keystore_table {
+    size_t capacity;
+    size_t used;
+    metakey_t slot[1];
+};
+
+/********************************************************************
+ * keystore_s:                                                      *
+ *                                                                  *
+ * table: the current table, replaced as a whole when it grows      *
+ * size: number of keys                                             *
+ * lock: serialises all updates                                     *
+ * backing: keyfile that missing keys are loaded from, or NULL      *
+ * resident: keys loaded from the backing keyfile                   *
+ * limit: most resident keys to keep, 0 for no limit                *
+ * hand: the eviction clock hand, a slot index                      *
+ * faults / evictions: keys loaded from / dropped to the keyfile    *
+ ********************************************************************/
+struct keystore_s {
+    struct keystore_table *table;
+    size_t size;
+    pthread_mutex_t lock;
+    keyfile_t backing;
+    size_t resident;
+    size_t limit;
+    size_t hand;
+    unsigned long faults;
+    unsigned long evictions;
+};
+
+/********************************************************************
+ * ks_reader:                                                       *
+ *      epoch record of a thread reading keystores                  *
+ *                                                                  *
+ * epoch: the global epoch when the thread started reading          *
+ * active: the thread is inside a read section                      *
+ * depth: nesting of read sections, private to the thread           *
+ * in_use: the record belongs to a live thread                      *
+ ********************************************************************/
+struct ks_reader {
+    unsigned long epoch;
+    int active;
+    int depth;
+    int in_use;
+    struct ks_reader *next;
+};
+
+/* a table or metakey waiting for the readers to move on */
+struct ks_limbo {
+    void *p;
+    int is_key;
+    unsigned long epoch;
+    struct ks_limbo *next;
+};
+
+/* marks a removed entry; never dereferenced */
+static struct metakey ks_tombstone;
+#define     KS_TOMBSTONE    (&ks_tombstone)
+
+/* epoch based reclamation, shared by all keystores */
+static unsigned long ks_epoch = 0;
+static struct ks_reader *ks_readers = NULL;
+static struct ks_limbo *ks_limbo = NULL;
+static pthread_mutex_t ks_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ks_reader_key;
+static pthread_once_t ks_reader_once = PTHREAD_ONCE_INIT;
+static __thread struct ks_reader *ks_self = NULL;
+
+static size_t keystore_slot( unsigned long, size_t );
+static struct keystore_table *keystore_table_new( size_t );
+static metakey_t keystore_probe( struct keystore_table *, unsigned long );
+static size_t keystore_find( struct keystore_table *, unsigned long );
+static crypto_key_return_t keystore_rehash( keystore_t );
+static crypto_key_return_t keystore_insert_locked( keystore_t, unsigned long,
+                                                   metakey_t );
+static void keystore_unlink_locked( keystore_t, size_t, metakey_t );
+static metakey_t keystore_fault( keystore_t, keyfile_t, unsigned long );
+static int keystore_evict( keystore_t );
+static struct ks_reader *ks_read_enter( void );
+static void ks_read_exit( struct ks_reader * );
+static void ks_reader_init( void );
+static void ks_reader_release( void * );
+static void ks_retire( void *, int );
+static int ks_try_advance( void );
+static void ks_reclaim( int );
+static void ks_free( void *, int );
+
+keystore_t crypto_keystore_new( size_t slots ) {
+    keystore_t ks = NULL;
+    size_t capacity = 2;
+
+    while (capacity < slots) {
+        capacity <<= 1;
+    }
+
+    ks = CRYPTO_MALLOC(1, sizeof *ks);
+    if (NULL == ks) {
+        return NULL;
+    }
+
+    ks->table = keystore_table_new(capacity);
+    if (NULL == ks->table) {
+        CRYPTO_FREE(ks);
+        return NULL;
+    }
+
+    ks->size = 0;
+    pthread_mutex_init(&ks->lock, NULL);
+
+    return ks;
+}
+
+void crypto_keystore_free( keystore_t ks ) {
+    struct keystore_table *t = NULL;
+    size_t i = 0;
+
+    if (NULL == ks) {
+        return;
+    }
+
+    t = ks->table;
+    for (i = 0; i < t->capacity; ++i) {
+        if ((NULL != t->slot[i]) && (KS_TOMBSTONE != t->slot[i])) {
+            TRACE_DEBUG("[+] wiping key %lu...\n", t->slot[i]->id);
+
+            crypto_metakey_free(t->slot[i]);
+            t->slot[i] = NULL;
+        }
+    }
+
+    /* nobody is reading any more: everything retired can go */
+    ks_reclaim(1);
+
+    CRYPTO_FREE(t);
+    pthread_mutex_destroy(&ks->lock);
+    CRYPTO_FREE(ks);
+}
+
+crypto_key_return_t crypto_keystore_insert( keystore_t ks, unsigned long id,
+        metakey_t mk ) {
+    crypto_key_return_t result = KEY_FAILURE;
+
+    mk->refs = 0;
+    mk->lazy = 0;
+
+    pthread_mutex_lock(&ks->lock);
+    result = keystore_insert_locked(ks, id, mk);
+    pthread_mutex_unlock(&ks->lock);
+    ks_reclaim(0);
+
+    return result;
+}
+
+metakey_t crypto_keystore_add( keystore_t ks, unsigned long id ) {
+    crypto_key_return_t result = KEY_FAILURE;
+    metakey_t mk = crypto_metakey_new();
+
+    if (NULL == mk) {
+        return NULL;
+    }
+
+    result = crypto_keystore_insert(ks, id, mk);
+    if (KEY_SUCCESS != result) {
+        crypto_metakey_free(mk);
+        return NULL;
+    }
+
+    return mk;
+}
+
+metakey_t crypto_keystore_lookup( keystore_t ks, unsigned long id ) {
+    struct ks_reader *r = ks_read_enter();
+    metakey_t mk = NULL;
+
+    if (NULL != r) {
+        mk = keystore_probe(__atomic_load_n(&ks->table, __ATOMIC_ACQUIRE),
+                id);
+        ks_read_exit(r);
+    }
+
+    return mk;
+}
+
+metakey_t crypto_keystore_get( keystore_t ks, unsigned long id ) {
+    struct ks_reader *r = ks_read_enter();
+    metakey_t mk = NULL;
+    keyfile_t kf = NULL;
+    unsigned int old = 0;
+
+    if (NULL == r) {
+        return NULL;
+    }
+
+    /* inside the read section the metakey can not be freed, so the
+     * reference is taken before anyone could */
+    mk = keystore_probe(__atomic_load_n(&ks->table, __ATOMIC_ACQUIRE), id);
+    if (NULL != mk) {
+        old = __atomic_fetch_add(&mk->refs, 1, __ATOMIC_ACQ_REL);
+
+        /* only store when it changes, so hot keys stay in shared cache */
+        if ((0 == (old & METAKEY_REF_ZEROING)) &&
+                (0 == __atomic_load_n(&mk->used, __ATOMIC_RELAXED))) {
+            __atomic_store_n(&mk->used, 1, __ATOMIC_RELAXED);
+        }
+    }
+    ks_read_exit(r);
+
+    /* crypto_zerokey got there first and may be halfway through the key
+     * bytes: a cipher handle keyed from them now would outlive the wipe */
+    if (old & METAKEY_REF_ZEROING) {
+        crypto_keystore_put(mk);
+        return NULL;
+    }
+
+    kf = __atomic_load_n(&ks->backing, __ATOMIC_ACQUIRE);
+    if ((NULL == mk) && (NULL != kf)) {
+        mk = keystore_fault(ks, kf, id);
+    }
+
+    return mk;
+}
+
+void crypto_keystore_put( metakey_t mk ) {
+    unsigned int old = 0;
+
+    if (NULL == mk) {
+        return;
+    }
+
+    /* the last reference to a removed key frees it */
+    old = __atomic_fetch_sub(&mk->refs, 1, __ATOMIC_ACQ_REL);
+    if ((METAKEY_REF_ORPHAN | 1) == old) {
+        crypto_metakey_free(mk);
+    }
+}
+
+crypto_key_return_t crypto_keystore_remove( keystore_t ks,
+        unsigned long id ) {
+    struct keystore_table *t = NULL;
+    metakey_t mk = NULL;
+    size_t i = 0;
+
+    pthread_mutex_lock(&ks->lock);
+    t  = ks->table;
+    i  = keystore_find(t, id);
+    mk = t->slot[i];
+    if ((NULL == mk) || (KS_TOMBSTONE == mk)) {
+        pthread_mutex_unlock(&ks->lock);
+        return KEY_NOT_FOUND;
+    }
+
+    keystore_unlink_locked(ks, i, mk);
+    pthread_mutex_unlock(&ks->lock);
+
+    ks_reclaim(0);
+    return KEY_SUCCESS;
+}
+
+crypto_key_return_t crypto_keystore_rotate( keystore_t ks, unsigned long id,
+        metakey_t mk ) {
+    struct keystore_table *t = NULL;
+    metakey_t old = NULL;
+    size_t i = 0;
+
+    pthread_mutex_lock(&ks->lock);
+    t   = ks->table;
+    i   = keystore_find(t, id);
+    old = t->slot[i];
+    if ((NULL == old) || (KS_TOMBSTONE == old)) {
+        pthread_mutex_unlock(&ks->lock);
+        return KEY_NOT_FOUND;
+    }
+
+    if (0 != old->lazy) {
+        ks->resident--;
+    }
+
+    mk->id   = id;
+    mk->refs = 0;
+    mk->lazy = 0;
+    __atomic_store_n(&t->slot[i], mk, __ATOMIC_RELEASE);
+    ks_retire(old, 1);
+    pthread_mutex_unlock(&ks->lock);
+
+    ks_reclaim(0);
+    return KEY_SUCCESS;
+}
+
+size_t crypto_keystore_size( keystore_t ks ) {
+    return __atomic_load_n(&ks->size, __ATOMIC_RELAXED);
+}
+
+void crypto_keystore_attach( keystore_t ks, keyfile_t kf ) {
+    __atomic_store_n(&ks->backing, kf, __ATOMIC_RELEASE);
+}
+
+void crypto_keystore_set_limit( keystore_t ks, size_t limit ) {
+    pthread_mutex_lock(&ks->lock);
+    ks->limit = limit;
+    while ((0 != limit) && (ks->resident > limit) && keystore_evict(ks)) {
+        /* evicted one */
+    }
+    pthread_mutex_unlock(&ks->lock);
+
+    ks_reclaim(0);
+}
+
+crypto_key_return_t crypto_keystore_preload( keystore_t ks,
+        const unsigned long *ids, size_t n ) {
+    crypto_key_return_t result = KEY_SUCCESS;
+    crypto_key_return_t insert = KEY_SUCCESS;
+    keyfile_t kf = __atomic_load_n(&ks->backing, __ATOMIC_ACQUIRE);
+    unsigned long *want = NULL;
+    metakey_t *mks = NULL;
+    size_t i = 0, nwant = 0;
+
+    if (NULL == kf) {
+        return KEY_NOT_INIT;
+    }
+
+    want = malloc((n + 1) * sizeof *want);
+    mks  = calloc(n + 1, sizeof *mks);
+    if ((NULL == want) || (NULL == mks)) {
+        free(want);
+        free(mks);
+        return KEY_FAILURE;
+    }
+
+    /* only the keys that are not in yet */
+    for (i = 0; i < n; ++i) {
+        if (NULL != crypto_keystore_lookup(ks, ids[i])) {
+            continue;
+        }
+
+        mks[nwant] = crypto_metakey_new();
+        if (NULL == mks[nwant]) {
+            result = KEY_FAILURE;
+            break;
+        }
+        want[nwant++] = ids[i];
+    }
+
+    if ((KEY_SUCCESS == result) && (nwant > 0)) {
+        result = crypto_keyfile_load_keys(kf, want, mks, nwant);
+    }
+
+    pthread_mutex_lock(&ks->lock);
+    for (i = 0; i < nwant; ++i) {
+        if (1 != mks[i]->initialised) {
+            continue;
+        }
+
+        /* cold until someone asks for it */
+        mks[i]->lazy = 1;
+        mks[i]->used = 0;
+        mks[i]->refs = 0;
+
+        insert = keystore_insert_locked(ks, want[i], mks[i]);
+        if (KEY_SUCCESS == insert) {
+            ks->faults++;
+            mks[i] = NULL;
+        } else if ((KEY_EXISTS != insert) && (KEY_SUCCESS == result)) {
+            result = insert;
+        }
+    }
+    pthread_mutex_unlock(&ks->lock);
+    ks_reclaim(0);
+
+    for (i = 0; i < nwant; ++i) {
+        if (NULL != mks[i]) {
+            crypto_metakey_free(mks[i]);
+        }
+    }
+
+    free(want);
+    free(mks);
+
+    return result;
+}
+
+void crypto_keystore_stats( keystore_t ks, struct keystore_stats *st ) {
+    pthread_mutex_lock(&ks->lock);
+    st->keys      = ks->size;
+    st->resident  = ks->resident;
+    st->limit     = ks->limit;
+    st->faults    = ks->faults;
+    st->evictions = ks->evictions;
+    pthread_mutex_unlock(&ks->lock);
+}
+
+crypto_key_return_t crypto_zerokeystore( keystore_t ks ) {
+    crypto_key_return_t result = KEY_SUCCESS;
+    crypto_key_return_t zero   = KEY_FAILURE;
+    struct keystore_table *t = NULL;
+    metakey_t mk = NULL;
+    size_t i = 0;
+
+    if (NULL == ks) {
+        return LIB_NOT_INIT;
+    }
+
+    pthread_mutex_lock(&ks->lock);
+    t = ks->table;
+    for (i = 0; i < t->capacity; ++i) {
+        mk = t->slot[i];
+        if ((NULL == mk) || (KS_TOMBSTONE == mk) ||
+                (1 != mk->initialised)) {
+            continue;
+        }
+
+        zero = crypto_zerokey(mk);
+        if ((KEY_SUCCESS != zero) && (KEY_SUCCESS == result)) {
+            result = zero;
+        }
+    }
+    pthread_mutex_unlock(&ks->lock);
+
+    return result;
+}
+
+
+/**************************************************************************/
+/*                           hash table helpers                           */
+/**************************************************************************/
+
+/* home slot of an ID. IDs are often small and sequential, so they are
+ * mixed (the 64-bit murmur3 finaliser) before taking the low bits. */
+static size_t keystore_slot( unsigned long id, size_t capacity ) {
+    uint64_t h = (uint64_t) id;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (size_t) h & (capacity - 1);
+}
+
+static struct keystore_table *keystore_table_new( size_t capacity ) {
+    struct keystore_table *t = NULL;
+
+    t = CRYPTO_MALLOC(1, sizeof *t + (capacity - 1) * sizeof t->slot[0]);
+    if (NULL != t) {
+        t->capacity = capacity;
+        t->used     = 0;
+    }
+
+    return t;
+}
+
+/* the key with this ID, or NULL. safe against concurrent updates. */
+static metakey_t keystore_probe( struct keystore_table *t,
+        unsigned long id ) {
+    size_t mask = t->capacity - 1;
+    size_t i = keystore_slot(id, t->capacity);
+    size_t n = 0;
+    metakey_t mk = NULL;
+
+    for (n = 0; n < t->capacity; ++n, i = (i + 1) & mask) {
+        mk = __atomic_load_n(&t->slot[i], __ATOMIC_ACQUIRE);
+        if (NULL == mk) {
+            break;
+        } else if ((KS_TOMBSTONE != mk) && (id == mk->id)) {
+            return mk;
+        }
+    }
+
+    return NULL;
+}
+
+/* writers only: the slot holding id or, if there is none, the slot a new
+ * key with this ID goes in (the first tombstone or the terminating NULL).
+ * for a missing key the returned slot is not a live key. */
+static size_t keystore_find( struct keystore_table *t, unsigned long id ) {
+    size_t mask = t->capacity - 1;
+    size_t i = keystore_slot(id, t->capacity);
+    size_t free_slot = t->capacity;
+
+    while (NULL != t->slot[i]) {
+        if (KS_TOMBSTONE == t->slot[i]) {
+            if (t->capacity == free_slot) {
+                free_slot = i;
+            }
+        } else if (id == t->slot[i]->id) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return (t->capacity == free_slot) ? i : free_slot;
+}
+
+/* build a new table without tombstones, twice the size if the keys alone
+ * fill a quarter of it, publish it and retire the old one. called with
+ * the keystore locked. */
+static crypto_key_return_t keystore_rehash( keystore_t ks ) {
+    struct keystore_table *old = ks->table;
+    struct keystore_table *t = NULL;
+    size_t capacity = old->capacity;
+    size_t i = 0;
+
+    if (4 * (ks->size + 1) > capacity) {
+        capacity *= 2;
+    }
+
+    t = keystore_table_new(capacity);
+    if (NULL == t) {
+        TRACE_ERROR("[!] error growing the keystore!\n");
+
+        return KEY_FAILURE;
+    }
+
+    for (i = 0; i < old->capacity; ++i) {
+        if ((NULL != old->slot[i]) && (KS_TOMBSTONE != old->slot[i])) {
+            t->slot[keystore_find(t, old->slot[i]->id)] = old->slot[i];
+            t->used++;
+        }
+    }
+
+    __atomic_store_n(&ks->table, t, __ATOMIC_RELEASE);
+    ks_retire(old, 0);
+
+    return KEY_SUCCESS;
+}
+
+
+/* add a metakey whose refs and lazy fields are already set up. called
+ * with the keystore locked. */
+static crypto_key_return_t keystore_insert_locked( keystore_t ks,
+        unsigned long id, metakey_t mk ) {
+    crypto_key_return_t result = KEY_SUCCESS;
+    struct keystore_table *t = NULL;
+    size_t i = 0;
+
+    /* make room among the loaded keys first */
+    while ((0 != mk->lazy) && (0 != ks->limit) &&
+            (ks->resident >= ks->limit) && keystore_evict(ks)) {
+        /* evicted one */
+    }
+
+    /* keep keys plus tombstones at or below half the table */
+    if (2 * (ks->table->used + 1) > ks->table->capacity) {
+        result = keystore_rehash(ks);
+    }
+
+    t = ks->table;
+    if (KEY_SUCCESS != result) {
+        /* no memory to grow */
+    } else if (NULL != keystore_probe(t, id)) {
+        result = KEY_EXISTS;
+    } else {
+        mk->id = id;
+
+        i = keystore_find(t, id);
+        if (NULL == t->slot[i]) {
+            t->used++;
+        }
+
+        /* the metakey is complete before readers can see it */
+        __atomic_store_n(&t->slot[i], mk, __ATOMIC_RELEASE);
+        __atomic_store_n(&ks->size, ks->size + 1, __ATOMIC_RELAXED);
+        if (0 != mk->lazy) {
+            ks->resident++;
+        }
+    }
+
+    return result;
+}
+
+/* take the key in slot i out of the table and retire it. called with the
+ * keystore locked. */
+static void keystore_unlink_locked( keystore_t ks, size_t i, metakey_t mk ) {
+    /* a tombstone keeps the probe sequences of later keys intact */
+    __atomic_store_n(&ks->table->slot[i], KS_TOMBSTONE, __ATOMIC_RELEASE);
+    __atomic_store_n(&ks->size, ks->size - 1, __ATOMIC_RELAXED);
+    if (0 != mk->lazy) {
+        ks->resident--;
+    }
+
+    ks_retire(mk, 1);
+}
+
+/* load a missing key from the backing keyfile and add it, returning it
+ * with a reference taken. the unwrap happens outside the lock; if another
+ * thread loads the same key meanwhile, its copy wins. */
+static metakey_t keystore_fault( keystore_t ks, keyfile_t kf,
+        unsigned long id ) {
+    crypto_key_return_t result = KEY_FAILURE;
+    metakey_t mk = crypto_metakey_new();
+    metakey_t cur = NULL;
+
+    if (NULL == mk) {
+        return NULL;
+    }
+
+    if (KEY_SUCCESS != crypto_keyfile_load(kf, id, mk)) {
+        crypto_metakey_free(mk);
+        return NULL;
+    }
+
+    mk->lazy = 1;
+    mk->used = 1;
+    mk->refs = 1;
+
+    pthread_mutex_lock(&ks->lock);
+    cur = keystore_probe(ks->table, id);
+    if (NULL != cur) {
+        /* live in the table, so it can not be freed under the lock */
+        __atomic_add_fetch(&cur->refs, 1, __ATOMIC_ACQ_REL);
+    } else {
+        result = keystore_insert_locked(ks, id, mk);
+        if (KEY_SUCCESS == result) {
+            ks->faults++;
+            cur = mk;
+            mk = NULL;
+        }
+    }
+    pthread_mutex_unlock(&ks->lock);
+    ks_reclaim(0);
+
+    if (NULL != mk) {
+        crypto_metakey_free(mk);
+    }
+
+    return cur;
+}
+
+/* drop one loaded key that is neither referenced nor recently used; the
+ * clock hand sweeps the table, clearing the used bits it passes, so this
+ * is an approximate LRU in amortised constant time. keys that did not
+ * come from the keyfile are never evicted. called with the keystore
+ * locked; returns 0 if every loaded key is in use. */
+static int keystore_evict( keystore_t ks ) {
+    struct keystore_table *t = ks->table;
+    metakey_t mk = NULL;
+    size_t n = 0, i = 0;
+
+    for (n = 0; n < 2 * t->capacity; ++n) {
+        i = ks->hand++ & (t->capacity - 1);
+        mk = t->slot[i];
+
+        if ((NULL == mk) || (KS_TOMBSTONE == mk) || (0 == mk->lazy) ||
+                (0 != __atomic_load_n(&mk->refs, __ATOMIC_ACQUIRE))) {
+            continue;
+        } else if (0 != __atomic_load_n(&mk->used, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&mk->used, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        TRACE_DEBUG("[+] evicting key %lu...\n", mk->id);
+
+        /* a reader that grabs it meanwhile keeps it alive until put */
+        keystore_unlink_locked(ks, i, mk);
+        ks->evictions++;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**************************************************************************/
+/*                       epoch based reclamation                          */
+/**************************************************************************/
+
+/* start a read section: publish the epoch the thread is reading in. this
+ * is a couple of stores, so lookups never wait for writers. */
+static struct ks_reader *ks_read_enter( ) {
+    struct ks_reader *r = ks_self;
+
+    if (NULL == r) {
+        pthread_once(&ks_reader_once, ks_reader_init);
+
+        /* reuse the record of a thread that has exited, or add one */
+        for (r = __atomic_load_n(&ks_readers, __ATOMIC_ACQUIRE); NULL != r;
+                r = r->next) {
+            int expected = 0;
+
+            if (__atomic_compare_exchange_n(&r->in_use, &expected, 1, 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+
+        if (NULL == r) {
+            r = calloc(1, sizeof *r);
+            if (NULL == r) {
+                return NULL;
+            }
+
+            r->in_use = 1;
+            r->next = __atomic_load_n(&ks_readers, __ATOMIC_RELAXED);
+            while (! __atomic_compare_exchange_n(&ks_readers, &r->next, r,
+                        0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                /* r->next was refreshed, try again */
+            }
+        }
+
+        pthread_setspecific(ks_reader_key, r);
+        ks_self = r;
+    }
+
+    if (0 == r->depth++) {
+        __atomic_store_n(&r->epoch, __atomic_load_n(&ks_epoch,
+                    __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        __atomic_store_n(&r->active, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    return r;
+}
+
+static void ks_read_exit( struct ks_reader *r ) {
+    if (0 == --r->depth) {
+        __atomic_store_n(&r->active, 0, __ATOMIC_RELEASE);
+    }
+}
+
+static void ks_reader_init( ) {
+    pthread_key_create(&ks_reader_key, ks_reader_release);
+}
+
+/* thread exit: hand the record to the next new thread */
+static void ks_reader_release( void *arg ) {
+    struct ks_reader *r = arg;
+
+    __atomic_store_n(&r->active, 0, __ATOMIC_RELEASE);
+    r->depth = 0;
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* queue something unlinked from a table to be freed once no reader can
+ * still see it */
+static void ks_retire( void *p, int is_key ) {
+    struct ks_limbo *l = malloc(sizeof *l);
+    unsigned long target = 0;
+
+    pthread_mutex_lock(&ks_reclaim_lock);
+    if (NULL != l) {
+        l->p      = p;
+        l->is_key = is_key;
+        l->epoch  = __atomic_load_n(&ks_epoch, __ATOMIC_SEQ_CST);
+        l->next   = ks_limbo;
+        ks_limbo  = l;
+        pthread_mutex_unlock(&ks_reclaim_lock);
+        return;
+    }
+
+    /* out of memory: wait for the grace period right here */
+    target = __atomic_load_n(&ks_epoch, __ATOMIC_SEQ_CST) + 2;
+    while (__atomic_load_n(&ks_epoch, __ATOMIC_SEQ_CST) < target) {
+        if (! ks_try_advance()) {
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&ks_reclaim_lock);
+
+    ks_free(p, is_key);
+}
+
+/* move the global epoch on if every active reader has seen it. called
+ * with ks_reclaim_lock held. */
+static int ks_try_advance( ) {
+    unsigned long e = __atomic_load_n(&ks_epoch, __ATOMIC_SEQ_CST);
+    struct ks_reader *r = NULL;
+
+    for (r = __atomic_load_n(&ks_readers, __ATOMIC_ACQUIRE); NULL != r;
+            r = r->next) {
+        if (__atomic_load_n(&r->active, __ATOMIC_SEQ_CST) &&
+                (e != __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST))) {
+            return 0;
+        }
+    }
+
+    __atomic_store_n(&ks_epoch, e + 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+/* free whatever was retired two or more epochs ago; everything if all is
+ * set, which is only safe when no thread is reading */
+static void ks_reclaim( int all ) {
+    struct ks_limbo **lp = NULL, *l = NULL, *done = NULL;
+    unsigned long e = 0;
+
+    pthread_mutex_lock(&ks_reclaim_lock);
+    if (NULL == ks_limbo) {
+        pthread_mutex_unlock(&ks_reclaim_lock);
+        return;
+    }
+
+    ks_try_advance();
+    e = __atomic_load_n(&ks_epoch, __ATOMIC_SEQ_CST);
+
+    lp = &ks_limbo;
+    while (NULL != (l = *lp)) {
+        if (all || (l->epoch + 2 <= e)) {
+            *lp = l->next;
+            l->next = done;
+            done = l;
+        } else {
+            lp = &l->next;
+        }
+    }
+    pthread_mutex_unlock(&ks_reclaim_lock);
+
+    while (NULL != done) {
+        l = done;
+        done = l->next;
+        ks_free(l->p, l->is_key);
+        free(l);
+    }
+}
+
+/* a retired table goes right away; a retired key only once its last
+ * reference is dropped (see crypto_keystore_put) */
+static void ks_free( void *p, int is_key ) {
+    metakey_t mk = p;
+    unsigned int old = 0;
+
+    if (! is_key) {
+        CRYPTO_FREE(p);
+        return;
+    }
+
+    old = __atomic_fetch_or(&mk->refs, METAKEY_REF_ORPHAN, __ATOMIC_ACQ_REL);
+    if (0 == (old & ~METAKEY_REF_ORPHAN)) {
+        crypto_metakey_free(mk);
+    }
+}
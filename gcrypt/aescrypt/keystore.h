@@ -0,0 +1,197 @@
+/**************************************************************************
+ * keystore.h                                                             *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>"                        *
+ * 2011-01-19                                                             *
+ *                                                                        *
+ * the keystore: metakeys indexed by key ID                               *
+ **************************************************************************/
+
+#ifndef __KEYSTORE_H
+#define __KEYSTORE_H
+
+#include <stdlib.h>
+
+#include "config.h"
+#include "crypto.h"
+#include "keyfile.h"
+#include "metakey.h"
+
+/**************************************************************************/
+/*                         note on the keystore                           */
+/**************************************************************************/
+/*
+ * the keystore is an open addressing hash table (linear probing) of
+ * pointers to metakeys, keyed by the metakey's id. lookups, inserts and
+ * removals take constant time on average. removed entries leave a
+ * tombstone; once keys plus tombstones fill half the table it is rebuilt
+ * without them, twice the size if the keys alone need it. since it only
+ * holds pointers, rebuilding moves no keys.
+ *
+ * any number of threads may look keys up while one thread at a time
+ * updates the keystore (a mutex serialises insert, remove and rotate).
+ * lookups take no lock: a reader publishes the epoch it started in, reads
+ * the current table with atomic loads and never waits for a writer. a
+ * writer never frees what it unlinks - a replaced table or a removed key -
+ * straight away but queues it, and it is freed only once every reader
+ * that could still see it has left its read section (epoch based
+ * reclamation).
+ *
+ * crypto_keystore_get hands out a counted reference to a key; hold it for
+ * as long as the key is used and give it back with crypto_keystore_put.
+ * a referenced key is not zeroised (crypto_zerokey returns KEY_IN_USE),
+ * and a referenced key that is removed or rotated out is freed when the
+ * last reference goes. crypto_keystore_lookup returns a borrowed pointer
+ * and is only safe when no other thread removes keys.
+ *
+ * a keyfile (keyfile.h) can be attached to the keystore as its backing
+ * store. the keys in it are then not loaded up front: crypto_keystore_get
+ * loads a key the first time it is asked for, so start up and memory use
+ * depend on the keys actually used, not on the size of the keyfile. with
+ * a limit set (crypto_keystore_set_limit), loading a key beyond the limit
+ * first evicts a loaded key that nobody references and that has not been
+ * used recently (a CLOCK sweep, i.e. approximate LRU); evicted keys are
+ * wiped like removed ones and loaded again when next asked for. keys added
+ * with crypto_keystore_insert are never evicted.
+ *
+ * crypto_init creates the global keystore with KEYSTORE_SIZE slots and
+ * crypto_shutdown wipes and frees it along with every key in it.
+ */
+
+
+/**************************************************************************/
+/*                          keystore functions                            */
+/**************************************************************************/
+
+/* crypto_keystore_new: create an empty keystore
+ *      arguments: the initial number of slots, rounded up to a power of two
+ *      returns: the new keystore_t, or NULL if out of memory
+ */
+extern keystore_t crypto_keystore_new( size_t );
+
+/* crypto_keystore_free: wipe and free every key in the keystore, then the
+ *                  keystore itself. no other thread may be using it.
+ *      arguments: the keystore_t; NULL is ignored
+ */
+extern void crypto_keystore_free( keystore_t );
+
+/* crypto_keystore_insert: add a metakey to the keystore under an ID. the
+ *                  keystore takes ownership of the metakey.
+ *      arguments: the keystore_t, the key ID, and the metakey_t
+ *      returns: KEY_SUCCESS, KEY_EXISTS if the ID is taken, or
+ *                 KEY_FAILURE if the table could not grow
+ */
+extern crypto_key_return_t crypto_keystore_insert( keystore_t, unsigned long,
+                                                   metakey_t );
+
+/* crypto_keystore_add: create an empty metakey and insert it under an ID
+ *      arguments: the keystore_t and the key ID
+ *      returns: the new metakey_t, or NULL if the ID is taken or out of
+ *                 memory
+ */
+extern metakey_t crypto_keystore_add( keystore_t, unsigned long );
+
+/* crypto_keystore_lookup: find a key by ID. keys not loaded from the
+ *                  backing keyfile yet are not found.
+ *      arguments: the keystore_t and the key ID
+ *      returns: the metakey_t, or NULL if there is no key with that ID
+ */
+extern metakey_t crypto_keystore_lookup( keystore_t, unsigned long );
+
+/* crypto_keystore_get: find a key by ID and take a reference to it. safe
+ *                  while other threads update the keystore, and never
+ *                  blocks unless the key has to be loaded from the backing
+ *                  keyfile.
+ *      arguments: the keystore_t and the key ID
+ *      returns: the metakey_t, to be released with crypto_keystore_put, or
+ *                 NULL if there is no key with that ID or crypto_zerokey
+ *                 is wiping it
+ */
+extern metakey_t crypto_keystore_get( keystore_t, unsigned long );
+
+/* crypto_keystore_put: give back a reference from crypto_keystore_get. the
+ *                  metakey must not be used afterwards.
+ *      arguments: the metakey_t; NULL is ignored
+ */
+extern void crypto_keystore_put( metakey_t );
+
+/* crypto_keystore_remove: take a key out of the keystore, then wipe and
+ *                  free it (see crypto_metakey_free) once no reader can
+ *                  see it and its last reference is put.
+ *      arguments: the keystore_t and the key ID
+ *      returns: KEY_SUCCESS or KEY_NOT_FOUND
+ */
+extern crypto_key_return_t crypto_keystore_remove( keystore_t,
+                                                   unsigned long );
+
+/* crypto_keystore_rotate: replace the key stored under an ID. readers see
+ *                  either the old or the new key; the old one is freed like
+ *                  a removed key. the keystore takes ownership of the new
+ *                  metakey.
+ *      arguments: the keystore_t, the key ID, and the new metakey_t
+ *      returns: KEY_SUCCESS or KEY_NOT_FOUND
+ */
+extern crypto_key_return_t crypto_keystore_rotate( keystore_t, unsigned long,
+                                                   metakey_t );
+
+/* crypto_keystore_size: the number of keys in the keystore */
+extern size_t crypto_keystore_size( keystore_t );
+
+/* crypto_keystore_attach: load keys missing from the keystore from a
+ *                  keyfile on first use. the keyfile stays open until it
+ *                  is detached (NULL) or the keystore is freed; attach and
+ *                  detach only while no other thread uses the keystore.
+ *      arguments: the keystore_t and an open keyfile_t, or NULL
+ */
+extern void crypto_keystore_attach( keystore_t, keyfile_t );
+
+/* crypto_keystore_set_limit: cap the number of keys loaded from the
+ *                  backing keyfile that stay in memory, evicting cold ones
+ *                  right away if there are more.
+ *      arguments: the keystore_t and the limit, 0 for none (the default)
+ */
+extern void crypto_keystore_set_limit( keystore_t, size_t );
+
+/* crypto_keystore_preload: load keys from the backing keyfile ahead of
+ *                  use, unwrapping them all in one batch. keys already in
+ *                  the keystore are left alone; preloaded keys count
+ *                  against the limit like keys loaded on first use.
+ *      arguments: the keystore_t, an array of key IDs and its length
+ *      returns: KEY_SUCCESS, KEY_NOT_INIT if no keyfile is attached, or
+ *                 the first error loading or inserting a key; the keys
+ *                 that did load are kept either way
+ */
+extern crypto_key_return_t crypto_keystore_preload( keystore_t,
+                                                    const unsigned long *,
+                                                    size_t );
+
+/********************************************************************
+ * keystore_stats:                                                  *
+ *      counters for a keystore                                     *
+ *                                                                  *
+ * keys: keys in the keystore                                       *
+ * resident: how many of them were loaded from the keyfile          *
+ * limit: the limit on resident keys, 0 for none                    *
+ * faults: keys loaded from the keyfile so far                      *
+ * evictions: loaded keys evicted so far                            *
+ ********************************************************************/
+struct keystore_stats {
+    size_t keys;
+    size_t resident;
+    size_t limit;
+    unsigned long faults;
+    unsigned long evictions;
+};
+
+/* crypto_keystore_stats: fill in a keystore's counters */
+extern void crypto_keystore_stats( keystore_t, struct keystore_stats * );
+
+/* crypto_zerokeystore: zeroise every initialised key in the keystore; the
+ *                  keys stay in the keystore. referenced keys are skipped.
+ *      arguments: the keystore_t
+ *      returns: KEY_SUCCESS, LIB_NOT_INIT if the keystore is NULL, or the
+ *                 first error crypto_zerokey returned (KEY_IN_USE if a key
+ *                 was referenced)
+ */
+extern crypto_key_return_t crypto_zerokeystore( keystore_t );
+
+#endif
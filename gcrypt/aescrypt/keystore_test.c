@@ -0,0 +1,302 @@
+/************************************************************************
+ * keystore_test.c                                                      *
+ * 4096R/B7B720D6 "Kyle Isom <coder@kyleisom.net>                       *
+ *                                                                      *
+ * stress test the keystore: reader threads look keys up, use them and  *
+ * try to zeroise them while a writer adds, rotates and removes keys    *
+ * and another thread keeps zeroising the whole keystore.               *
+ * with -l the keys start out in a keyfile and are loaded on first use  *
+ * (a quarter of them preloaded), with at most the given number kept in *
+ * memory.                                                              *
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <gcrypt.h>
+
+#include "crypto.h"
+#include "cryptoinit.h"
+#include "metakey.h"
+#include "keyfile.h"
+#include "keystore.h"
+
+#define TEST_KEYS           256
+#define TEST_READERS        4
+#define TEST_KEYSIZE        16
+#define TEST_KEYFILE        "keystore_test.keys"
+
+struct reader_stats {
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long errors;
+    unsigned int seed;
+};
+
+static int running = 1;
+
+static metakey_t tagged_key( unsigned long );
+static int check_key( metakey_t, unsigned long );
+static void *reader( void * );
+static void *zeroiser( void * );
+static unsigned long writer( unsigned int );
+static keyfile_t backing_keyfile( metakey_t );
+
+int main(int argc, char **argv ) {
+    pthread_t threads[TEST_READERS];
+    pthread_t zero_thread;
+    struct reader_stats stats[TEST_READERS];
+    unsigned long lookups = 0, hits = 0, errors = 0, updates = 0;
+    unsigned long zeroed = 0;
+    struct keystore_stats ks_stats;
+    unsigned long preload[TEST_KEYS / 4];
+    metakey_t kek = NULL;
+    keyfile_t kf = NULL;
+    unsigned long id = 0;
+    long limit = -1;
+    int seconds = 2;
+    int opt = 0;
+    int i = 0;
+
+    while (-1 != (opt = getopt(argc, argv, "t:l:"))) {
+        switch (opt) {
+            case 't':
+                seconds = atoi(optarg);
+                break;
+            case 'l':
+                limit = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds] [-l limit]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    keystore = crypto_init( );
+    if (NULL == keystore) {
+        fprintf(stderr, "[!] %s: keystore generation failed!\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (limit >= 0) {
+        /* every key in the keyfile, none in memory */
+        kek = tagged_key(TEST_KEYS);
+        kf  = backing_keyfile(kek);
+        crypto_keystore_attach(keystore, kf);
+        crypto_keystore_set_limit(keystore, (size_t) limit);
+
+        /* warm up with a batch of keys, as a server would on start up */
+        for (id = 0; id < TEST_KEYS / 4; ++id) {
+            preload[id] = id * 4;
+        }
+        if (KEY_SUCCESS != crypto_keystore_preload(keystore, preload,
+                    TEST_KEYS / 4)) {
+            fprintf(stderr, "[!] %s: could not preload keys!\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* otherwise start with every other key present */
+    for (id = 0; (NULL == kf) && (id < TEST_KEYS); id += 2) {
+        if (KEY_SUCCESS != crypto_keystore_insert(keystore, id,
+                    tagged_key(id))) {
+            fprintf(stderr, "[!] %s: could not add key %lu!\n", argv[0], id);
+            return EXIT_FAILURE;
+        }
+    }
+
+    memset(stats, 0, sizeof stats);
+    for (i = 0; i < TEST_READERS; ++i) {
+        stats[i].seed = (unsigned int) i + 1;
+        pthread_create(&threads[i], NULL, reader, &stats[i]);
+    }
+    pthread_create(&zero_thread, NULL, zeroiser, &zeroed);
+
+    updates = writer((unsigned int) seconds);
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(zero_thread, NULL);
+    for (i = 0; i < TEST_READERS; ++i) {
+        pthread_join(threads[i], NULL);
+        lookups += stats[i].lookups;
+        hits    += stats[i].hits;
+        errors  += stats[i].errors;
+    }
+
+    fprintf(stderr, "[+] %s: %lu lookups (%lu hits), %lu updates, "
+            "%lu zeroisations, %lu errors, %u keys left\n", argv[0],
+            lookups, hits, updates, zeroed, errors,
+            (unsigned int) crypto_keystore_size(keystore));
+
+    crypto_keystore_stats(keystore, &ks_stats);
+    if (NULL != kf) {
+        fprintf(stderr, "[+] %s: %lu keys loaded, %lu evicted, %u resident "
+                "(limit %u)\n", argv[0], ks_stats.faults,
+                ks_stats.evictions, (unsigned int) ks_stats.resident,
+                (unsigned int) ks_stats.limit);
+
+        /* only keys held by readers at the time may push it over */
+        if ((0 != limit) && (ks_stats.resident > (size_t) limit)) {
+            fprintf(stderr, "[!] %s: more keys resident than allowed!\n",
+                    argv[0]);
+            errors++;
+        }
+
+        crypto_keystore_attach(keystore, NULL);
+        crypto_keyfile_close(kf);
+        crypto_metakey_free(kek);
+        unlink(TEST_KEYFILE);
+    }
+
+    if (CRYPTO_SUCCESS != crypto_shutdown( )) {
+        fprintf(stderr, "[!] %s: shutdown failed!\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    return (0 == errors) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* a new key whose first bytes are its ID, so readers can tell whether they
+ * got the key they asked for */
+static metakey_t tagged_key( unsigned long id ) {
+    metakey_t mk = crypto_metakey_new( );
+
+    if ((NULL == mk) || (KEY_SUCCESS != crypto_genkey(mk, TEST_KEYSIZE))) {
+        fprintf(stderr, "[!] could not generate key %lu!\n", id);
+        exit(EXIT_FAILURE);
+    }
+
+    mk->algo = GCRY_CIPHER_AES128;
+    memcpy(mk->key, &id, sizeof id);
+    return mk;
+}
+
+/* the key asked for, or that key zeroised in full; a key caught halfway
+ * through crypto_zerokey is neither */
+static int check_key( metakey_t mk, unsigned long id ) {
+    static const unsigned char zero[TEST_KEYSIZE];
+    unsigned long tag = 0;
+
+    memcpy(&tag, mk->key, sizeof tag);
+    return (id == mk->id) && (1 == mk->initialised) && ((id == tag) ||
+            (0 == memcmp(mk->key, zero, TEST_KEYSIZE)));
+}
+
+static void *reader( void *arg ) {
+    struct reader_stats *st = arg;
+    unsigned char block[16];
+    unsigned char held[TEST_KEYSIZE];
+    gcry_cipher_hd_t hd = NULL;
+    metakey_t mk = NULL;
+    unsigned long id = 0;
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        id = (unsigned long) rand_r(&st->seed) % TEST_KEYS;
+        st->lookups++;
+
+        mk = crypto_keystore_get(keystore, id);
+        if (NULL == mk) {
+            continue;
+        }
+        st->hits++;
+
+        memcpy(held, mk->key, TEST_KEYSIZE);
+        if (! check_key(mk, id)) {
+            fprintf(stderr, "[!] key %lu is not the key asked for!\n", id);
+            st->errors++;
+        }
+
+        /* a referenced key must not be zeroised underneath us */
+        if (0 == st->hits % 64) {
+            if (KEY_IN_USE != crypto_zerokey(mk)) {
+                fprintf(stderr, "[!] key %lu zeroised while in use!\n", id);
+                st->errors++;
+            }
+
+            if (KEY_SUCCESS == crypto_cipher_get(mk, GCRY_CIPHER_MODE_ECB,
+                        &hd)) {
+                memset(block, 0, sizeof block);
+                gcry_cipher_encrypt(hd, block, sizeof block, NULL, 0);
+                crypto_cipher_put(mk, hd);
+            } else {
+                st->errors++;
+            }
+        }
+
+        if (0 != memcmp(held, mk->key, TEST_KEYSIZE)) {
+            fprintf(stderr, "[!] key %lu changed while in use!\n", id);
+            st->errors++;
+        }
+
+        crypto_keystore_put(mk);
+    }
+
+    return NULL;
+}
+
+/* zeroise every key nobody holds, over and over: readers must never get
+ * a key that is being wiped */
+static void *zeroiser( void *arg ) {
+    unsigned long *rounds = arg;
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        crypto_zerokeystore(keystore);
+        (*rounds)++;
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+/* write every test key into a keyfile and open it */
+static keyfile_t backing_keyfile( metakey_t kek ) {
+    metakey_t keys[TEST_KEYS];
+    keyfile_t kf = NULL;
+    unsigned long id = 0;
+
+    for (id = 0; id < TEST_KEYS; ++id) {
+        keys[id] = tagged_key(id);
+        keys[id]->id = id;
+    }
+
+    if ((KEY_SUCCESS != crypto_keyfile_write(TEST_KEYFILE, kek, keys,
+                    TEST_KEYS)) ||
+            (CRYPTO_SUCCESS != crypto_keyfile_open(TEST_KEYFILE, kek,
+                    &kf))) {
+        fprintf(stderr, "[!] could not set up %s!\n", TEST_KEYFILE);
+        exit(EXIT_FAILURE);
+    }
+
+    for (id = 0; id < TEST_KEYS; ++id) {
+        crypto_metakey_free(keys[id]);
+    }
+
+    return kf;
+}
+
+/* add, rotate and remove keys until the time is up */
+static unsigned long writer( unsigned int seconds ) {
+    unsigned int seed = 0;
+    unsigned long updates = 0;
+    unsigned long id = 0;
+    metakey_t mk = NULL;
+    time_t end = time(NULL) + seconds;
+
+    while (time(NULL) < end) {
+        id = (unsigned long) rand_r(&seed) % TEST_KEYS;
+        mk = tagged_key(id);
+
+        if (KEY_NOT_FOUND == crypto_keystore_rotate(keystore, id, mk)) {
+            crypto_keystore_insert(keystore, id, mk);
+        } else if (0 == rand_r(&seed) % 2) {
+            crypto_keystore_remove(keystore, id);
+        }
+        updates++;
+    }
+
+    return updates;
+}
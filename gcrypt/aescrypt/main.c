@@ -12,33 +12,80 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <gcrypt.h>
 
+#include "cryptoaead.h"
+#include "cryptobuf.h"
+#include "cryptocontainer.h"
+#include "cryptofile.h"
+#include "cryptoprofile.h"
 #include "cryptoinit.h"
-#include "cryptfile.h"
+#include "cryptosecmem.h"
+#include "cryptostream.h"
+#include "cryptotrace.h"
+#include "cryptowipe.h"
+#include "cryptoxts.h"
+#include "keyfile.h"
+#include "keystore.h"
+#include "metakey.h"
 
+static void usage( const char * );
+static int load_key( const char *, metakey_t, size_t, crypto_op_t,
+                     metakey_t );
+static int load_stored_key( const char *, const char *, metakey_t, size_t,
+                            int );
+static int parse_range( const char *, uint64_t *, uint64_t * );
+static int wipe_tree( const char *, size_t, unsigned int, unsigned int );
+static void secmem_report( void );
+static void bufpool_report( void );
+static void profile_report( const struct profile_report * );
+
+/* options with no single letter */
+#define     OPT_PROFILE     256
+
+static const struct option long_options[] = {
+    { "profile",    no_argument,    NULL,   OPT_PROFILE },
+    { "help",       no_argument,    NULL,   'h' },
+    { NULL,         0,              NULL,   0 }
+};
 
 int main(int argc, char **argv) {
-    enum crypto_op op;
-    struct crypto_t*  aes;          /* stores algorith / key info   */
-    struct crypto_t** keyring;
-                                    /* stores list of crypto_t's, 
-                                       NULL terminated              */
-    char *keyfile   = NULL;         /* file contain key             */
+    crypto_op_t op  = null;
+    crypto_return_t result = CRYPTO_FAILURE;
+    metakey_t aes   = NULL;         /* stores algorith / key info   */
+    size_t keysize  = 0;            /* key size in bytes            */
+    int algo        = 0;
+    int c           = 0;
+    unsigned long threads = 0;      /* worker threads, -j           */
+    stream_io_t io  = STREAM_IO_BUFFERED;
+    stream_aead_t aead = STREAM_AEAD_AUTO;  /* authentication, -a */
+    int aead_given  = 0;
+    unsigned long depth = AIO_QUEUE_DEPTH;  /* chunks in flight, -q */
+    unsigned long chunk = STREAM_CHUNK_SIZE;/* bytes per chunk, -c  */
+    int container   = 0;            /* write a container, -C        */
+    int ranged      = 0;            /* decrypt a range only, -r     */
+    int xts         = 0;            /* sector-wise XTS, -X          */
+    uint64_t range_off = 0;
+    uint64_t range_len = UINT64_MAX;
+    const char *keyfile = NULL;     /* file contain key             */
+    const char *store = NULL;       /* multi-key keyfile, -K        */
+    const char *wrapfile = NULL;    /* key wrapping the -k key, -W  */
+    metakey_t kek   = NULL;
+    unsigned long key_id = 0;       /* key to use from it, -n       */
     char *infile    = NULL;         /* input file                   */
     char *outfile   = NULL;         /* output file                  */
-
-    /* set up keyring */
-
-    /* allocate memory for crypto struct */
-    aes = (struct crypto_t *) calloc(1, sizeof(struct crypto_t));
-    if (NULL == aes) {
-        fprintf(stderr, "[!] error in crypto_t calloc!\n");
-        exit 2;
-    }
+    const char *wipe = NULL;        /* tree to wipe, -x             */
+    unsigned long passes = 0;       /* wipe passes, -p              */
+    int profile     = 0;            /* time each stage, --profile   */
+    struct profile_report prof;
 
     /* parse  command line options */
     opterr  = 0;
-    while ((c = getopt(argc, argv, "i:o:edb:k:")) != -1) {
+    while ((c = getopt_long(argc, argv,
+                    "i:o:edb:k:K:W:n:j:I:q:c:Ca:r:XS:x:p:m:HvT:h",
+                    long_options, NULL)) != -1) {
         switch (c) {
             case 'i':
                 infile  = optarg;
@@ -47,49 +94,568 @@ int main(int argc, char **argv) {
                 outfile = optarg;
                 break;
             case 'e':
-                op = ENCRYPT;
+                op = encrypt;
                 break;
             case 'd':
-                op = DECRYPT;
+                op = decrypt;
                 break;
             case 'b':
-                aes.keysize = (size_t) strtol(optarg, NULL, 0);
-                aes.keysize /= 8;
+                keysize = (size_t) strtoul(optarg, NULL, 0);
+                keysize /= 8;
                 break;
             case 'k':
                 keyfile = optarg;
                 break;
-            case 'h':
-                usage();
+            case 'K':
+                store = optarg;
                 break;
-            default:
+            case 'W':
+                wrapfile = optarg;
+                break;
+            case 'n':
+                key_id = strtoul(optarg, NULL, 0);
+                break;
+            case 'j':
+                threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'I':
+                if (0 == strcmp(optarg, "mmap")) {
+                    io = STREAM_IO_MMAP;
+                } else if (0 == strcmp(optarg, "aio")) {
+                    io = STREAM_IO_AIO;
+                } else if (0 == strcmp(optarg, "buffered")) {
+                    io = STREAM_IO_BUFFERED;
+                } else {
+                    fprintf(stderr, "[!] unknown I/O method %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'q':
+                depth = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                chunk = strtoul(optarg, NULL, 0);
+                break;
+            case 'C':
+                container = 1;
+                break;
+            case 'a':
+                if (CRYPTO_SUCCESS != crypto_aead_parse(optarg, &aead)) {
+                    fprintf(stderr, "[!] unknown AEAD %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                aead_given = 1;
+                break;
+            case 'r':
+                if (0 != parse_range(optarg, &range_off, &range_len)) {
+                    fprintf(stderr, "[!] -r takes offset:length\n");
+                    return EXIT_FAILURE;
+                }
+                ranged = 1;
+                break;
+            case 'X':
+                xts = 1;
+                break;
+            case 'S':
+                if (CRYPTO_SUCCESS != crypto_xts_set_sector_size(
+                            (size_t) strtoul(optarg, NULL, 0))) {
+                    fprintf(stderr, "[!] -S must be a power of two between ");
+                    fprintf(stderr, "%d and %d.\n", XTS_MIN_SECTOR,
+                            XTS_MAX_SECTOR);
+                    return EXIT_FAILURE;
+                }
                 break;
+            case 'x':
+                wipe = optarg;
+                break;
+            case 'p':
+                passes = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                crypto_secmem_set_size((size_t) strtoul(optarg, NULL, 0));
+                break;
+            case 'H':
+                crypto_bufpool_set_hugepages(1);
+                break;
+            case 'v':
+                crypto_trace_set_level(crypto_trace_level + 1);
+                break;
+            case 'T':
+                if (CRYPTO_SUCCESS != crypto_trace_dump_to(optarg, SIGUSR1)) {
+                    fprintf(stderr, "[!] can not write latencies to %s\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_PROFILE:
+                profile = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((threads > STREAM_MAX_THREADS) || (0 == depth) ||
+            (depth > AIO_MAX_DEPTH)) {
+        fprintf(stderr, "[!] -j must be between 1 and %d, ",
+                STREAM_MAX_THREADS);
+        fprintf(stderr, "-q between 1 and %d.\n", AIO_MAX_DEPTH);
+        return EXIT_FAILURE;
+    }
+
+    /* -x needs no key: it only overwrites and removes */
+    if (NULL != wipe) {
+        if (null != op) {
+            fprintf(stderr, "[!] -x can not be used with -e or -d.\n");
+            return EXIT_FAILURE;
+        }
+
+        return wipe_tree(wipe, (size_t) passes, (0 == threads) ?
+                WIPE_THREADS : (unsigned int) threads, (unsigned int) depth);
+    }
+
+    if (null == op) {
+        fprintf(stderr, "[!] one of -e, -d or -x must be given.\n");
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((container && (encrypt != op)) || (ranged && (decrypt != op))) {
+        fprintf(stderr, "[!] -C only applies to -e, -r only to -d.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* containers are always GCM; decryption follows the stream header */
+    if (aead_given && (container || (encrypt != op))) {
+        fprintf(stderr, "[!] -a only applies to -e without -C.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* an XTS image has no header to hold a container, an AEAD or a range */
+    if (xts && (container || aead_given || ranged)) {
+        fprintf(stderr, "[!] -X can not be used with -C, -a or -r.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* the mmap and aio paths only know CTR: asking for them picks it,
+     * unless an AEAD was asked for as well */
+    if ((encrypt == op) && (! container) && (STREAM_IO_BUFFERED != io)) {
+        if (! aead_given) {
+            aead = STREAM_AEAD_NONE;
+        } else if (STREAM_AEAD_NONE != aead) {
+            fprintf(stderr, "[!] -I mmap and aio only apply to -a none.\n");
+            return EXIT_FAILURE;
         }
     }
-    
+
     /* select cipher based on key size */
-    if (32 == aes.keysize) {
-        aes.algo = GCRYPT_CIPHER_AES256;
+    if (32 == keysize) {
+        algo = GCRY_CIPHER_AES256;
     }
-    else if (24 == aes.keysize) {
-        aes.algo = GCRYPT_CIPHER_AES192;
+    else if (24 == keysize) {
+        algo = GCRY_CIPHER_AES192;
     }
-    else if (16 == aes.keysize) {
-        aes.algo = GCRYPT_CIPHER_AES128;
+    else if (16 == keysize) {
+        algo = GCRY_CIPHER_AES128;
     }
     else {
         fprintf(stderr, "[!] invalid keysize! ");
         fprintf(stderr, "must be one of 128, 192, or 256.\n");
-        exit 1;
+        return EXIT_FAILURE;
+    }
+
+    if ((NULL != store) && (NULL != wrapfile)) {
+        fprintf(stderr, "[!] -K and -W can not be used together.\n");
+        return EXIT_FAILURE;
     }
 
+    if (NULL == keyfile) {
+        keyfile = DEFAULT_KEYFILE;
+    }
+
+    /* sectors are independent, so XTS uses every CPU unless told not to */
+    if (xts && (0 == threads)) {
+        threads = (unsigned long) sysconf(_SC_NPROCESSORS_ONLN);
+        if ((0 == threads) || (threads > STREAM_MAX_THREADS)) {
+            threads = (0 == threads) ? 1 : STREAM_MAX_THREADS;
+        }
+    }
+
+    crypto_stream_set_threads((0 == threads) ? 1 : (unsigned int) threads);
+    crypto_stream_set_io(io);
+    crypto_stream_set_aead(aead);
+    crypto_stream_set_depth((unsigned int) depth);
 
-    if (crypto_init()) {
-        printf("[!] could not initalise gcrypt!\n");
+    if (CRYPTO_SUCCESS != crypto_stream_set_chunk_size((size_t) chunk)) {
+        fprintf(stderr, "[!] -c must be a non-zero multiple of %d.\n",
+                STREAM_BLOCK_LEN);
         return EXIT_FAILURE;
     }
 
-    return crypto_shutdown( keyring );
+    keystore = crypto_init();
+    if (NULL == keystore) {
+        fprintf(stderr, "[!] could not initalise gcrypt!\n");
+        return EXIT_FAILURE;
+    }
+
+    /* with -W the key in -k is stored wrapped under the key in -W */
+    if (NULL != wrapfile) {
+        kek = crypto_metakey_new();
+        if ((NULL == kek) ||
+                (EXIT_SUCCESS != load_key(wrapfile, kek, keysize, op, NULL))) {
+            crypto_metakey_free(kek);
+            crypto_zerokeystore(keystore);
+            crypto_shutdown();
+            return EXIT_FAILURE;
+        }
+        kek->algo = algo;
+    }
+
+    /* with -K the key from -k is only the key-encrypting key, and the
+     * algorithm comes with the stored key */
+    aes = crypto_keystore_add(keystore, key_id);
+    if ((NULL != aes) && (NULL == store)) {
+        aes->algo = algo;
+    }
+
+    if (NULL == aes) {
+        fprintf(stderr, "[!] could not allocate a key!\n");
+    } else if (EXIT_SUCCESS == ((NULL == store) ?
+                load_key(keyfile, aes, xts ? 2 * keysize : keysize, op, kek) :
+                load_stored_key(store, keyfile, aes, keysize, algo))) {
+        if (profile) {
+            crypto_profile_start();
+        }
+
+        if (xts) {
+            result = crypto_xts_crypt_file(infile, outfile, aes, op);
+        } else if ((encrypt == op) && container) {
+            result = crypto_container_encrypt_file(infile, outfile, aes);
+        } else if (encrypt == op) {
+            result = crypto_encrypt_file(infile, outfile, aes);
+        } else if (ranged) {
+            result = crypto_container_decrypt_file(infile, outfile, aes,
+                    range_off, range_len);
+        } else {
+            result = crypto_decrypt_file(infile, outfile, aes);
+        }
+
+        if (profile) {
+            crypto_profile_stop(&prof);
+            profile_report(&prof);
+        }
+
+        if ((CRYPTO_BAD_FORMAT == result) && (! xts)) {
+            fprintf(stderr, "[!] input is not a valid encrypted file ");
+            fprintf(stderr, "for this key!\n");
+        } else if (CRYPTO_AUTH_FAILURE == result) {
+            fprintf(stderr, "[!] input has been tampered with!\n");
+        } else if (CRYPTO_SUCCESS != result) {
+            fprintf(stderr, "[!] %s failed!\n",
+                    (encrypt == op) ? "encryption" : "decryption");
+        }
+    }
+
+    crypto_metakey_free(kek);
+    crypto_zerokeystore(keystore);
+    secmem_report();
+    bufpool_report();
+    crypto_shutdown();
+
+    return (CRYPTO_SUCCESS == result) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* load the key for the operation. when encrypting, a missing keyfile is
+ * not an error: a fresh key is generated and written out so the data can
+ * be decrypted later. with a key-encrypting key the keyfile holds the key
+ * wrapped under it. */
+static int load_key( const char *keyfile, metakey_t mk, size_t keysize,
+        crypto_op_t op, metakey_t kek ) {
+    crypto_key_return_t key_result = KEY_FAILURE;
+
+    if ((encrypt == op) && (AUTOKEYGEN)) {
+        crypto_set_autogen();
+    } else {
+        crypto_unset_autogen();
+    }
+
+    key_result = (NULL == kek) ? crypto_loadkey(keyfile, mk, keysize) :
+        crypto_loadkey_wrapped(keyfile, mk, keysize, kek);
+    switch (key_result) {
+        case KEY_SUCCESS:
+            return EXIT_SUCCESS;
+        case KEYGEN:
+            if (KEY_SUCCESS != ((NULL == kek) ? crypto_dumpkey(keyfile, mk) :
+                        crypto_dumpkey_wrapped(keyfile, mk, kek))) {
+                fprintf(stderr, "[!] could not write new key to %s!\n",
+                        keyfile);
+                return EXIT_FAILURE;
+            }
+
+            fprintf(stderr, "[+] generated new key in %s\n", keyfile);
+            return EXIT_SUCCESS;
+        case SIZE_MISMATCH:
+            fprintf(stderr, "[!] %s does not hold a %u-bit key!\n", keyfile,
+                    (unsigned int) keysize * 8);
+            break;
+        case INCONSISTENT_STATE:
+            fprintf(stderr, "[!] keyfile %s in an inconsistent state!\n",
+                    keyfile);
+            break;
+        default:
+            fprintf(stderr, "[!] error loading key from %s!\n", keyfile);
+            if (NULL != kek) {
+                fprintf(stderr, "[!] is it wrapped under the key from -W?\n");
+            }
+            break;
+    }
+
+    return EXIT_FAILURE;
+}
+
+/* load key mk->id from a multi-key keyfile, unwrapping it with the key in
+ * kekfile. the key-encrypting key is wiped as soon as the key is out. */
+static int load_stored_key( const char *store, const char *kekfile,
+        metakey_t mk, size_t keysize, int algo ) {
+    crypto_key_return_t key_result = KEY_FAILURE;
+    crypto_return_t result = CRYPTO_FAILURE;
+    metakey_t kek = crypto_metakey_new();
+    keyfile_t kf = NULL;
+
+    if (NULL == kek) {
+        fprintf(stderr, "[!] could not allocate a key!\n");
+        return EXIT_FAILURE;
+    }
+
+    crypto_unset_autogen();
+    if (KEY_SUCCESS != crypto_loadkey(kekfile, kek, keysize)) {
+        fprintf(stderr, "[!] error loading key-encrypting key from %s!\n",
+                kekfile);
+        crypto_metakey_free(kek);
+        return EXIT_FAILURE;
+    }
+    kek->algo = algo;
+
+    result = crypto_keyfile_open(store, kek, &kf);
+    if (CRYPTO_SUCCESS == result) {
+        key_result = crypto_keyfile_load(kf, mk->id, mk);
+        crypto_keyfile_close(kf);
+    } else if (CRYPTO_BAD_FORMAT == result) {
+        fprintf(stderr, "[!] %s is not a keyfile!\n", store);
+    } else {
+        fprintf(stderr, "[!] could not open keyfile %s!\n", store);
+    }
+    crypto_metakey_free(kek);
+
+    if (KEY_NOT_FOUND == key_result) {
+        fprintf(stderr, "[!] %s holds no key %lu!\n", store, mk->id);
+    } else if ((KEY_SUCCESS != key_result) && (CRYPTO_SUCCESS == result)) {
+        fprintf(stderr, "[!] key %lu in %s does not unwrap with the key in ",
+                mk->id, store);
+        fprintf(stderr, "%s!\n", kekfile);
+    }
+
+    return (KEY_SUCCESS == key_result) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+/* parse an offset:length range; the length may be left out to read to the
+ * end of the data. */
+static int parse_range( const char *arg, uint64_t *off, uint64_t *len ) {
+    char *end = NULL;
 
+    *off = (uint64_t) strtoull(arg, &end, 0);
+    if ((end == arg) || ((':' != *end) && ('\0' != *end))) {
+        return -1;
+    }
+
+    *len = UINT64_MAX;
+    if ((':' == *end) && ('\0' != end[1])) {
+        arg = end + 1;
+        *len = (uint64_t) strtoull(arg, &end, 0);
+        if ((end == arg) || ('\0' != *end)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* wipe and remove a file or directory tree, and say how it went */
+static int wipe_tree( const char *path, size_t passes, unsigned int threads,
+        unsigned int depth ) {
+    crypto_key_return_t result = KEY_FAILURE;
+    struct wipe_report report;
+
+    keystore = crypto_init();
+    if (NULL == keystore) {
+        fprintf(stderr, "[!] could not initalise gcrypt!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (0 == passes) {
+        passes = crypto_wipe_passes();
+    }
+
+    result = crypto_wipe_tree(path, passes, threads, depth, &report);
+    fprintf(stderr, "[+] wiped %lu files, %llu bytes in %u passes ",
+            report.files, report.bytes / passes, (unsigned int) passes);
+    fprintf(stderr, "with %u threads\n", threads);
+    fprintf(stderr, "    removed %lu directories, %lu other entries, ",
+            report.dirs, report.others);
+    fprintf(stderr, "%lu jobs, %lu errors\n", report.jobs, report.errors);
+    if (report.seconds > 0) {
+        fprintf(stderr, "    %.3f seconds, %.1f MB/s written\n",
+                report.seconds,
+                (double) report.bytes / report.seconds / 1e6);
+    }
+
+    if (KEY_SUCCESS != result) {
+        fprintf(stderr, "[!] %s was not completely wiped!\n", path);
+    }
+
+    bufpool_report();
+    crypto_zerokeystore(keystore);
+    crypto_shutdown();
+
+    return (KEY_SUCCESS == result) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* with secure memory, say how much of it was needed */
+static void secmem_report( ) {
+    struct secmem_stats sm;
+
+    crypto_secmem_stats(&sm);
+    if (0 == sm.size) {
+        return;
+    }
+
+    fprintf(stderr, "[+] secure memory: %lu bytes (growing by %lu), ",
+            (unsigned long) sm.size, (unsigned long) sm.expand);
+    fprintf(stderr, "%lu at most in use, %lu failed allocations\n",
+            (unsigned long) sm.high_water, sm.failures);
+}
+
+/* data buffers that could not be locked may have been swapped out */
+static void bufpool_report( ) {
+    struct bufpool_stats bp;
+
+    crypto_bufpool_stats(&bp);
+    if (0 == bp.unlocked) {
+        return;
+    }
+
+    fprintf(stderr, "[!] %lu of %lu data buffers could not be locked ",
+            bp.unlocked, bp.mapped);
+    fprintf(stderr, "into memory (see ulimit -l)\n");
+}
+
+/* where the time went, stage by stage, and which stage held the rest up */
+static void profile_report( const struct profile_report *rep ) {
+    uint64_t total = 0;
+    double secs = 0, busy = 0;
+    unsigned int i = 0;
+
+    for (i = 0; i < PROFILE_STAGES; ++i) {
+        total += rep->busy_ns[i];
+    }
+
+    secs = (double) rep->wall_ns / 1e9;
+    fprintf(stderr, "[+] profile: %llu bytes in %.3f s",
+            (unsigned long long) rep->bytes[PROFILE_CIPHER], secs);
+    if (secs > 0) {
+        fprintf(stderr, ", %.1f MB/s",
+                (double) rep->bytes[PROFILE_CIPHER] / secs / 1e6);
+    }
+    fprintf(stderr, "\n    %-8s %10s %7s %10s %8s\n", "stage", "busy s",
+            "share", "MB/s", "calls");
+
+    for (i = 0; i < PROFILE_STAGES; ++i) {
+        busy = (double) rep->busy_ns[i] / 1e9;
+        fprintf(stderr, "    %-8s %10.3f %6.1f%% ",
+                crypto_profile_name((profile_stage_t) i), busy,
+                (0 == total) ? 0.0 :
+                    100.0 * (double) rep->busy_ns[i] / (double) total);
+        if ((busy > 0) && (0 != rep->bytes[i])) {
+            fprintf(stderr, "%10.1f", (double) rep->bytes[i] / busy / 1e6);
+        } else {
+            fprintf(stderr, "%10s", "-");
+        }
+        fprintf(stderr, " %8llu\n", (unsigned long long) rep->calls[i]);
+    }
+
+    if (0 != rep->samples) {
+        fprintf(stderr, "    chunks in flight: %.1f on average, ",
+                (double) rep->inflight / (double) rep->samples);
+        fprintf(stderr, "%llu at most\n",
+                (unsigned long long) rep->inflight_max);
+    }
+
+    if (0 != total) {
+        fprintf(stderr, "    limiting stage: %s\n",
+                crypto_profile_name(crypto_profile_limit(rep)));
+    }
+}
+
+static void usage( const char *progname ) {
+    fprintf(stderr, "usage: %s -e|-d -b bits [-k keyfile] ", progname);
+    fprintf(stderr, "[-K keystore -n id] [-W keyfile]\n");
+    fprintf(stderr, "\t[-i infile] [-o outfile] [-j threads]");
+    fprintf(stderr, " [-I buffered|mmap|aio] [-q depth] [-c chunk]\n");
+    fprintf(stderr, "\t");
+    fprintf(stderr, "[-C] [-a auto|gcm|ocb|chacha20|none] ");
+    fprintf(stderr, "[-r offset:length] [-X [-S sector]]\n\t");
+    fprintf(stderr, "[-m bytes] [-H] [-v] ");
+    fprintf(stderr, "[-T file] [--profile]\n");
+    fprintf(stderr, "       %s -x path [-p passes] [-j threads] ", progname);
+    fprintf(stderr, "[-q depth]\n");
+    fprintf(stderr, "\t-i\tinput file (default stdin)\n");
+    fprintf(stderr, "\t-o\toutput file (default stdout)\n");
+    fprintf(stderr, "\t-e\tencrypt\n");
+    fprintf(stderr, "\t-d\tdecrypt\n");
+    fprintf(stderr, "\t-b\tkey size in bits (128, 192, or 256 bits)\n");
+    fprintf(stderr, "\t-k\tspecify a key file (default %s)\n",
+            DEFAULT_KEYFILE);
+    fprintf(stderr, "\t-K\tuse a key from a multi-key keyfile (see ");
+    fprintf(stderr, "aeskeygen), unwrapped\n\t\twith the key from -k\n");
+    fprintf(stderr, "\t-n\tID of the key to use from -K (default 0)\n");
+    fprintf(stderr, "\t-W\tkeep the key from -k wrapped under the key in ");
+    fprintf(stderr, "this file\n\t\t(generated if missing when encrypting)\n");
+    fprintf(stderr, "\t-j\tnumber of worker threads (default 1, or %d ",
+            WIPE_THREADS);
+    fprintf(stderr, "with -x)\n");
+    fprintf(stderr, "\t-I\tI/O method for regular files ");
+    fprintf(stderr, "(default buffered)\n");
+    fprintf(stderr, "\t-q\tchunks in flight with -I aio, jobs queued with ");
+    fprintf(stderr, "-x (default %d)\n", AIO_QUEUE_DEPTH);
+    fprintf(stderr, "\t-c\tchunk size in bytes (default %d)\n",
+            STREAM_CHUNK_SIZE);
+    fprintf(stderr, "\t-C\tencrypt into a seekable, authenticated ");
+    fprintf(stderr, "container\n");
+    fprintf(stderr, "\t-a\tseal every chunk with an AEAD, so decryption ");
+    fprintf(stderr, "stops at the first\n\t\tchunk that was tampered ");
+    fprintf(stderr, "with; auto picks the fastest on\n\t\tthis CPU ");
+    fprintf(stderr, "(default auto, or none with -I mmap|aio)\n");
+    fprintf(stderr, "\t-r\tdecrypt only offset:length of a container\n");
+    fprintf(stderr, "\t-X\tencrypt or decrypt a disk image or device ");
+    fprintf(stderr, "in place, sector by\n\t\tsector, with AES-XTS; ");
+    fprintf(stderr, "the key is twice -b, -o is optional\n\t\tand ");
+    fprintf(stderr, "-j defaults to all CPUs\n");
+    fprintf(stderr, "\t-S\tsector size in bytes with -X (default %d)\n",
+            XTS_SECTOR_SIZE);
+    fprintf(stderr, "\t-m\tsecure memory in bytes, 0 for none ");
+    fprintf(stderr, "(default %d)\n", SECURE_MEM);
+    fprintf(stderr, "\t-H\tback large data buffers with huge pages\n");
+    fprintf(stderr, "\t-v\tmore messages; repeat for more still\n");
+    fprintf(stderr, "\t-T\twrite latency histograms as JSON to file ");
+    fprintf(stderr, "(- for stderr)\n\t\tat exit and on SIGUSR1\n");
+    fprintf(stderr, "\t-x\twipe and remove a file or directory tree\n");
+    fprintf(stderr, "\t-p\toverwrite passes with -x (default %d)\n",
+            WIPE_PASSES);
+    fprintf(stderr, "\t--profile\n\t\treport the time spent reading, ");
+    fprintf(stderr, "encrypting, writing and\n\t\tsyncing, and which ");
+    fprintf(stderr, "stage limited the run\n");
+}
@@ -9,55 +9,180 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <gcrypt.h>
 
+#include "cryptoarena.h"
+#include "cryptorand.h"
+#include "cryptosecmem.h"
+#include "cryptoutil.h"
 #include "metakey.h"
+#include "debug.h"
 
 /* key autogeneration flag */
 static int generate_keys = 0;
-extern keystore_t keystore;
+
+/********************************************************************
+ * cipher_cache:                                                    *
+ *      keyed cipher handles belonging to one metakey               *
+ *                                                                  *
+ * slot: the handles; a slot with a NULL hd is free                 *
+ * gen: bumped by crypto_cipher_flush, handles from an older        *
+ *      generation are closed instead of being reused               *
+ * nbusy: number of handles currently handed out                    *
+ ********************************************************************/
+struct cipher_slot {
+    gcry_cipher_hd_t hd;
+    int algo;
+    int mode;
+    unsigned long gen;
+    unsigned short busy;
+};
+
+struct cipher_cache {
+    struct cipher_slot slot[CIPHER_CACHE_SIZE];
+    unsigned long gen;
+    size_t nbusy;
+};
+
+/* handles are taken and put back once per job rather than per chunk, so
+ * a single lock for all the caches is enough */
+static pthread_mutex_t cipher_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static crypto_key_return_t metakey_key_alloc( metakey_t, size_t );
+static void metakey_key_release( metakey_t );
+
+metakey_t crypto_metakey_new( ) {
+    metakey_t mk = crypto_arena_alloc();
+
+    if (NULL != mk) {
+        mk->arena = 1;
+    } else {
+        /* no arena memory left, fall back to the allocator */
+        mk = CRYPTO_MALLOC(1, sizeof *mk);
+    }
+
+    if (NULL == mk) {
+        TRACE_ERROR("[!] error allocating memory for metakey!\n");
+
+        return NULL;
+    }
+
+    mk->sm = (unsigned short) crypto_secmem_enabled();
+    return mk;
+}
+
+void crypto_metakey_free( metakey_t mk ) {
+    if (NULL == mk) {
+        return;
+    }
+
+    crypto_cipher_flush(mk);
+    metakey_key_release(mk);
+
+    if (0 != mk->arena) {
+        crypto_arena_release(mk);
+    } else {
+        CRYPTO_FREE(mk);
+    }
+}
 
 crypto_key_return_t crypto_genkey( metakey_t mk, size_t keysize ) {
     crypto_key_return_t result = KEY_FAILURE;
-    mk->keysize = keysize;
+    uint64_t start = 0;
 
     if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
         result = KEY_NOT_INIT;
 
-#ifdef DEBUG
-        fprintf(stderr, "[!] crypto library not initialised!\n");
-#endif
+        TRACE_ERROR("[!] crypto library not initialised!\n");
 
         return result;
     }
 
-#ifdef DEBUG
-    printf("[+] generating a new %u-bit key...\n", (unsigned int) keysize * 8);
-#endif
+    TRACE_DEBUG("[+] generating a new %u-bit key...\n",
+                (unsigned int) keysize * 8);
 
-    /* in the initialisation, we allocated memory for each key already */
-    gcry_free(mk->key);     /* need to free it to avoid mem leak */
-    mk->key = RNG_METHOD( mk->keysize, CRYPTO_RANDOM_STRENGTH );
+    TRACE_START(start);
 
-    if (NULL == mk->key) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] key generation failed!\n");
-#endif
+    /* handles keyed with the old key must not be reused */
+    crypto_cipher_flush(mk);
+
+    /* arena keys are generated in place, in their slot */
+    if (KEY_SUCCESS != metakey_key_alloc(mk, keysize)) {
+        TRACE_ERROR("[!] key generation failed!\n");
 
         return result;
     }
+    gcry_randomize(mk->key, mk->keysize, CRYPTO_RANDOM_STRENGTH);
 
     mk->initialised = 1;
+    TRACE_END(TRACE_KEYGEN, start);
 
     result = KEY_SUCCESS;
     return result;
 } /* end crypto_genkey */
 
+crypto_key_return_t crypto_genkeys( metakey_t *mks, size_t n,
+        size_t keysize ) {
+    uint64_t start = 0;
+    size_t i = 0;
+
+    if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+        TRACE_ERROR("[!] crypto library not initialised!\n");
+
+        return KEY_NOT_INIT;
+    }
+
+    TRACE_INFO("[+] generating %lu new %u-bit keys...\n", (unsigned long) n,
+               (unsigned int) keysize * 8);
+
+    /* without the pool the keys still come out, just more slowly */
+    crypto_randpool_start();
+
+    for (i = 0; i < n; ++i) {
+        TRACE_START(start);
+        crypto_cipher_flush(mks[i]);
+
+        if (KEY_SUCCESS != metakey_key_alloc(mks[i], keysize)) {
+            TRACE_ERROR("[!] key generation failed!\n");
+
+            return KEY_FAILURE;
+        }
+
+        crypto_randpool_read(mks[i]->key, keysize);
+        mks[i]->initialised = 1;
+        TRACE_END(TRACE_KEYGEN, start);
+    }
+
+    return KEY_SUCCESS;
+} /* end crypto_genkeys */
+
+crypto_key_return_t crypto_setkey( metakey_t mk, const unsigned char *key,
+        size_t keysize ) {
+    if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+        TRACE_ERROR("[!] crypto library not initialised!\n");
+
+        return LIB_NOT_INIT;
+    }
+
+    crypto_cipher_flush(mk);
+
+    if (KEY_SUCCESS != metakey_key_alloc(mk, keysize)) {
+        return KEY_FAILURE;
+    }
+    memcpy(mk->key, key, keysize);
+
+    mk->initialised = 1;
+    return KEY_SUCCESS;
+} /* end crypto_setkey */
+
 crypto_key_return_t crypto_loadkey( const char *filename, metakey_t mk,
         size_t keysize) {
     crypto_key_return_t result = KEY_FAILURE;
     FILE *kf = NULL;
     size_t fresult;
+    uint64_t start = 0;
 
     /* tmp_key has size keysize + 2 for two reasons:
      *  1. one extra char to detect key size mismatches
@@ -65,32 +190,26 @@ crypto_key_return_t crypto_loadkey( const char *filename, metakey_t mk,
      */
     unsigned char *tmp_key = CRYPTO_MALLOC( keysize + 2, sizeof *tmp_key);
 
+    TRACE_START(start);
+
     /* ensure library has been initialised */
     if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] library not initialised!\n");
-#endif
+        TRACE_ERROR("[!] library not initialised!\n");
 
         result = LIB_NOT_INIT;
         return result;
     }
 
-#ifdef DEBUG
-    printf("[+] attempting to open keyfile %s...\n", filename);
-#endif 
+    TRACE_DEBUG("[+] attempting to open keyfile %s...\n", filename);
 
     kf = fopen(filename, "r");
     if ((NULL == kf) || (0 != ferror(kf))) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] error opening file %s...\n", filename);
-        perror("fopen");
-#endif
+        TRACE_ERROR("[!] error opening file %s...\n", filename);
+        TRACE_ERRNO("fopen");
 
         /* if generate_keys is set, we should attempt to generate a new key */
         if (0 != generate_keys) {
-#ifdef DEBUG
-            printf("[+] attempting to generate a new key...\n");
-#endif
+            TRACE_DEBUG("[+] attempting to generate a new key...\n");
 
             /* don't check if the library is initialised, we already checked
              * that...  */
@@ -112,16 +231,11 @@ crypto_key_return_t crypto_loadkey( const char *filename, metakey_t mk,
     }
 
     /* the keyfile is now open without error */
-    mk->keysize = keysize;
+    crypto_cipher_flush(mk);
 
-    /* calloc memory for the key */
-    gcry_free(mk->key);     /* memory allocated during initialisation */
-    mk->key = CRYPTO_MALLOC( mk->keysize, sizeof mk->key);
-
-    if (NULL == mk->key) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] error allocating memory for key!\n");
-#endif
+    /* get zeroed memory for the key */
+    if (KEY_SUCCESS != metakey_key_alloc(mk, keysize)) {
+        TRACE_ERROR("[!] error allocating memory for key!\n");
 
         return result;
     }
@@ -138,22 +252,18 @@ crypto_key_return_t crypto_loadkey( const char *filename, metakey_t mk,
      *  of bytes copied into tmp_key to make sure they match.
      */
     if (keysize != fresult) {
-#ifdef DBEUG
-        fprintf(stderr, "[!] key size mismatch in file %s: ", filename);
-        fprintf(stderr, "expected %u bytes, actually read %u bytes!\n",
-                (unsigned int) keysize, (unsigned int) fresult);
-#endif
+        TRACE_ERROR("[!] key size mismatch in file %s: ", filename);
+        TRACE_ERROR("expected %u bytes, actually read %u bytes!\n",
+                    (unsigned int) keysize, (unsigned int) fresult);
 
         /* first step is to zeroise the tmp_key */
         gcry_create_nonce(tmp_key, keysize + 1);
-        gcry_free(tmp_key);
+        CRYPTO_FREE(tmp_key);
 
         /* check to make sure the keyfile closes successfully,
          * if it doesn't close return with an inconsistent state error */
         if (0 != fclose(kf)) {
-#ifdef DEBUG
-            fprintf(stderr, "[!] error closing %s!\n", filename);
-#endif
+            TRACE_ERROR("[!] error closing %s!\n", filename);
 
             return INCONSISTENT_STATE;
         } /* end fclose error check */
@@ -181,25 +291,23 @@ crypto_key_return_t crypto_loadkey( const char *filename, metakey_t mk,
 
     /* at this point, the key was loaded without error */
 
-    /* copy tmp_key into mk->key and wipe the temp key */
-    strncpy((char *) mk->key, (char *) tmp_key, mk->keysize);
+    /* copy tmp_key into mk->key and wipe the temp key. the key is raw
+     * binary and may contain NUL bytes, so it must not be copied as a
+     * string. */
+    memcpy(mk->key, tmp_key, mk->keysize);
     gcry_create_nonce(tmp_key, mk->keysize);
-    gcry_free(tmp_key);
+    CRYPTO_FREE(tmp_key);
 
 
-#ifdef DEBUG
-    printf("[+] key successfully loaded!\n");
-#endif
+    TRACE_DEBUG("[+] key successfully loaded!\n");
 
     mk->initialised = 1;
 
     /* time to close and check for errors */
     if (0 != fclose(kf)) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] error closing keyfile %s!\n", filename);
-        fprintf(stderr, "[!] keyfile may be in an inconsistent state!\n");
-        perror("fclose");
-#endif 
+        TRACE_ERROR("[!] error closing keyfile %s!\n", filename);
+        TRACE_ERROR("[!] keyfile may be in an inconsistent state!\n");
+        TRACE_ERRNO("fclose");
 
         result = INCONSISTENT_STATE;
     }
@@ -208,6 +316,7 @@ crypto_key_return_t crypto_loadkey( const char *filename, metakey_t mk,
         result = KEY_SUCCESS;
     }
 
+    TRACE_END(TRACE_KEYLOAD, start);
     return result;
 } /* end crypto_loadkey */
 
@@ -217,18 +326,14 @@ crypto_key_return_t crypto_dumpkey( const char *filename, metakey_t mk ) {
     size_t fresult = 0;
 
     if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] library not initialised!\n");
-#endif
+        TRACE_ERROR("[!] library not initialised!\n");
 
         return LIB_NOT_INIT;
     }
 
     if (1 != mk->initialised) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] dumpkey(): attmepted to dump an uninitialised ");
-        fprintf(stderr, "key!\n");
-#endif
+        TRACE_ERROR("[!] dumpkey(): attmepted to dump an uninitialised ");
+        TRACE_ERROR("key!\n");
 
         return KEY_NOT_INIT;
     }
@@ -236,33 +341,27 @@ crypto_key_return_t crypto_dumpkey( const char *filename, metakey_t mk ) {
     /* open keyfile and check for errors */
     kf = fopen(filename, "w+");
     if ((NULL == kf) || (0 != ferror(kf))) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] error opening %s for write!\n", filename);
-        perror("fopen");
-#endif
+        TRACE_ERROR("[!] error opening %s for write!\n", filename);
+        TRACE_ERRNO("fopen");
 
         return result;
     } /* end fopen error checking */
 
     /* write key to file and check the appropriate number of bytes were 
      * written into the file */
-    fresult = fwrite(mk->key, sizeof mk->key, mk->keysize, kf);
+    fresult = fwrite(mk->key, sizeof *mk->key, mk->keysize, kf);
     if (mk->keysize != fresult) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] error dumping key to %s: ", filename);
-        fprintf(stderr, "expected %u bytes, wrote %u bytes!\n",
-                (unsigned int) mk->keysize, (unsigned int) fresult);
-#endif
+        TRACE_ERROR("[!] error dumping key to %s: ", filename);
+        TRACE_ERROR("expected %u bytes, wrote %u bytes!\n",
+                    (unsigned int) mk->keysize, (unsigned int) fresult);
 
         result = SIZE_MISMATCH;
 
         /* close keyfile and check for errors */
         if (0 != fclose(kf)) {
-#ifdef DEBUG
-            fprintf(stderr, "[!] error closing keyfile. keyfile may be in an ");
-            fprintf(stderr, "inconsistent state!\n");
-            perror("fclose");
-#endif
+            TRACE_ERROR("[!] error closing keyfile. keyfile may be in an ");
+            TRACE_ERROR("inconsistent state!\n");
+            TRACE_ERRNO("fclose");
 
             result = INCONSISTENT_STATE;
         }
@@ -276,12 +375,10 @@ crypto_key_return_t crypto_dumpkey( const char *filename, metakey_t mk ) {
 
     /* close and check for errors */
     if (0 != fclose(kf)) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] error closing keyfile %s - keyfile may be in an ",
-                filename);
-        fprintf(stderr, "inconsistent state!\n");
-        perror("fclose");
-#endif
+        TRACE_ERROR("[!] error closing keyfile %s - keyfile may be in an ",
+                    filename);
+        TRACE_ERROR("inconsistent state!\n");
+        TRACE_ERRNO("fclose");
 
         result = INCONSISTENT_STATE;
     } /* end file close error handling */
@@ -293,37 +390,472 @@ crypto_key_return_t crypto_dumpkey( const char *filename, metakey_t mk ) {
     return result;
 } /* end crypto_dumpkey */
 
+crypto_key_return_t crypto_wrapkey( metakey_t kek, metakey_t mk,
+        unsigned char *out, size_t *outlen ) {
+    crypto_key_return_t result = KEY_FAILURE;
+    gcry_cipher_hd_t hd = NULL;
+    unsigned char *block = NULL;
+    size_t blocklen = 0;
+
+    if ((NULL == mk) || (1 != mk->initialised)) {
+        return KEY_NOT_INIT;
+    } else if (mk->keysize > WRAP_KEY_MAX) {
+        return KEY_FAILURE;
+    }
+
+    blocklen = CRYPTO_WRAP_HEADER_LEN + mk->keysize;
+    block = CRYPTO_MALLOC(1, blocklen);
+    if (NULL == block) {
+        return KEY_FAILURE;
+    }
+
+    put_be64(block, (uint64_t) mk->id);
+    put_be32(block + 8, (uint32_t) mk->algo);
+    put_be32(block + 12, (uint32_t) mk->keysize);
+    memcpy(block + CRYPTO_WRAP_HEADER_LEN, mk->key, mk->keysize);
+
+    result = crypto_cipher_get(kek, GCRY_CIPHER_MODE_AESWRAP, &hd);
+    if (KEY_SUCCESS == result) {
+        if (0 != gcry_cipher_encrypt(hd, out, CRYPTO_WRAPPED_LEN(mk->keysize),
+                    block, blocklen)) {
+            TRACE_ERROR("[!] error wrapping key %lu!\n", mk->id);
+
+            result = KEY_FAILURE;
+        } else {
+            *outlen = CRYPTO_WRAPPED_LEN(mk->keysize);
+        }
+        crypto_cipher_put(kek, hd);
+    }
+
+    crypto_wipe(block, blocklen);
+    CRYPTO_FREE(block);
+
+    return result;
+} /* end crypto_wrapkey */
+
+crypto_key_return_t crypto_unwrapkeys( metakey_t kek,
+        const struct wrapped_key *in, metakey_t *out, size_t n ) {
+    crypto_key_return_t result = KEY_SUCCESS;
+    gcry_cipher_hd_t hd = NULL;
+    unsigned char *scratch = NULL, *block = NULL;
+    size_t total = 0, keysize = 0, i = 0;
+
+    if ((NULL == kek) || (1 != kek->initialised)) {
+        return KEY_NOT_INIT;
+    }
+
+    /* one secure buffer for every key block of the batch */
+    for (i = 0; i < n; ++i) {
+        if ((in[i].len >= CRYPTO_WRAPPED_LEN(0)) &&
+                (in[i].len <= CRYPTO_WRAPPED_LEN(WRAP_KEY_MAX))) {
+            total += in[i].len - 8;
+        }
+    }
+
+    if (0 == total) {
+        return (0 == n) ? KEY_SUCCESS : KEY_FAILURE;
+    }
+
+    scratch = CRYPTO_MALLOC(1, total);
+    if (NULL == scratch) {
+        return KEY_FAILURE;
+    }
+
+    if (KEY_SUCCESS != crypto_cipher_get(kek, GCRY_CIPHER_MODE_AESWRAP,
+                &hd)) {
+        CRYPTO_FREE(scratch);
+        return KEY_NOT_INIT;
+    }
+
+    block = scratch;
+    for (i = 0; i < n; ++i) {
+        if ((in[i].len < CRYPTO_WRAPPED_LEN(0)) ||
+                (in[i].len > CRYPTO_WRAPPED_LEN(WRAP_KEY_MAX))) {
+            result = KEY_FAILURE;
+            continue;
+        }
+
+        if (0 != gcry_cipher_decrypt(hd, block, in[i].len - 8, in[i].data,
+                    in[i].len)) {
+            TRACE_ERROR("[!] key %lu does not unwrap!\n", in[i].id);
+
+            result = KEY_FAILURE;
+        } else {
+            keysize = get_be32(block + 12);
+
+            if ((keysize > WRAP_KEY_MAX) ||
+                    (CRYPTO_WRAPPED_LEN(keysize) != in[i].len) ||
+                    (get_be64(block) != (uint64_t) in[i].id)) {
+                TRACE_ERROR("[!] wrapped key %lu is not key %lu!\n",
+                            (unsigned long) get_be64(block), in[i].id);
+
+                result = KEY_FAILURE;
+            } else if (KEY_SUCCESS != crypto_setkey(out[i],
+                        block + CRYPTO_WRAP_HEADER_LEN, keysize)) {
+                result = KEY_FAILURE;
+            } else {
+                out[i]->algo = (int) get_be32(block + 8);
+            }
+        }
+
+        block += in[i].len - 8;
+    }
+    crypto_cipher_put(kek, hd);
+
+    crypto_wipe(scratch, total);
+    CRYPTO_FREE(scratch);
+
+    return result;
+} /* end crypto_unwrapkeys */
+
+crypto_key_return_t crypto_unwrapkey( metakey_t kek,
+        const unsigned char *in, size_t len, metakey_t mk ) {
+    struct wrapped_key wk;
+
+    wk.data = in;
+    wk.len  = len;
+    wk.id   = mk->id;
+
+    return crypto_unwrapkeys(kek, &wk, &mk, 1);
+}
+
+crypto_key_return_t crypto_loadkey_wrapped( const char *filename,
+        metakey_t mk, size_t keysize, metakey_t kek ) {
+    crypto_key_return_t result = KEY_FAILURE;
+    unsigned char wrapped[CRYPTO_WRAPPED_LEN(WRAP_KEY_MAX) + 1];
+    FILE *kf = NULL;
+    size_t len = 0;
+
+    if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+        TRACE_ERROR("[!] library not initialised!\n");
+
+        return LIB_NOT_INIT;
+    }
+
+    kf = fopen(filename, "rb");
+    if (NULL == kf) {
+        TRACE_ERROR("[!] error opening file %s...\n", filename);
+        TRACE_ERRNO("fopen");
+
+        if (0 == generate_keys) {
+            return KEY_FAILURE;
+        }
+
+        result = crypto_genkey(mk, keysize);
+        if (KEY_SUCCESS == result) {
+            return KEYGEN;
+        }
+
+        return (KEY_FAILURE == result) ? KEYGEN_ERR : result;
+    }
+
+    len = fread(wrapped, 1, sizeof wrapped, kf);
+    if (0 == ferror(kf)) {
+        result = crypto_unwrapkey(kek, wrapped, len, mk);
+    }
+
+    /* the key was authentic, but it is not the key asked for */
+    if ((KEY_SUCCESS == result) && (keysize != mk->keysize)) {
+        TRACE_ERROR("[!] expected a %u-byte key, found %u bytes!\n",
+                    (unsigned int) keysize, (unsigned int) mk->keysize);
+
+        crypto_cipher_flush(mk);
+        metakey_key_release(mk);
+        mk->initialised = 0;
+        result = SIZE_MISMATCH;
+    }
+
+    if (0 != fclose(kf)) {
+        result = INCONSISTENT_STATE;
+    }
+
+    return result;
+} /* end crypto_loadkey_wrapped */
+
+crypto_key_return_t crypto_dumpkey_wrapped( const char *filename,
+        metakey_t mk, metakey_t kek ) {
+    crypto_key_return_t result = KEY_FAILURE;
+    unsigned char wrapped[CRYPTO_WRAPPED_LEN(WRAP_KEY_MAX)];
+    FILE *kf = NULL;
+    size_t len = 0;
+
+    if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+        TRACE_ERROR("[!] library not initialised!\n");
+
+        return LIB_NOT_INIT;
+    }
+
+    result = crypto_wrapkey(kek, mk, wrapped, &len);
+    if (KEY_SUCCESS != result) {
+        return result;
+    }
+
+    kf = fopen(filename, "wb");
+    if (NULL == kf) {
+        TRACE_ERROR("[!] error opening %s for write!\n", filename);
+        TRACE_ERRNO("fopen");
+
+        return KEY_FAILURE;
+    }
+
+    if (len != fwrite(wrapped, 1, len, kf)) {
+        result = SIZE_MISMATCH;
+    }
+
+    if (0 != fclose(kf)) {
+        TRACE_ERROR("[!] error closing keyfile %s - keyfile may be in an ",
+                    filename);
+        TRACE_ERROR("inconsistent state!\n");
+
+        result = INCONSISTENT_STATE;
+    }
+
+    return result;
+} /* end crypto_dumpkey_wrapped */
+
 crypto_key_return_t crypto_zerokey( metakey_t mk ) {
     crypto_key_return_t result = KEY_FAILURE;
-    size_t i = 0;
+    unsigned int refs = 0;
 
     if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] crypto library not initialised!\n");
-#endif
+        TRACE_ERROR("[!] crypto library not initialised!\n");
 
         return LIB_NOT_INIT;
     }
 
     if (! 1 == mk->initialised ) {
-#ifdef DEBUG
-        fprintf(stderr, "[!] key not initialised!\n");
-#endif
+        TRACE_ERROR("[!] key not initialised!\n");
 
         return KEY_NOT_INIT;
     }
 
-    gcry_create_nonce(mk->key, mk->keysize);
-    for (i = 0; i < mk->keysize; ++i) {
-        mk->key[i] = '\x00';
+    /* refuse while a keystore user holds the key; the flag keeps new
+     * references from counting as "before the wipe". a key in use is an
+     * answer, not a fault: crypto_zerokeystore meets them all the time */
+    if (! __atomic_compare_exchange_n(&mk->refs, &refs, METAKEY_REF_ZEROING,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        TRACE_DEBUG("[+] key %lu is in use\n", mk->id);
+
+        return KEY_IN_USE;
     }
 
+    /* the cached handles hold the expanded key */
+    crypto_cipher_flush(mk);
+
+    gcry_create_nonce(mk->key, mk->keysize);
+    crypto_wipe(mk->key, mk->keysize);
+    __atomic_fetch_and(&mk->refs, ~METAKEY_REF_ZEROING, __ATOMIC_RELEASE);
+
     result = KEY_SUCCESS;
 
     return result;
 }   /* end crypto_zerokey */
 
 
+crypto_key_return_t crypto_cipher_open( metakey_t mk, int mode,
+        gcry_cipher_hd_t *hd ) {
+    gcry_error_t err = 0;
+    unsigned int flags = 0;
+    int algo = 0;
+
+    if (! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+        TRACE_ERROR("[!] crypto library not initialised!\n");
+
+        return LIB_NOT_INIT;
+    }
+
+    if ((NULL == mk) || (1 != mk->initialised) || (NULL == mk->key) ||
+            (0 == mk->keysize)) {
+        TRACE_ERROR("[!] cipher_open(): key not initialised!\n");
+
+        return KEY_NOT_INIT;
+    }
+
+    /* keys in secure memory get a cipher context in secure memory too,
+     * otherwise the expanded key schedule would end up in normal memory */
+    if (0 != mk->sm) {
+        flags |= GCRY_CIPHER_SECURE;
+    }
+
+#if GCRYPT_VERSION_NUMBER >= 0x010900
+    /* wrap with padding (RFC 5649); unwrapping takes RFC 3394 as well */
+    if (GCRY_CIPHER_MODE_AESWRAP == mode) {
+        flags |= GCRY_CIPHER_EXTENDED;
+    }
+#endif
+
+    /* Poly1305 only pairs with ChaCha20, which takes the key's bytes */
+    algo = (GCRY_CIPHER_MODE_POLY1305 == mode) ? GCRY_CIPHER_CHACHA20
+                                               : mk->algo;
+
+    err = gcry_cipher_open(hd, algo, mode, flags);
+    if (0 != err) {
+        TRACE_ERROR("[!] gcry_cipher_open: %s\n", gcry_strerror(err));
+
+        return KEY_FAILURE;
+    }
+
+    err = gcry_cipher_setkey(*hd, mk->key, mk->keysize);
+    if (0 != err) {
+        TRACE_ERROR("[!] gcry_cipher_setkey: %s\n", gcry_strerror(err));
+
+        gcry_cipher_close(*hd);
+        *hd = NULL;
+        return KEY_FAILURE;
+    }
+
+    return KEY_SUCCESS;
+}   /* end crypto_cipher_open */
+
+
+crypto_key_return_t crypto_cipher_get( metakey_t mk, int mode,
+        gcry_cipher_hd_t *hd ) {
+    crypto_key_return_t result = KEY_FAILURE;
+    struct cipher_cache *cc = NULL;
+    struct cipher_slot *slot = NULL;
+    size_t i = 0, reserved = CIPHER_CACHE_SIZE;
+    unsigned long gen = 0;
+
+    *hd = NULL;
+    if ((NULL == mk) || (1 != mk->initialised)) {
+        return KEY_NOT_INIT;
+    }
+
+    pthread_mutex_lock(&cipher_lock);
+    if (NULL == mk->ciphers) {
+        mk->ciphers = calloc(1, sizeof *mk->ciphers);
+    }
+    cc = mk->ciphers;
+
+    if (NULL != cc) {
+        for (i = 0; i < CIPHER_CACHE_SIZE; ++i) {
+            slot = &cc->slot[i];
+            if (0 != slot->busy) {
+                continue;
+            } else if (NULL == slot->hd) {
+                if (CIPHER_CACHE_SIZE == reserved) {
+                    reserved = i;
+                }
+                continue;
+            }
+
+            if ((mode == slot->mode) && (mk->algo == slot->algo) &&
+                    (cc->gen == slot->gen)) {
+                slot->busy = 1;
+                cc->nbusy++;
+                *hd = slot->hd;
+                pthread_mutex_unlock(&cipher_lock);
+
+                return KEY_SUCCESS;
+            }
+        }
+
+        /* nothing to reuse: take a free slot, or make room by closing an
+         * idle handle set up for another mode */
+        for (i = 0; (CIPHER_CACHE_SIZE == reserved) &&
+                (i < CIPHER_CACHE_SIZE); ++i) {
+            if (0 == cc->slot[i].busy) {
+                gcry_cipher_close(cc->slot[i].hd);
+                cc->slot[i].hd = NULL;
+                reserved = i;
+            }
+        }
+
+        if (reserved < CIPHER_CACHE_SIZE) {
+            cc->slot[reserved].busy = 1;
+            cc->nbusy++;
+            gen = cc->gen;
+        }
+    }
+    pthread_mutex_unlock(&cipher_lock);
+
+    /* expand the key outside the lock */
+    result = crypto_cipher_open(mk, mode, hd);
+
+    if ((NULL != cc) && (reserved < CIPHER_CACHE_SIZE)) {
+        pthread_mutex_lock(&cipher_lock);
+        slot = &cc->slot[reserved];
+        if (KEY_SUCCESS == result) {
+            slot->hd    = *hd;
+            slot->algo  = mk->algo;
+            slot->mode  = mode;
+            slot->gen   = gen;
+        } else {
+            slot->busy  = 0;
+            cc->nbusy--;
+        }
+        pthread_mutex_unlock(&cipher_lock);
+    }
+
+    return result;
+}   /* end crypto_cipher_get */
+
+
+void crypto_cipher_put( metakey_t mk, gcry_cipher_hd_t hd ) {
+    struct cipher_cache *cc = NULL;
+    size_t i = 0;
+    int cached = 0;
+
+    if (NULL == hd) {
+        return;
+    }
+
+    /* drop the IV and any mode state, keeping only the key schedule */
+    gcry_cipher_reset(hd);
+
+    pthread_mutex_lock(&cipher_lock);
+    cc = (NULL == mk) ? NULL : mk->ciphers;
+    for (i = 0; (NULL != cc) && (i < CIPHER_CACHE_SIZE); ++i) {
+        if ((hd != cc->slot[i].hd) || (0 == cc->slot[i].busy)) {
+            continue;
+        }
+
+        cached = 1;
+        cc->slot[i].busy = 0;
+        cc->nbusy--;
+        if (cc->gen != cc->slot[i].gen) {
+            gcry_cipher_close(hd);
+            cc->slot[i].hd = NULL;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&cipher_lock);
+
+    /* the cache was full when the handle was taken */
+    if (0 == cached) {
+        gcry_cipher_close(hd);
+    }
+}   /* end crypto_cipher_put */
+
+
+void crypto_cipher_flush( metakey_t mk ) {
+    struct cipher_cache *cc = NULL;
+    size_t i = 0;
+
+    if (NULL == mk) {
+        return;
+    }
+
+    pthread_mutex_lock(&cipher_lock);
+    cc = mk->ciphers;
+    if (NULL != cc) {
+        cc->gen++;
+        for (i = 0; i < CIPHER_CACHE_SIZE; ++i) {
+            if ((0 == cc->slot[i].busy) && (NULL != cc->slot[i].hd)) {
+                gcry_cipher_close(cc->slot[i].hd);
+                cc->slot[i].hd = NULL;
+            }
+        }
+
+        if (0 == cc->nbusy) {
+            free(cc);
+            mk->ciphers = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cipher_lock);
+}   /* end crypto_cipher_flush */
+
+
 /* auto key generation functions - all are one line */
 void crypto_set_autogen( ) {
     generate_keys = 1;
@@ -339,39 +871,43 @@ int crypto_autogen_status( ) {
 /* end auto key generation functions */
 
 
-/**************************/
-/* clear out the keystore */
-/**************************/
-crypto_key_return_t crypto_zerokeystore( keystore_t keystore ) {
-    size_t i = 0;
-    crypto_key_return_t result = INCONSISTENT_STATE;
-    crypto_key_return_t zero   = KEY_FAILURE;
+/**************************************************************************/
+/*                           internal helpers                             */
+/**************************************************************************/
 
-    if (NULL == keystore) {
-        result = LIB_NOT_INIT;
-    } else {
-
-        while (i < keystore->size) {
-            if (NULL == keystore->store[i]) {
-                continue;
-            }
-
-            zero = crypto_zerokey(keystore->store[i]);
-            if (zero != KEY_SUCCESS) {
-                result = zero;
-            }
-
-            ++i;
-        }
+/* point mk->key at zeroed memory for a keysize byte key: the metakey's
+ * own slot for arena metakeys, a fresh allocation otherwise. the old key
+ * is wiped first. */
+static crypto_key_return_t metakey_key_alloc( metakey_t mk,
+        size_t keysize ) {
+    metakey_key_release(mk);
 
-        if (INCONSISTENT_STATE == result) {
-            result = KEY_SUCCESS;
+    if ((0 != mk->arena) && (keysize <= ARENA_KEY_MAX)) {
+        mk->key = crypto_arena_keybuf(mk);
+        memset(mk->key, 0, ARENA_KEY_MAX);
+    } else {
+        mk->key = CRYPTO_MALLOC(keysize, sizeof *mk->key);
+        if (NULL == mk->key) {
+            return KEY_FAILURE;
         }
     }
 
-    return result;
+    mk->keysize = keysize;
+    return KEY_SUCCESS;
 }
 
+/* wipe the key and, unless it lives in the arena slot, free it */
+static void metakey_key_release( metakey_t mk ) {
+    if (NULL == mk->key) {
+        return;
+    }
 
+    gcry_create_nonce(mk->key, mk->keysize);
+    crypto_wipe(mk->key, mk->keysize);
+    if ((0 == mk->arena) || (crypto_arena_keybuf(mk) != mk->key)) {
+        CRYPTO_FREE(mk->key);
+    }
 
-        
+    mk->key = NULL;
+    mk->keysize = 0;
+}
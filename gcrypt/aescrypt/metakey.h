@@ -13,11 +13,10 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <gcrypt.h>
 
 #include "crypto.h"
 
-extern keystore_t keystore;
-
 /**************************************************************************/
 /*                  note on automatic key generation                      */
 /**************************************************************************/
@@ -37,10 +36,30 @@ extern keystore_t keystore;
  */
 
 
+/* flag bits of metakey.refs, above the reference count. ORPHAN: the key
+ * has been removed from its keystore and is freed with the last reference.
+ * ZEROING: crypto_zerokey is wiping the key. */
+#define     METAKEY_REF_ORPHAN      0x80000000U
+#define     METAKEY_REF_ZEROING     0x40000000U
+
+
 /**************************************************************************/
 /*                         metakey functions                              */
 /**************************************************************************/
 
+/* crypto_metakey_new: allocate an empty, uninitialised metakey. a key has
+ *                to be generated or loaded into it before use.
+ *      arguments: none
+ *      returns: the new metakey_t, or NULL if out of memory
+ */
+extern metakey_t crypto_metakey_new( void );
+
+/* crypto_metakey_free: wipe a metakey's key, close its cached cipher
+ *                handles and free it. none of its handles may be in use.
+ *      arguments: the metakey_t to destroy; NULL is ignored
+ */
+extern void crypto_metakey_free( metakey_t );
+
 /* crypto_genkey: generate a new symmetric key; keys are non-null-terminated
  *                buffers containing unsigned chars.
  *      arguments: the metakey_t containing the key to be generated and
@@ -50,6 +69,25 @@ extern keystore_t keystore;
  */
 extern crypto_key_return_t crypto_genkey( metakey_t, size_t );
 
+/* crypto_genkeys: generate a batch of keys of the same size from the
+ *                random pool (see cryptorand.h), starting the pool if it
+ *                is not running. unlike crypto_genkey this does not wait
+ *                for entropy as long as the pool has enough bytes, and
+ *                allocates nothing beyond the keys themselves.
+ *      arguments: an array of metakey_t, its length, and the key size
+ *      returns: KEY_SUCCESS, or the first error; the keys before the one
+ *                that failed are generated
+ */
+extern crypto_key_return_t crypto_genkeys( metakey_t *, size_t, size_t );
+
+/* crypto_setkey: copy raw key bytes into a metakey, e.g. a key unwrapped
+ *                from storage. the caller wipes its own copy.
+ *      arguments: the metakey_t, the key bytes, and the key size
+ *      returns: KEY_SUCCESS, KEY_FAILURE if out of memory, or LIB_NOT_INIT
+ */
+extern crypto_key_return_t crypto_setkey( metakey_t, const unsigned char *,
+                                          size_t );
+
 /* crypto_loadkey: load a symmetric key from a file. if automatic key
  *                 generation is enabled and there is an error reading the
  *                 key from the file, a key will be generated.
@@ -80,16 +118,151 @@ extern crypto_key_return_t crypto_dumpkey( const char *, metakey_t );
 
 /* crypto_zerokey: zeroise a key. the key is randomised with a nonce of
  *                 the same size as the key, then every byte is set to 0.
+ *                 a key referenced through crypto_keystore_get is left
+ *                 alone.
  *      arguments: a metakey_t to be blanked
  *      returns: a crypto_key_return_t returning one of the following codes:
- *                 KEY_FAILURE, KEY_SUCCESS, KEY_NOT_INIT, LIB_NOT_INIT
+ *                 KEY_FAILURE, KEY_SUCCESS, KEY_NOT_INIT, LIB_NOT_INIT,
+ *                 KEY_IN_USE
  */
 extern crypto_key_return_t crypto_zerokey( metakey_t );
 
+/* crypto_cipher_open: open a gcrypt cipher handle for the key's algorithm
+ *                 in the given mode and load the key into it; for
+ *                 GCRY_CIPHER_MODE_POLY1305 the algorithm is ChaCha20,
+ *                 which needs a 32 byte key. the caller
+ *                 is responsible for setting the IV / counter and for 
+ *                 closing the handle with gcry_cipher_close.
+ *      arguments: the metakey_t holding the key, an int specifying one of
+ *                 the GCRY_CIPHER_MODE_* modes, and a pointer to the
+ *                 handle to be opened.
+ *      returns: a crypto_key_return_t returning one of the following codes:
+ *                 KEY_FAILURE, KEY_SUCCESS, KEY_NOT_INIT, LIB_NOT_INIT
+ */
+extern crypto_key_return_t crypto_cipher_open( metakey_t, int, 
+                                               gcry_cipher_hd_t * );
+
+/* crypto_cipher_get: like crypto_cipher_open, but reuses a handle the key
+ *                 has already set up for this mode if one is idle, so the
+ *                 AES key schedule is only expanded once per handle. the
+ *                 handle is returned in the state right after setkey, i.e.
+ *                 with no IV set. each thread needs its own handle; the
+ *                 key caches up to CIPHER_CACHE_SIZE of them. safe to call
+ *                 from several threads at once.
+ *      arguments: the metakey_t, a GCRY_CIPHER_MODE_* mode, and a pointer
+ *                 to the handle to fill in.
+ *      returns: see crypto_cipher_open
+ */
+extern crypto_key_return_t crypto_cipher_get( metakey_t, int,
+                                              gcry_cipher_hd_t * );
+
+/* crypto_cipher_put: hand a handle from crypto_cipher_get back to its key.
+ *                 the handle's IV and mode state are reset; it must not be
+ *                 used afterwards.
+ *      arguments: the metakey_t the handle was taken from, and the handle
+ */
+extern void crypto_cipher_put( metakey_t, gcry_cipher_hd_t );
+
+/* crypto_cipher_flush: close every idle cached handle of a key, and have
+ *                 the ones still in use closed when they are put back.
+ *                 crypto_genkey, crypto_loadkey and crypto_zerokey do this
+ *                 themselves; it only needs calling when the key bytes are
+ *                 changed by hand.
+ *      arguments: the metakey_t
+ */
+extern void crypto_cipher_flush( metakey_t );
+
 /********************************/
-/* keyring functions            */
+/* key wrapping                 */
 /********************************/
-extern crypto_key_return_t crypto_zerokeystore( keystore_t keystore );
+
+/*
+ * keys at rest are wrapped under a key-encrypting key (KEK) with AES key
+ * wrap: RFC 5649 (key wrap with padding) where libgcrypt has it, RFC 3394
+ * otherwise; unwrapping accepts either. what gets wrapped is a key block:
+ *
+ *      offset  size    field (big endian)
+ *      0       8       the key's ID
+ *      8       4       cipher algorithm (GCRY_CIPHER_*)
+ *      12      4       key size in bytes, n
+ *      16      n       the key
+ *
+ * the wrap authenticates the block, so a key can not be unwrapped under
+ * another ID or used with another cipher without the KEK noticing.
+ * a wrapped key takes CRYPTO_WRAPPED_LEN(n) bytes.
+ */
+#define     CRYPTO_WRAP_HEADER_LEN  16
+#define     CRYPTO_WRAPPED_LEN(n)   \
+    ((((n) + CRYPTO_WRAP_HEADER_LEN + 7) & ~(size_t) 7) + 8)
+
+/********************************************************************
+ * wrapped_key:                                                     *
+ *      one wrapped key handed to crypto_unwrapkeys                 *
+ *                                                                  *
+ * data / len: the wrapped key                                      *
+ * id: the ID the key must have been wrapped under                  *
+ ********************************************************************/
+struct wrapped_key {
+    const unsigned char *data;
+    size_t len;
+    unsigned long id;
+};
+
+/* crypto_wrapkey: wrap a key under a KEK, with the key's id, algo and
+ *                 size.
+ *      arguments: the KEK metakey_t, the metakey_t to wrap, an output
+ *                 buffer of at least CRYPTO_WRAPPED_LEN(keysize) bytes,
+ *                 and a size_t * set to the wrapped length.
+ *      returns: KEY_SUCCESS, KEY_NOT_INIT if either key is not
+ *                 initialised, or KEY_FAILURE
+ */
+extern crypto_key_return_t crypto_wrapkey( metakey_t, metakey_t,
+                                           unsigned char *, size_t * );
+
+/* crypto_unwrapkeys: unwrap a batch of keys in one pass, through a single
+ *                 KEK cipher handle and a single secure memory buffer, so
+ *                 the cost is the AES work rather than per-key set up.
+ *                 each key goes into the matching metakey, algorithm
+ *                 included; keys that fail to unwrap leave theirs as it
+ *                 was.
+ *      arguments: the KEK metakey_t, an array of wrapped keys, an array
+ *                 of as many metakey_t's, and the number of keys.
+ *      returns: KEY_SUCCESS if every key unwrapped, KEY_NOT_INIT if the
+ *                 KEK is not initialised, or KEY_FAILURE if any key was
+ *                 damaged, wrapped under another KEK or another ID.
+ */
+extern crypto_key_return_t crypto_unwrapkeys( metakey_t,
+                                              const struct wrapped_key *,
+                                              metakey_t *, size_t );
+
+/* crypto_unwrapkey: crypto_unwrapkeys for one key, which has to have
+ *                 been wrapped under the metakey's id.
+ *      arguments: the KEK metakey_t, the wrapped key and its length, and
+ *                 the metakey_t to load.
+ */
+extern crypto_key_return_t crypto_unwrapkey( metakey_t,
+                                             const unsigned char *, size_t,
+                                             metakey_t );
+
+/* crypto_loadkey_wrapped: crypto_loadkey for a key file written by
+ *                 crypto_dumpkey_wrapped. a missing file is handled like
+ *                 crypto_loadkey does, but a key of the wrong size is
+ *                 never replaced.
+ *      arguments: the filename, the metakey_t to load, the expected key
+ *                 size, and the KEK metakey_t
+ *      returns: as crypto_loadkey; KEY_FAILURE also if the key does not
+ *                 unwrap.
+ */
+extern crypto_key_return_t crypto_loadkey_wrapped( const char *, metakey_t,
+                                                   size_t, metakey_t );
+
+/* crypto_dumpkey_wrapped: write a key to a file wrapped under a KEK,
+ *                 instead of as raw bytes.
+ *      arguments: the filename, the metakey_t to write, the KEK metakey_t
+ *      returns: as crypto_dumpkey
+ */
+extern crypto_key_return_t crypto_dumpkey_wrapped( const char *, metakey_t,
+                                                   metakey_t );
 
 /********************************/
 /* miscellaneous functions      */